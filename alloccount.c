@@ -0,0 +1,203 @@
+/*
+ * alloccount.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Heap allocation counting.
+ *
+ * Linked into a test or benchmark, this replaces malloc(), calloc(),
+ * realloc() and free() with versions which count the allocations made
+ * between alloccountStart() and alloccountStop(), then pass the call on
+ * to the C library's allocator. Allocations the C library makes on our
+ * behalf, in getaddrinfo() or stdio for instance, are counted too.
+ *
+ * With glibc the real allocator is called through its __libc_ entry
+ * points. Elsewhere it is looked up with dlsym(RTLD_NEXT). dlsym() may
+ * itself allocate before the lookup is done, so those few early
+ * allocations are served from a small static arena, and are never freed.
+ *
+ * Counting is for one thread: the count is not atomic.
+ *
+ */
+
+#define _GNU_SOURCE /* RTLD_NEXT */
+
+#include <stdlib.h>
+#include <string.h>
+#include "alloccount.h"
+
+#ifdef __GLIBC__
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+#define realMalloc __libc_malloc
+#define realCalloc __libc_calloc
+#define realRealloc __libc_realloc
+#define realFree __libc_free
+
+#else
+
+#include <dlfcn.h>
+
+#define ARENA_SIZE 4096
+
+static void *(*nextMalloc)(size_t);
+static void *(*nextCalloc)(size_t, size_t);
+static void *(*nextRealloc)(void *, size_t);
+static void (*nextFree)(void *);
+static Bool lookingUp = FALSE;
+static unsigned arenaUsed = 0;
+static _Alignas(16) char arena[ARENA_SIZE];
+
+/*
+ * Serve an allocation made while the real allocator is being looked up
+ */
+
+static void *arenaAlloc(size_t size)
+{
+	void *p;
+
+	size = (size + 15) & ~(size_t) 15;
+	if(size > ARENA_SIZE - arenaUsed)
+		return NULL;
+	p = arena + arenaUsed;
+	arenaUsed += size;
+	return p; /* Static storage, so already zeroed */
+}
+
+/*
+ * Return TRUE if ptr came from the arena
+ */
+
+static Bool inArena(const void *ptr)
+{
+	return (((const char *) ptr >= arena) && ((const char *) ptr < arena + ARENA_SIZE)) ? TRUE : FALSE;
+}
+
+/*
+ * Find the allocator we are standing in front of
+ */
+
+static Bool lookUp(void)
+{
+	if(nextFree)
+		return TRUE;
+	if(lookingUp)
+		return FALSE;
+	lookingUp = TRUE;
+	nextMalloc = dlsym(RTLD_NEXT, "malloc");
+	nextCalloc = dlsym(RTLD_NEXT, "calloc");
+	nextRealloc = dlsym(RTLD_NEXT, "realloc");
+	nextFree = dlsym(RTLD_NEXT, "free");
+	lookingUp = FALSE;
+	if(!nextMalloc || !nextCalloc || !nextRealloc || !nextFree)
+		abort();
+	return TRUE;
+}
+
+static void *realMalloc(size_t size)
+{
+	return (lookUp()) ? (*nextMalloc)(size) : arenaAlloc(size);
+}
+
+static void *realCalloc(size_t nmemb, size_t size)
+{
+	if((size) && (nmemb > (size_t) -1 / size))
+		return NULL;
+	return (lookUp()) ? (*nextCalloc)(nmemb, size) : arenaAlloc(nmemb * size);
+}
+
+static void *realRealloc(void *ptr, size_t size)
+{
+	void *p;
+
+	if(!inArena(ptr))
+		return (lookUp()) ? (*nextRealloc)(ptr, size) : NULL;
+	/* Move out of the arena. The old size isn't known, but the arena ends at ARENA_SIZE. */
+	if((p = realMalloc(size)))
+		memcpy(p, ptr, ((size_t) (arena + ARENA_SIZE - (char *) ptr) < size) ? (size_t) (arena + ARENA_SIZE - (char *) ptr) : size);
+	return p;
+}
+
+static void realFree(void *ptr)
+{
+	if((ptr) && (!inArena(ptr)) && (lookUp()))
+		(*nextFree)(ptr);
+}
+
+#endif
+
+static Bool counting = FALSE;
+static unsigned long allocs = 0;
+
+void *malloc(size_t size)
+{
+	if(counting)
+		allocs++;
+	return realMalloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	if(counting)
+		allocs++;
+	return realCalloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if(counting)
+		allocs++;
+	return realRealloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	realFree(ptr);
+}
+
+/*
+ * Zero the count and start counting
+ */
+
+void alloccountStart(void)
+{
+	allocs = 0;
+	counting = TRUE;
+}
+
+/*
+ * Stop counting, and return the number of allocations since alloccountStart()
+ */
+
+unsigned long alloccountStop(void)
+{
+	counting = FALSE;
+	return allocs;
+}
+
+/*
+ * Return the number of allocations so far, without stopping
+ */
+
+unsigned long alloccountGet(void)
+{
+	return allocs;
+}
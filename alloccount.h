@@ -0,0 +1,20 @@
+/*
+ * alloccount.h
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * Heap allocation counting for the tests and benchmarks
+ */
+
+#ifndef ALLOCCOUNT_H
+#define ALLOCCOUNT_H
+
+#include "types.h"
+
+/* Prototypes */
+
+void alloccountStart(void);
+unsigned long alloccountStop(void);
+unsigned long alloccountGet(void);
+
+#endif
@@ -0,0 +1,261 @@
+/*
+ * confbench.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Benchmark start up with a large number of services.
+ *
+ * For each service count a config file is generated, and the time taken
+ * by confreadScan(), by building its section index, and by setting up the
+ * services is reported. Service setup makes the same config lookups,
+ * duplicate checks and copies as main() does for each service stanza.
+ * It is timed twice: with the section index and hashed duplicate checks,
+ * and with the list search and pairwise duplicate scans used before them.
+ *
+ * Usage: confbench [SERVICES ...]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include "notify.h"
+#include "confread.h"
+
+#define DEF_SERVICES_SMALL 1000
+#define DEF_SERVICES_LARGE 10000
+
+#define MALLOC_ERROR	fatal("Out of memory in file %s, at line %d", __FILE__, __LINE__)
+
+/* What main() keeps for each service */
+typedef struct bench_service benchService_t;
+
+struct bench_service
+{
+	String instance_id;
+	String class;
+	String type;
+	unsigned address;
+	unsigned polling_interval;
+	unsigned channel;
+};
+
+/* The keys main() looks up in each service stanza */
+static const String serviceKeys[] = {"address", "class", "type", "bus", "han-command", "units",
+	"polling-interval", "precision", "channel", NULL};
+
+char *progName = "confbench";
+int debugLvl = 0;
+
+/*
+ * Monotonic time in nanoseconds
+ */
+
+static uint64_t nowNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/*
+ * Write a config file with the given number of sensor services
+ */
+
+static void writeConfig(FILE *f, unsigned services)
+{
+	unsigned i;
+
+	fprintf(f, "[general]\nhost = localhost\nservices=");
+	for(i = 0; i < services; i++)
+		fprintf(f, "%ssvc%u", (i) ? ", " : "", i);
+	fprintf(f, "\n\n");
+	for(i = 0; i < services; i++){
+		fprintf(f, "[svc%u]\naddress = %u\ninstance = inst%u\nclass = sensor\ntype = request\n", i, i % 255, i);
+		fprintf(f, "han-command = gtmp\nunits = celsius\npolling-interval = 60\nchannel = %u\n\n", i % 8);
+	}
+}
+
+/*
+ * Split the services list in place. Returns the number of names
+ */
+
+static unsigned splitServices(String list, String *names, unsigned max)
+{
+	unsigned count = 0;
+	String p, save;
+
+	for(p = strtok_r(list, ", ", &save); p && (count < max); p = strtok_r(NULL, ", ", &save))
+		names[count++] = p;
+	return count;
+}
+
+/*
+ * Set up the services the way main() does. Returns the number set up
+ */
+
+static unsigned setupServices(ConfigEntryPtr_t ce, String *names, unsigned count, benchService_t *services, Bool indexed)
+{
+	SectionEntryPtr_t se;
+	hashMapPtr_t nameMap = NULL, instanceMap = NULL;
+	benchService_t *sp;
+	String p;
+	unsigned i, j;
+
+	if(indexed && ((!(nameMap = hashmapNew(count))) || (!(instanceMap = hashmapNew(count)))))
+		MALLOC_ERROR;
+
+	for(i = 0; i < count; i++){
+		if(!(se = confreadFindSection(ce, names[i])))
+			fatal("Stanza for service %s does not exist", names[i]);
+		if(!(p = confreadValueBySectEntKey(se, "instance")))
+			fatal("Instance for service %s does not exist", names[i]);
+		sp = &services[i];
+		if(!(sp->instance_id = strdup(p)))
+			MALLOC_ERROR;
+
+		/* Duplicate service names and instance IDs */
+		if(indexed){
+			if(hashmapInsert(nameMap, names[i], se))
+				fatal("Service name %s is already defined", names[i]);
+			if(hashmapInsert(instanceMap, sp->instance_id, sp))
+				fatal("Instance id %s is already defined", p);
+		}
+		else{
+			for(j = 0; j < i; j++){
+				if(!strcmp(names[j], names[i]))
+					fatal("Service name %s is already defined", names[i]);
+				if(!strcmp(services[j].instance_id, sp->instance_id))
+					fatal("Instance id %s is already defined", p);
+			}
+		}
+
+		/* The rest of the stanza */
+		for(j = 0; serviceKeys[j]; j++)
+			p = confreadValueBySectEntKey(se, serviceKeys[j]);
+		if(!(sp->class = strdup(confreadValueBySectEntKey(se, "class"))) ||
+		!(sp->type = strdup(confreadValueBySectEntKey(se, "type"))))
+			MALLOC_ERROR;
+		sp->address = strtoul(confreadValueBySectEntKey(se, "address"), NULL, 10);
+		sp->polling_interval = strtoul(confreadValueBySectEntKey(se, "polling-interval"), NULL, 10);
+		sp->channel = strtoul(confreadValueBySectEntKey(se, "channel"), NULL, 10);
+	}
+	hashmapFree(nameMap);
+	hashmapFree(instanceMap);
+	return count;
+}
+
+/*
+ * Free what setupServices() allocated
+ */
+
+static void freeServices(benchService_t *services, unsigned count)
+{
+	unsigned i;
+
+	for(i = 0; i < count; i++){
+		free(services[i].instance_id);
+		free(services[i].class);
+		free(services[i].type);
+	}
+}
+
+/*
+ * Run the benchmark for one service count
+ */
+
+static void bench(unsigned services)
+{
+	char path[] = "/tmp/confbench-XXXXXX";
+	FILE *f;
+	int fd;
+	ConfigEntryPtr_t ce;
+	SectionEntryPtr_t se;
+	hashMapPtr_t index;
+	String list, *names;
+	benchService_t *sp;
+	unsigned count;
+	uint64_t start, scanNs, indexNs, setupNs, listNs;
+
+	if(((fd = mkstemp(path)) < 0) || (!(f = fdopen(fd, "w"))))
+		fatal_with_reason(errno, "Can't create %s", path);
+	writeConfig(f, services);
+	if(fclose(f))
+		fatal_with_reason(errno, "Can't write %s", path);
+
+	/* Scan, which includes building the index */
+	start = nowNs();
+	if(!(ce = confreadScan(path, NULL)))
+		fatal("Can't scan %s", path);
+	scanNs = nowNs() - start;
+	unlink(path);
+
+	/* Build the index again on its own to time it */
+	index = ce->section_index;
+	ce->section_index = NULL;
+	hashmapFree(index);
+	start = nowNs();
+	if((index = hashmapNew(ce->section_count))){
+		for(se = ce->head; se; se = se->next)
+			hashmapInsert(index, se->section, se);
+	}
+	indexNs = nowNs() - start;
+
+	if(!(list = strdup(confreadValueBySectKey(ce, "general", "services"))) ||
+	!(names = malloc(services * sizeof(String))) ||
+	!(sp = calloc(services, sizeof(benchService_t))))
+		MALLOC_ERROR;
+	count = splitServices(list, names, services);
+
+	/* Before the index: list search and pairwise duplicate scans */
+	start = nowNs();
+	setupServices(ce, names, count, sp, FALSE);
+	listNs = nowNs() - start;
+	freeServices(sp, count);
+
+	/* Now */
+	ce->section_index = index;
+	start = nowNs();
+	setupServices(ce, names, count, sp, TRUE);
+	setupNs = nowNs() - start;
+	freeServices(sp, count);
+
+	printf("%6u services: confreadScan %8.2f ms (index build %.2f ms), service setup %8.2f ms, without index %9.2f ms\n",
+		count, scanNs / 1e6, indexNs / 1e6, setupNs / 1e6, listNs / 1e6);
+
+	free(sp);
+	free(names);
+	free(list);
+	confreadFree(ce);
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+
+	if(argc < 2){
+		bench(DEF_SERVICES_SMALL);
+		bench(DEF_SERVICES_LARGE);
+	}
+	for(i = 1; i < argc; i++)
+		bench(strtoul(argv[i], NULL, 10));
+	return 0;
+}
@@ -37,7 +37,6 @@
 
 
 #define MAX_CONFIG_LINE	1024
-#define MAX_VALUE 768
 #define MAX_KEY 128
 #define MAX_SECTION 128
 
@@ -54,7 +53,7 @@ enum { TOK_ERR = -1, TOK_NL=0, TOK_SECTION, TOK_KEY, TOK_VALUE, TOK_COMMENT};
 
 /* Internal functions */
 
-static int linescan(String *lp, String tokstring);
+static int linescan(String *lp, String tokstring, int maxvalue);
 static String removespctab(String line);
 static char copyuntil(String dest, String *srcp, int max_dest_len, const String stopchrs);
 
@@ -72,26 +71,12 @@ static void *mallocz(size_t size)
  
 
 /*
-* Hash a string
+* Hash a string. The hash is the one the hash tables use.
 */
 
 uint32_t confreadHash(const String key)
 {
-	int len = strlen(key);
-	register uint32_t hash, i;
-
-	if(!key)
-		return 0;
-
-	for(hash = i = 0; i < len; ++i){
-		hash += key[i];
-		hash += (hash << 10);
-		hash ^= (hash >> 6);
- 	}
-	hash += (hash << 3);
-	hash ^= (hash >> 11);
-	hash += (hash << 15);
-	return hash;
+	return hashmapHash(key);
 }
 
 
@@ -174,9 +159,10 @@ static String removespctab(String line)
 * Scan the line for tokens. Return a token code indicating what was
 * found. Load tokstring with the token found unless tokstring is set to NULL, 
 * in that case, throw the characters away until the next token is detected.
+* Values are limited to maxvalue - 1 characters.
 */
 
-static int linescan(String *lp, String tokstring){
+static int linescan(String *lp, String tokstring, int maxvalue){
 
 	int retval = TOK_ERR;
 	
@@ -200,7 +186,7 @@ static int linescan(String *lp, String tokstring){
 		case '=':
 			/* Value */
 			(*lp)++;
-			copyuntil(tokstring, lp, MAX_VALUE, "#;\n");
+			copyuntil(tokstring, lp, maxvalue, "#;\n");
 			debug(DEBUG_INCOMPLETE, "TOK_VALUE");
 			retval = TOK_VALUE;
 			break;
@@ -278,8 +264,12 @@ SectionEntryPtr_t confreadFindSection(ConfigEntryPtr_t ce, const String section)
 	if((!ce) || (ce->magic != CE_MAGIC) || (!ce->head))
 		return NULL;
 
+	/* Use the index if there is one */
+	if(ce->section_index)
+		return hashmapFind(ce->section_index, section);
+
 	/* Hash the section string passed in */
-	sh = confreadHash(section);
+	sh = hashmapHash(section);
 	for(se = ce->head; (se); se = se->next){ /* Traverse section list */
 		/* Compare hashes, and if they match, compare strings */
 		if((sh == se->hash) && (!strcmp(se->section, section))){
@@ -349,7 +339,7 @@ KeyEntryPtr_t confreadFindKey(SectionEntryPtr_t se, const String key)
 		return NULL;
 
 	/* Hash the section string passed in */
-	kh = confreadHash(key);
+	kh = hashmapHash(key);
 	for(ke = se->key_head; (ke); ke = ke->next){ /* Traverse key list */
 		/* Compare hashes, and if they match, compare strings */
 		if((kh == ke->hash) && (!strcmp(ke->key, key)))
@@ -545,6 +535,9 @@ void confreadFree(ConfigEntryPtr_t ce)
 	if((!ce) || (ce->magic != CE_MAGIC))
 		return;
 
+	hashmapFree(ce->section_index);
+	ce->section_index = NULL;
+
 	se = ce->tail; /* Start at end of section list and work back */
 	
 	while((se) && (se->magic == SE_MAGIC)){
@@ -647,6 +640,7 @@ ConfigEntryPtr_t confreadScan(String thePath, void (*error_callback)(int type, i
 	
 	/* Allocate a line buffer */
 
+	ce->line_size = ce->work_size = MAX_CONFIG_LINE;
 	if(!(ce->line = mallocz(MAX_CONFIG_LINE))){
 		debug(DEBUG_UNEXPECTED, "Can't malloc line buffer in confReadScan()");
 		confreadFree(ce);
@@ -673,10 +667,23 @@ ConfigEntryPtr_t confreadScan(String thePath, void (*error_callback)(int type, i
 	}
 	
 	for(linenum = 1; ; linenum++){
-		/* Get a line */
-		if(fgets(ce->line, MAX_CONFIG_LINE, conf_file) == NULL)
+		/* Get a line, getline() grows the line buffer as needed for long service lists */
+		if(getline(&ce->line, &ce->line_size, conf_file) == -1)
 			break;
 
+		/* Keep the work string at least as big as the line */
+		if(ce->work_size < ce->line_size){
+			free(ce->work_string);
+			ce->work_size = ce->line_size;
+			if(!(ce->work_string = mallocz(ce->work_size))){
+				debug(DEBUG_UNEXPECTED, "Can't grow work string in confReadScan()");
+				fclose(conf_file);
+				confreadFree(ce);
+				(*error_callback)(CRE_MALLOC, __LINE__, NULL);
+				return NULL;
+			}
+		}
+
 		/* Remove spaces and tabs */
 		removespctab(ce->line);
 
@@ -685,7 +692,7 @@ ConfigEntryPtr_t confreadScan(String thePath, void (*error_callback)(int type, i
 		
 		/* Parse tree root */
 
-		switch(linescan(&p, ce->work_string)){
+		switch(linescan(&p, ce->work_string, ce->work_size)){
 
 			/* It was a newline or a comment, get another line */
 
@@ -712,14 +719,14 @@ ConfigEntryPtr_t confreadScan(String thePath, void (*error_callback)(int type, i
 					return NULL;
 				}
 				/* Hash the section */
-				se->hash = confreadHash(se->section);
+				se->hash = hashmapHash(se->section);
 
 				/* Record the line number */
 				se->linenum = linenum;
 	
 				/* Scan rest of line looking for a comment or a new line */
 
-				switch(linescan(&p, NULL)){
+				switch(linescan(&p, NULL, ce->work_size)){
 					case TOK_NL:
 					case TOK_COMMENT:
 						break;
@@ -731,6 +738,7 @@ ConfigEntryPtr_t confreadScan(String thePath, void (*error_callback)(int type, i
 				}
 
 				/* Insert into section list */
+				ce->section_count++;
 				if(!ce->head){
 					ce->head = se; /* First entry */
 				}
@@ -763,7 +771,7 @@ ConfigEntryPtr_t confreadScan(String thePath, void (*error_callback)(int type, i
 					}
 
 					/* Hash the key */
-					kv->hash = confreadHash(kv->key);
+					kv->hash = hashmapHash(kv->key);
 
 					/* Record the line number */
 					kv->linenum = linenum;
@@ -771,7 +779,7 @@ ConfigEntryPtr_t confreadScan(String thePath, void (*error_callback)(int type, i
 
 				/* Next token had better be a value */
 
-				switch(linescan(&p, ce->work_string)){
+				switch(linescan(&p, ce->work_string, ce->work_size)){
 					case TOK_VALUE:
 						if(kv && se){
 							/* Save value */
@@ -803,7 +811,7 @@ ConfigEntryPtr_t confreadScan(String thePath, void (*error_callback)(int type, i
 				/* Next token had better be a */
 				/* newline or comment */
 
-				switch(linescan(&p, NULL)){
+				switch(linescan(&p, NULL, ce->work_size)){
 					case TOK_NL:
 					case TOK_COMMENT:
 						break;
@@ -836,6 +844,16 @@ ConfigEntryPtr_t confreadScan(String thePath, void (*error_callback)(int type, i
 
 	else
 		fclose(conf_file);
+
+	/*
+	 * Index the sections by name. The first section wins if a name is used twice,
+	 * the same as the list search. If the index can't be built, the list search is used.
+	 */
+
+	if((ce->section_index = hashmapNew(ce->section_count))){
+		for(se = ce->head; se; se = se->next)
+			hashmapInsert(ce->section_index, se->section, se);
+	}
 	return ce;
 }
 
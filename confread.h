@@ -10,6 +10,7 @@
 #define CONFSCAN_H
 
 #include "types.h"
+#include "hashmap.h"
 
 /* Enums */
 
@@ -53,10 +54,14 @@ struct sectionent{
 
 struct configent{
 	uint32_t magic;
+	unsigned section_count;
+	size_t line_size;
+	size_t work_size;
 	String line;
 	String work_string;
 	SectionEntryPtr_t head;
 	SectionEntryPtr_t tail;
+	hashMapPtr_t section_index;
 };
 
 
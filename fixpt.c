@@ -0,0 +1,148 @@
+/*
+ * fixpt.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Scaled integer conversion helpers.
+ *
+ * The HAN nodes report readings as an integer mantissa and a signed
+ * 8 bit power of ten exponent. These functions convert such readings
+ * into an integer count of 10^-precision units without touching the FPU,
+ * so that change detection can be done with exact integer compares.
+ * Results which do not fit are saturated, and results which are too
+ * small to represent round to zero, so the whole int8 exponent
+ * range is handled.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "fixpt.h"
+
+/* Power of ten table */
+
+const int64_t fixptPow10[FIXPT_POW10_MAX + 1] = {
+	1LL,
+	10LL,
+	100LL,
+	1000LL,
+	10000LL,
+	100000LL,
+	1000000LL,
+	10000000LL,
+	100000000LL,
+	1000000000LL,
+	10000000000LL,
+	100000000000LL,
+	1000000000000LL,
+	10000000000000LL,
+	100000000000000LL,
+	1000000000000000LL,
+	10000000000000000LL,
+	100000000000000000LL,
+	1000000000000000000LL
+};
+
+/*
+ * Saturate to the largest value of the same sign
+ */
+
+static fixpt_t saturate(int64_t value)
+{
+	if(value > 0)
+		return INT64_MAX;
+	if(value < 0)
+		return INT64_MIN;
+	return 0;
+}
+
+
+/*
+ * Divide num by den rounding half away from zero
+ * den must be positive
+ */
+
+fixpt_t fixptDivRound(int64_t num, int64_t den)
+{
+	int64_t rem;
+
+	if(den <= 0)
+		return 0;
+	rem = num % den;
+	if(rem < 0)
+		rem = -rem;
+	if(rem >= den - rem) /* Remainder is at least half the divisor */
+		return (num < 0) ? (num / den) - 1 : (num / den) + 1;
+	return num / den;
+}
+
+/*
+ * Return value * 10^exponent, rounded.
+ */
+
+fixpt_t fixptScale(int64_t value, int exponent)
+{
+	int64_t p;
+
+	if(!value || !exponent)
+		return value;
+
+	if(exponent > 0){
+		if(exponent > FIXPT_POW10_MAX)
+			return saturate(value);
+		p = fixptPow10[exponent];
+		if((value > INT64_MAX / p) || (value < INT64_MIN / p))
+			return saturate(value);
+		return value * p;
+	}
+	if(-exponent > FIXPT_POW10_MAX + 1)
+		return 0; /* |value| < 10^20 / 2 always rounds to zero */
+	if(-exponent > FIXPT_POW10_MAX){
+		/* 10^19 does not fit, but half of it does */
+		if(value >= 5 * fixptPow10[FIXPT_POW10_MAX])
+			return 1;
+		if(value <= -5 * fixptPow10[FIXPT_POW10_MAX])
+			return -1;
+		return 0;
+	}
+
+	return fixptDivRound(value, fixptPow10[-exponent]);
+}
+
+/*
+ * Return value * 10^exponent / divisor with a single rounding step.
+ * divisor must be positive.
+ */
+
+fixpt_t fixptScaleDiv(int64_t value, int exponent, int64_t divisor)
+{
+	int64_t p;
+
+	if(divisor <= 0)
+		return 0;
+
+	if(exponent >= 0)
+		return fixptDivRound(fixptScale(value, exponent), divisor);
+
+	/* Fold the negative power of ten into the divisor if it fits */
+	if(-exponent <= FIXPT_POW10_MAX){
+		p = fixptPow10[-exponent];
+		if(divisor <= INT64_MAX / p)
+			return fixptDivRound(value, divisor * p);
+	}
+	return fixptDivRound(fixptScale(value, exponent), divisor);
+}
@@ -0,0 +1,29 @@
+/*
+ * fixpt.h
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * Scaled integer (fixed point) conversion helpers
+ */
+
+#ifndef FIXPT_H
+#define FIXPT_H
+
+#include "types.h"
+
+/* Largest power of ten which fits in the table */
+#define FIXPT_POW10_MAX 18
+
+/* A fixed point value is an integer count of 10^-precision units */
+typedef int64_t fixpt_t;
+
+/* Powers of ten from 10^0 to 10^FIXPT_POW10_MAX */
+extern const int64_t fixptPow10[FIXPT_POW10_MAX + 1];
+
+/* Prototypes */
+
+fixpt_t fixptScale(int64_t value, int exponent);
+fixpt_t fixptScaleDiv(int64_t value, int exponent, int64_t divisor);
+fixpt_t fixptDivRound(int64_t num, int64_t den);
+
+#endif
@@ -0,0 +1,160 @@
+/*
+ * flight.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Always on flight recorder.
+ *
+ * Events go into a fixed ring of compact binary records, so there is
+ * something to look at after a problem even when debugging was off.
+ * Recording an event is a clock read, an atomic increment and a few
+ * stores, and nothing is ever allocated. The ring is written to a file
+ * on demand, and the file is turned into a timeline by flightdec.
+ *
+ * The dump only uses open(), write() and close(), so it can be called
+ * on the way out of fatal().
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "flight.h"
+
+flightRecord_t flightRing[FLIGHT_RECORDS];
+uint32_t flightHead = 0;
+
+static const String *serviceNames = NULL;
+static const String *busNames = NULL;
+static unsigned serviceNameCount = 0;
+static unsigned busNameCount = 0;
+
+static const String eventNames[FLIGHT_EVENTS] = {
+	"none",
+	"enqueue",
+	"drop",
+	"send",
+	"receive",
+	"decode",
+	"trigger",
+	"timeout",
+	"connect",
+	"connect-fail",
+	"disconnect"
+};
+
+/*
+ * Return the name of an event
+ */
+
+const String flightEventName(unsigned event)
+{
+	return (event < FLIGHT_EVENTS) ? eventNames[event] : "unknown";
+}
+
+/*
+ * Set the service and bus names written with a dump.
+ * The arrays must stay valid for the life of the process.
+ */
+
+void flightSetNames(const String *services, unsigned serviceCount, const String *buses, unsigned busCount)
+{
+	serviceNames = services;
+	serviceNameCount = serviceCount;
+	busNames = buses;
+	busNameCount = busCount;
+}
+
+/*
+ * Write all of a buffer
+ */
+
+static Bool writeAll(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t res;
+
+	while(len){
+		if((res = write(fd, p, len)) < 0)
+			return FALSE;
+		p += res;
+		len -= res;
+	}
+	return TRUE;
+}
+
+/*
+ * Write a list of names, each NUL terminated
+ */
+
+static Bool writeNames(int fd, const String *names, unsigned count)
+{
+	unsigned i;
+
+	for(i = 0; i < count; i++){
+		if(!writeAll(fd, names[i], strlen(names[i]) + 1))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Dump the ring to a file, oldest record first.
+ * Records are still being added while the dump runs, and any which are
+ * overwritten part way through are sorted out by the decoder.
+ */
+
+Bool flightDump(const String path)
+{
+	flightHeader_t hdr;
+	struct timespec ts;
+	uint32_t head = __atomic_load_n(&flightHead, __ATOMIC_ACQUIRE);
+	uint32_t start, n;
+	int fd;
+	Bool ok;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, FLIGHT_MAGIC, sizeof(hdr.magic));
+	hdr.recordSize = sizeof(flightRecord_t);
+	hdr.count = (head > FLIGHT_RECORDS) ? FLIGHT_RECORDS : head;
+	hdr.first = head - hdr.count;
+	hdr.services = serviceNameCount;
+	hdr.buses = busNameCount;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	hdr.monoNs = (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	hdr.realNs = (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+
+	if((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		return FALSE;
+	ok = writeAll(fd, &hdr, sizeof(hdr));
+
+	/* The oldest records are from the start position to the end of the ring, then the rest wrap */
+	start = hdr.first & (FLIGHT_RECORDS - 1);
+	n = (start + hdr.count > FLIGHT_RECORDS) ? FLIGHT_RECORDS - start : hdr.count;
+	if(ok)
+		ok = writeAll(fd, &flightRing[start], n * sizeof(flightRecord_t));
+	if((ok) && (n < hdr.count))
+		ok = writeAll(fd, flightRing, (hdr.count - n) * sizeof(flightRecord_t));
+
+	if(ok)
+		ok = writeNames(fd, serviceNames, serviceNameCount);
+	if(ok)
+		ok = writeNames(fd, busNames, busNameCount);
+	if(close(fd) < 0)
+		ok = FALSE;
+	return ok;
+}
@@ -0,0 +1,97 @@
+/*
+ * flight.h
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * Always on flight recorder of binary event records
+ */
+
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <time.h>
+#include "types.h"
+
+/* Number of records kept, must be a power of two */
+#define FLIGHT_RECORDS 8192
+
+/* Service ID for events which aren't about a service */
+#define FLIGHT_NONE 0xFFFFFFFF
+
+/* Dump file header magic */
+#define FLIGHT_MAGIC "XPLHFLT1"
+
+typedef enum {FLIGHT_ENQUEUE = 1, FLIGHT_DROP, FLIGHT_SEND, FLIGHT_RECEIVE, FLIGHT_DECODE, FLIGHT_TRIGGER,
+FLIGHT_TIMEOUT, FLIGHT_CONNECT, FLIGHT_CONNECT_FAIL, FLIGHT_DISCONNECT, FLIGHT_EVENTS} flightEvent_t;
+
+typedef struct flight_record flightRecord_t;
+typedef struct flight_header flightHeader_t;
+
+/*
+ * Event record. seq is cleared before the other fields are written and
+ * set last, to one more than the record's position in the event stream,
+ * so a decoder can tell a complete record from one which was being
+ * overwritten during the dump.
+ */
+
+struct flight_record
+{
+	uint64_t ns;
+	uint32_t service;
+	uint32_t arg;
+	uint16_t event;
+	uint16_t bus;
+	uint32_t seq;
+};
+
+/*
+ * Dump file header. It is followed by count records oldest first,
+ * starting at position first in the event stream, then the service
+ * names and the bus names, each NUL terminated.
+ */
+
+struct flight_header
+{
+	char magic[8];
+	uint32_t recordSize;
+	uint32_t first;
+	uint32_t count;
+	uint32_t services;
+	uint32_t buses;
+	uint32_t reserved;
+	uint64_t monoNs;
+	uint64_t realNs;
+};
+
+extern flightRecord_t flightRing[FLIGHT_RECORDS];
+extern uint32_t flightHead;
+
+/*
+ * Record an event. Safe to call from any thread.
+ */
+
+static inline void flightRecord(flightEvent_t event, unsigned bus, uint32_t service, uint32_t arg)
+{
+	struct timespec ts;
+	uint32_t seq = __atomic_fetch_add(&flightHead, 1, __ATOMIC_RELAXED);
+	flightRecord_t *r = &flightRing[seq & (FLIGHT_RECORDS - 1)];
+
+	/* Mark the record incomplete before any field changes */
+	__atomic_store_n(&r->seq, 0, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	r->ns = (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+	r->service = service;
+	r->arg = arg;
+	r->event = event;
+	r->bus = bus;
+	__atomic_store_n(&r->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Prototypes */
+
+const String flightEventName(unsigned event);
+void flightSetNames(const String *services, unsigned serviceCount, const String *buses, unsigned busCount);
+Bool flightDump(const String path);
+
+#endif
@@ -0,0 +1,187 @@
+/*
+ * flightdec.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Print a flight recorder dump from xplhan as a timeline.
+ *
+ * Usage: flightdec FILE
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "flight.h"
+
+/*
+ * Split a block of NUL terminated names into a list
+ */
+
+static char *splitNames(char *p, char *end, String *names, unsigned count)
+{
+	unsigned i;
+
+	for(i = 0; i < count; i++){
+		if(p >= end)
+			return NULL;
+		names[i] = p;
+		p += strlen(p) + 1;
+	}
+	return p;
+}
+
+/*
+ * Print the detail of an event from its argument
+ */
+
+static void printDetail(const flightRecord_t *r)
+{
+	switch(r->event){
+		case FLIGHT_ENQUEUE:
+			printf("%s", (r->arg) ? "poll" : "request");
+			break;
+
+		case FLIGHT_DROP:
+			printf("work queue full");
+			break;
+
+		case FLIGHT_SEND:
+			printf("queue wait %u us", r->arg);
+			break;
+
+		case FLIGHT_RECEIVE:
+			printf("%u bytes", r->arg);
+			break;
+
+		case FLIGHT_DECODE:
+			if(r->service == FLIGHT_NONE)
+				printf("unmatched, from address %u", r->arg);
+			else
+				printf("round trip %u us", r->arg);
+			break;
+
+		case FLIGHT_TRIGGER:
+			printf("%s", (r->arg) ? "trigger" : "status");
+			break;
+
+		case FLIGHT_TIMEOUT:
+			printf("no response after %u ms", r->arg);
+			break;
+
+		case FLIGHT_CONNECT_FAIL:
+			printf("%s", strerror(r->arg));
+			break;
+
+		default:
+			break;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *f;
+	char *buf, *p, *end;
+	long size;
+	flightHeader_t *hdr;
+	flightRecord_t *rec, *r;
+	String *services, *buses;
+	uint32_t i, skipped = 0;
+	uint64_t prevNs = 0;
+	time_t secs;
+	struct tm tm;
+	char when[32];
+	int64_t realNs;
+
+	if(argc != 2){
+		fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+		return 1;
+	}
+	if(!(f = fopen(argv[1], "rb"))){
+		perror(argv[1]);
+		return 1;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+	if((size < (long) sizeof(flightHeader_t)) || (!(buf = malloc(size + 1))) || (fread(buf, 1, size, f) != (size_t) size)){
+		fprintf(stderr, "%s: could not read the dump\n", argv[1]);
+		return 1;
+	}
+	fclose(f);
+	buf[size] = 0;
+	end = buf + size;
+
+	hdr = (flightHeader_t *) buf;
+	if((memcmp(hdr->magic, FLIGHT_MAGIC, sizeof(hdr->magic))) || (hdr->recordSize != sizeof(flightRecord_t)) ||
+	(sizeof(flightHeader_t) + ((size_t) hdr->count * sizeof(flightRecord_t)) > (size_t) size)){
+		fprintf(stderr, "%s: not a flight recorder dump from this version\n", argv[1]);
+		return 1;
+	}
+	rec = (flightRecord_t *) (buf + sizeof(flightHeader_t));
+	p = (char *) (rec + hdr->count);
+	if(!(services = calloc(hdr->services + 1, sizeof(String))) || !(buses = calloc(hdr->buses + 1, sizeof(String)))){
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	if((p = splitNames(p, end, services, hdr->services)))
+		p = splitNames(p, end, buses, hdr->buses);
+	if(!p)
+		fprintf(stderr, "%s: names missing, printing IDs\n", argv[1]);
+
+	secs = hdr->realNs / 1000000000ULL;
+	localtime_r(&secs, &tm);
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+	printf("Dump taken %s, %u records\n", when, hdr->count);
+
+	for(i = 0; i < hdr->count; i++){
+		r = &rec[i];
+		/* Skip records overwritten while the dump was written */
+		if((r->seq != hdr->first + i + 1) || (!r->event) || (r->ns > hdr->monoNs)){
+			skipped++;
+			continue;
+		}
+		/* Wall clock time from the distance to the dump */
+		realNs = hdr->realNs - (hdr->monoNs - r->ns);
+		secs = realNs / 1000000000LL;
+		localtime_r(&secs, &tm);
+		strftime(when, sizeof(when), "%H:%M:%S", &tm);
+		printf("%s.%06u %+12.3f ms  ", when, (unsigned) ((realNs % 1000000000LL) / 1000),
+		(prevNs) ? (r->ns - prevNs) / 1000000.0 : 0.0);
+		prevNs = r->ns;
+		if((r->bus < hdr->buses) && (buses[r->bus]))
+			printf("%-10s ", buses[r->bus]);
+		else
+			printf("bus %-6u ", r->bus);
+		if(r->service == FLIGHT_NONE)
+			printf("%-20s ", "-");
+		else if((r->service < hdr->services) && (services[r->service]))
+			printf("%-20s ", services[r->service]);
+		else
+			printf("service %-12u ", r->service);
+		printf("%-13s ", flightEventName(r->event));
+		printDetail(r);
+		printf("\n");
+	}
+	if(skipped)
+		printf("%u records were incomplete and skipped\n", skipped);
+	free(services);
+	free(buses);
+	free(buf);
+	return 0;
+}
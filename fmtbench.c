@@ -0,0 +1,98 @@
+/*
+ * fmtbench.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Benchmark fmtnumFixed() against the snprintf() of a double it replaced,
+ * over readings like the ones the HAN nodes report.
+ *
+ * Usage: fmtbench [ITERATIONS]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fmtnum.h"
+
+#define VALUES 1024
+#define DEF_ITERATIONS 2000000
+
+static fixpt_t values[VALUES];
+static unsigned precisions[VALUES];
+static volatile unsigned sink;
+
+/*
+ * Monotonic time in nanoseconds
+ */
+
+static uint64_t nowNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+	char buf[FMTNUM_SIZE], ref[FMTNUM_SIZE];
+	unsigned long iterations = DEF_ITERATIONS;
+	unsigned long i;
+	unsigned j;
+	uint64_t start, fmtNs, snNs;
+
+	if(argc > 1)
+		iterations = strtoul(argv[1], NULL, 10);
+
+	/* Temperatures, voltages and currents from -100 to 500 with 1 to 3 decimals */
+	srand(1);
+	for(j = 0; j < VALUES; j++){
+		precisions[j] = 1 + (j % 3);
+		values[j] = (((fixpt_t) rand() % 600000) - 100000) / fixptPow10[3 - precisions[j]];
+	}
+
+	/* Both must give the same text */
+	for(j = 0; j < VALUES; j++){
+		fmtnumFixed(buf, sizeof(buf), values[j], precisions[j]);
+		snprintf(ref, sizeof(ref), "%.*f", precisions[j], (double) values[j] / fixptPow10[precisions[j]]);
+		if(strcmp(buf, ref)){
+			fprintf(stderr, "Mismatch: %s, snprintf gives %s\n", buf, ref);
+			return 1;
+		}
+	}
+
+	start = nowNs();
+	for(i = 0; i < iterations; i++){
+		j = i & (VALUES - 1);
+		sink += fmtnumFixed(buf, sizeof(buf), values[j], precisions[j]);
+	}
+	fmtNs = nowNs() - start;
+
+	start = nowNs();
+	for(i = 0; i < iterations; i++){
+		j = i & (VALUES - 1);
+		sink += snprintf(buf, sizeof(buf), "%.*f", precisions[j], (double) values[j] / fixptPow10[precisions[j]]);
+	}
+	snNs = nowNs() - start;
+
+	printf("fmtnumFixed: %.1f ns per value\n", (double) fmtNs / iterations);
+	printf("snprintf:    %.1f ns per value\n", (double) snNs / iterations);
+	printf("Speed up:    %.1fx\n", (fmtNs) ? (double) snNs / fmtNs : 0.0);
+	return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * fmtnum.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Fixed precision number formatting.
+ *
+ * Replaces snprintf("%n.mf") for the values we send out. The value is
+ * already a scaled integer, so this is just digit generation: no
+ * locale, no format string parsing, no floating point, and no
+ * allocations. Digits are generated two at a time from a lookup table,
+ * and 64 bit division is only used while the value does not fit in
+ * 32 bits, since 64 bit division is a library call on small ARM cores.
+ *
+ */
+
+#include <stdint.h>
+#include "fmtnum.h"
+
+/* Two digit lookup table */
+
+static const char digitPairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+
+/*
+ * Format a fixed point value with exactly precision digits after the
+ * decimal point into buf.
+ *
+ * Returns the number of characters written not including the NUL,
+ * or -1 if the result will not fit in size bytes. Nothing is written
+ * to buf on failure, so the caller never sees a truncated number.
+ */
+
+int fmtnumFixed(String buf, unsigned size, fixpt_t value, unsigned precision)
+{
+	char tmp[FMTNUM_SIZE + FIXPT_POW10_MAX];
+	uint64_t mag;
+	uint32_t mag32;
+	int n = 0, len, i;
+	Bool neg = (value < 0);
+
+	if(!buf || (precision > FIXPT_POW10_MAX))
+		return -1;
+
+	/* Magnitude, taking care with INT64_MIN */
+	mag = neg ? ((uint64_t) (-(value + 1))) + 1 : (uint64_t) value;
+
+	/* Generate digits in reverse order */
+	while(mag > UINT32_MAX){
+		tmp[n++] = (char) ('0' + (mag % 10));
+		mag /= 10;
+	}
+	for(mag32 = (uint32_t) mag; mag32 >= 100; mag32 /= 100){
+		i = (mag32 % 100) << 1;
+		tmp[n++] = digitPairs[i + 1];
+		tmp[n++] = digitPairs[i];
+	}
+	if(mag32 >= 10){
+		i = mag32 << 1;
+		tmp[n++] = digitPairs[i + 1];
+		tmp[n++] = digitPairs[i];
+	}
+	else
+		tmp[n++] = (char) ('0' + mag32);
+
+	/* Zero pad so there is at least one digit before the decimal point */
+	while(n <= (int) precision)
+		tmp[n++] = '0';
+
+	len = n + (neg ? 1 : 0) + (precision ? 1 : 0);
+	if(len >= (int) size)
+		return -1;
+
+	if(neg)
+		*buf++ = '-';
+	for(i = n - 1; i >= 0; i--){
+		*buf++ = tmp[i];
+		if(i && (i == (int) precision))
+			*buf++ = '.';
+	}
+	*buf = 0;
+
+	return len;
+}
@@ -0,0 +1,22 @@
+/*
+ * fmtnum.h
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * Fixed precision number to text formatting
+ */
+
+#ifndef FMTNUM_H
+#define FMTNUM_H
+
+#include "types.h"
+#include "fixpt.h"
+
+/* Buffer size which holds any fixed point value, sign, decimal point and NUL */
+#define FMTNUM_SIZE 24
+
+/* Prototypes */
+
+int fmtnumFixed(String buf, unsigned size, fixpt_t value, unsigned precision);
+
+#endif
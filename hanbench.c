@@ -0,0 +1,605 @@
+/*
+ * hanbench.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Benchmark the HAN transports against a mock HAN server.
+ *
+ * The mock server answers each command line with a response line straight
+ * away, with a thread per connection. The client runs a reactor as the
+ * daemon does, with one connection per bus and one command in flight on
+ * each: the next command is sent from the handler which receives the
+ * previous response. This is done with the socket transport, then with
+ * the io_uring transport if it is built in.
+ *
+ * Round trip latency is measured per transaction. System calls are
+ * counted per transaction on the client side: one epoll_wait() per
+ * reactor wakeup, the transport's read() and write() calls, and for
+ * io_uring, each io_uring_enter() and each read of the completion
+ * eventfd.
+ *
+ * Each transport is then run with concurrent xPL traffic. A sender thread
+ * sends xPL datagrams to a UDP socket at XPL_RATE per second, and the
+ * handler which drains the socket spends XPL_WORK_US on each one, which
+ * stands in for xPLLib's parsing and dispatch. This is done twice:
+ *
+ * one loop     - the buses and the xPL socket share one reactor, as
+ *                they do when the daemon is not threaded.
+ * loop per bus - each bus has its own reactor and thread, and the xPL
+ *                socket has another, as in threaded mode.
+ *
+ * The transactions are shared out between the buses. With xPL traffic,
+ * the one loop's wakeups include those for the xPL socket, so the number
+ * of datagrams handled is shown instead of the system calls.
+ *
+ * Usage: hanbench [TRANSACTIONS [BUSES [XPL_RATE]]]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "notify.h"
+#include "histo.h"
+#include "reactor.h"
+#include "uring.h"
+#include "hantrans.h"
+
+#define DEF_TRANSACTIONS 20000
+#define DEF_BUSES 1
+#define MAX_BUSES 64
+#define WARMUP 100
+#define URING_ENTRIES 64
+#define DEF_XPL_RATE 2000
+#define XPL_WORK_US 20
+#define XPL_TICK_NS 1000000
+
+static const char command[] = "CA0612010000\n";
+static const char response[] = "RS061201100A01\n";
+
+/* A typical sensor status message, as the other xPL services on the network send */
+static const char xplMessage[] = "xpl-stat\n{\nhop=1\nsource=hwstar-xplhan.bench\ntarget=*\n}\n"
+	"sensor.basic\n{\ndevice=outside\ntype=temp\ncurrent=21.5\nunits=celsius\n}\n";
+
+char *progName = "hanbench";
+int debugLvl = 0;
+
+typedef struct bench_run benchRun_t;
+typedef benchRun_t * benchRunPtr_t;
+
+typedef struct bench_loop benchLoop_t;
+typedef benchLoop_t * benchLoopPtr_t;
+
+typedef struct bench_bus benchBus_t;
+typedef benchBus_t * benchBusPtr_t;
+
+/* One connection to the mock server */
+struct bench_bus
+{
+	benchLoopPtr_t loop;
+	hanTransPtr_t trans;
+	uint64_t sentUs;
+};
+
+/* A reactor and the buses it runs */
+struct bench_loop
+{
+	reactorPtr_t reactor;
+	uringPtr_t uring;
+	benchBusPtr_t bus;
+	unsigned buses;
+	unsigned long done;
+	unsigned long transactions;
+	uint64_t completionReads;
+	uint64_t startWakeups;
+	uint64_t startReads;
+	uint64_t startWrites;
+	uint64_t startSubmits;
+	uint64_t startCompletionReads;
+	Bool failed;
+	histo_t rtt;
+	pthread_t thread;
+};
+
+struct bench_run
+{
+	unsigned loops;
+	unsigned xplRate;
+	int xplFd;
+	int xplStopFd;
+	unsigned xplPort;
+	uint64_t xplReceived;
+	reactorPtr_t xplReactor;
+	pthread_t xplThread;
+	pthread_t senderThread;
+	atomic_int senderStop;
+	benchLoop_t loop[MAX_BUSES];
+	benchBus_t bus[MAX_BUSES];
+};
+
+/*
+ * Mock HAN server connection. Answers every line.
+ */
+
+static void *mockConnection(void *arg)
+{
+	int fd = (int) (long) arg;
+	char buf[256];
+	ssize_t n, i;
+
+	while((n = read(fd, buf, sizeof(buf))) > 0){
+		for(i = 0; i < n; i++){
+			if((buf[i] == '\n') && (write(fd, response, sizeof(response) - 1) < 0))
+				break;
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+/*
+ * Mock HAN server. Starts a thread for each connection.
+ */
+
+static void *mockServer(void *arg)
+{
+	int listenFd = (int) (long) arg;
+	pthread_t thread;
+	int fd;
+
+	for(;;){
+		if((fd = accept(listenFd, NULL, NULL)) < 0)
+			continue;
+		if(pthread_create(&thread, NULL, mockConnection, (void *) (long) fd))
+			close(fd);
+		else
+			pthread_detach(thread);
+	}
+	return NULL;
+}
+
+/*
+ * Start the mock server on a free loopback port, and return the port
+ */
+
+static unsigned startMockServer(void)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	pthread_t thread;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) || (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) ||
+	(listen(fd, MAX_BUSES) < 0) || (getsockname(fd, (struct sockaddr *) &addr, &len) < 0))
+		fatal_with_reason(errno, "Could not start the mock server");
+	if(pthread_create(&thread, NULL, mockServer, (void *) (long) fd))
+		fatal("Could not start the mock server thread");
+	return ntohs(addr.sin_port);
+}
+
+/*
+ * xPL traffic sender. Sends XPL_RATE datagrams per second, every tick
+ * sending those due since the start, until told to stop.
+ */
+
+static void *xplSender(void *arg)
+{
+	benchRunPtr_t b = arg;
+	struct sockaddr_in addr;
+	struct timespec next;
+	unsigned long sent = 0, due;
+	uint64_t start = histoNowUs();
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(b->xplPort);
+	if((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		fatal_with_reason(errno, "Could not create the xPL sender socket");
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while(!atomic_load_explicit(&b->senderStop, memory_order_relaxed)){
+		due = ((histoNowUs() - start) * b->xplRate) / 1000000;
+		for(; sent < due; sent++)
+			(void) sendto(fd, xplMessage, sizeof(xplMessage) - 1, 0, (struct sockaddr *) &addr, sizeof(addr));
+		if((next.tv_nsec += XPL_TICK_NS) >= 1000000000){
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+	close(fd);
+	return NULL;
+}
+
+/*
+ * xPL datagrams are ready. Drain the socket, spending XPL_WORK_US on each.
+ */
+
+static void xplHandler(int fd, uint32_t events, void *ctx)
+{
+	benchRunPtr_t b = ctx;
+	char buf[1500];
+	uint64_t until;
+
+	while(recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0){
+		b->xplReceived++;
+		for(until = histoNowUs() + XPL_WORK_US; histoNowUs() < until;)
+			;
+	}
+}
+
+/*
+ * Stop the xPL reactor, from its own thread
+ */
+
+static void xplStopHandler(int fd, uint32_t events, void *ctx)
+{
+	benchRunPtr_t b = ctx;
+
+	reactorStop(b->xplReactor);
+}
+
+/*
+ * Run a reactor on its own thread
+ */
+
+static void *reactorThread(void *arg)
+{
+	reactorRun(arg);
+	return NULL;
+}
+
+/*
+ * Open the xPL socket and start the sender. The socket is handled by r,
+ * or by a reactor on its own thread if r is NULL.
+ */
+
+static void startXpl(benchRunPtr_t b, reactorPtr_t r)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(((b->xplFd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) || (bind(b->xplFd, (struct sockaddr *) &addr, sizeof(addr)) < 0) ||
+	(getsockname(b->xplFd, (struct sockaddr *) &addr, &len) < 0))
+		fatal_with_reason(errno, "Could not open the xPL socket");
+	b->xplPort = ntohs(addr.sin_port);
+	b->xplStopFd = -1;
+	b->xplReactor = NULL;
+	if(!r){
+		if(!(r = b->xplReactor = reactorNew()))
+			fatal_with_reason(errno, "reactorNew()");
+		if(((b->xplStopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) ||
+		(!reactorAddFd(r, b->xplStopFd, EPOLLIN, xplStopHandler, b)))
+			fatal_with_reason(errno, "Could not register the xPL stop fd");
+	}
+	if(!reactorAddFd(r, b->xplFd, EPOLLIN, xplHandler, b))
+		fatal("Could not register the xPL socket");
+	if((b->xplReactor) && pthread_create(&b->xplThread, NULL, reactorThread, b->xplReactor))
+		fatal("Could not start the xPL thread");
+	atomic_store(&b->senderStop, 0);
+	if(pthread_create(&b->senderThread, NULL, xplSender, b))
+		fatal("Could not start the xPL sender thread");
+}
+
+/*
+ * Stop the sender, and the xPL reactor if it has its own thread
+ */
+
+static void stopXpl(benchRunPtr_t b, reactorPtr_t r)
+{
+	uint64_t one = 1;
+
+	atomic_store(&b->senderStop, 1);
+	pthread_join(b->senderThread, NULL);
+	if(b->xplReactor){
+		if(write(b->xplStopFd, &one, sizeof(one)) < 0)
+			fatal_with_reason(errno, "Could not stop the xPL thread");
+		pthread_join(b->xplThread, NULL);
+		reactorRemoveFd(b->xplReactor, b->xplStopFd);
+		close(b->xplStopFd);
+		r = b->xplReactor;
+	}
+	reactorRemoveFd(r, b->xplFd);
+	close(b->xplFd);
+	if(b->xplReactor)
+		reactorFree(b->xplReactor);
+}
+
+/*
+ * Snapshot the counters, once the warm up transactions are done
+ */
+
+static void startCounting(benchLoopPtr_t l)
+{
+	const hanTransStats_t *ts;
+	unsigned i;
+
+	histoClear(&l->rtt);
+	l->startWakeups = reactorGetWakeups(l->reactor);
+	l->startReads = l->startWrites = 0;
+	for(i = 0; i < l->buses; i++){
+		ts = hantransGetStats(l->bus[i].trans);
+		l->startReads += ts->reads;
+		l->startWrites += ts->writes;
+	}
+	l->startSubmits = (l->uring) ? uringGetStats(l->uring)->submits : 0;
+	l->startCompletionReads = l->completionReads;
+}
+
+/*
+ * Send a command on a bus
+ */
+
+static void sendCommand(benchBusPtr_t bus)
+{
+	bus->sentUs = histoNowUs();
+	if(!hantransSend(bus->trans, command, sizeof(command) - 1)){
+		bus->loop->failed = TRUE;
+		reactorStop(bus->loop->reactor);
+	}
+}
+
+/*
+ * A response arrived. Send the next command, or stop.
+ */
+
+static void responseLine(const String line, void *ctx)
+{
+	benchBusPtr_t bus = ctx;
+	benchLoopPtr_t l = bus->loop;
+
+	if(!line){
+		l->failed = TRUE;
+		hantransClose(bus->trans);
+		reactorStop(l->reactor);
+		return;
+	}
+	if(l->done >= l->transactions + WARMUP)
+		return; /* Stopping */
+	histoRecord(&l->rtt, histoNowUs() - bus->sentUs);
+	if(++l->done == WARMUP)
+		startCounting(l);
+	if(l->done == l->transactions + WARMUP){
+		reactorStop(l->reactor);
+		return;
+	}
+	sendCommand(bus);
+}
+
+/*
+ * io_uring completions are ready
+ */
+
+static void uringHandler(int fd, uint32_t events, void *ctx)
+{
+	benchLoopPtr_t l = ctx;
+
+	l->completionReads++;
+	uringProcess(l->uring);
+}
+
+/*
+ * Submit the io_uring operations queued in this reactor iteration
+ */
+
+static void uringFlushHandler(void *ctx)
+{
+	uringFlush(ctx);
+}
+
+/*
+ * Set up a loop for a run of buses. Returns FALSE if io_uring was asked
+ * for and is not available.
+ */
+
+static Bool startLoop(benchLoopPtr_t l, benchBusPtr_t bus, unsigned buses, unsigned long transactions,
+	const String service, Bool useUring)
+{
+	unsigned i;
+
+	l->bus = bus;
+	l->buses = buses;
+	l->transactions = transactions;
+	if(!(l->reactor = reactorNew()))
+		fatal_with_reason(errno, "reactorNew()");
+	if(useUring){
+		if(!(l->uring = uringNew(URING_ENTRIES))){
+			reactorFree(l->reactor);
+			return FALSE;
+		}
+		if(!reactorAddFd(l->reactor, uringGetFD(l->uring), EPOLLIN, uringHandler, l))
+			fatal("Could not register io_uring fd");
+		reactorSetFlush(l->reactor, uringFlushHandler, l->uring);
+	}
+	for(i = 0; i < buses; i++){
+		bus[i].loop = l;
+		if(!(bus[i].trans = hantransNew("127.0.0.1", service, l->reactor, l->uring, responseLine, &bus[i])))
+			fatal("hantransNew()");
+		if(!hantransConnect(bus[i].trans))
+			fatal_with_reason(errno, "Could not connect to the mock server");
+	}
+	return TRUE;
+}
+
+/*
+ * Send the first commands and run a loop until its transactions are done
+ */
+
+static void *runLoop(void *arg)
+{
+	benchLoopPtr_t l = arg;
+	unsigned i;
+
+	for(i = 0; i < l->buses; i++)
+		sendCommand(&l->bus[i]);
+	if(l->uring)
+		uringFlush(l->uring); /* The reactor only flushes after it has handled something */
+	reactorRun(l->reactor);
+	return NULL;
+}
+
+/*
+ * Return the system calls a loop made after its warm up
+ */
+
+static uint64_t loopSyscalls(benchLoopPtr_t l)
+{
+	const hanTransStats_t *ts;
+	uint64_t syscalls;
+	unsigned i;
+
+	syscalls = reactorGetWakeups(l->reactor) - l->startWakeups - l->startReads - l->startWrites;
+	for(i = 0; i < l->buses; i++){
+		ts = hantransGetStats(l->bus[i].trans);
+		syscalls += ts->reads + ts->writes;
+	}
+	if(l->uring)
+		syscalls += (uringGetStats(l->uring)->submits - l->startSubmits) + (l->completionReads - l->startCompletionReads);
+	return syscalls;
+}
+
+/*
+ * Free a loop and its buses
+ */
+
+static void freeLoop(benchLoopPtr_t l)
+{
+	unsigned i;
+
+	for(i = 0; i < l->buses; i++)
+		hantransFree(l->bus[i].trans);
+	if(l->uring){
+		reactorRemoveFd(l->reactor, uringGetFD(l->uring));
+		uringFree(l->uring);
+	}
+	reactorFree(l->reactor);
+}
+
+/*
+ * Run the benchmark with one transport, with all the buses on one loop or
+ * a loop per bus, and with xPL traffic if xplRate is not 0. Returns FALSE
+ * if it could not be run.
+ */
+
+static Bool runBench(unsigned port, Bool useUring, unsigned long transactions, unsigned buses,
+	Bool loopPerBus, unsigned xplRate)
+{
+	static benchRun_t b;
+	static histo_t rtt;
+	char service[8];
+	uint64_t syscalls = 0, start, elapsedUs;
+	unsigned long total = 0;
+	unsigned i;
+
+	memset(&b, 0, sizeof(b));
+	b.loops = (loopPerBus) ? buses : 1;
+	b.xplRate = xplRate;
+	snprintf(service, sizeof(service), "%u", port);
+	for(i = 0; i < b.loops; i++){
+		if(!startLoop(&b.loop[i], &b.bus[i * (buses / b.loops)], buses / b.loops, transactions / b.loops, service, useUring)){
+			printf("io_uring: not available (%s)\n", strerror(errno));
+			while(i--)
+				freeLoop(&b.loop[i]);
+			return FALSE;
+		}
+	}
+	if(xplRate)
+		startXpl(&b, (loopPerBus) ? NULL : b.loop[0].reactor);
+
+	start = histoNowUs();
+	if(loopPerBus){
+		for(i = 0; i < b.loops; i++){
+			if(pthread_create(&b.loop[i].thread, NULL, runLoop, &b.loop[i]))
+				fatal("Could not start a bus thread");
+		}
+		for(i = 0; i < b.loops; i++)
+			pthread_join(b.loop[i].thread, NULL);
+	}
+	else
+		runLoop(&b.loop[0]);
+	elapsedUs = histoNowUs() - start;
+	if(xplRate)
+		stopXpl(&b, b.loop[0].reactor);
+
+	histoClear(&rtt);
+	for(i = 0; i < b.loops; i++){
+		if(b.loop[i].failed)
+			fatal("%s: transaction %lu failed", hantransName(b.bus[0].trans), b.loop[i].done);
+		histoMerge(&rtt, &b.loop[i].rtt);
+		syscalls += loopSyscalls(&b.loop[i]);
+		total += b.loop[i].transactions;
+	}
+	printf("%-8s %-12s: %lu transactions on %u buses, round trip p50 %llu, p99 %llu, p999 %llu, max %llu us, ",
+	hantransName(b.bus[0].trans), (loopPerBus) ? "loop per bus" : "one loop", total, buses,
+	(unsigned long long) histoPermille(&rtt, 500), (unsigned long long) histoPermille(&rtt, 990),
+	(unsigned long long) histoPermille(&rtt, 999), (unsigned long long) rtt.max);
+	if(xplRate)
+		printf("%llu xPL datagrams in %.1f ms\n", (unsigned long long) b.xplReceived, elapsedUs / 1000.0);
+	else
+		printf("%.2f system calls per transaction\n", (double) syscalls / total);
+	fflush(stdout);
+
+	for(i = 0; i < b.loops; i++)
+		freeLoop(&b.loop[i]);
+	return TRUE;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long transactions = DEF_TRANSACTIONS;
+	unsigned buses = DEF_BUSES, xplRate = DEF_XPL_RATE;
+	unsigned port;
+	Bool useUring;
+
+	if(argc > 1)
+		transactions = strtoul(argv[1], NULL, 10);
+	if(argc > 2)
+		buses = (unsigned) strtoul(argv[2], NULL, 10);
+	if(argc > 3)
+		xplRate = (unsigned) strtoul(argv[3], NULL, 10);
+	if((buses) && (transactions < buses))
+		transactions = buses;
+	if((!buses) || (buses > MAX_BUSES))
+		fatal("BUSES must be from 1 to %d", MAX_BUSES);
+	port = startMockServer();
+	printf("%u buses, %ld CPUs, xPL traffic %u datagrams per second, %d us each\n",
+	buses, sysconf(_SC_NPROCESSORS_ONLN), xplRate, XPL_WORK_US);
+	for(useUring = FALSE; useUring <= TRUE; useUring++){
+		if(!runBench(port, useUring, transactions, buses, FALSE, 0))
+			continue;
+		if(xplRate){
+			runBench(port, useUring, transactions, buses, FALSE, xplRate);
+			runBench(port, useUring, transactions, buses, TRUE, xplRate);
+		}
+	}
+	return 0;
+}
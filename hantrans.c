@@ -0,0 +1,334 @@
+/*
+ * hantrans.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * HAN server transport.
+ *
+ * A bus talks to its HAN server through a transport, which connects,
+ * sends commands, hands back whole response lines, and closes. There are
+ * two implementations behind the same interface:
+ *
+ * socket - the socket is watched by the reactor. Each time it is readable
+ *          it is read with one read() of up to a line's worth, and sends
+ *          are written straight away.
+ * uring  - receives are multishot io_uring receives, and sends are queued
+ *          and go out with the rest of the io_uring submissions when the
+ *          reactor flushes. See uring.c.
+ *
+ * Both connect with socketConnectIP(), and both feed what they receive
+ * through the same line assembler.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "notify.h"
+#include "socket.h"
+#include "hantrans.h"
+
+typedef struct han_trans_ops hanTransOps_t;
+
+/* An implementation */
+struct han_trans_ops
+{
+	const String name;
+	Bool (*attach)(hanTransPtr_t t);	/* Start receiving on a new connection */
+	Bool (*send)(hanTransPtr_t t, const char *data, unsigned len);
+	void (*detach)(hanTransPtr_t t);	/* Stop receiving, before the socket is closed */
+};
+
+struct han_trans
+{
+	const hanTransOps_t *ops;
+	int fd;
+	unsigned rxPos;
+	String host;
+	String service;
+	reactorPtr_t reactor;
+	uringPtr_t uring;
+	hanTransLineHandler_t handler;
+	void *ctx;
+	hanTransStats_t stats;
+	char rxBuf[HANTRANS_LINE_MAX];
+};
+
+/*
+ * Split received data into lines, and pass each one to the handler.
+ * Returns are ignored. Stops if the handler closes the transport.
+ */
+
+static void assembleLines(hanTransPtr_t t, const char *data, int len)
+{
+	int i;
+
+	for(i = 0; (i < len) && (t->fd >= 0); i++){
+		if(data[i] == '\r') /* Ignore return */
+			continue;
+		if(data[i] != '\n'){
+			if(t->rxPos < (HANTRANS_LINE_MAX - 1))
+				t->rxBuf[t->rxPos++] = data[i];
+			else
+				debug(DEBUG_UNEXPECTED,"End of line buffer reached!");
+			continue;
+		}
+		t->rxBuf[t->rxPos] = 0;
+		t->rxPos = 0;
+		t->stats.lines++;
+		(*t->handler)(t->rxBuf, t->ctx);
+	}
+}
+
+/*
+ * Socket transport: the socket is readable
+ */
+
+static void socketReadable(int fd, uint32_t events, void *ctx)
+{
+	hanTransPtr_t t = ctx;
+	char buf[HANTRANS_LINE_MAX];
+	ssize_t res;
+
+	t->stats.reads++;
+	if((res = read(fd, buf, sizeof(buf))) > 0){
+		assembleLines(t, buf, (int) res);
+		return;
+	}
+	if(res < 0){
+		if((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+			return;
+		debug(DEBUG_UNEXPECTED, "Read error on fd %d: %s", fd, strerror(errno));
+	}
+	(*t->handler)(NULL, t->ctx); /* EOF or error */
+}
+
+/*
+ * Socket transport: watch the socket from the reactor
+ */
+
+static Bool socketAttach(hanTransPtr_t t)
+{
+	return reactorAddFd(t->reactor, t->fd, EPOLLIN, socketReadable, t);
+}
+
+/*
+ * Socket transport: write the data now
+ */
+
+static Bool socketSend(hanTransPtr_t t, const char *data, unsigned len)
+{
+	ssize_t res;
+
+	while(len){
+		t->stats.writes++;
+		if((res = write(t->fd, data, len)) < 0){
+			if(errno == EINTR)
+				continue;
+			debug(DEBUG_UNEXPECTED, "Write error on fd %d: %s", t->fd, strerror(errno));
+			return FALSE;
+		}
+		data += res;
+		len -= res;
+	}
+	return TRUE;
+}
+
+/*
+ * Socket transport: stop watching the socket
+ */
+
+static void socketDetach(hanTransPtr_t t)
+{
+	reactorRemoveFd(t->reactor, t->fd);
+}
+
+/*
+ * io_uring transport: data, EOF or an error was received
+ */
+
+static void uringReceived(int fd, const char *data, int len, void *ctx)
+{
+	hanTransPtr_t t = ctx;
+
+	if(len > 0){
+		assembleLines(t, data, len);
+		return;
+	}
+	if(len < 0)
+		debug(DEBUG_UNEXPECTED, "Read error on fd %d: %s", fd, strerror(-len));
+	(*t->handler)(NULL, t->ctx); /* EOF or error */
+}
+
+/*
+ * io_uring transport: start a multishot receive
+ */
+
+static Bool uringAttach(hanTransPtr_t t)
+{
+	return uringAddStream(t->uring, t->fd, uringReceived, t);
+}
+
+/*
+ * io_uring transport: queue the data to go out at the next flush
+ */
+
+static Bool uringQueueSend(hanTransPtr_t t, const char *data, unsigned len)
+{
+	return uringSend(t->uring, t->fd, data, len);
+}
+
+/*
+ * io_uring transport: cancel the receive
+ */
+
+static void uringDetach(hanTransPtr_t t)
+{
+	uringRemoveStream(t->uring, t->fd);
+}
+
+static const hanTransOps_t socketOps = {"socket", socketAttach, socketSend, socketDetach};
+static const hanTransOps_t uringOps = {"io_uring", uringAttach, uringQueueSend, uringDetach};
+
+/*
+ * Create a transport to a HAN server. It is not connected until hantransConnect() is called.
+ * The socket transport is used if u is NULL, otherwise the io_uring transport.
+ * r is the reactor which runs the caller, and u must be the io_uring instance it flushes.
+ *
+ * Returns NULL if memory could not be allocated.
+ */
+
+hanTransPtr_t hantransNew(const String host, const String service, reactorPtr_t r, uringPtr_t u,
+hanTransLineHandler_t handler, void *ctx)
+{
+	hanTransPtr_t t;
+
+	if(!(t = calloc(1, sizeof(hanTrans_t))))
+		return NULL;
+	if((!(t->host = strdup(host))) || (!(t->service = strdup(service)))){
+		hantransFree(t);
+		return NULL;
+	}
+	t->ops = (u) ? &uringOps : &socketOps;
+	t->fd = -1;
+	t->reactor = r;
+	t->uring = u;
+	t->handler = handler;
+	t->ctx = ctx;
+	return t;
+}
+
+/*
+ * Close and free a transport
+ */
+
+void hantransFree(hanTransPtr_t t)
+{
+	if(!t)
+		return;
+	hantransClose(t);
+	free(t->host);
+	free(t->service);
+	free(t);
+}
+
+/*
+ * Connect to the HAN server. Returns FALSE with errno set if the connection fails.
+ */
+
+Bool hantransConnect(hanTransPtr_t t)
+{
+	int err;
+
+	if(t->fd >= 0)
+		return TRUE;
+	if((t->fd = socketConnectIP(t->host, t->service, PF_UNSPEC, SOCK_STREAM)) < 0){
+		t->fd = -1;
+		return FALSE;
+	}
+	t->rxPos = 0;
+	if(!(*t->ops->attach)(t)){
+		err = errno;
+		close(t->fd);
+		t->fd = -1;
+		errno = err;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Send data. Returns FALSE on an error, after which the transport should be closed.
+ */
+
+Bool hantransSend(hanTransPtr_t t, const char *data, unsigned len)
+{
+	if(t->fd < 0)
+		return FALSE;
+	return (*t->ops->send)(t, data, len);
+}
+
+/*
+ * Close the connection. A partly received line is thrown away.
+ */
+
+void hantransClose(hanTransPtr_t t)
+{
+	if(t->fd < 0)
+		return;
+	(*t->ops->detach)(t);
+	close(t->fd);
+	t->fd = -1;
+	t->rxPos = 0;
+}
+
+/*
+ * Return TRUE if the transport is connected
+ */
+
+Bool hantransIsOpen(hanTransPtr_t t)
+{
+	return (t->fd >= 0) ? TRUE : FALSE;
+}
+
+/*
+ * Return the socket fd, or -1 if not connected
+ */
+
+int hantransGetFD(hanTransPtr_t t)
+{
+	return t->fd;
+}
+
+/*
+ * Return the name of the implementation in use
+ */
+
+const String hantransName(hanTransPtr_t t)
+{
+	return t->ops->name;
+}
+
+/*
+ * Return the statistics
+ */
+
+const hanTransStats_t *hantransGetStats(hanTransPtr_t t)
+{
+	return &t->stats;
+}
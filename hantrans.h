@@ -0,0 +1,52 @@
+/*
+ * hantrans.h
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * HAN server transport: connect, send, receive lines and close,
+ * over plain sockets or io_uring
+ */
+
+#ifndef HANTRANS_H
+#define HANTRANS_H
+
+#include "types.h"
+#include "reactor.h"
+#include "uring.h"
+
+/* Longest line received, including the terminating NUL */
+#define HANTRANS_LINE_MAX 256
+
+typedef struct han_trans hanTrans_t;
+typedef hanTrans_t * hanTransPtr_t;
+typedef struct han_trans_stats hanTransStats_t;
+
+/*
+ * Called with each line received, without the line ending.
+ * line is NULL on EOF or a receive error, and the handler must then close the transport.
+ */
+
+typedef void (*hanTransLineHandler_t)(const String line, void *ctx);
+
+/* System calls made by the transport itself. The io_uring transport makes none, see uringGetStats() */
+struct han_trans_stats
+{
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t lines;
+};
+
+/* Prototypes */
+
+hanTransPtr_t hantransNew(const String host, const String service, reactorPtr_t r, uringPtr_t u,
+hanTransLineHandler_t handler, void *ctx);
+void hantransFree(hanTransPtr_t t);
+Bool hantransConnect(hanTransPtr_t t);
+Bool hantransSend(hanTransPtr_t t, const char *data, unsigned len);
+void hantransClose(hanTransPtr_t t);
+Bool hantransIsOpen(hanTransPtr_t t);
+int hantransGetFD(hanTransPtr_t t);
+const String hantransName(hanTransPtr_t t);
+const hanTransStats_t *hantransGetStats(hanTransPtr_t t);
+
+#endif
@@ -0,0 +1,200 @@
+/*
+ * hashmap.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Open addressing hash table with linear probing, keyed on strings.
+ *
+ * Keys are hashed with hashmapHash(), and the hash is kept in the slot
+ * so a probe only calls strcmp() when the hashes match. The table is a
+ * power of two in size and is doubled when it gets 3/4 full, so lookups
+ * stay at about one probe however many entries there are.
+ *
+ * Key strings are not copied, they must live as long as the table.
+ * There is no delete, since the tables are built once at startup.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "notify.h"
+#include "hashmap.h"
+
+#define MIN_SLOTS 16
+
+/*
+ * Hash a string (Jenkins one at a time)
+ */
+
+uint32_t hashmapHash(const String key)
+{
+	uint32_t hash = 0;
+	const char *p;
+
+	if(!key)
+		return 0;
+
+	for(p = key; *p; p++){
+		hash += *p;
+		hash += (hash << 10);
+		hash ^= (hash >> 6);
+	}
+	hash += (hash << 3);
+	hash ^= (hash >> 11);
+	hash += (hash << 15);
+	return hash;
+}
+
+/*
+ * Allocate a slot array
+ */
+
+static Bool allocSlots(hashMapPtr_t hm, unsigned size)
+{
+	if(!(hm->slots = calloc(size, sizeof(hashMapSlot_t))))
+		return FALSE;
+	hm->mask = size - 1;
+	hm->count = 0;
+	return TRUE;
+}
+
+/*
+ * Find the slot for a key. Returns either the slot holding the key or the empty slot where it would go.
+ */
+
+static hashMapSlot_t *findSlot(hashMapPtr_t hm, const String key, uint32_t hash)
+{
+	unsigned i;
+	hashMapSlot_t *slot;
+
+	for(i = hash & hm->mask; ; i = (i + 1) & hm->mask){
+		slot = &hm->slots[i];
+		if(!slot->key)
+			return slot;
+		if((slot->hash == hash) && (!strcmp(slot->key, key)))
+			return slot;
+	}
+}
+
+/*
+ * Double the size of the table
+ */
+
+static Bool grow(hashMapPtr_t hm)
+{
+	hashMapSlot_t *old = hm->slots, *slot;
+	unsigned i, oldSize = hm->mask + 1, count = hm->count;
+
+	if(!allocSlots(hm, oldSize << 1)){
+		hm->slots = old;
+		return FALSE;
+	}
+	for(i = 0; i < oldSize; i++){
+		if(old[i].key){
+			slot = findSlot(hm, old[i].key, old[i].hash);
+			*slot = old[i];
+		}
+	}
+	hm->count = count;
+	free(old);
+	return TRUE;
+}
+
+/*
+ * Create a new table big enough to hold sizeHint entries without growing
+ */
+
+hashMapPtr_t hashmapNew(unsigned sizeHint)
+{
+	hashMapPtr_t hm;
+	unsigned size = MIN_SLOTS;
+
+	while(size < sizeHint + (sizeHint / 3) + 1)
+		size <<= 1;
+
+	if(!(hm = calloc(1, sizeof(hashMap_t))))
+		return NULL;
+	if(!allocSlots(hm, size)){
+		free(hm);
+		return NULL;
+	}
+	return hm;
+}
+
+/*
+ * Free a table. The keys and values are not freed.
+ */
+
+void hashmapFree(hashMapPtr_t hm)
+{
+	if(hm){
+		free(hm->slots);
+		free(hm);
+	}
+}
+
+/*
+ * Look up a key. Returns the value or NULL if the key is not in the table.
+ */
+
+void *hashmapFind(hashMapPtr_t hm, const String key)
+{
+	if((!hm) || (!key))
+		return NULL;
+	return findSlot(hm, key, hashmapHash(key))->value;
+}
+
+/*
+ * Insert a key and a non-NULL value.
+ *
+ * Returns NULL if the key was inserted, or the existing value if the key
+ * is already in the table, in which case the table is not changed.
+ */
+
+void *hashmapInsert(hashMapPtr_t hm, const String key, void *value)
+{
+	uint32_t hash;
+	hashMapSlot_t *slot;
+
+	if((!hm) || (!key) || (!value))
+		return NULL;
+
+	hash = hashmapHash(key);
+	slot = findSlot(hm, key, hash);
+	if(slot->key)
+		return slot->value;
+
+	if(((hm->count + 1) << 2) > ((hm->mask + 1) * 3)){ /* More than 3/4 full? */
+		if(!grow(hm))
+			fatal("Out of memory in file %s, at line %d", __FILE__, __LINE__);
+		slot = findSlot(hm, key, hash);
+	}
+	slot->hash = hash;
+	slot->key = key;
+	slot->value = value;
+	hm->count++;
+	return NULL;
+}
+
+/*
+ * Return the number of entries
+ */
+
+unsigned hashmapCount(hashMapPtr_t hm)
+{
+	return (hm) ? hm->count : 0;
+}
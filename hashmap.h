@@ -0,0 +1,43 @@
+/*
+ * hashmap.h
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * Open addressing string keyed hash table
+ */
+
+#ifndef HASHMAP_H
+#define HASHMAP_H
+
+#include "types.h"
+
+typedef struct hashmap_slot hashMapSlot_t;
+typedef struct hashmap hashMap_t;
+typedef hashMap_t * hashMapPtr_t;
+
+/* One slot in the table. An empty slot has a NULL key. */
+
+struct hashmap_slot
+{
+	uint32_t hash;
+	String key;
+	void *value;
+};
+
+struct hashmap
+{
+	unsigned mask;
+	unsigned count;
+	hashMapSlot_t *slots;
+};
+
+/* Prototypes */
+
+uint32_t hashmapHash(const String key);
+hashMapPtr_t hashmapNew(unsigned sizeHint);
+void hashmapFree(hashMapPtr_t hm);
+void *hashmapFind(hashMapPtr_t hm, const String key);
+void *hashmapInsert(hashMapPtr_t hm, const String key, void *value);
+unsigned hashmapCount(hashMapPtr_t hm);
+
+#endif
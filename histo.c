@@ -0,0 +1,135 @@
+/*
+ * histo.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Fixed bucket latency histograms.
+ *
+ * The buckets are log-linear, like HDR histograms: linear below HISTO_SUB,
+ * then HISTO_SUB buckets per power of two. Finding the bucket is a count
+ * leading zeros and a shift, so recording is an increment and a few
+ * instructions with no branches on the bucket layout, and a histogram
+ * is a fixed size whatever is recorded into it.
+ *
+ * Percentiles are reported as the upper bound of the bucket they fall in,
+ * clamped to the largest value recorded.
+ *
+ * A histogram may be read by another thread while it is recorded into.
+ * Such reads load each field with a relaxed atomic, so the count can be a
+ * few values ahead of or behind the buckets, but nothing is torn.
+ *
+ */
+
+#include <string.h>
+#include "histo.h"
+
+/*
+ * Clear a histogram
+ */
+
+void histoClear(histoPtr_t h)
+{
+	memset(h, 0, sizeof(histo_t));
+}
+
+/*
+ * Copy a histogram another thread may be recording into
+ */
+
+void histoSnapshot(histoPtr_t dst, const histo_t *src)
+{
+	unsigned i;
+
+	for(i = 0; i < HISTO_BUCKETS; i++)
+		dst->buckets[i] = __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+	dst->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	dst->sum = __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+	dst->max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+}
+
+/*
+ * Add the counts in src to dst
+ */
+
+void histoMerge(histoPtr_t dst, const histo_t *src)
+{
+	uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+	unsigned i;
+
+	for(i = 0; i < HISTO_BUCKETS; i++)
+		dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+	dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+	if(max > dst->max)
+		dst->max = max;
+}
+
+/*
+ * Return the largest value which goes in a bucket
+ */
+
+uint64_t histoBucketUpper(unsigned idx)
+{
+	unsigned exp;
+
+	if(idx >= HISTO_BUCKETS - 1)
+		return UINT64_MAX;
+	idx++;
+	if(idx < HISTO_SUB)
+		return idx - 1;
+	exp = (idx >> HISTO_SUB_BITS) + HISTO_SUB_BITS - 1;
+	return ((uint64_t) (HISTO_SUB + (idx & (HISTO_SUB - 1))) << (exp - HISTO_SUB_BITS)) - 1;
+}
+
+/*
+ * Return the pm'th permille, 0 if the histogram is empty
+ */
+
+uint64_t histoPermille(const histo_t *h, unsigned pm)
+{
+	uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	uint64_t rank, seen = 0, upper;
+	unsigned i;
+
+	if(!count)
+		return 0;
+	if(pm > 1000)
+		pm = 1000;
+	/* Rank of the value wanted, counting from 1 */
+	rank = ((count * pm) + 999) / 1000;
+	if(!rank)
+		rank = 1;
+	for(i = 0; i < HISTO_BUCKETS; i++){
+		seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+		if(seen >= rank)
+			break;
+	}
+	upper = histoBucketUpper(i);
+	return (upper < max) ? upper : max;
+}
+
+/*
+ * Return the pct'th percentile, 0 if the histogram is empty
+ */
+
+uint64_t histoPercentile(const histo_t *h, unsigned pct)
+{
+	if(pct > 100)
+		pct = 100;
+	return histoPermille(h, pct * 10);
+}
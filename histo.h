@@ -0,0 +1,91 @@
+/*
+ * histo.h
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * Fixed bucket latency histograms
+ */
+
+#ifndef HISTO_H
+#define HISTO_H
+
+#include <time.h>
+#include "types.h"
+
+/*
+ * Values below HISTO_SUB get a bucket each. Above that, each power of two
+ * is split into HISTO_SUB buckets, so a bucket is within 1/HISTO_SUB of
+ * the value it holds. Values of 2^32 and over go in the last bucket.
+ */
+
+#define HISTO_SUB_BITS 3
+#define HISTO_SUB (1 << HISTO_SUB_BITS)
+#define HISTO_BUCKETS ((32 - HISTO_SUB_BITS + 1) << HISTO_SUB_BITS)
+
+typedef struct histo histo_t;
+typedef histo_t * histoPtr_t;
+
+struct histo
+{
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint32_t buckets[HISTO_BUCKETS];
+};
+
+/*
+ * Bucket index for a value
+ */
+
+static inline unsigned histoIndex(uint64_t v)
+{
+	unsigned exp;
+
+	if(v < HISTO_SUB)
+		return (unsigned) v;
+	if(v >> 32)
+		return HISTO_BUCKETS - 1;
+	exp = 63 - __builtin_clzll(v);
+	return ((exp - HISTO_SUB_BITS + 1) << HISTO_SUB_BITS) + ((v >> (exp - HISTO_SUB_BITS)) & (HISTO_SUB - 1));
+}
+
+/*
+ * Record a value. A histogram must only be recorded into by one thread.
+ * Other threads may read it while it is recorded into, so the fields are
+ * stored with relaxed atomics. Read them with histoSnapshot(), histoMerge()
+ * or histoPermille().
+ */
+
+static inline void histoRecord(histoPtr_t h, uint64_t v)
+{
+	unsigned idx = histoIndex(v);
+
+	__atomic_store_n(&h->buckets[idx], h->buckets[idx] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->sum, h->sum + v, __ATOMIC_RELAXED);
+	if(v > h->max)
+		__atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+/*
+ * Monotonic time in microseconds, for timestamping the events to be recorded
+ */
+
+static inline uint64_t histoNowUs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/* Prototypes */
+
+void histoClear(histoPtr_t h);
+void histoSnapshot(histoPtr_t dst, const histo_t *src);
+void histoMerge(histoPtr_t dst, const histo_t *src);
+uint64_t histoBucketUpper(unsigned idx);
+uint64_t histoPercentile(const histo_t *h, unsigned pct);
+uint64_t histoPermille(const histo_t *h, unsigned pm);
+
+#endif
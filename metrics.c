@@ -0,0 +1,382 @@
+/*
+ * metrics.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Metrics endpoint.
+ *
+ * Listens on a Unix socket ("unix:/path") or a TCP port ("port" or
+ * "host:port", localhost if the host is left out), and answers every
+ * HTTP request on it with the metrics in Prometheus text format. The
+ * metrics are rendered by a callback into a buffer for each scrape.
+ *
+ * Everything is non-blocking and driven from the reactor, so a slow or
+ * stuck client never holds up the loop. A request is answered once its
+ * headers have arrived; the reply is written as the socket allows and
+ * the connection is closed after it. Clients beyond METRICS_MAX_CLIENTS
+ * are closed as soon as they are accepted.
+ *
+ */
+
+#define _GNU_SOURCE /* accept4() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "notify.h"
+#include "metrics.h"
+
+#define METRICS_MAX_CLIENTS 8
+#define METRICS_REQ_SIZE 1024
+#define METRICS_DEF_HOST "127.0.0.1"
+
+typedef struct metrics_client metricsClient_t;
+typedef metricsClient_t * metricsClientPtr_t;
+
+struct metrics_client
+{
+	int fd;
+	unsigned reqLen;
+	size_t sent;
+	metricsServerPtr_t server;
+	metricsBuf_t reply;
+	char req[METRICS_REQ_SIZE];
+};
+
+struct metrics_server
+{
+	int fd;
+	unsigned clients;
+	reactorPtr_t reactor;
+	metricsRender_t render;
+	void *ctx;
+};
+
+/*
+ * Append formatted text to a buffer, growing it as needed
+ */
+
+void metricsPrintf(metricsBufPtr_t mb, const char *format, ...)
+{
+	va_list ap;
+	size_t newSize;
+	char *p;
+	int n;
+
+	if(mb->failed)
+		return;
+	for(;;){
+		va_start(ap, format);
+		n = vsnprintf(mb->buf + mb->len, mb->size - mb->len, format, ap);
+		va_end(ap);
+		if(n < 0){
+			mb->failed = TRUE;
+			return;
+		}
+		if((size_t) n < mb->size - mb->len){
+			mb->len += n;
+			return;
+		}
+		newSize = (mb->size) ? mb->size * 2 : 4096;
+		while(newSize - mb->len <= (size_t) n)
+			newSize *= 2;
+		if(!(p = realloc(mb->buf, newSize))){
+			mb->failed = TRUE;
+			return;
+		}
+		mb->buf = p;
+		mb->size = newSize;
+	}
+}
+
+/*
+ * Append the HELP and TYPE lines for a metric
+ */
+
+void metricsHeader(metricsBufPtr_t mb, const String name, const String type, const String help)
+{
+	metricsPrintf(mb, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*
+ * Append a histogram of microseconds, as seconds.
+ * Every bucket up to the one holding the largest value gets a line, empty
+ * or not, so the bucket bounds stay the same from scrape to scrape. The
+ * buckets above it are left out: all they would repeat is the count,
+ * which is in the +Inf bucket.
+ */
+
+void metricsHisto(metricsBufPtr_t mb, const String name, const String labels, const histo_t *live)
+{
+	histo_t snap, *h = &snap;
+	uint64_t cum = 0;
+	unsigned i, last;
+
+	/* Another thread may be recording into it */
+	histoSnapshot(&snap, live);
+	last = (h->count) ? histoIndex(h->max) : 0;
+	if(last > HISTO_BUCKETS - 2)
+		last = HISTO_BUCKETS - 2;
+	for(i = 0; (h->count) && (i <= last); i++){
+		cum += h->buckets[i];
+		metricsPrintf(mb, "%s_bucket{%s,le=\"%.6f\"} %llu\n", name, labels,
+		histoBucketUpper(i) / 1e6, (unsigned long long) cum);
+	}
+	metricsPrintf(mb, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels, (unsigned long long) h->count);
+	metricsPrintf(mb, "%s_sum{%s} %.6f\n", name, labels, h->sum / 1e6);
+	metricsPrintf(mb, "%s_count{%s} %llu\n", name, labels, (unsigned long long) h->count);
+}
+
+/*
+ * Close a client connection
+ */
+
+static void closeClient(metricsClientPtr_t c)
+{
+	reactorRemoveFd(c->server->reactor, c->fd);
+	close(c->fd);
+	c->server->clients--;
+	free(c->reply.buf);
+	free(c);
+}
+
+/*
+ * Write as much of the reply as the socket will take
+ */
+
+static void sendReply(metricsClientPtr_t c)
+{
+	ssize_t res;
+
+	while(c->sent < c->reply.len){
+		if((res = send(c->fd, c->reply.buf + c->sent, c->reply.len - c->sent, MSG_NOSIGNAL)) < 0){
+			if((errno == EAGAIN) || (errno == EWOULDBLOCK)){
+				reactorModifyFd(c->server->reactor, c->fd, EPOLLOUT);
+				return;
+			}
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		c->sent += res;
+	}
+	closeClient(c);
+}
+
+/*
+ * Render the metrics and start sending the reply
+ */
+
+static void startReply(metricsClientPtr_t c)
+{
+	metricsBuf_t body;
+	metricsBufPtr_t mb = &c->reply;
+
+	memset(&body, 0, sizeof(body));
+	(*c->server->render)(&body, c->server->ctx);
+	if(body.failed){
+		metricsPrintf(mb, "HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+	}
+	else{
+		metricsPrintf(mb, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %lu\r\nConnection: close\r\n\r\n", (unsigned long) body.len);
+		if((!mb->failed) && (body.len))
+			metricsPrintf(mb, "%s", body.buf);
+	}
+	free(body.buf);
+	if(mb->failed){
+		debug(DEBUG_UNEXPECTED, "Could not build metrics reply");
+		closeClient(c);
+		return;
+	}
+	sendReply(c);
+}
+
+/*
+ * Client socket is readable or writable
+ */
+
+static void clientHandler(int fd, uint32_t events, void *ctx)
+{
+	metricsClientPtr_t c = ctx;
+	ssize_t res;
+
+	if(c->reply.buf){ /* Reply in progress */
+		sendReply(c);
+		return;
+	}
+	res = recv(fd, c->req + c->reqLen, METRICS_REQ_SIZE - 1 - c->reqLen, 0);
+	if(res < 0){
+		if((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+			return;
+		closeClient(c);
+		return;
+	}
+	if(!res){ /* Closed before the request was complete */
+		closeClient(c);
+		return;
+	}
+	c->reqLen += res;
+	c->req[c->reqLen] = 0;
+	/* Answer once the headers are complete, or the buffer is full */
+	if((strstr(c->req, "\r\n\r\n")) || (strstr(c->req, "\n\n")) || (c->reqLen == METRICS_REQ_SIZE - 1))
+		startReply(c);
+}
+
+/*
+ * Listening socket is readable
+ */
+
+static void listenHandler(int fd, uint32_t events, void *ctx)
+{
+	metricsServerPtr_t ms = ctx;
+	metricsClientPtr_t c;
+	int cfd;
+
+	while((cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0){
+		if((ms->clients >= METRICS_MAX_CLIENTS) || (!(c = calloc(1, sizeof(metricsClient_t))))){
+			close(cfd);
+			continue;
+		}
+		c->fd = cfd;
+		c->server = ms;
+		if(!reactorAddFd(ms->reactor, cfd, EPOLLIN, clientHandler, c)){
+			close(cfd);
+			free(c);
+			continue;
+		}
+		reactorSetName(ms->reactor, cfd, "metrics client");
+		ms->clients++;
+	}
+	if((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+		debug(DEBUG_UNEXPECTED, "Metrics accept failed: %s", strerror(errno));
+}
+
+/*
+ * Open a Unix listening socket, replacing a stale socket file
+ */
+
+static int listenUnix(const String path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	if(strlen(path) >= sizeof(sun.sun_path)){
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	if((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	unlink(path);
+	if((bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) || (listen(fd, METRICS_MAX_CLIENTS) < 0)){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Open a TCP listening socket on host:port, or port on localhost
+ */
+
+static int listenTCP(const String where)
+{
+	struct addrinfo hints, *list, *ai;
+	char host[256];
+	const char *port;
+	int fd = -1, on = 1, err;
+
+	if((port = strrchr(where, ':'))){
+		if((size_t) (port - where) >= sizeof(host)){
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memcpy(host, where, port - where);
+		host[port - where] = 0;
+		port++;
+	}
+	else{
+		strcpy(host, METRICS_DEF_HOST);
+		port = where;
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if((err = getaddrinfo(host, port, &hints, &list))){
+		debug(DEBUG_UNEXPECTED, "Metrics address %s: %s", where, gai_strerror(err));
+		errno = EINVAL;
+		return -1;
+	}
+	for(ai = list; ai; ai = ai->ai_next){
+		if((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol)) < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if((bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) && (listen(fd, METRICS_MAX_CLIENTS) == 0))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(list);
+	return fd;
+}
+
+/*
+ * Start serving metrics from a reactor.
+ * Returns NULL and sets errno if the listening socket could not be opened.
+ */
+
+metricsServerPtr_t metricsListen(reactorPtr_t r, const String where, metricsRender_t render, void *ctx)
+{
+	metricsServerPtr_t ms;
+	int fd, err;
+
+	if(!strncmp(where, "unix:", 5))
+		fd = listenUnix(where + 5);
+	else
+		fd = listenTCP(where);
+	if(fd < 0)
+		return NULL;
+	if(!(ms = calloc(1, sizeof(metricsServer_t)))){
+		err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+	ms->fd = fd;
+	ms->reactor = r;
+	ms->render = render;
+	ms->ctx = ctx;
+	if(!reactorAddFd(r, fd, EPOLLIN, listenHandler, ms)){
+		close(fd);
+		free(ms);
+		errno = ENOMEM;
+		return NULL;
+	}
+	reactorSetName(r, fd, "metrics listener");
+	return ms;
+}
@@ -0,0 +1,40 @@
+/*
+ * metrics.h
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * Metrics endpoint serving Prometheus text format
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "types.h"
+#include "histo.h"
+#include "reactor.h"
+
+typedef struct metrics_server metricsServer_t;
+typedef metricsServer_t * metricsServerPtr_t;
+
+typedef struct metrics_buf metricsBuf_t;
+typedef metricsBuf_t * metricsBufPtr_t;
+
+struct metrics_buf
+{
+	Bool failed;
+	size_t len;
+	size_t size;
+	char *buf;
+};
+
+/* Renders the metrics into mb for each scrape */
+typedef void (*metricsRender_t)(metricsBufPtr_t mb, void *ctx);
+
+/* Prototypes */
+
+metricsServerPtr_t metricsListen(reactorPtr_t r, const String where, metricsRender_t render, void *ctx);
+void metricsPrintf(metricsBufPtr_t mb, const char *format, ...);
+void metricsHeader(metricsBufPtr_t mb, const String name, const String type, const String help);
+void metricsHisto(metricsBufPtr_t mb, const String name, const String labels, const histo_t *h);
+
+#endif
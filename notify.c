@@ -44,6 +44,9 @@ extern int debugLvl;
 
 FILE *output = NULL;
 
+/* Called before exiting on a fatal error */
+static void (*fatalHook)(void) = NULL;
+
 
 /*
 * Redirect logging and error output
@@ -62,6 +65,30 @@ void notify_logpath(char *path)
 }
 
 
+/*
+* Set a function to call before exiting on a fatal error
+*/
+
+void notify_on_fatal(void (*hook)(void))
+{
+  fatalHook = hook;
+}
+
+
+/*
+* Run the fatal error hook once, in case it fails fatally itself
+*/
+
+static void run_fatal_hook(void)
+{
+  void (*hook)(void) = fatalHook;
+
+  fatalHook = NULL;
+  if(hook)
+    (*hook)();
+}
+
+
 /* Fatal error handler with strerror(errno) reason */
 
 void fatal_with_reason(int error, char *message, ...)
@@ -75,6 +102,7 @@ void fatal_with_reason(int error, char *message, ...)
     fprintf(LOGOUT, ": %s\n",strerror(error));
 
     va_end(ap);
+    run_fatal_hook();
     exit(1);
 }
 
@@ -91,6 +119,7 @@ void fatal(char *message, ...) {
 	
 	/* Exit with an error code. */
 	va_end(ap);
+	run_fatal_hook();
 	exit(1);
 }
 
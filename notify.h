@@ -32,6 +32,9 @@
 // Call to redirect the error and log output to a different file (i.e. /tmp/logfile)
 void notify_logpath(char *path);
 
+// Call to set a function to run before exiting on a fatal error
+void notify_on_fatal(void (*hook)(void));
+
 // Fatal error handler with strerror(errno);
 void fatal_with_reason(int error, char *message, ...);
 
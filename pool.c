@@ -0,0 +1,133 @@
+/*
+ * pool.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Fixed capacity pool of equal sized objects.
+ *
+ * All the objects are allocated in one block when the pool is created.
+ * Free objects are chained through their first word, so getting and
+ * putting an object are both O(1) and never call malloc() or free().
+ * When the pool is empty poolGet() returns NULL, and the caller decides
+ * what to do with the work it could not queue.
+ *
+ * A pool is used by one thread, but its counters may be read by another,
+ * so they are stored with relaxed atomics. Read them with __atomic_load_n().
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "notify.h"
+#include "pool.h"
+
+/*
+ * Create a pool of capacity objects of objSize bytes
+ */
+
+poolPtr_t poolNew(size_t objSize, unsigned capacity)
+{
+	poolPtr_t pool;
+	unsigned i;
+	char *obj;
+
+	if(!capacity)
+		return NULL;
+
+	/* Round the object size up so every object is suitably aligned */
+	if(objSize < sizeof(void *))
+		objSize = sizeof(void *);
+	objSize = (objSize + sizeof(long long) - 1) & ~(sizeof(long long) - 1);
+
+	if(!(pool = calloc(1, sizeof(pool_t))))
+		return NULL;
+	if(!(pool->objects = calloc(capacity, objSize))){
+		free(pool);
+		return NULL;
+	}
+	pool->objSize = objSize;
+	pool->capacity = capacity;
+
+	/* Chain the objects onto the free list, lowest address first */
+	for(i = capacity; i--;){
+		obj = pool->objects + (i * objSize);
+		*(void **) obj = pool->freeList;
+		pool->freeList = obj;
+	}
+	return pool;
+}
+
+/*
+ * Free a pool and every object in it
+ */
+
+void poolFree(poolPtr_t pool)
+{
+	if(pool){
+		free(pool->objects);
+		free(pool);
+	}
+}
+
+/*
+ * Get a zeroed object from the pool, returns NULL if the pool is empty
+ */
+
+void *poolGet(poolPtr_t pool)
+{
+	void *obj;
+
+	if(!(obj = pool->freeList)){
+		__atomic_store_n(&pool->stats.exhausted, pool->stats.exhausted + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	pool->freeList = *(void **) obj;
+	memset(obj, 0, pool->objSize);
+
+	__atomic_store_n(&pool->stats.allocs, pool->stats.allocs + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&pool->stats.in_use, pool->stats.in_use + 1, __ATOMIC_RELAXED);
+	if(pool->stats.in_use > pool->stats.peak)
+		__atomic_store_n(&pool->stats.peak, pool->stats.in_use, __ATOMIC_RELAXED);
+	return obj;
+}
+
+/*
+ * Return an object to the pool
+ */
+
+void poolPut(poolPtr_t pool, void *obj)
+{
+	if(!obj)
+		return;
+	if(((char *) obj < pool->objects) || ((char *) obj >= pool->objects + (pool->capacity * pool->objSize))){
+		debug(DEBUG_UNEXPECTED, "poolPut(): object %p does not belong to the pool", obj);
+		return;
+	}
+	*(void **) obj = pool->freeList;
+	pool->freeList = obj;
+	__atomic_store_n(&pool->stats.frees, pool->stats.frees + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&pool->stats.in_use, pool->stats.in_use - 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Return the pool counters
+ */
+
+const poolStats_t *poolGetStats(poolPtr_t pool)
+{
+	return &pool->stats;
+}
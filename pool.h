@@ -0,0 +1,47 @@
+/*
+ * pool.h
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * Fixed capacity pool of equal sized objects
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include "types.h"
+
+typedef struct pool_stats poolStats_t;
+typedef struct pool pool_t;
+typedef pool_t * poolPtr_t;
+
+/* Counters */
+
+struct pool_stats
+{
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t exhausted;
+	unsigned in_use;
+	unsigned peak;
+};
+
+struct pool
+{
+	size_t objSize;
+	unsigned capacity;
+	void *freeList;
+	char *objects;
+	poolStats_t stats;
+};
+
+/* Prototypes */
+
+poolPtr_t poolNew(size_t objSize, unsigned capacity);
+void poolFree(poolPtr_t pool);
+void *poolGet(poolPtr_t pool);
+void poolPut(poolPtr_t pool, void *obj);
+const poolStats_t *poolGetStats(poolPtr_t pool);
+
+#endif
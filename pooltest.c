@@ -0,0 +1,252 @@
+/*
+ * pooltest.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Pool soak test.
+ *
+ * Gets and puts objects in a random order for a few million rounds,
+ * emptying the pool now and then. Checks that every object handed out
+ * is zeroed and not already in use, that an empty pool returns NULL,
+ * that the counters add up, and that nothing calls malloc() once the
+ * pool has been created.
+ *
+ * Then takes work queue entries from a pool and queues them on a ring the
+ * way queueCommandAt() does, putting an entry back if the ring is full,
+ * while the consumer pops them and puts them back as freeWorkQueueEntry()
+ * does. Run once with the ring as big as the pool, as the daemon sizes it,
+ * and once with a smaller ring so that the ring full path is taken too.
+ * Checks that entries come off the ring in order and intact, that every
+ * entry goes back to the pool, and that nothing calls malloc().
+ *
+ * Usage: pooltest [ROUNDS]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "notify.h"
+#include "alloccount.h"
+#include "pool.h"
+#include "ring.h"
+
+#define CAPACITY 256
+#define OBJ_SIZE 40
+#define DEF_ROUNDS 4000000
+#define TAG 0xA5
+#define CMD_SIZE 32
+
+/* Laid out like a work queue entry */
+typedef struct test_entry testEntry_t;
+typedef testEntry_t * testEntryPtr_t;
+
+struct test_entry
+{
+	Bool is_poll;
+	uint32_t txn;
+	uint64_t queued_us;
+	uint64_t sent_us;
+	void *sp;
+	char cmd[CMD_SIZE];
+};
+
+char *progName = "pooltest";
+int debugLvl = 0;
+
+/*
+ * Report a failed check
+ */
+
+static int failed(const String what)
+{
+	fprintf(stderr, "pooltest: FAIL: %s\n", what);
+	return 1;
+}
+
+/*
+ * Return TRUE if every byte of an object is zero
+ */
+
+static Bool isZeroed(const void *obj, size_t size)
+{
+	const unsigned char *p = obj;
+	size_t i;
+
+	for(i = 0; i < size; i++){
+		if(p[i])
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Pass work queue entries from a pool through a ring. Returns the number of failed checks
+ */
+
+static int queueSoak(unsigned ringSize, unsigned long rounds)
+{
+	unsigned long round, allocs;
+	uint32_t queued = 0, dequeued = 0;
+	uint64_t ringFull = 0, poolEmpty = 0;
+	const poolStats_t *stats;
+	poolPtr_t pool;
+	ringPtr_t ring;
+	testEntryPtr_t wq;
+	char cmd[CMD_SIZE];
+	int errors = 0;
+
+	if(!(pool = poolNew(sizeof(testEntry_t), CAPACITY)))
+		return failed("poolNew()");
+	if(!(ring = ringNew(sizeof(testEntryPtr_t), ringSize)))
+		return failed("ringNew()");
+	stats = poolGetStats(pool);
+
+	alloccountStart();
+	for(round = 0; (round < rounds) && (!errors); round++){
+		if(rand() & 1){
+			/* Queue a command */
+			if(!(wq = poolGet(pool))){
+				poolEmpty++;
+				continue;
+			}
+			if(!isZeroed(wq, sizeof(testEntry_t)))
+				errors += failed("Entry was not zeroed");
+			snprintf(wq->cmd, CMD_SIZE, "gtmp %u", queued);
+			wq->txn = queued;
+			if(!ringPush(ring, &wq)){
+				ringFull++;
+				poolPut(pool, wq);
+				continue;
+			}
+			queued++;
+		}
+		else if(ringPop(ring, &wq)){
+			/* Send it and free it */
+			snprintf(cmd, CMD_SIZE, "gtmp %u", dequeued);
+			if((wq->txn != dequeued) || strcmp(wq->cmd, cmd))
+				errors += failed("Entry came off the ring out of order or overwritten");
+			dequeued++;
+			poolPut(pool, wq);
+		}
+		if(stats->in_use != ringCount(ring))
+			errors += failed("Entries went missing between the pool and the ring");
+	}
+	while(ringPop(ring, &wq)){
+		dequeued++;
+		poolPut(pool, wq);
+	}
+	allocs = alloccountStop();
+
+	printf("Ring of %u: %u commands queued and sent, ring full %llu times, pool empty %llu times, %lu allocations\n",
+	ringCapacity(ring), dequeued, (unsigned long long) ringFull, (unsigned long long) poolEmpty, allocs);
+	if(allocs)
+		errors += failed("Queueing called malloc()");
+	if((queued != dequeued) || (stats->in_use != 0))
+		errors += failed("Entries were not all returned to the pool");
+	if((ringSize < CAPACITY) && (!ringFull))
+		errors += failed("Ring full path was not taken");
+
+	ringFree(ring);
+	poolFree(pool);
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned char *held[CAPACITY];
+	unsigned heldCount = 0, i;
+	unsigned long rounds = DEF_ROUNDS, round, allocs;
+	uint64_t gets = 0, puts = 0, empties = 0;
+	const poolStats_t *stats;
+	poolPtr_t pool;
+	unsigned char *obj;
+	int errors = 0;
+
+	if(argc > 1)
+		rounds = strtoul(argv[1], NULL, 10);
+
+	if(!(pool = poolNew(OBJ_SIZE, CAPACITY)))
+		return failed("poolNew()");
+	stats = poolGetStats(pool);
+	srand(1);
+
+	alloccountStart();
+	for(round = 0; (round < rounds) && (!errors); round++){
+		if((round % 100000) == 0){ /* Drain the pool completely */
+			while((obj = poolGet(pool))){
+				gets++;
+				if(heldCount == CAPACITY){
+					errors += failed("Pool handed out more than its capacity");
+					break;
+				}
+				if(!isZeroed(obj, OBJ_SIZE))
+					errors += failed("Object was not zeroed");
+				memset(obj, TAG, OBJ_SIZE);
+				held[heldCount++] = obj;
+			}
+			empties++;
+			if(heldCount != CAPACITY)
+				errors += failed("Pool returned NULL before it was empty");
+		}
+		if((heldCount) && ((heldCount == CAPACITY) || (rand() & 1))){
+			/* Put back a random object, after checking nobody else wrote to it */
+			i = rand() % heldCount;
+			obj = held[i];
+			if((obj[0] != TAG) || (obj[OBJ_SIZE - 1] != TAG))
+				errors += failed("Object was handed out twice");
+			held[i] = held[--heldCount];
+			poolPut(pool, obj);
+			puts++;
+		}
+		else{
+			if(!(obj = poolGet(pool))){
+				errors += failed("Pool returned NULL while not empty");
+				break;
+			}
+			gets++;
+			if(!isZeroed(obj, OBJ_SIZE))
+				errors += failed("Object was not zeroed");
+			memset(obj, TAG, OBJ_SIZE);
+			held[heldCount++] = obj;
+		}
+	}
+	allocs = alloccountStop();
+
+	while(heldCount){
+		poolPut(pool, held[--heldCount]);
+		puts++;
+	}
+
+	printf("%lu rounds, %llu gets, %llu puts, pool emptied %llu times, peak %u in use, %lu allocations\n",
+	round, (unsigned long long) gets, (unsigned long long) puts, (unsigned long long) empties, stats->peak, allocs);
+	if(allocs)
+		errors += failed("Soak called malloc()");
+	if((stats->allocs != gets) || (stats->frees != puts) || (stats->in_use != 0))
+		errors += failed("Counters do not add up");
+	if((stats->peak != CAPACITY) || (stats->exhausted != empties))
+		errors += failed("Peak or exhausted count is wrong");
+
+	poolFree(pool);
+
+	errors += queueSoak(CAPACITY, rounds / 4);
+	errors += queueSoak(CAPACITY / 4, rounds / 4);
+
+	if(!errors)
+		printf("pooltest: PASS\n");
+	return (errors) ? 1 : 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * probes.h
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * USDT static tracepoints, for bpftrace, perf and systemtap.
+ *
+ * Built in whenever sys/sdt.h (from systemtap-sdt-dev) is installed, or
+ * when compiled with -DHAVE_SDT. A probe is then a single nop until a
+ * tracer attaches. -DNO_SDT leaves them out. Without sys/sdt.h the probes
+ * compile to nothing, and their arguments are not evaluated.
+ *
+ * The provider is xplhan. Bus is the bus ID, service the service ID and
+ * address the HAN node address. Times are in microseconds unless noted.
+ *
+ * command_queue(bus, service, address, is_poll)
+ * command_drop(bus, service, address, is_poll)     Work or request queue full
+ * command_send(bus, service, address, queue_us)
+ * command_timeout(bus, service, address, waited_ms)
+ * response_receive(bus, bytes)                     Entry to decodeResponse()
+ * response_decode(bus, service, address, rtt_us)
+ * response_unmatched(bus, address)
+ * action_emit(service, address, is_trigger)       An action sends a reading
+ * action_suppress(service, address)                A polled reading is unchanged
+ * xpl_send(service, is_trigger)
+ * han_connect(bus)
+ * han_connect_fail(bus, errno)
+ * han_disconnect(bus, service)                     service is -1 if none was pending
+ *
+ * For example:
+ *   bpftrace -e 'usdt:/usr/local/bin/xplhan:xplhan:response_decode { @rtt[arg2] = hist(arg3); }'
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#if !defined(HAVE_SDT) && !defined(NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define HAVE_SDT
+#endif
+#endif
+
+#if defined(HAVE_SDT) && !defined(NO_SDT)
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(xplhan, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(xplhan, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(xplhan, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(xplhan, name, a, b, c, d)
+
+#else
+
+#define PROBE1(name, a) do {} while(0)
+#define PROBE2(name, a, b) do {} while(0)
+#define PROBE3(name, a, b, c) do {} while(0)
+#define PROBE4(name, a, b, c, d) do {} while(0)
+
+#endif
+
+#endif
@@ -0,0 +1,340 @@
+/*
+ * prof.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Pipeline stage profiling with hardware performance counters.
+ *
+ * Each thread which marks a stage gets its own group of counters from
+ * perf_event_open(), counting that thread only: CPU cycles, instructions
+ * retired and task clock. Marking a stage reads the whole group with one
+ * read(), and the counts since the last mark are added to the stage the
+ * thread was in. The totals are shared by all the threads and are added
+ * to atomically.
+ *
+ * The read() itself is counted too, half in the stage being left and half
+ * in the next, so every interval between marks carries the cost of about
+ * one mark. profInit() measures that cost by marking back to back, and it
+ * is taken off each interval.
+ *
+ * If the kernel has more counters to run than the PMU has, it time shares
+ * them, and the group only counts while it is on the PMU. The time the
+ * group was enabled and running is read along with the counts, and an
+ * interval in which it was not running all the time is scaled up by
+ * enabled / running, as perf does. Such intervals are counted, see
+ * profMultiplexed().
+ *
+ * Where the kernel won't count in kernel mode, counting falls back to
+ * user space only. Where there are no hardware counters, as in most
+ * virtual machines, only the task clock is counted.
+ *
+ * A mark still costs a system call, so profiling is opt in.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "notify.h"
+#include "prof.h"
+
+Bool profEnabled = FALSE;
+
+#define PROF_CALIBRATE_MARKS 64
+
+/* Layout of a group read, with the enabled and running times */
+struct group_read
+{
+	uint64_t nr;
+	uint64_t timeEnabled;
+	uint64_t timeRunning;
+	uint64_t values[PROF_COUNTERS];
+};
+
+static Bool haveHardware = FALSE;
+static Bool userOnly = FALSE;
+static profCounts_t totals[PROF_STAGES];
+static uint64_t markCost[PROF_COUNTERS];
+static uint64_t multiplexed = 0;
+
+static __thread Bool threadOpened = FALSE;
+static __thread int leaderFd = -1;
+static __thread unsigned groupSize = 0;
+static __thread profCounter_t groupOrder[PROF_COUNTERS];
+static __thread profStage_t current = PROF_NONE;
+static __thread uint64_t last[PROF_COUNTERS];
+static __thread uint64_t lastEnabled = 0;
+static __thread uint64_t lastRunning = 0;
+
+static const String stageNames[PROF_STAGES] = {
+	"none",
+	"decode",
+	"conversion",
+	"formatting",
+	"xpl send"
+};
+
+static const struct {
+	uint32_t type;
+	uint64_t config;
+} counterEvents[PROF_COUNTERS] = {
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+	{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK}
+};
+
+/*
+ * Open one counter for the calling thread, in the group led by groupFd
+ */
+
+static int openCounter(profCounter_t counter, int groupFd)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = counterEvents[counter].type;
+	attr.config = counterEvents[counter].config;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	attr.exclude_kernel = (userOnly) ? 1 : 0;
+	attr.exclude_hv = 1;
+	return (int) syscall(__NR_perf_event_open, &attr, 0, -1, groupFd, PERF_FLAG_FD_CLOEXEC);
+}
+
+/*
+ * Add a counter to the calling thread's group
+ */
+
+static Bool addCounter(profCounter_t counter)
+{
+	int fd;
+
+	if((fd = openCounter(counter, leaderFd)) < 0)
+		return FALSE;
+	if(leaderFd < 0)
+		leaderFd = fd;
+	groupOrder[groupSize++] = counter;
+	return TRUE;
+}
+
+/*
+ * Open the calling thread's counters
+ */
+
+static Bool openThreadCounters(void)
+{
+	threadOpened = TRUE;
+	if((haveHardware) && ((!addCounter(PROF_CYCLES)) || (!addCounter(PROF_INSTRUCTIONS))))
+		return FALSE;
+	return addCounter(PROF_TASK_NS);
+}
+
+/*
+ * Read the calling thread's counters, and the time the group has been enabled and running
+ */
+
+static Bool readCounters(uint64_t *values, uint64_t *enabled, uint64_t *running)
+{
+	struct group_read gr;
+	unsigned i;
+
+	if(read(leaderFd, &gr, sizeof(gr)) < (ssize_t) ((groupSize + 3) * sizeof(uint64_t)))
+		return FALSE;
+	for(i = 0; i < groupSize; i++)
+		values[groupOrder[i]] = gr.values[i];
+	*enabled = gr.timeEnabled;
+	*running = gr.timeRunning;
+	return TRUE;
+}
+
+/*
+ * Sort helper for the calibration
+ */
+
+static int cmpU64(const void *a, const void *b)
+{
+	uint64_t ua = *(const uint64_t *) a;
+	uint64_t ub = *(const uint64_t *) b;
+
+	return (ua > ub) - (ua < ub);
+}
+
+/*
+ * Measure what one mark adds to the interval it ends, as the median of
+ * the counts between back to back reads
+ */
+
+static void calibrate(void)
+{
+	uint64_t prev[PROF_COUNTERS], now[PROF_COUNTERS], enabled, running;
+	uint64_t deltas[PROF_COUNTERS][PROF_CALIBRATE_MARKS];
+	unsigned i, j;
+
+	memset(prev, 0, sizeof(prev));
+	memset(now, 0, sizeof(now));
+	if(!readCounters(prev, &enabled, &running))
+		return;
+	for(j = 0; j < PROF_CALIBRATE_MARKS; j++){
+		if(!readCounters(now, &enabled, &running))
+			return;
+		for(i = 0; i < PROF_COUNTERS; i++)
+			deltas[i][j] = now[i] - prev[i];
+		memcpy(prev, now, sizeof(prev));
+	}
+	for(i = 0; i < PROF_COUNTERS; i++){
+		qsort(deltas[i], PROF_CALIBRATE_MARKS, sizeof(uint64_t), cmpU64);
+		markCost[i] = deltas[i][PROF_CALIBRATE_MARKS / 2];
+	}
+}
+
+/*
+ * See if a counter can be opened. Kernel time is counted as well if the
+ * kernel allows it, as the xPL send is mostly a system call.
+ */
+
+static Bool probeCounter(profCounter_t counter)
+{
+	int fd;
+
+	if(((fd = openCounter(counter, -1)) < 0) && ((errno == EACCES) || (errno == EPERM)) && (!userOnly)){
+		userOnly = TRUE;
+		fd = openCounter(counter, -1);
+	}
+	if(fd < 0)
+		return FALSE;
+	close(fd);
+	return TRUE;
+}
+
+/*
+ * Find out which counters can be had, and turn profiling on.
+ * Returns FALSE with errno set if no counters could be opened.
+ */
+
+Bool profInit(void)
+{
+	haveHardware = probeCounter(PROF_CYCLES);
+	if((!haveHardware) && (!probeCounter(PROF_TASK_NS)))
+		return FALSE;
+	if(!openThreadCounters())
+		return FALSE;
+	calibrate();
+	profEnabled = TRUE;
+	return TRUE;
+}
+
+/*
+ * Charge the counts since the last mark to the stage the calling thread
+ * was in, then move it to a new stage. A thread's counters are opened the
+ * first time it marks a stage.
+ */
+
+void profMark(profStage_t stage, Bool entry)
+{
+	uint64_t now[PROF_COUNTERS], enabled, running, delta;
+	double scale = 1.0;
+	unsigned i;
+
+	if((!threadOpened) && (!openThreadCounters()))
+		debug(DEBUG_UNEXPECTED, "Could not open performance counters for this thread: %s", strerror(errno));
+	if(leaderFd < 0)
+		return;
+	memset(now, 0, sizeof(now));
+	if(!readCounters(now, &enabled, &running))
+		return;
+	if(current != PROF_NONE){
+		if((running - lastRunning) < (enabled - lastEnabled)){
+			/* The group was off the PMU for part of the interval */
+			__atomic_fetch_add(&multiplexed, 1, __ATOMIC_RELAXED);
+			if(running > lastRunning)
+				scale = (double) (enabled - lastEnabled) / (running - lastRunning);
+		}
+		for(i = 0; i < PROF_COUNTERS; i++){
+			delta = (uint64_t) ((now[i] - last[i]) * scale);
+			delta = (delta > markCost[i]) ? delta - markCost[i] : 0;
+			__atomic_fetch_add(&totals[current].value[i], delta, __ATOMIC_RELAXED);
+		}
+	}
+	if((entry) && (stage != PROF_NONE))
+		__atomic_fetch_add(&totals[stage].entries, 1, __ATOMIC_RELAXED);
+	memcpy(last, now, sizeof(last));
+	lastEnabled = enabled;
+	lastRunning = running;
+	current = stage;
+}
+
+/*
+ * Return TRUE if a counter is being counted
+ */
+
+Bool profHaveCounter(profCounter_t counter)
+{
+	return (counter == PROF_TASK_NS) ? TRUE : haveHardware;
+}
+
+/*
+ * Return TRUE if the counters leave out time spent in the kernel
+ */
+
+Bool profUserOnly(void)
+{
+	return userOnly;
+}
+
+/*
+ * Return the cost of one mark, which is taken off each stage interval
+ */
+
+uint64_t profMarkCost(profCounter_t counter)
+{
+	return (counter < PROF_COUNTERS) ? markCost[counter] : 0;
+}
+
+/*
+ * Return the number of stage intervals which were scaled because the
+ * kernel was time sharing the counters
+ */
+
+uint64_t profMultiplexed(void)
+{
+	return __atomic_load_n(&multiplexed, __ATOMIC_RELAXED);
+}
+
+/*
+ * Return the name of a stage
+ */
+
+const String profStageName(profStage_t stage)
+{
+	return (stage < PROF_STAGES) ? stageNames[stage] : "unknown";
+}
+
+/*
+ * Copy out the totals for a stage
+ */
+
+void profGetCounts(profStage_t stage, profCountsPtr_t counts)
+{
+	unsigned i;
+
+	counts->entries = __atomic_load_n(&totals[stage].entries, __ATOMIC_RELAXED);
+	for(i = 0; i < PROF_COUNTERS; i++)
+		counts->value[i] = __atomic_load_n(&totals[stage].value[i], __ATOMIC_RELAXED);
+}
@@ -0,0 +1,71 @@
+/*
+ * prof.h
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * Per stage hardware counters from perf_event_open
+ */
+
+#ifndef PROF_H
+#define PROF_H
+
+#include "types.h"
+
+typedef enum {PROF_NONE = 0, PROF_DECODE, PROF_CONVERT, PROF_FORMAT, PROF_XPL_SEND, PROF_STAGES} profStage_t;
+typedef enum {PROF_CYCLES = 0, PROF_INSTRUCTIONS, PROF_TASK_NS, PROF_COUNTERS} profCounter_t;
+
+typedef struct prof_counts profCounts_t;
+typedef profCounts_t * profCountsPtr_t;
+
+/* Totals for a stage. entries is the number of times the stage was entered */
+struct prof_counts
+{
+	uint64_t entries;
+	uint64_t value[PROF_COUNTERS];
+};
+
+/* Set when profiling is on. Check it before marking a stage */
+extern Bool profEnabled;
+
+/* Prototypes */
+
+Bool profInit(void);
+void profMark(profStage_t stage, Bool entry);
+Bool profHaveCounter(profCounter_t counter);
+Bool profUserOnly(void);
+uint64_t profMarkCost(profCounter_t counter);
+uint64_t profMultiplexed(void);
+const String profStageName(profStage_t stage);
+void profGetCounts(profStage_t stage, profCountsPtr_t counts);
+
+/*
+ * Start a stage, ending the one the thread was in
+ */
+
+static inline void profEnter(profStage_t stage)
+{
+	if(profEnabled)
+		profMark(stage, TRUE);
+}
+
+/*
+ * Carry on with a stage without counting an entry, for work done in batches
+ */
+
+static inline void profContinue(profStage_t stage)
+{
+	if(profEnabled)
+		profMark(stage, FALSE);
+}
+
+/*
+ * End the stage the thread was in
+ */
+
+static inline void profLeave(void)
+{
+	if(profEnabled)
+		profMark(PROF_NONE, FALSE);
+}
+
+#endif
@@ -0,0 +1,536 @@
+/*
+ * reactor.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * epoll based event loop.
+ *
+ * Each watched fd is a source. The epoll event carries a pointer to the
+ * source, so dispatch is O(1) however many fds are registered. Timers
+ * are timerfds and signals come in through a signalfd, so they are just
+ * more sources and signal handlers run in normal context rather than
+ * inside an asynchronous signal handler.
+ *
+ * A source removed from inside a handler may still have an event pending
+ * in the current batch, so removed sources are only freed once the batch
+ * has been dispatched.
+ *
+ * An optional flush handler runs after each batch, so output queued by
+ * the handlers can be sent with one system call.
+ *
+ * Every callback is timed, and each timer's deadline is kept so the
+ * lateness of its expiry can be recorded. A callback which runs for
+ * longer than the stall threshold, or a timer which runs that much past
+ * its deadline, is warned about by name, so something blocking the loop
+ * shows up rather than silently delaying everything behind it.
+ *
+ * A reactor is run by one thread. Several threads can each run their own.
+ * The loop health stats may be copied by another thread while the loop
+ * runs: the counters are stored with relaxed atomics, and the longest
+ * callback's name and time are guarded by a sequence count.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <pthread.h>
+#include "notify.h"
+#include "reactor.h"
+
+#define REACTOR_MAX_EVENTS 32
+
+typedef enum {RS_FD = 0, RS_TIMER, RS_SIGNAL} reactorSourceKind_t;
+
+typedef struct reactor_source reactorSource_t;
+typedef reactorSource_t * reactorSourcePtr_t;
+
+struct reactor_source
+{
+	reactorSourceKind_t kind;
+	Bool dead;
+	int fd;
+	reactorFdHandler_t fdHandler;
+	reactorTimerHandler_t timerHandler;
+	reactorSignalHandler_t signalHandler;
+	void *ctx;
+	uint64_t deadlineUs;
+	uint64_t intervalUs;
+	char name[REACTOR_NAME_SIZE];
+	reactorSourcePtr_t nextDead;
+};
+
+struct reactor
+{
+	Bool stop;
+	int epfd;
+	uint64_t wakeups;
+	reactorFlushHandler_t flushHandler;
+	void *flushCtx;
+	unsigned fdTableSize;
+	reactorSourcePtr_t *byFd;
+	reactorSourcePtr_t deadList;
+	uint64_t stallUs;
+	unsigned maxSeq;
+	reactorStats_t stats;
+};
+
+/*
+ * Register a source
+ */
+
+static reactorSourcePtr_t addSource(reactorPtr_t r, int fd, uint32_t events, reactorSourceKind_t kind, void *ctx)
+{
+	reactorSourcePtr_t src, *table;
+	struct epoll_event ev;
+	unsigned size;
+
+	if(fd < 0)
+		return NULL;
+
+	/* Grow the fd table if need be */
+	if((unsigned) fd >= r->fdTableSize){
+		for(size = (r->fdTableSize) ? r->fdTableSize : 16; size <= (unsigned) fd; size <<= 1);
+		if(!(table = realloc(r->byFd, size * sizeof(reactorSourcePtr_t))))
+			return NULL;
+		memset(table + r->fdTableSize, 0, (size - r->fdTableSize) * sizeof(reactorSourcePtr_t));
+		r->byFd = table;
+		r->fdTableSize = size;
+	}
+	if(r->byFd[fd]){
+		debug(DEBUG_UNEXPECTED, "reactor: fd %d is already registered", fd);
+		return NULL;
+	}
+
+	if(!(src = calloc(1, sizeof(reactorSource_t))))
+		return NULL;
+	src->kind = kind;
+	src->fd = fd;
+	src->ctx = ctx;
+	snprintf(src->name, sizeof(src->name), "%s fd %d", (kind == RS_FD) ? "io" : ((kind == RS_TIMER) ? "timer" : "signal"), fd);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = src;
+	if(epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) < 0){
+		debug(DEBUG_UNEXPECTED, "reactor: epoll_ctl add of fd %d failed: %s", fd, strerror(errno));
+		free(src);
+		return NULL;
+	}
+	r->byFd[fd] = src;
+	return src;
+}
+
+/*
+ * Look up the source for an fd
+ */
+
+static reactorSourcePtr_t findSource(reactorPtr_t r, int fd)
+{
+	if((fd < 0) || ((unsigned) fd >= r->fdTableSize))
+		return NULL;
+	return r->byFd[fd];
+}
+
+/*
+ * Free the sources removed during the last batch
+ */
+
+static void reapSources(reactorPtr_t r)
+{
+	reactorSourcePtr_t src;
+
+	while((src = r->deadList)){
+		r->deadList = src->nextDead;
+		free(src);
+	}
+}
+
+/*
+ * Create a reactor
+ */
+
+reactorPtr_t reactorNew(void)
+{
+	reactorPtr_t r;
+
+	if(!(r = calloc(1, sizeof(reactor_t))))
+		return NULL;
+	if((r->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0){
+		free(r);
+		return NULL;
+	}
+	return r;
+}
+
+/*
+ * Free a reactor. Timer and signal fds are closed, other fds are left to their owners.
+ */
+
+void reactorFree(reactorPtr_t r)
+{
+	unsigned i;
+
+	if(!r)
+		return;
+	for(i = 0; i < r->fdTableSize; i++){
+		if(r->byFd[i]){
+			if(r->byFd[i]->kind != RS_FD)
+				close(i);
+			free(r->byFd[i]);
+		}
+	}
+	reapSources(r);
+	close(r->epfd);
+	free(r->byFd);
+	free(r);
+}
+
+/*
+ * Watch an fd. events is a mask of EPOLLIN, EPOLLOUT etc.
+ */
+
+Bool reactorAddFd(reactorPtr_t r, int fd, uint32_t events, reactorFdHandler_t handler, void *ctx)
+{
+	reactorSourcePtr_t src;
+
+	if(!(src = addSource(r, fd, events, RS_FD, ctx)))
+		return FALSE;
+	src->fdHandler = handler;
+	return TRUE;
+}
+
+/*
+ * Change the events watched for on an fd
+ */
+
+Bool reactorModifyFd(reactorPtr_t r, int fd, uint32_t events)
+{
+	reactorSourcePtr_t src;
+	struct epoll_event ev;
+
+	if(!(src = findSource(r, fd)))
+		return FALSE;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = src;
+	return (epoll_ctl(r->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) ? FALSE : TRUE;
+}
+
+/*
+ * Stop watching an fd. The caller still owns the fd and must close it.
+ */
+
+Bool reactorRemoveFd(reactorPtr_t r, int fd)
+{
+	reactorSourcePtr_t src;
+
+	if(!(src = findSource(r, fd)))
+		return FALSE;
+	epoll_ctl(r->epfd, EPOLL_CTL_DEL, fd, NULL);
+	r->byFd[fd] = NULL;
+	src->dead = TRUE;
+	src->nextDead = r->deadList;
+	r->deadList = src;
+	return TRUE;
+}
+
+/*
+ * Add a timer. It is created disarmed, use reactorSetTimer() to start it.
+ * Returns the timer fd, or -1 on error.
+ */
+
+int reactorAddTimer(reactorPtr_t r, reactorTimerHandler_t handler, void *ctx)
+{
+	reactorSourcePtr_t src;
+	int fd;
+
+	if((fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+		return -1;
+	if(!(src = addSource(r, fd, EPOLLIN, RS_TIMER, ctx))){
+		close(fd);
+		return -1;
+	}
+	src->timerHandler = handler;
+	return fd;
+}
+
+/*
+ * Arm a timer to expire firstMs from now, then every intervalMs.
+ * An intervalMs of 0 makes it a one shot, a firstMs of 0 disarms it.
+ */
+
+Bool reactorSetTimer(reactorPtr_t r, int fd, long long firstMs, long long intervalMs)
+{
+	struct itimerspec its;
+	reactorSourcePtr_t src;
+
+	if((src = findSource(r, fd))){
+		src->deadlineUs = (firstMs) ? histoNowUs() + (firstMs * 1000) : 0;
+		src->intervalUs = intervalMs * 1000;
+	}
+
+	its.it_value.tv_sec = firstMs / 1000;
+	its.it_value.tv_nsec = (firstMs % 1000) * 1000000;
+	its.it_interval.tv_sec = intervalMs / 1000;
+	its.it_interval.tv_nsec = (intervalMs % 1000) * 1000000;
+	return (timerfd_settime(fd, 0, &its, NULL) < 0) ? FALSE : TRUE;
+}
+
+/*
+ * Arm a one shot timer to expire at deadlineMs on the reactorNowMs() clock.
+ * A deadline which has already passed expires straight away, a negative
+ * deadline disarms the timer.
+ */
+
+Bool reactorSetTimerAt(reactorPtr_t r, int fd, long long deadlineMs)
+{
+	struct itimerspec its;
+	reactorSourcePtr_t src;
+	uint64_t nowUs;
+
+	/* Lateness of an expiry which is already due counts from now */
+	if((src = findSource(r, fd))){
+		nowUs = histoNowUs();
+		src->deadlineUs = (deadlineMs < 0) ? 0 : (((uint64_t) deadlineMs * 1000 > nowUs) ? (uint64_t) deadlineMs * 1000 : nowUs);
+		src->intervalUs = 0;
+	}
+	memset(&its, 0, sizeof(its));
+	if(deadlineMs >= 0){
+		if(!deadlineMs)
+			deadlineMs = 1; /* A zero it_value would disarm the timer */
+		its.it_value.tv_sec = deadlineMs / 1000;
+		its.it_value.tv_nsec = (deadlineMs % 1000) * 1000000;
+	}
+	return (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) ? FALSE : TRUE;
+}
+
+/*
+ * Return the monotonic clock in milliseconds, the clock the timers run on
+ */
+
+long long reactorNowMs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (((long long) ts.tv_sec) * 1000) + (ts.tv_nsec / 1000000);
+}
+
+/*
+ * Deliver a set of signals through the reactor. The signals are blocked
+ * in the calling thread, so this should be done before any other
+ * threads are created, which then inherit the mask.
+ * Returns the signal fd, or -1 on error.
+ */
+
+int reactorAddSignals(reactorPtr_t r, const sigset_t *sigs, reactorSignalHandler_t handler, void *ctx)
+{
+	reactorSourcePtr_t src;
+	int fd;
+
+	if(pthread_sigmask(SIG_BLOCK, sigs, NULL))
+		return -1;
+	if((fd = signalfd(-1, sigs, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+		return -1;
+	if(!(src = addSource(r, fd, EPOLLIN, RS_SIGNAL, ctx))){
+		close(fd);
+		return -1;
+	}
+	src->signalHandler = handler;
+	return fd;
+}
+
+/*
+ * Record how late a timer ran, and work out its next deadline
+ */
+
+static void timerLateness(reactorPtr_t r, reactorSourcePtr_t src, uint64_t nowUs, uint64_t expirations)
+{
+	uint64_t late;
+
+	if(!src->deadlineUs)
+		return;
+	late = (nowUs > src->deadlineUs) ? nowUs - src->deadlineUs : 0;
+	histoRecord(&r->stats.lateness, late);
+	if((r->stallUs) && (late > r->stallUs)){
+		__atomic_store_n(&r->stats.lateTimers, r->stats.lateTimers + 1, __ATOMIC_RELAXED);
+		warn("Event loop: %s ran %llu ms late", src->name, (unsigned long long) late / 1000);
+	}
+	src->deadlineUs = (src->intervalUs) ? src->deadlineUs + (expirations * src->intervalUs) : 0;
+}
+
+/*
+ * Account for the time a callback took
+ */
+
+static void timeCallback(reactorPtr_t r, const String name, uint64_t us)
+{
+	unsigned i;
+
+	__atomic_store_n(&r->stats.callbacks, r->stats.callbacks + 1, __ATOMIC_RELAXED);
+	if(us > r->stats.maxCallbackUs){
+		/* An odd sequence count tells a reader the name is being written */
+		__atomic_store_n(&r->maxSeq, r->maxSeq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		__atomic_store_n(&r->stats.maxCallbackUs, us, __ATOMIC_RELAXED);
+		for(i = 0; i < REACTOR_NAME_SIZE; i++){
+			__atomic_store_n(&r->stats.maxCallback[i], name[i], __ATOMIC_RELAXED);
+			if(!name[i])
+				break;
+		}
+		__atomic_store_n(&r->maxSeq, r->maxSeq + 1, __ATOMIC_RELEASE);
+	}
+	if((r->stallUs) && (us > r->stallUs)){
+		__atomic_store_n(&r->stats.stalls, r->stats.stalls + 1, __ATOMIC_RELAXED);
+		warn("Event loop: stalled for %llu ms in %s", (unsigned long long) us / 1000, name);
+	}
+}
+
+/*
+ * Dispatch events until reactorStop() is called
+ */
+
+void reactorRun(reactorPtr_t r)
+{
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	struct signalfd_siginfo si;
+	reactorSourcePtr_t src;
+	uint64_t expirations, startUs;
+	int i, n;
+
+	r->stop = FALSE;
+	while(!r->stop){
+		if((n = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS, -1)) < 0){
+			if(errno == EINTR)
+				continue;
+			fatal_with_reason(errno, "epoll_wait");
+		}
+		__atomic_store_n(&r->wakeups, r->wakeups + 1, __ATOMIC_RELAXED);
+		for(i = 0; i < n; i++){
+			src = events[i].data.ptr;
+			if(src->dead)
+				continue; /* Removed by an earlier handler in this batch */
+			startUs = histoNowUs();
+			switch(src->kind){
+				case RS_FD:
+					(*src->fdHandler)(src->fd, events[i].events, src->ctx);
+					break;
+
+				case RS_TIMER:
+					if(read(src->fd, &expirations, sizeof(expirations)) == sizeof(expirations)){
+						timerLateness(r, src, startUs, expirations);
+						(*src->timerHandler)(src->fd, src->ctx);
+					}
+					break;
+
+				case RS_SIGNAL:
+					while(read(src->fd, &si, sizeof(si)) == sizeof(si))
+						(*src->signalHandler)((int) si.ssi_signo, src->ctx);
+					break;
+			}
+			/* A source removed by its own handler is still valid until the batch is reaped */
+			timeCallback(r, src->name, histoNowUs() - startUs);
+		}
+		if(r->flushHandler){
+			startUs = histoNowUs();
+			(*r->flushHandler)(r->flushCtx);
+			timeCallback(r, "flush", histoNowUs() - startUs);
+		}
+		reapSources(r);
+	}
+}
+
+/*
+ * Set the handler which runs after each batch of events
+ */
+
+void reactorSetFlush(reactorPtr_t r, reactorFlushHandler_t handler, void *ctx)
+{
+	r->flushHandler = handler;
+	r->flushCtx = ctx;
+}
+
+/*
+ * Make reactorRun() return after the current batch
+ */
+
+void reactorStop(reactorPtr_t r)
+{
+	r->stop = TRUE;
+}
+
+/*
+ * Return the number of times the reactor has woken up
+ */
+
+uint64_t reactorGetWakeups(reactorPtr_t r)
+{
+	return __atomic_load_n(&r->wakeups, __ATOMIC_RELAXED);
+}
+
+/*
+ * Name a source, for stall warnings and the stats
+ */
+
+void reactorSetName(reactorPtr_t r, int fd, const String name)
+{
+	reactorSourcePtr_t src;
+
+	if((src = findSource(r, fd)))
+		snprintf(src->name, sizeof(src->name), "%s", name);
+}
+
+/*
+ * Set how long a callback can run, or a timer be late, before it is
+ * warned about. 0 turns the warnings off.
+ */
+
+void reactorSetStallThreshold(reactorPtr_t r, uint64_t us)
+{
+	r->stallUs = us;
+}
+
+/*
+ * Copy the loop health stats. They are updated by the thread running the
+ * reactor, so a copy made from another thread is a moment's snapshot, and
+ * the counters in it may be a little behind one another.
+ */
+
+void reactorGetStats(reactorPtr_t r, reactorStatsPtr_t stats)
+{
+	unsigned seq, i;
+
+	histoSnapshot(&stats->lateness, &r->stats.lateness);
+	stats->callbacks = __atomic_load_n(&r->stats.callbacks, __ATOMIC_RELAXED);
+	stats->stalls = __atomic_load_n(&r->stats.stalls, __ATOMIC_RELAXED);
+	stats->lateTimers = __atomic_load_n(&r->stats.lateTimers, __ATOMIC_RELAXED);
+	/* Retry if the longest callback changed while it was copied */
+	do{
+		seq = __atomic_load_n(&r->maxSeq, __ATOMIC_ACQUIRE);
+		stats->maxCallbackUs = __atomic_load_n(&r->stats.maxCallbackUs, __ATOMIC_RELAXED);
+		for(i = 0; i < REACTOR_NAME_SIZE; i++)
+			stats->maxCallback[i] = __atomic_load_n(&r->stats.maxCallback[i], __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while((seq & 1) || (seq != __atomic_load_n(&r->maxSeq, __ATOMIC_RELAXED)));
+	stats->maxCallback[REACTOR_NAME_SIZE - 1] = '\0';
+}
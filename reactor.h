@@ -0,0 +1,69 @@
+/*
+ * reactor.h
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * epoll based event loop with timerfd timers and signalfd signals
+ */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <signal.h>
+#include <sys/epoll.h>
+#include "types.h"
+#include "histo.h"
+
+/* Longest source name kept, including the NUL */
+#define REACTOR_NAME_SIZE 48
+
+typedef struct reactor reactor_t;
+typedef reactor_t * reactorPtr_t;
+
+typedef struct reactor_stats reactorStats_t;
+typedef reactorStats_t * reactorStatsPtr_t;
+
+/*
+ * Loop health. Lateness is how long after its deadline each timer ran,
+ * in microseconds. A stall is a callback which ran for longer than the
+ * stall threshold, a late timer is one which ran more than the threshold
+ * after its deadline.
+ */
+
+struct reactor_stats
+{
+	histo_t lateness;
+	uint64_t callbacks;
+	uint64_t stalls;
+	uint64_t lateTimers;
+	uint64_t maxCallbackUs;
+	char maxCallback[REACTOR_NAME_SIZE];
+};
+
+/* Handlers */
+typedef void (*reactorFdHandler_t)(int fd, uint32_t events, void *ctx);
+typedef void (*reactorTimerHandler_t)(int fd, void *ctx);
+typedef void (*reactorSignalHandler_t)(int signo, void *ctx);
+typedef void (*reactorFlushHandler_t)(void *ctx);
+
+/* Prototypes */
+
+reactorPtr_t reactorNew(void);
+void reactorFree(reactorPtr_t r);
+Bool reactorAddFd(reactorPtr_t r, int fd, uint32_t events, reactorFdHandler_t handler, void *ctx);
+Bool reactorModifyFd(reactorPtr_t r, int fd, uint32_t events);
+Bool reactorRemoveFd(reactorPtr_t r, int fd);
+int reactorAddTimer(reactorPtr_t r, reactorTimerHandler_t handler, void *ctx);
+Bool reactorSetTimer(reactorPtr_t r, int fd, long long firstMs, long long intervalMs);
+Bool reactorSetTimerAt(reactorPtr_t r, int fd, long long deadlineMs);
+void reactorSetName(reactorPtr_t r, int fd, const String name);
+void reactorSetStallThreshold(reactorPtr_t r, uint64_t us);
+long long reactorNowMs(void);
+int reactorAddSignals(reactorPtr_t r, const sigset_t *sigs, reactorSignalHandler_t handler, void *ctx);
+void reactorSetFlush(reactorPtr_t r, reactorFlushHandler_t handler, void *ctx);
+void reactorRun(reactorPtr_t r);
+void reactorStop(reactorPtr_t r);
+uint64_t reactorGetWakeups(reactorPtr_t r);
+void reactorGetStats(reactorPtr_t r, reactorStatsPtr_t stats);
+
+#endif
@@ -0,0 +1,208 @@
+/*
+ * ring.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Bounded lock free ring buffer of fixed size elements, copied in and
+ * out by value.
+ *
+ * Each slot carries a sequence number which tells the producer and the
+ * consumer whose turn it is, so a slot is never read before its element
+ * has been written, or overwritten before it has been read.
+ *
+ * There is always a single consumer. ringPush() is for a single producer
+ * and just publishes the new tail, ringPushMP() lets several producers
+ * share the ring by claiming slots with a compare and swap. Use one or the
+ * other on a given ring, not both.
+ *
+ * Backpressure is explicit: ringPush() and ringPushMP() return FALSE when
+ * the ring is full, and ringPop() returns FALSE when it is empty. Neither
+ * ever blocks.
+ *
+ * The producer and consumer indexes are on separate cache lines so the
+ * two sides do not bounce a line between them on every operation.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "ring.h"
+
+#define RING_CACHE_LINE 64
+#define RING_MAX_CAPACITY (1U << 30)
+
+typedef struct ring_slot ringSlot_t;
+
+struct ring_slot
+{
+	atomic_uint seq;
+	/* The element follows */
+};
+
+struct ring
+{
+	/* Producer side */
+	atomic_uint tail __attribute__ ((aligned (RING_CACHE_LINE)));
+	/* Consumer side */
+	atomic_uint head __attribute__ ((aligned (RING_CACHE_LINE)));
+	/* Read only after creation */
+	unsigned mask __attribute__ ((aligned (RING_CACHE_LINE)));
+	size_t elemSize;
+	size_t slotSize;
+	char *slots;
+};
+
+/*
+ * Return the slot for a position
+ */
+
+static inline ringSlot_t *slotAt(ringPtr_t r, unsigned pos)
+{
+	return (ringSlot_t *) (r->slots + ((pos & r->mask) * r->slotSize));
+}
+
+/*
+ * Create a ring. The capacity is rounded up to a power of two.
+ */
+
+ringPtr_t ringNew(size_t elemSize, unsigned capacity)
+{
+	ringPtr_t r;
+	unsigned size, i;
+
+	if((!elemSize) || (!capacity) || (capacity > RING_MAX_CAPACITY))
+		return NULL;
+	for(size = 2; size < capacity; size <<= 1);
+
+	if(posix_memalign((void **) &r, RING_CACHE_LINE, sizeof(ring_t)))
+		return NULL;
+	memset(r, 0, sizeof(ring_t));
+	r->mask = size - 1;
+	r->elemSize = elemSize;
+	r->slotSize = (sizeof(ringSlot_t) + elemSize + sizeof(long long) - 1) & ~(sizeof(long long) - 1);
+	if(posix_memalign((void **) &r->slots, RING_CACHE_LINE, size * r->slotSize)){
+		free(r);
+		return NULL;
+	}
+	for(i = 0; i < size; i++)
+		atomic_init(&slotAt(r, i)->seq, i);
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	return r;
+}
+
+/*
+ * Free a ring
+ */
+
+void ringFree(ringPtr_t r)
+{
+	if(r){
+		free(r->slots);
+		free(r);
+	}
+}
+
+/*
+ * Single producer push. Returns FALSE if the ring is full.
+ */
+
+Bool ringPush(ringPtr_t r, const void *elem)
+{
+	unsigned pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	ringSlot_t *slot = slotAt(r, pos);
+
+	if(atomic_load_explicit(&slot->seq, memory_order_acquire) != pos)
+		return FALSE; /* Consumer has not freed the slot yet */
+
+	memcpy(slot + 1, elem, r->elemSize);
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+	atomic_store_explicit(&r->tail, pos + 1, memory_order_relaxed);
+	return TRUE;
+}
+
+/*
+ * Multiple producer push. Returns FALSE if the ring is full.
+ */
+
+Bool ringPushMP(ringPtr_t r, const void *elem)
+{
+	unsigned pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	ringSlot_t *slot;
+	int diff;
+
+	for(;;){
+		slot = slotAt(r, pos);
+		diff = (int) (atomic_load_explicit(&slot->seq, memory_order_acquire) - pos);
+		if(!diff){
+			/* Slot is free, try to claim it */
+			if(atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos + 1,
+			memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if(diff < 0)
+			return FALSE; /* Full */
+		else
+			pos = atomic_load_explicit(&r->tail, memory_order_relaxed); /* Another producer got there first */
+	}
+
+	memcpy(slot + 1, elem, r->elemSize);
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+	return TRUE;
+}
+
+/*
+ * Single consumer pop. Returns FALSE if the ring is empty.
+ */
+
+Bool ringPop(ringPtr_t r, void *elem)
+{
+	unsigned pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+	ringSlot_t *slot = slotAt(r, pos);
+
+	if(atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1)
+		return FALSE; /* Nothing published in this slot yet */
+
+	memcpy(elem, slot + 1, r->elemSize);
+	/* Hand the slot back to the producers for the next lap */
+	atomic_store_explicit(&slot->seq, pos + r->mask + 1, memory_order_release);
+	atomic_store_explicit(&r->head, pos + 1, memory_order_relaxed);
+	return TRUE;
+}
+
+/*
+ * Return the number of elements in the ring. This is only a snapshot
+ * when other threads are using the ring.
+ */
+
+unsigned ringCount(ringPtr_t r)
+{
+	unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+	return tail - head;
+}
+
+/*
+ * Return the number of elements the ring can hold
+ */
+
+unsigned ringCapacity(ringPtr_t r)
+{
+	return r->mask + 1;
+}
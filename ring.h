@@ -0,0 +1,28 @@
+/*
+ * ring.h
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * Bounded lock free ring buffer
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include "types.h"
+
+typedef struct ring ring_t;
+typedef ring_t * ringPtr_t;
+
+/* Prototypes */
+
+ringPtr_t ringNew(size_t elemSize, unsigned capacity);
+void ringFree(ringPtr_t r);
+Bool ringPush(ringPtr_t r, const void *elem);
+Bool ringPushMP(ringPtr_t r, const void *elem);
+Bool ringPop(ringPtr_t r, void *elem);
+unsigned ringCount(ringPtr_t r);
+unsigned ringCapacity(ringPtr_t r);
+
+#endif
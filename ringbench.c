@@ -0,0 +1,206 @@
+/*
+ * ringbench.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Benchmark ring throughput and latency.
+ *
+ * One producer thread pushes with ringPush(), then 1 to N producer
+ * threads push with ringPushMP(), while the main thread pops, as the HAN
+ * thread does with its request ring. Elements are the size of a work
+ * queue entry, which is what the request rings carry by value.
+ *
+ * Each case is run twice:
+ *
+ * flat out - the producers push as fast as they can. Throughput is the
+ *            number of elements popped per second. Latency includes the
+ *            time spent queued behind other elements.
+ * paced    - each producer pushes one element every PACE_NS, so the ring
+ *            is nearly always empty and the latency is the hand over
+ *            from producer to consumer.
+ *
+ * Latency is from just before the push to just after the pop. A producer
+ * yields while it waits for its next push or for a full ring to drain, and
+ * the consumer yields when the ring is empty, so with fewer CPUs than
+ * threads the figures include scheduling delay.
+ * ringtest checks correctness.
+ *
+ * Usage: ringbench [ELEMENTS [PRODUCERS]]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include "notify.h"
+#include "histo.h"
+#include "ring.h"
+
+#define DEF_ELEMENTS 1000000
+#define DEF_PRODUCERS 4
+#define MAX_PRODUCERS 16
+#define CAPACITY 1024
+#define PACE_NS 2000
+#define PACED_DIVISOR 10
+
+typedef struct bench_elem benchElem_t;
+
+/* Sized like a work queue entry */
+struct bench_elem
+{
+	uint64_t stampNs;
+	unsigned producer;
+	unsigned seq;
+	char pad[48];
+};
+
+static ringPtr_t ring;
+static atomic_int go;
+static Bool multiProducer;
+static Bool paced;
+static unsigned long perProducer;
+static unsigned long fullCount[MAX_PRODUCERS];
+
+char *progName = "ringbench";
+int debugLvl = 0;
+
+/*
+ * Monotonic time in nanoseconds
+ */
+
+static uint64_t nowNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/*
+ * Producer thread
+ */
+
+static void *producer(void *arg)
+{
+	unsigned id = (unsigned) (long) arg;
+	benchElem_t e;
+	unsigned long i;
+	uint64_t next;
+
+	memset(&e, 0, sizeof(e));
+	e.producer = id;
+	while(!atomic_load_explicit(&go, memory_order_acquire))
+		sched_yield();
+	next = nowNs();
+	for(i = 0; i < perProducer; i++){
+		if(paced){
+			next += PACE_NS;
+			while(nowNs() < next)
+				sched_yield();
+		}
+		e.seq = (unsigned) i;
+		e.stampNs = nowNs();
+		while(!((multiProducer) ? ringPushMP(ring, &e) : ringPush(ring, &e))){
+			fullCount[id]++;
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Run one case and print the results
+ */
+
+static void run(unsigned producers, Bool mp, Bool pace, unsigned long elements)
+{
+	pthread_t threads[MAX_PRODUCERS];
+	static histo_t lat;
+	unsigned long received = 0, total, emptyCount = 0, full = 0;
+	uint64_t start, elapsed;
+	benchElem_t e;
+	unsigned i;
+	char name[16];
+
+	multiProducer = mp;
+	paced = pace;
+	perProducer = elements / producers;
+	total = perProducer * producers;
+	histoClear(&lat);
+	memset(fullCount, 0, sizeof(fullCount));
+	atomic_store(&go, 0);
+	if(!(ring = ringNew(sizeof(benchElem_t), CAPACITY)))
+		fatal("ringNew() failed");
+	for(i = 0; i < producers; i++){
+		if(pthread_create(&threads[i], NULL, producer, (void *) (long) i))
+			fatal("pthread_create() failed");
+	}
+
+	start = nowNs();
+	atomic_store_explicit(&go, 1, memory_order_release);
+	while(received < total){
+		if(!ringPop(ring, &e)){
+			emptyCount++;
+			sched_yield();
+			continue;
+		}
+		histoRecord(&lat, nowNs() - e.stampNs);
+		received++;
+	}
+	elapsed = nowNs() - start;
+
+	for(i = 0; i < producers; i++){
+		pthread_join(threads[i], NULL);
+		full += fullCount[i];
+	}
+	ringFree(ring);
+
+	snprintf(name, sizeof(name), "%s %u", (mp) ? "MP" : "SPSC", producers);
+	printf("%-7s %-8s: %6.2f M/s, latency p50 %7llu, p99 %8llu, p999 %8llu, max %9llu ns, full %lu, empty %lu\n",
+	name, (pace) ? "paced" : "flat out", (elapsed) ? total * 1000.0 / elapsed : 0.0,
+	(unsigned long long) histoPermille(&lat, 500), (unsigned long long) histoPermille(&lat, 990),
+	(unsigned long long) histoPermille(&lat, 999), (unsigned long long) lat.max, full, emptyCount);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long elements = DEF_ELEMENTS;
+	unsigned producers = DEF_PRODUCERS, n;
+	Bool pace;
+
+	if(argc > 1)
+		elements = strtoul(argv[1], NULL, 10);
+	if(argc > 2)
+		producers = strtoul(argv[2], NULL, 10);
+	if((!elements) || (!producers) || (producers > MAX_PRODUCERS))
+		fatal("Usage: %s [ELEMENTS [PRODUCERS]], up to %d producers", progName, MAX_PRODUCERS);
+
+	printf("Ring of %d %zu byte elements, %ld CPUs, paced producers push every %d ns\n",
+	CAPACITY, sizeof(benchElem_t), sysconf(_SC_NPROCESSORS_ONLN), PACE_NS);
+	for(pace = FALSE; pace <= TRUE; pace++){
+		/* Paced runs take PACE_NS per element, so they are shorter */
+		run(1, FALSE, pace, (pace) ? elements / PACED_DIVISOR : elements);
+		for(n = 1; n <= producers; n++)
+			run(n, TRUE, pace, (pace) ? elements / PACED_DIVISOR : elements);
+	}
+	return 0;
+}
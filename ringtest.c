@@ -0,0 +1,178 @@
+/*
+ * ringtest.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Ring stress test.
+ *
+ * First checks the single producer ring for order, full and empty. Then
+ * several producer threads push numbered elements with ringPushMP() into
+ * a small ring, so they fight over slots and the ring fills and wraps
+ * all the time, while the main thread pops. Every element must arrive
+ * exactly once, and each producer's elements must arrive in the order
+ * they were pushed.
+ *
+ * Usage: ringtest [ELEMENTS_PER_PRODUCER]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "ring.h"
+
+#define PRODUCERS 4
+#define CAPACITY 64
+#define DEF_ELEMENTS 250000
+
+typedef struct test_elem testElem_t;
+
+struct test_elem
+{
+	unsigned producer;
+	unsigned seq;
+	unsigned check;
+};
+
+static ringPtr_t ring;
+static unsigned long elements = DEF_ELEMENTS;
+static unsigned long fullCount[PRODUCERS];
+
+/*
+ * Report a failed check
+ */
+
+static int failed(const String what)
+{
+	fprintf(stderr, "ringtest: FAIL: %s\n", what);
+	return 1;
+}
+
+/*
+ * Producer thread. Retries when the ring is full.
+ */
+
+static void *producer(void *arg)
+{
+	unsigned id = (unsigned) (long) arg;
+	testElem_t e;
+	unsigned long i;
+
+	e.producer = id;
+	for(i = 0; i < elements; i++){
+		e.seq = (unsigned) i;
+		e.check = e.seq ^ (id * 0x9E3779B9U);
+		while(!ringPushMP(ring, &e)){
+			fullCount[id]++;
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Single producer order, full and empty
+ */
+
+static int testSingleProducer(void)
+{
+	ringPtr_t r;
+	unsigned i, v;
+	int errors = 0;
+
+	if(!(r = ringNew(sizeof(unsigned), 5)))
+		return failed("ringNew()");
+	if(ringCapacity(r) != 8)
+		errors += failed("Capacity was not rounded up to a power of two");
+	for(i = 0; i < 8; i++){
+		if(!ringPush(r, &i))
+			errors += failed("Push failed before the ring was full");
+	}
+	if(ringPush(r, &i))
+		errors += failed("Push succeeded on a full ring");
+	if(ringCount(r) != 8)
+		errors += failed("Count on a full ring");
+	for(i = 0; i < 8; i++){
+		if((!ringPop(r, &v)) || (v != i))
+			errors += failed("Elements out of order");
+	}
+	if(ringPop(r, &v))
+		errors += failed("Pop succeeded on an empty ring");
+	ringFree(r);
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t threads[PRODUCERS];
+	unsigned long next[PRODUCERS];
+	unsigned long received = 0, total, emptyCount = 0, full = 0;
+	testElem_t e;
+	unsigned i;
+	int errors = 0;
+
+	if(argc > 1)
+		elements = strtoul(argv[1], NULL, 10);
+	total = elements * PRODUCERS;
+
+	errors += testSingleProducer();
+
+	if(!(ring = ringNew(sizeof(testElem_t), CAPACITY)))
+		return failed("ringNew()");
+	memset(next, 0, sizeof(next));
+	for(i = 0; i < PRODUCERS; i++){
+		if(pthread_create(&threads[i], NULL, producer, (void *) (long) i))
+			return failed("pthread_create()");
+	}
+
+	while(received < total){
+		if(!ringPop(ring, &e)){
+			emptyCount++;
+			sched_yield();
+			continue;
+		}
+		received++;
+		if((e.producer >= PRODUCERS) || (e.check != (e.seq ^ (e.producer * 0x9E3779B9U)))){
+			errors += failed("Corrupt element");
+			break;
+		}
+		if(e.seq != next[e.producer]){
+			fprintf(stderr, "ringtest: producer %u element %u arrived, expected %lu\n", e.producer, e.seq, next[e.producer]);
+			errors += failed("Element lost, repeated or out of order");
+			break;
+		}
+		next[e.producer]++;
+	}
+	if(errors)
+		return 1; /* The producers may be stuck on a full ring */
+
+	for(i = 0; i < PRODUCERS; i++){
+		pthread_join(threads[i], NULL);
+		full += fullCount[i];
+	}
+	if(ringPop(ring, &e))
+		errors += failed("Extra element in the ring");
+
+	printf("%d producers, %lu elements through a ring of %u, ring full %lu times, empty %lu times\n",
+	PRODUCERS, received, ringCapacity(ring), full, emptyCount);
+	ringFree(ring);
+	if(!errors)
+		printf("ringtest: PASS\n");
+	return (errors) ? 1 : 0;
+}
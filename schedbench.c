@@ -0,0 +1,388 @@
+/*
+ * schedbench.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Benchmark the poll scheduler's walk over the service state.
+ *
+ * The services are set up in the order main() allocates them, each entry
+ * followed by its strings and a stand-in for the xPLLib service and message
+ * it creates, so the entries end up spread over the heap as they do in the
+ * daemon. A quarter of the services are not polled, the rest poll every
+ * 10, 30, 60 or 300 seconds. Three schedulers are run for the same number
+ * of one second ticks:
+ *
+ * list   - the tick scan over the linked list of service entries, with
+ *          the poll counters in the entries.
+ * arrays - the same tick scan over the packed hot arrays.
+ * heap   - the timer heap busRun() uses now, which only visits the
+ *          services that are due.
+ *
+ * A due poll reads the address and command from the service entry, as
+ * dispatchPollCommand() does, and the answer is checked against the last
+ * reading, kept in the entry for list and in the hot array otherwise.
+ *
+ * In the daemon the scheduler runs once a second, after other work has
+ * had the caches, so each tick is also run after evicting the caches.
+ * L1 data cache and last level cache misses are counted with
+ * perf_event_open() where the machine has hardware counters.
+ *
+ * Usage: schedbench [SERVICES [TICKS]]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "notify.h"
+#include "fixpt.h"
+#include "timerheap.h"
+
+#define DEF_SERVICES 10000
+#define DEF_TICKS 600
+#define XPL_STANDIN_SIZE 256
+#define EVICT_SIZE (64 * 1024 * 1024)
+
+#define MALLOC_ERROR	fatal("Out of memory in file %s, at line %d", __FILE__, __LINE__)
+
+typedef enum {SCHED_LIST = 0, SCHED_ARRAYS, SCHED_HEAP, SCHED_METHODS} schedMethod_t;
+typedef enum {MISS_L1D = 0, MISS_LLC, MISS_COUNTERS} missCounter_t;
+
+typedef struct service_entry serviceEntry_t;
+typedef serviceEntry_t * serviceEntryPtr_t;
+
+/* The service entry as it was before the hot state moved out of it */
+struct service_entry
+{
+	Bool is_sensor;
+	Bool precision_override;
+	int poll_last;
+	unsigned address;
+	unsigned polling_interval;
+	unsigned poll_counter;
+	unsigned service_id;
+	unsigned channel;
+	unsigned precision;
+	unsigned units;
+	char *units_keyword;
+	String sensor_type;
+	unsigned class_id;
+	unsigned type_id;
+	unsigned cmd;
+	fixpt_t poll_fx_last;
+	String instance_id;
+	String class;
+	String type;
+	void *xplService;
+	void *msg;
+	void *enc;
+	serviceEntryPtr_t prev;
+	serviceEntryPtr_t next;
+};
+
+/* The hot arrays */
+static unsigned *pollingInterval;
+static unsigned *pollCounter;
+static fixpt_t *pollFxLast;
+static serviceEntryPtr_t *entry;
+static serviceEntryPtr_t listHead;
+static timerHeapPtr_t polls;
+
+static unsigned services = DEF_SERVICES;
+static unsigned ticks = DEF_TICKS;
+static unsigned long long pollsDone;
+static unsigned long long sink;
+static char *evictBuf;
+static int missFd[MISS_COUNTERS] = {-1, -1};
+
+static const String methodNames[SCHED_METHODS] = {"list", "arrays", "heap"};
+static const unsigned intervals[] = {10, 30, 60, 300};
+
+char *progName = "schedbench";
+int debugLvl = 0;
+
+/*
+ * Monotonic time in nanoseconds
+ */
+
+static uint64_t nowNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/*
+ * Open a cache miss counter for this thread. Returns -1 if there isn't one
+ */
+
+static int openMissCounter(uint32_t type, uint64_t config)
+{
+	struct perf_event_attr attr;
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.exclude_hv = 1;
+	if((fd = (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC)) >= 0)
+		return fd;
+	/* Count in user space only if that is all the kernel allows */
+	attr.exclude_kernel = 1;
+	return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+/*
+ * Read the miss counters
+ */
+
+static void readMisses(uint64_t *values)
+{
+	unsigned i;
+
+	for(i = 0; i < MISS_COUNTERS; i++){
+		values[i] = 0;
+		if((missFd[i] >= 0) && (read(missFd[i], &values[i], sizeof(uint64_t)) != sizeof(uint64_t)))
+			values[i] = 0;
+	}
+}
+
+/*
+ * Push the service state out of the caches
+ */
+
+static void evictCaches(void)
+{
+	size_t i;
+
+	for(i = 0; i < EVICT_SIZE; i += 64)
+		evictBuf[i]++;
+}
+
+/*
+ * What dispatchPollCommand() reads from the service entry
+ */
+
+static void dispatchPoll(serviceEntryPtr_t sp)
+{
+	sink += sp->address + sp->cmd;
+	pollsDone++;
+}
+
+/*
+ * The change check made when the answer comes back. The reading changes every other poll
+ */
+
+static void checkReading(serviceEntryPtr_t sp, Bool hot)
+{
+	fixpt_t val = (pollsDone >> 1) & 0xFF;
+
+	if(hot){
+		if(pollFxLast[sp->service_id] != val)
+			pollFxLast[sp->service_id] = val;
+	}
+	else if(sp->poll_fx_last != val)
+		sp->poll_fx_last = val;
+}
+
+/*
+ * Set up the services in the order main() allocates them
+ */
+
+static void setupServices(void)
+{
+	serviceEntryPtr_t sp, tail = NULL;
+	void *standin;
+	char name[32];
+	unsigned i;
+
+	if(!(pollingInterval = calloc(services, sizeof(unsigned))) ||
+	!(pollCounter = calloc(services, sizeof(unsigned))) ||
+	!(pollFxLast = calloc(services, sizeof(fixpt_t))) ||
+	!(entry = calloc(services, sizeof(serviceEntryPtr_t))) ||
+	!(polls = timerheapNew(services)))
+		MALLOC_ERROR;
+
+	for(i = 0; i < services; i++){
+		if(!(sp = calloc(1, sizeof(serviceEntry_t))))
+			MALLOC_ERROR;
+		snprintf(name, sizeof(name), "inst%u", i);
+		if(!(sp->instance_id = strdup(name)) || !(sp->class = strdup("sensor")) || !(sp->type = strdup("request")))
+			MALLOC_ERROR;
+		/* Stand-ins for the xPLLib service and message */
+		if(!(standin = calloc(1, XPL_STANDIN_SIZE)) || !(sp->msg = calloc(1, XPL_STANDIN_SIZE)))
+			MALLOC_ERROR;
+		sp->xplService = standin;
+		sp->service_id = i;
+		sp->address = i % 255;
+		sp->cmd = 1 + (i % 8);
+		sp->is_sensor = TRUE;
+		if(i % 4)
+			sp->polling_interval = intervals[(i / 4) % 4];
+		pollingInterval[i] = sp->polling_interval;
+		entry[i] = sp;
+		if(!tail)
+			listHead = sp;
+		else{
+			tail->next = sp;
+			sp->prev = tail;
+		}
+		tail = sp;
+		/* First polls are a second after start up */
+		if(pollingInterval[i] && (!timerheapPush(polls, 1000, i)))
+			MALLOC_ERROR;
+	}
+}
+
+/*
+ * Run one scheduler tick at time now (ms)
+ */
+
+static void tick(schedMethod_t method, long long now)
+{
+	serviceEntryPtr_t sp;
+	const timerHeapEntry_t *next;
+	long long due, interval;
+	unsigned id;
+
+	switch(method){
+		case SCHED_LIST:
+			for(sp = listHead; sp; sp = sp->next){
+				if(sp->polling_interval){
+					if(!sp->poll_counter){
+						sp->poll_counter = sp->polling_interval;
+						dispatchPoll(sp);
+						checkReading(sp, FALSE);
+					}
+					else
+						sp->poll_counter--;
+				}
+			}
+			break;
+
+		case SCHED_ARRAYS:
+			for(id = 0; id < services; id++){
+				if(pollingInterval[id]){
+					if(!pollCounter[id]){
+						pollCounter[id] = pollingInterval[id];
+						dispatchPoll(entry[id]);
+						checkReading(entry[id], TRUE);
+					}
+					else
+						pollCounter[id]--;
+				}
+			}
+			break;
+
+		case SCHED_HEAP:
+			while((next = timerheapTop(polls)) && (next->due <= now)){
+				interval = pollingInterval[next->id] * 1000LL;
+				if((due = next->due + interval) <= now)
+					due = now + interval;
+				dispatchPoll(entry[next->id]);
+				checkReading(entry[next->id], TRUE);
+				timerheapReschedule(polls, due);
+			}
+			break;
+
+		default:
+			break;
+	}
+}
+
+/*
+ * Run a scheduler for all the ticks and print the results
+ */
+
+static void run(schedMethod_t method, Bool cold)
+{
+	uint64_t before[MISS_COUNTERS], after[MISS_COUNTERS], misses[MISS_COUNTERS] = {0, 0};
+	uint64_t start, ns = 0;
+	unsigned long long startPolls = pollsDone;
+	unsigned t, i;
+
+	for(t = 1; t <= ticks; t++){
+		if(cold)
+			evictCaches();
+		readMisses(before);
+		start = nowNs();
+		tick(method, t * 1000LL);
+		ns += nowNs() - start;
+		readMisses(after);
+		for(i = 0; i < MISS_COUNTERS; i++)
+			misses[i] += after[i] - before[i];
+	}
+	printf("%-6s %-4s %9.1f us per tick, %7llu polls", methodNames[method], (cold) ? "cold" : "warm",
+		ns / 1000.0 / ticks, pollsDone - startPolls);
+	if(missFd[MISS_L1D] >= 0)
+		printf(", %8.1f L1D misses per tick", (double) misses[MISS_L1D] / ticks);
+	if(missFd[MISS_LLC] >= 0)
+		printf(", %8.1f LLC misses per tick", (double) misses[MISS_LLC] / ticks);
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	schedMethod_t method;
+	unsigned id;
+
+	if(argc > 1)
+		services = strtoul(argv[1], NULL, 10);
+	if(argc > 2)
+		ticks = strtoul(argv[2], NULL, 10);
+	if(!services || !ticks)
+		fatal("Usage: %s [SERVICES [TICKS]]", progName);
+
+	if(!(evictBuf = calloc(1, EVICT_SIZE)))
+		MALLOC_ERROR;
+	setupServices();
+
+	missFd[MISS_L1D] = openMissCounter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+	missFd[MISS_LLC] = openMissCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	printf("%u services, %u ticks, %zu byte service entries", services, ticks, sizeof(serviceEntry_t));
+	if((missFd[MISS_L1D] < 0) && (missFd[MISS_LLC] < 0))
+		printf(", no hardware cache counters");
+	printf("\n");
+
+	for(method = SCHED_LIST; method < SCHED_METHODS; method++){
+		run(method, FALSE);
+		/* Start the cold run from the same state */
+		for(id = 0; id < services; id++)
+			entry[id]->poll_counter = pollCounter[id] = 0;
+		if(method == SCHED_HEAP){
+			timerheapFree(polls);
+			if(!(polls = timerheapNew(services)))
+				MALLOC_ERROR;
+			for(id = 0; id < services; id++){
+				if(pollingInterval[id] && (!timerheapPush(polls, 1000, id)))
+					MALLOC_ERROR;
+			}
+		}
+		run(method, TRUE);
+	}
+	if(!sink)
+		printf("\n");
+	return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * sendbench.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Benchmark the heap allocations and CPU time of sending a sensor.basic
+ * message, with the message built for every reading as it used to be,
+ * and with a message built once per service and reused.
+ *
+ * xPLLib per reading:  xPL_createBroadcastMessage(), xPL_setSchema(),
+ *                      four xPL_setMessageNamedValue(), xPL_sendMessage()
+ *                      and xPL_releaseMessage(), as the handlers did.
+ * xPLLib prebuilt:     xPL_setMessageType(), one xPL_setMessageNamedValue()
+ *                      and xPL_sendMessage(), as deliverServiceMessage() does.
+ * native per reading:  xplencCreate(), xplencSendFixed() and xplencFree().
+ * native prebuilt:     xplencSendFixed(), as deliverServiceMessage() does.
+ *
+ * The native encoder's datagrams are handed to a send handler which
+ * throws them away, so its figures leave out the sendto() which every
+ * method makes. xPLLib sends its datagrams, so its figures include it.
+ * The value is formatted with fmtnumFixed() in every case.
+ *
+ * CPU time is the thread's CPU time. Allocations are counted with
+ * alloccount.c, including any made inside xPLLib and the C library.
+ *
+ * Usage: sendbench [MESSAGES]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <xPL.h>
+#include "notify.h"
+#include "fmtnum.h"
+#include "xplenc.h"
+#include "alloccount.h"
+
+#define DEF_MESSAGES 200000
+#define WARMUP 1000
+
+char *progName = "sendbench";
+int debugLvl = 0;
+
+typedef void (*sendMethod_t)(unsigned long i);
+
+static xPL_ServicePtr service;
+static xPL_MessagePtr prebuilt;
+static xplencTemplatePtr_t template;
+static uint64_t dropped;
+
+/*
+ * Thread CPU time in nanoseconds
+ */
+
+static uint64_t cpuNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/*
+ * Native encoder send handler. Throws the datagram away.
+ */
+
+static Bool dropDatagram(int fd, const char *data, unsigned len, const struct sockaddr *addr, socklen_t addrLen, void *ctx)
+{
+	dropped++;
+	return TRUE;
+}
+
+/*
+ * Reading i, in hundredths of a degree
+ */
+
+static fixpt_t reading(unsigned long i)
+{
+	return (fixpt_t) ((i * 37) % 6000) - 1000;
+}
+
+static void xplPerReading(unsigned long i)
+{
+	xPL_MessagePtr msg;
+	char ws[FMTNUM_SIZE];
+
+	if(!(msg = xPL_createBroadcastMessage(service, (i & 1) ? xPL_MESSAGE_TRIGGER : xPL_MESSAGE_STATUS)))
+		fatal("Could not create message");
+	xPL_setSchema(msg, "sensor", "basic");
+	xPL_setMessageNamedValue(msg, "device", "0");
+	xPL_setMessageNamedValue(msg, "type", "temp");
+	fmtnumFixed(ws, sizeof(ws), reading(i), 2);
+	xPL_setMessageNamedValue(msg, "current", ws);
+	xPL_setMessageNamedValue(msg, "units", "celsius");
+	xPL_sendMessage(msg);
+	xPL_releaseMessage(msg);
+}
+
+static void xplPrebuilt(unsigned long i)
+{
+	char ws[FMTNUM_SIZE];
+
+	fmtnumFixed(ws, sizeof(ws), reading(i), 2);
+	xPL_setMessageType(prebuilt, (i & 1) ? xPL_MESSAGE_TRIGGER : xPL_MESSAGE_STATUS);
+	xPL_setMessageNamedValue(prebuilt, "current", ws);
+	xPL_sendMessage(prebuilt);
+}
+
+static void nativePerReading(unsigned long i)
+{
+	xplencTemplatePtr_t t;
+
+	if(!(t = xplencCreate("hwstar-xplhan.bench", "sensor", "basic", "0", "temp", "celsius")))
+		fatal("xplencCreate()");
+	xplencSendFixed(t, (i & 1) ? XPLENC_TRIG : XPLENC_STAT, NULL, reading(i), 2);
+	xplencFree(t);
+}
+
+static void nativePrebuilt(unsigned long i)
+{
+	xplencSendFixed(template, (i & 1) ? XPLENC_TRIG : XPLENC_STAT, NULL, reading(i), 2);
+}
+
+/*
+ * Time one method, and print its allocations and CPU time per message
+ */
+
+static void runMethod(const String name, sendMethod_t method, unsigned long messages)
+{
+	unsigned long i, allocs;
+	uint64_t start, ns;
+
+	for(i = 0; i < WARMUP; i++)
+		(*method)(i);
+	alloccountStart();
+	start = cpuNs();
+	for(i = 0; i < messages; i++)
+		(*method)(i);
+	ns = cpuNs() - start;
+	allocs = alloccountStop();
+	printf("%-20s: %6.2f allocations, %7.1f ns CPU per message\n", name, (double) allocs / messages, (double) ns / messages);
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long messages = DEF_MESSAGES;
+
+	if(argc > 1)
+		messages = strtoul(argv[1], NULL, 10);
+	if(!messages)
+		messages = 1;
+
+	if(!xPL_initialize(xcStandAlone))
+		printf("xPLLib: could not initialize, not run\n");
+	else{
+		if(!(service = xPL_createService("hwstar", "xplhan", "bench")))
+			fatal("xPL_createService()");
+		xPL_setServiceEnabled(service, TRUE);
+		if(!(prebuilt = xPL_createBroadcastMessage(service, xPL_MESSAGE_STATUS)))
+			fatal("xPL_createBroadcastMessage()");
+		xPL_setSchema(prebuilt, "sensor", "basic");
+		xPL_setMessageNamedValue(prebuilt, "device", "0");
+		xPL_setMessageNamedValue(prebuilt, "type", "temp");
+		xPL_setMessageNamedValue(prebuilt, "current", "");
+		xPL_setMessageNamedValue(prebuilt, "units", "celsius");
+		runMethod("xPLLib per reading", xplPerReading, messages);
+		runMethod("xPLLib prebuilt", xplPrebuilt, messages);
+		xPL_releaseMessage(prebuilt);
+		xPL_shutdown();
+	}
+
+	if(!xplencInit(NULL))
+		fatal("xplencInit()");
+	xplencSetSendHandler(dropDatagram, NULL);
+	if(!(template = xplencCreate("hwstar-xplhan.bench", "sensor", "basic", "0", "temp", "celsius")))
+		fatal("xplencCreate()");
+	runMethod("native per reading", nativePerReading, messages);
+	runMethod("native prebuilt", nativePrebuilt, messages);
+	if(dropped != 2 * (messages + WARMUP))
+		fatal("Only %llu of the native datagrams reached the send handler", (unsigned long long) dropped);
+	xplencFree(template);
+	xplencShutdown();
+	return 0;
+}
@@ -0,0 +1,137 @@
+/*
+ * timerheap.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Binary min heap of deadlines, each tagged with an id.
+ *
+ * The earliest deadline is always at the top, so finding the next thing
+ * to wake up for is O(1), and moving the top entry to its next deadline
+ * is O(log n). The heap has a fixed size set when it is created, since
+ * the polled services are all known at startup.
+ *
+ */
+
+#include <stdlib.h>
+#include "timerheap.h"
+
+/*
+ * Move an entry up until its parent is earlier
+ */
+
+static void siftUp(timerHeapPtr_t th, unsigned i)
+{
+	timerHeapEntry_t e = th->entries[i];
+	unsigned parent;
+
+	while(i){
+		parent = (i - 1) >> 1;
+		if(th->entries[parent].due <= e.due)
+			break;
+		th->entries[i] = th->entries[parent];
+		i = parent;
+	}
+	th->entries[i] = e;
+}
+
+/*
+ * Move an entry down until both its children are later
+ */
+
+static void siftDown(timerHeapPtr_t th, unsigned i)
+{
+	timerHeapEntry_t e = th->entries[i];
+	unsigned child;
+
+	for(;;){
+		child = (i << 1) + 1;
+		if(child >= th->count)
+			break;
+		if((child + 1 < th->count) && (th->entries[child + 1].due < th->entries[child].due))
+			child++;
+		if(e.due <= th->entries[child].due)
+			break;
+		th->entries[i] = th->entries[child];
+		i = child;
+	}
+	th->entries[i] = e;
+}
+
+/*
+ * Create a heap which can hold size entries
+ */
+
+timerHeapPtr_t timerheapNew(unsigned size)
+{
+	timerHeapPtr_t th;
+
+	if(!(th = calloc(1, sizeof(timerHeap_t))))
+		return NULL;
+	if((size) && (!(th->entries = calloc(size, sizeof(timerHeapEntry_t))))){
+		free(th);
+		return NULL;
+	}
+	th->size = size;
+	return th;
+}
+
+/*
+ * Free a heap
+ */
+
+void timerheapFree(timerHeapPtr_t th)
+{
+	if(th){
+		free(th->entries);
+		free(th);
+	}
+}
+
+/*
+ * Add a deadline, returns FALSE if the heap is full
+ */
+
+Bool timerheapPush(timerHeapPtr_t th, long long due, unsigned id)
+{
+	if(th->count >= th->size)
+		return FALSE;
+	th->entries[th->count].due = due;
+	th->entries[th->count].id = id;
+	siftUp(th, th->count++);
+	return TRUE;
+}
+
+/*
+ * Return the earliest deadline, or NULL if the heap is empty
+ */
+
+const timerHeapEntry_t *timerheapTop(timerHeapPtr_t th)
+{
+	return (th->count) ? &th->entries[0] : NULL;
+}
+
+/*
+ * Give the earliest entry a new deadline
+ */
+
+void timerheapReschedule(timerHeapPtr_t th, long long due)
+{
+	if(!th->count)
+		return;
+	th->entries[0].due = due;
+	siftDown(th, 0);
+}
@@ -0,0 +1,39 @@
+/*
+ * timerheap.h
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * Binary min heap of deadlines
+ */
+
+#ifndef TIMERHEAP_H
+#define TIMERHEAP_H
+
+#include "types.h"
+
+typedef struct timerheap_entry timerHeapEntry_t;
+typedef struct timerheap timerHeap_t;
+typedef timerHeap_t * timerHeapPtr_t;
+
+struct timerheap_entry
+{
+	long long due;
+	unsigned id;
+};
+
+struct timerheap
+{
+	unsigned count;
+	unsigned size;
+	timerHeapEntry_t *entries;
+};
+
+/* Prototypes */
+
+timerHeapPtr_t timerheapNew(unsigned size);
+void timerheapFree(timerHeapPtr_t th);
+Bool timerheapPush(timerHeapPtr_t th, long long due, unsigned id);
+const timerHeapEntry_t *timerheapTop(timerHeapPtr_t th);
+void timerheapReschedule(timerHeapPtr_t th, long long due);
+
+#endif
@@ -0,0 +1,108 @@
+/*
+ * trace.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Transaction tracing.
+ *
+ * Spans are written to a file as Chrome trace events, which load in
+ * chrome://tracing and Perfetto. Each span is an async begin and end pair
+ * with the transaction ID as its id, so all the spans of one transaction
+ * are shown together on their own track, whichever thread they ran on.
+ * Timestamps are CLOCK_MONOTONIC microseconds, the same clock as the
+ * latency histograms.
+ *
+ * Tracing is opt in. Spans are written under a mutex, as the HAN threads
+ * and the xPL thread both add them, and the file is buffered by stdio.
+ *
+ */
+
+#define _GNU_SOURCE /* gettid() */
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+Bool traceEnabled = FALSE;
+
+static FILE *traceFile = NULL;
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t nextId = 0;
+static pid_t tracePid;
+static __thread pid_t traceTid = 0;
+
+/*
+ * Open a trace file, and turn tracing on
+ */
+
+Bool traceOpen(const String path)
+{
+	if(!(traceFile = fopen(path, "w")))
+		return FALSE;
+	tracePid = getpid();
+	fprintf(traceFile, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	traceEnabled = TRUE;
+	return TRUE;
+}
+
+/*
+ * Turn tracing off, and finish the trace file
+ */
+
+void traceClose(void)
+{
+	if(!traceFile)
+		return;
+	pthread_mutex_lock(&traceLock);
+	traceEnabled = FALSE;
+	fprintf(traceFile, "{}]}\n");
+	fclose(traceFile);
+	traceFile = NULL;
+	pthread_mutex_unlock(&traceLock);
+}
+
+/*
+ * Return a new transaction ID. IDs start at 1, 0 means not traced.
+ */
+
+uint32_t traceNewId(void)
+{
+	uint32_t id;
+	
+	while(!(id = __atomic_add_fetch(&nextId, 1, __ATOMIC_RELAXED)))
+		;
+	return id;
+}
+
+/*
+ * Add a span of a transaction
+ */
+
+void traceSpan(uint32_t id, const String name, uint64_t startUs, uint64_t endUs, const String service)
+{
+	if(!traceTid)
+		traceTid = syscall(SYS_gettid);
+	pthread_mutex_lock(&traceLock);
+	if(traceFile){
+		fprintf(traceFile, "{\"name\":\"%s\",\"cat\":\"xplhan\",\"ph\":\"b\",\"id\":%u,\"pid\":%d,\"tid\":%d,\"ts\":%llu,"
+		"\"args\":{\"service\":\"%s\"}},\n", name, id, (int) tracePid, (int) traceTid, (unsigned long long) startUs, service);
+		fprintf(traceFile, "{\"name\":\"%s\",\"cat\":\"xplhan\",\"ph\":\"e\",\"id\":%u,\"pid\":%d,\"tid\":%d,\"ts\":%llu},\n",
+		name, id, (int) tracePid, (int) traceTid, (unsigned long long) endUs);
+	}
+	pthread_mutex_unlock(&traceLock);
+}
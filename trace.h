@@ -0,0 +1,24 @@
+/*
+ * trace.h
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * Transaction spans in Chrome trace event format
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "types.h"
+
+/* Set when a trace file is open. Check it before doing any tracing work */
+extern Bool traceEnabled;
+
+/* Prototypes */
+
+Bool traceOpen(const String path);
+void traceClose(void);
+uint32_t traceNewId(void);
+void traceSpan(uint32_t id, const String name, uint64_t startUs, uint64_t endUs, const String service);
+
+#endif
@@ -0,0 +1,512 @@
+/*
+ * uring.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * io_uring backend for the HAN streams.
+ *
+ * Each HAN socket has one multishot receive outstanding, which completes
+ * once for every chunk of data which arrives, into buffers picked by the
+ * kernel from a provided buffer ring. Buffers go back on the ring as soon
+ * as the receive handler returns. Sends are copied into slots from a fixed
+ * pool and are prepared but not submitted; uringFlush() submits everything
+ * prepared since the last flush with one io_uring_enter(), and is meant to
+ * run once per event loop iteration. Completions are signalled on an
+ * eventfd, which is watched by the reactor like any other fd.
+ *
+ * Outbound xPL datagrams can be queued the same way with uringSendTo(),
+ * as sendmsg operations, so they go out in the same io_uring_enter() as
+ * the HAN commands. Inbound xPL stays with xPLLib, which owns the receive
+ * socket and reads and parses each datagram itself.
+ *
+ * One instance is used by one thread.
+ *
+ * Without liburing (HAVE_LIBURING not defined), uringNew() fails with
+ * ENOSYS and the socket backend has to be used.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "notify.h"
+#include "uring.h"
+
+#ifdef HAVE_LIBURING
+
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <liburing.h>
+#include "pool.h"
+
+#define URING_BUF_GROUP 0
+#define URING_BUF_COUNT 64
+#define URING_BUF_SIZE 256
+#define URING_SEND_SIZE 48
+#define URING_DGRAM_SIZE 512
+
+typedef enum {UO_STREAM = 0, UO_SEND, UO_DGRAM, UO_CANCEL} uringOpKind_t;
+
+typedef struct uring_stream uringStream_t;
+typedef uringStream_t * uringStreamPtr_t;
+
+typedef struct uring_send uringSend_t;
+typedef uringSend_t * uringSendPtr_t;
+
+typedef struct uring_dgram uringDgram_t;
+typedef uringDgram_t * uringDgramPtr_t;
+
+/* The kind is first, so a completion's user data can be told apart */
+
+struct uring_stream
+{
+	uringOpKind_t kind;
+	Bool armed;
+	Bool dead;
+	int fd;
+	uringRecvHandler_t handler;
+	void *ctx;
+	uringStreamPtr_t next;
+};
+
+struct uring_send
+{
+	uringOpKind_t kind;
+	int fd;
+	unsigned len;
+	char data[URING_SEND_SIZE];
+};
+
+struct uring_dgram
+{
+	uringOpKind_t kind;
+	int fd;
+	unsigned len;
+	struct msghdr msg;
+	struct iovec iov;
+	struct sockaddr_storage addr;
+	char data[URING_DGRAM_SIZE];
+};
+
+struct uring
+{
+	struct io_uring ring;
+	struct io_uring_buf_ring *bufRing;
+	char *bufs;
+	int eventFd;
+	unsigned prepared;
+	poolPtr_t sendPool;
+	poolPtr_t dgramPool;
+	uringStreamPtr_t streams;
+	uringStats_t stats;
+};
+
+static uringOpKind_t cancelOp = UO_CANCEL;
+
+/*
+ * Get a submission queue entry, submitting what is prepared if the queue is full
+ */
+
+static struct io_uring_sqe *getSqe(uringPtr_t u)
+{
+	struct io_uring_sqe *sqe;
+
+	if(!(sqe = io_uring_get_sqe(&u->ring))){
+		uringFlush(u);
+		if(!(sqe = io_uring_get_sqe(&u->ring)))
+			fatal("getSqe(): io_uring submission queue full");
+	}
+	u->prepared++;
+	return sqe;
+}
+
+/*
+ * Hand a receive buffer back to the kernel
+ */
+
+static void recycleBuffer(uringPtr_t u, unsigned bid)
+{
+	io_uring_buf_ring_add(u->bufRing, u->bufs + (bid * URING_BUF_SIZE), URING_BUF_SIZE, bid,
+	io_uring_buf_ring_mask(URING_BUF_COUNT), 0);
+	io_uring_buf_ring_advance(u->bufRing, 1);
+}
+
+/*
+ * Start a multishot receive on a stream
+ */
+
+static void armStream(uringPtr_t u, uringStreamPtr_t s)
+{
+	struct io_uring_sqe *sqe = getSqe(u);
+
+	io_uring_prep_recv_multishot(sqe, s->fd, NULL, 0, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUF_GROUP;
+	io_uring_sqe_set_data(sqe, s);
+	s->armed = TRUE;
+}
+
+/*
+ * Free the streams which were removed and have no receive outstanding
+ */
+
+static void reapStreams(uringPtr_t u)
+{
+	uringStreamPtr_t *sp, s;
+
+	for(sp = &u->streams; (s = *sp);){
+		if((s->dead) && (!s->armed)){
+			*sp = s->next;
+			free(s);
+		}
+		else
+			sp = &s->next;
+	}
+}
+
+/*
+ * Handle a receive completion.
+ * Data is passed to the handler. When the multishot receive ends it is
+ * re-armed, unless the stream was at EOF, failed, or was removed.
+ */
+
+static void streamCompletion(uringPtr_t u, uringStreamPtr_t s, int res, unsigned flags)
+{
+	if(!(flags & IORING_CQE_F_MORE))
+		s->armed = FALSE;
+
+	if(flags & IORING_CQE_F_BUFFER){
+		if((!s->dead) && (res > 0)){
+			u->stats.recvs++;
+			(*s->handler)(s->fd, u->bufs + ((flags >> IORING_CQE_BUFFER_SHIFT) * URING_BUF_SIZE), res, s->ctx);
+		}
+		recycleBuffer(u, flags >> IORING_CQE_BUFFER_SHIFT);
+	}
+	else if((!s->armed) && (!s->dead) && (res != -ENOBUFS)){
+		(*s->handler)(s->fd, NULL, res, s->ctx); /* EOF or error */
+		return;
+	}
+
+	if((!s->armed) && (!s->dead)){
+		armStream(u, s);
+		u->stats.rearms++;
+	}
+}
+
+/*
+ * Create an instance with a submission queue of entries
+ */
+
+uringPtr_t uringNew(unsigned entries)
+{
+	uringPtr_t u;
+	unsigned i;
+	int err;
+
+	if(!(u = calloc(1, sizeof(uring_t))))
+		return NULL;
+	u->eventFd = -1;
+	if((err = io_uring_queue_init(entries, &u->ring, 0)) < 0){
+		free(u);
+		errno = -err;
+		return NULL;
+	}
+	if(!(u->bufRing = io_uring_setup_buf_ring(&u->ring, URING_BUF_COUNT, URING_BUF_GROUP, 0, &err))){
+		io_uring_queue_exit(&u->ring);
+		free(u);
+		errno = -err;
+		return NULL;
+	}
+	err = 0;
+	if((!(u->bufs = malloc(URING_BUF_COUNT * URING_BUF_SIZE))) ||
+	(!(u->sendPool = poolNew(sizeof(uringSend_t), entries))) ||
+	(!(u->dgramPool = poolNew(sizeof(uringDgram_t), entries))) ||
+	((u->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) ||
+	((err = io_uring_register_eventfd(&u->ring, u->eventFd)) < 0)){
+		if(err < 0)
+			errno = -err;
+		err = errno;
+		uringFree(u);
+		errno = err;
+		return NULL;
+	}
+	for(i = 0; i < URING_BUF_COUNT; i++)
+		io_uring_buf_ring_add(u->bufRing, u->bufs + (i * URING_BUF_SIZE), URING_BUF_SIZE, i,
+		io_uring_buf_ring_mask(URING_BUF_COUNT), i);
+	io_uring_buf_ring_advance(u->bufRing, URING_BUF_COUNT);
+	return u;
+}
+
+/*
+ * Free an instance
+ */
+
+void uringFree(uringPtr_t u)
+{
+	uringStreamPtr_t s;
+
+	if(!u)
+		return;
+	while((s = u->streams)){
+		u->streams = s->next;
+		free(s);
+	}
+	io_uring_free_buf_ring(&u->ring, u->bufRing, URING_BUF_COUNT, URING_BUF_GROUP);
+	io_uring_queue_exit(&u->ring);
+	if(u->eventFd >= 0)
+		close(u->eventFd);
+	poolFree(u->sendPool);
+	poolFree(u->dgramPool);
+	free(u->bufs);
+	free(u);
+}
+
+/*
+ * Return the fd which becomes readable when there are completions
+ */
+
+int uringGetFD(uringPtr_t u)
+{
+	return u->eventFd;
+}
+
+/*
+ * Start receiving on a connected stream socket
+ */
+
+Bool uringAddStream(uringPtr_t u, int fd, uringRecvHandler_t handler, void *ctx)
+{
+	uringStreamPtr_t s;
+
+	reapStreams(u);
+	if(!(s = calloc(1, sizeof(uringStream_t))))
+		return FALSE;
+	s->kind = UO_STREAM;
+	s->fd = fd;
+	s->handler = handler;
+	s->ctx = ctx;
+	s->next = u->streams;
+	u->streams = s;
+	armStream(u, s);
+	return TRUE;
+}
+
+/*
+ * Stop receiving on a stream.
+ * The handler is not called again for it. The caller may close the fd
+ * straight away, the kernel keeps the socket until the receive is cancelled.
+ */
+
+void uringRemoveStream(uringPtr_t u, int fd)
+{
+	struct io_uring_sqe *sqe;
+	uringStreamPtr_t s;
+
+	for(s = u->streams; s; s = s->next){
+		if((s->fd == fd) && (!s->dead))
+			break;
+	}
+	if(!s)
+		return;
+	s->dead = TRUE;
+	if(s->armed){
+		sqe = getSqe(u);
+		io_uring_prep_cancel(sqe, s, 0);
+		io_uring_sqe_set_data(sqe, &cancelOp);
+	}
+}
+
+/*
+ * Queue data to be sent on a stream at the next flush.
+ * Returns FALSE if the data is too long or there are no free send slots.
+ */
+
+Bool uringSend(uringPtr_t u, int fd, const char *data, unsigned len)
+{
+	struct io_uring_sqe *sqe;
+	uringSendPtr_t snd;
+
+	if((len > URING_SEND_SIZE) || (!(snd = poolGet(u->sendPool))))
+		return FALSE;
+	snd->kind = UO_SEND;
+	snd->fd = fd;
+	snd->len = len;
+	memcpy(snd->data, data, len);
+	sqe = getSqe(u);
+	io_uring_prep_send(sqe, fd, snd->data, len, MSG_NOSIGNAL);
+	io_uring_sqe_set_data(sqe, snd);
+	u->stats.sends++;
+	return TRUE;
+}
+
+/*
+ * Queue a datagram to be sent to addr at the next flush.
+ * Returns FALSE if the datagram or address is too long, or there are no free slots.
+ */
+
+Bool uringSendTo(uringPtr_t u, int fd, const char *data, unsigned len, const struct sockaddr *addr, socklen_t addrLen)
+{
+	struct io_uring_sqe *sqe;
+	uringDgramPtr_t dg;
+
+	if((len > URING_DGRAM_SIZE) || (addrLen > sizeof(struct sockaddr_storage)) || (!(dg = poolGet(u->dgramPool))))
+		return FALSE;
+	dg->kind = UO_DGRAM;
+	dg->fd = fd;
+	dg->len = len;
+	memcpy(dg->data, data, len);
+	memcpy(&dg->addr, addr, addrLen);
+	dg->iov.iov_base = dg->data;
+	dg->iov.iov_len = len;
+	dg->msg.msg_name = &dg->addr;
+	dg->msg.msg_namelen = addrLen;
+	dg->msg.msg_iov = &dg->iov;
+	dg->msg.msg_iovlen = 1;
+	sqe = getSqe(u);
+	io_uring_prep_sendmsg(sqe, fd, &dg->msg, 0);
+	io_uring_sqe_set_data(sqe, dg);
+	u->stats.datagrams++;
+	return TRUE;
+}
+
+/*
+ * Submit everything prepared since the last flush
+ */
+
+void uringFlush(uringPtr_t u)
+{
+	int res;
+
+	if(!u->prepared)
+		return;
+	if((res = io_uring_submit(&u->ring)) < 0)
+		debug(DEBUG_UNEXPECTED, "uringFlush(): io_uring_submit failed: %s", strerror(-res));
+	u->stats.submits++;
+	u->prepared = 0;
+}
+
+/*
+ * Process the completions. Call when the eventfd is readable.
+ */
+
+void uringProcess(uringPtr_t u)
+{
+	struct io_uring_cqe *cqe;
+	uringOpKind_t *op;
+	uringSendPtr_t snd;
+	uringDgramPtr_t dg;
+	uint64_t count;
+	unsigned flags;
+	int res;
+
+	if((read(u->eventFd, &count, sizeof(count)) < 0) && (errno != EAGAIN))
+		debug(DEBUG_UNEXPECTED, "uringProcess(): read from eventfd failed: %s", strerror(errno));
+
+	while(!io_uring_peek_cqe(&u->ring, &cqe)){
+		op = io_uring_cqe_get_data(cqe);
+		res = cqe->res;
+		flags = cqe->flags;
+		io_uring_cqe_seen(&u->ring, cqe);
+		u->stats.completions++;
+		switch(*op){
+			case UO_STREAM:
+				streamCompletion(u, (uringStreamPtr_t) op, res, flags);
+				break;
+
+			case UO_SEND:
+				snd = (uringSendPtr_t) op;
+				if(res < 0)
+					debug(DEBUG_UNEXPECTED, "Send on fd %d failed: %s", snd->fd, strerror(-res));
+				else if((unsigned) res != snd->len)
+					debug(DEBUG_UNEXPECTED, "Short send on fd %d, %d of %u bytes", snd->fd, res, snd->len);
+				poolPut(u->sendPool, snd);
+				break;
+
+			case UO_DGRAM:
+				dg = (uringDgramPtr_t) op;
+				if(res < 0)
+					debug(DEBUG_UNEXPECTED, "Datagram send on fd %d failed: %s", dg->fd, strerror(-res));
+				poolPut(u->dgramPool, dg);
+				break;
+
+			case UO_CANCEL:
+				break;
+		}
+	}
+	reapStreams(u);
+}
+
+/*
+ * Return the statistics
+ */
+
+const uringStats_t *uringGetStats(uringPtr_t u)
+{
+	return &u->stats;
+}
+
+#else /* HAVE_LIBURING */
+
+uringPtr_t uringNew(unsigned entries)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+void uringFree(uringPtr_t u)
+{
+}
+
+int uringGetFD(uringPtr_t u)
+{
+	return -1;
+}
+
+Bool uringAddStream(uringPtr_t u, int fd, uringRecvHandler_t handler, void *ctx)
+{
+	return FALSE;
+}
+
+void uringRemoveStream(uringPtr_t u, int fd)
+{
+}
+
+Bool uringSend(uringPtr_t u, int fd, const char *data, unsigned len)
+{
+	return FALSE;
+}
+
+Bool uringSendTo(uringPtr_t u, int fd, const char *data, unsigned len, const struct sockaddr *addr, socklen_t addrLen)
+{
+	return FALSE;
+}
+
+void uringFlush(uringPtr_t u)
+{
+}
+
+void uringProcess(uringPtr_t u)
+{
+}
+
+const uringStats_t *uringGetStats(uringPtr_t u)
+{
+	return NULL;
+}
+
+#endif /* HAVE_LIBURING */
@@ -0,0 +1,45 @@
+/*
+ * uring.h
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * io_uring I/O backend for the HAN streams and outbound xPL datagrams
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <sys/socket.h>
+#include "types.h"
+
+typedef struct uring uring_t;
+typedef uring_t * uringPtr_t;
+typedef struct uring_stats uringStats_t;
+
+/* Receive handler. len is the number of bytes received, 0 on EOF, or -errno on an error */
+typedef void (*uringRecvHandler_t)(int fd, const char *data, int len, void *ctx);
+
+struct uring_stats
+{
+	uint64_t submits;
+	uint64_t completions;
+	uint64_t recvs;
+	uint64_t sends;
+	uint64_t datagrams;
+	uint64_t rearms;
+};
+
+/* Prototypes */
+
+uringPtr_t uringNew(unsigned entries);
+void uringFree(uringPtr_t u);
+int uringGetFD(uringPtr_t u);
+Bool uringAddStream(uringPtr_t u, int fd, uringRecvHandler_t handler, void *ctx);
+void uringRemoveStream(uringPtr_t u, int fd);
+Bool uringSend(uringPtr_t u, int fd, const char *data, unsigned len);
+Bool uringSendTo(uringPtr_t u, int fd, const char *data, unsigned len, const struct sockaddr *addr, socklen_t addrLen);
+void uringFlush(uringPtr_t u);
+void uringProcess(uringPtr_t u);
+const uringStats_t *uringGetStats(uringPtr_t u);
+
+#endif
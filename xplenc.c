@@ -0,0 +1,400 @@
+/*
+ * xplenc.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Native xPL encoder.
+ *
+ * xPLLib rebuilds the text of a message every time it is sent. For the
+ * sensor messages we send on every reading, nearly all of that text is
+ * constant, so each service gets a template with the header and the
+ * fixed part of the body rendered once at startup. Sending a reading
+ * then patches the message type, copies in the device and current value
+ * and the fixed trailer, and hands the datagram to sendto(). A numeric
+ * current value is formatted straight into the datagram. No heap memory
+ * is touched per message.
+ *
+ * With batching on, messages are rendered into slots of a fixed batch
+ * instead, and xplencFlush() sends the whole batch with one sendmmsg().
+ * The caller flushes once per event loop iteration, so a poll storm or a
+ * burst of cached answers costs one system call. A full batch is flushed
+ * straight away. The batch is not locked, so only one thread may send.
+ *
+ * A send handler can be set to take the datagrams instead, so that they
+ * go out through the main loop's io_uring. Anything it can't take is sent
+ * by the encoder as usual.
+ *
+ * xPLLib is still used for everything else (hub discovery, heartbeats,
+ * and incoming messages).
+ *
+ */
+
+#define _GNU_SOURCE /* sendmmsg() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#include "notify.h"
+#include "fmtnum.h"
+#include "xplenc.h"
+
+/* Length of "xpl-stat" and "xpl-trig" */
+#define MSGTYPE_LEN 8
+
+static int encSock = -1;
+static struct sockaddr_in encAddr;
+static xplencStats_t encStats;
+
+static Bool batching = FALSE;
+static unsigned batchCount = 0;
+static xplencSendHandler_t sendHandler = NULL;
+static void *sendCtx = NULL;
+static struct mmsghdr batchMsg[XPLENC_BATCH];
+static struct iovec batchIov[XPLENC_BATCH];
+static char batchBuf[XPLENC_BATCH][XPLENC_MAX];
+
+/*
+ * Find the broadcast address for an interface.
+ * If ifname is empty, use the first non-loopback interface which supports broadcast
+ */
+
+static Bool findBroadcastAddr(const String ifname, struct in_addr *addr)
+{
+	struct ifaddrs *list, *ifa;
+	Bool res = FALSE;
+
+	if(getifaddrs(&list) == -1){
+		debug(DEBUG_UNEXPECTED, "findBroadcastAddr(): getifaddrs failed: %s", strerror(errno));
+		return FALSE;
+	}
+	for(ifa = list; ifa; ifa = ifa->ifa_next){
+		if((!ifa->ifa_addr) || (ifa->ifa_addr->sa_family != AF_INET))
+			continue;
+		if((!(ifa->ifa_flags & IFF_UP)) || (!(ifa->ifa_flags & IFF_BROADCAST)) || (!ifa->ifa_broadaddr))
+			continue;
+		if(ifname && ifname[0]){
+			if(strcmp(ifname, ifa->ifa_name))
+				continue;
+		}
+		else if(ifa->ifa_flags & IFF_LOOPBACK)
+			continue;
+		*addr = ((struct sockaddr_in *) ifa->ifa_broadaddr)->sin_addr;
+		res = TRUE;
+		break;
+	}
+	freeifaddrs(list);
+	return res;
+}
+
+/*
+ * Append a string to a fixed buffer, returns FALSE if it will not fit
+ */
+
+static Bool append(String buf, unsigned size, unsigned *len, const String s)
+{
+	unsigned l = strlen(s);
+
+	if(*len + l >= size)
+		return FALSE;
+	memcpy(buf + *len, s, l);
+	*len += l;
+	buf[*len] = 0;
+	return TRUE;
+}
+
+/*
+ * Open the send socket and look up the broadcast address
+ */
+
+Bool xplencInit(const String ifname)
+{
+	int on = 1;
+
+	memset(&encAddr, 0, sizeof(encAddr));
+	encAddr.sin_family = AF_INET;
+	encAddr.sin_port = htons(XPLENC_PORT);
+	if(!findBroadcastAddr(ifname, &encAddr.sin_addr)){
+		warn("Could not find a broadcast address for interface '%s', using 255.255.255.255", ifname ? ifname : "");
+		encAddr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+	}
+
+	if((encSock = socket(AF_INET, SOCK_DGRAM, 0)) == -1){
+		debug(DEBUG_UNEXPECTED, "xplencInit(): Could not create socket: %s", strerror(errno));
+		return FALSE;
+	}
+	if(setsockopt(encSock, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on)) == -1){
+		debug(DEBUG_UNEXPECTED, "xplencInit(): Could not enable broadcast: %s", strerror(errno));
+		close(encSock);
+		encSock = -1;
+		return FALSE;
+	}
+	debug(DEBUG_STATUS, "Native xPL encoder sending to %s:%d", inet_ntoa(encAddr.sin_addr), XPLENC_PORT);
+	return TRUE;
+}
+
+/*
+ * Close the send socket
+ */
+
+void xplencShutdown(void)
+{
+	xplencFlush();
+	if(encSock != -1){
+		close(encSock);
+		encSock = -1;
+	}
+}
+
+/*
+ * Create a message template.
+ *
+ * source is the full vendor-device.instance source address.
+ * device is the default device value, used when xplencSend() is passed a NULL device.
+ * units may be NULL if no units are to be sent.
+ *
+ * Returns NULL if the template could not be allocated, or the fixed text does not fit.
+ */
+
+xplencTemplatePtr_t xplencCreate(const String source, const String class, const String type,
+const String device, const String sensorType, const String units)
+{
+	xplencTemplatePtr_t t;
+	Bool ok = TRUE;
+
+	if((!source) || (!class) || (!type) || (!device) || (!sensorType))
+		return NULL;
+
+	if(!(t = calloc(1, sizeof(xplencTemplate_t))))
+		return NULL;
+
+	/* Header and body up to the device value */
+	ok = ok && append(t->buf, sizeof(t->buf), &t->head_len, "xpl-stat\n{\nhop=1\nsource=");
+	ok = ok && append(t->buf, sizeof(t->buf), &t->head_len, source);
+	ok = ok && append(t->buf, sizeof(t->buf), &t->head_len, "\ntarget=*\n}\n");
+	ok = ok && append(t->buf, sizeof(t->buf), &t->head_len, class);
+	ok = ok && append(t->buf, sizeof(t->buf), &t->head_len, ".");
+	ok = ok && append(t->buf, sizeof(t->buf), &t->head_len, type);
+	ok = ok && append(t->buf, sizeof(t->buf), &t->head_len, "\n{\ndevice=");
+
+	/* Between the device and the current value */
+	ok = ok && append(t->mid, sizeof(t->mid), &t->mid_len, "\ntype=");
+	ok = ok && append(t->mid, sizeof(t->mid), &t->mid_len, sensorType);
+	ok = ok && append(t->mid, sizeof(t->mid), &t->mid_len, "\ncurrent=");
+
+	/* After the current value */
+	if(units){
+		ok = ok && append(t->tail, sizeof(t->tail), &t->tail_len, "\nunits=");
+		ok = ok && append(t->tail, sizeof(t->tail), &t->tail_len, units);
+	}
+	ok = ok && append(t->tail, sizeof(t->tail), &t->tail_len, "\n}\n");
+
+	/* Default device, and room for the largest variable fields */
+	ok = ok && (strlen(device) < XPLENC_VALUE_MAX);
+	ok = ok && (t->head_len + t->mid_len + t->tail_len + (2 * XPLENC_VALUE_MAX) < XPLENC_MAX);
+
+	if(!ok){
+		free(t);
+		return NULL;
+	}
+	strcpy(t->device, device);
+	return t;
+}
+
+/*
+ * Free a template
+ */
+
+void xplencFree(xplencTemplatePtr_t t)
+{
+	if(t)
+		free(t);
+}
+
+/*
+ * Render and send a message from a template. The current value is either
+ * the string current, or if that is NULL, value formatted with precision
+ * digits after the decimal point.
+ *
+ * Returns the number of bytes sent or batched, or -1 on error
+ */
+
+static int render(xplencTemplatePtr_t t, xplencMsgType_t msgType, const String device, const String current,
+fixpt_t value, unsigned precision)
+{
+	unsigned dl, len;
+	int cl;
+	String p, dev, buf;
+
+	if((!t) || (encSock == -1))
+		return -1;
+
+	dev = (device) ? device : t->device;
+	dl = strlen(dev);
+	cl = (current) ? (int) strlen(current) : 0;
+	if((dl >= XPLENC_VALUE_MAX) || (cl >= XPLENC_VALUE_MAX)){
+		debug(DEBUG_UNEXPECTED, "xplencSend(): Value too long");
+		return -1;
+	}
+
+	/* Render in place, or into the next batch slot */
+	if(batching){
+		if(batchCount == XPLENC_BATCH)
+			xplencFlush();
+		buf = batchBuf[batchCount];
+		memcpy(buf, t->buf, t->head_len);
+	}
+	else
+		buf = t->buf;
+
+	/* Patch the message type */
+	memcpy(buf, (msgType == XPLENC_TRIG) ? "xpl-trig" : "xpl-stat", MSGTYPE_LEN);
+
+	/* Copy in the variable fields and the fixed text between them */
+	p = buf + t->head_len;
+	memcpy(p, dev, dl);
+	p += dl;
+	memcpy(p, t->mid, t->mid_len);
+	p += t->mid_len;
+	if(current)
+		memcpy(p, current, cl);
+	else if((cl = fmtnumFixed(p, XPLENC_VALUE_MAX, value, precision)) < 0){
+		debug(DEBUG_UNEXPECTED, "xplencSend(): Value too long");
+		return -1;
+	}
+	p += cl;
+	memcpy(p, t->tail, t->tail_len);
+	p += t->tail_len;
+	len = p - buf;
+	encStats.messages++;
+
+	if(batching){
+		batchIov[batchCount].iov_len = len;
+		batchCount++;
+		return (int) len;
+	}
+	if((sendHandler) && ((*sendHandler)(encSock, buf, len, (struct sockaddr *) &encAddr, sizeof(encAddr), sendCtx))){
+		encStats.handedOff++;
+		return (int) len;
+	}
+	encStats.syscalls++;
+	if(sendto(encSock, buf, len, 0, (struct sockaddr *) &encAddr, sizeof(encAddr)) < 0){
+		debug(DEBUG_UNEXPECTED, "xplencSend(): sendto failed: %s", strerror(errno));
+		return -1;
+	}
+	return (int) len;
+}
+
+/*
+ * Send a message with a string current value
+ *
+ * Returns the number of bytes sent or batched, or -1 on error
+ */
+
+int xplencSend(xplencTemplatePtr_t t, xplencMsgType_t msgType, const String device, const String current)
+{
+	if(!current)
+		return -1;
+	return render(t, msgType, device, current, 0, 0);
+}
+
+/*
+ * Send a message with a fixed point current value, formatted in place
+ *
+ * Returns the number of bytes sent or batched, or -1 on error
+ */
+
+int xplencSendFixed(xplencTemplatePtr_t t, xplencMsgType_t msgType, const String device, fixpt_t value, unsigned precision)
+{
+	return render(t, msgType, device, NULL, value, precision);
+}
+
+/*
+ * Turn batching on or off. Anything batched is sent first.
+ */
+
+void xplencSetBatching(Bool on)
+{
+	unsigned i;
+
+	xplencFlush();
+	for(i = 0; i < XPLENC_BATCH; i++){
+		batchIov[i].iov_base = batchBuf[i];
+		memset(&batchMsg[i], 0, sizeof(struct mmsghdr));
+		batchMsg[i].msg_hdr.msg_name = &encAddr;
+		batchMsg[i].msg_hdr.msg_namelen = sizeof(encAddr);
+		batchMsg[i].msg_hdr.msg_iov = &batchIov[i];
+		batchMsg[i].msg_hdr.msg_iovlen = 1;
+	}
+	batching = on;
+}
+
+/*
+ * Set a handler to take the datagrams, or NULL to send them here
+ */
+
+void xplencSetSendHandler(xplencSendHandler_t handler, void *ctx)
+{
+	xplencFlush();
+	sendHandler = handler;
+	sendCtx = ctx;
+}
+
+/*
+ * Send the batched messages
+ */
+
+void xplencFlush(void)
+{
+	unsigned sent = 0;
+	int res;
+
+	if(sendHandler){
+		for(; sent < batchCount; sent++){
+			if(!(*sendHandler)(encSock, batchBuf[sent], batchIov[sent].iov_len, (struct sockaddr *) &encAddr, sizeof(encAddr), sendCtx))
+				break; /* The rest are sent here */
+			encStats.handedOff++;
+		}
+	}
+	while(sent < batchCount){
+		encStats.syscalls++;
+		if((res = sendmmsg(encSock, batchMsg + sent, batchCount - sent, 0)) < 0){
+			if(errno == EINTR)
+				continue;
+			debug(DEBUG_UNEXPECTED, "xplencFlush(): sendmmsg failed: %s, dropped %u messages", strerror(errno), batchCount - sent);
+			break;
+		}
+		sent += res;
+	}
+	batchCount = 0;
+}
+
+/*
+ * Return the send statistics
+ */
+
+const xplencStats_t *xplencGetStats(void)
+{
+	return &encStats;
+}
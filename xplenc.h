@@ -0,0 +1,76 @@
+/*
+ * xplenc.h
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * Native xPL message encoder for outbound sensor messages
+ */
+
+#ifndef XPLENC_H
+#define XPLENC_H
+
+#include <sys/socket.h>
+#include "types.h"
+#include "fixpt.h"
+
+/* Maximum size of an encoded datagram */
+#define XPLENC_MAX 384
+
+/* Maximum length of a variable field (device or current value) */
+#define XPLENC_VALUE_MAX 32
+
+/* xPL port */
+#define XPLENC_PORT 3865
+
+/* Messages sent per sendmmsg() when batching */
+#define XPLENC_BATCH 32
+
+/* Message types */
+typedef enum {XPLENC_STAT = 0, XPLENC_TRIG} xplencMsgType_t;
+
+typedef struct xplenc_stats xplencStats_t;
+
+struct xplenc_stats
+{
+	uint64_t messages;
+	uint64_t syscalls;
+	uint64_t handedOff;
+};
+
+/* Queues a datagram to be sent later. Returns FALSE if it can't, and the encoder sends it itself */
+typedef Bool (*xplencSendHandler_t)(int fd, const char *data, unsigned len, const struct sockaddr *addr, socklen_t addrLen, void *ctx);
+
+typedef struct xplenc_template xplencTemplate_t;
+typedef xplencTemplate_t * xplencTemplatePtr_t;
+
+/*
+ * A message template. buf holds the datagram with the header and
+ * the body up to and including "device=" already rendered.
+ */
+
+struct xplenc_template
+{
+	unsigned head_len;
+	unsigned mid_len;
+	unsigned tail_len;
+	char device[XPLENC_VALUE_MAX];
+	char mid[96];
+	char tail[64];
+	char buf[XPLENC_MAX];
+};
+
+/* Prototypes */
+
+Bool xplencInit(const String ifname);
+void xplencShutdown(void);
+xplencTemplatePtr_t xplencCreate(const String source, const String class, const String type,
+const String device, const String sensorType, const String units);
+void xplencFree(xplencTemplatePtr_t t);
+int xplencSend(xplencTemplatePtr_t t, xplencMsgType_t msgType, const String device, const String current);
+int xplencSendFixed(xplencTemplatePtr_t t, xplencMsgType_t msgType, const String device, fixpt_t value, unsigned precision);
+void xplencSetBatching(Bool on);
+void xplencSetSendHandler(xplencSendHandler_t handler, void *ctx);
+void xplencFlush(void);
+const xplencStats_t *xplencGetStats(void);
+
+#endif
@@ -0,0 +1,111 @@
+/*
+ * xplenctest.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Check that the native xPL encoder renders messages correctly and
+ * touches no heap memory per message, batched or not.
+ *
+ * Allocations are counted with alloccount.c, so allocations made inside
+ * the C library on our behalf are counted too.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "notify.h"
+#include "alloccount.h"
+#include "xplenc.h"
+
+#define MESSAGES 1000
+
+char *progName = "xplenctest";
+int debugLvl = 0;
+
+/*
+ * Report a failed check
+ */
+
+static int failed(const String what)
+{
+	fprintf(stderr, "xplenctest: FAIL: %s\n", what);
+	return 1;
+}
+
+int main(int argc, char *argv[])
+{
+	static const char expect[] = "xpl-trig\n{\nhop=1\nsource=hwstar-xplhan.test\ntarget=*\n}\n"
+	"sensor.basic\n{\ndevice=porch\ntype=temp\ncurrent=-12.34\nunits=C\n}\n";
+	xplencTemplatePtr_t t;
+	const xplencStats_t *stats;
+	uint64_t messages, syscalls;
+	unsigned long allocs;
+	unsigned i;
+	int len, errors = 0;
+
+	if(!xplencInit(NULL))
+		return failed("xplencInit()");
+	if(!(t = xplencCreate("hwstar-xplhan.test", "sensor", "basic", "0", "temp", "C")))
+		return failed("xplencCreate()");
+
+	/* Unbatched, the datagram is rendered in the template. The send may fail where there is no network. */
+	xplencSendFixed(t, XPLENC_TRIG, "porch", -1234, 2);
+	len = strlen(expect);
+	if(memcmp(t->buf, expect, len))
+		errors += failed("xplencSendFixed() rendered the wrong text");
+	xplencSend(t, XPLENC_STAT, NULL, "on");
+	if(!strstr(t->buf, "xpl-stat") || !strstr(t->buf, "device=0\ntype=temp\ncurrent=on\n"))
+		errors += failed("xplencSend() rendered the wrong text");
+	if(xplencSendFixed(t, XPLENC_STAT, "a-device-name-which-is-much-too-long", 1, 0) != -1)
+		errors += failed("Over long device was not refused");
+
+	stats = xplencGetStats();
+	alloccountStart();
+	for(i = 0; i < MESSAGES; i++){
+		xplencSendFixed(t, XPLENC_STAT, NULL, (fixpt_t) i * 1001, 3);
+		xplencSend(t, XPLENC_TRIG, "porch", "off");
+	}
+	allocs = alloccountStop();
+	printf("Unbatched: %lu allocations in %u messages\n", allocs, 2 * MESSAGES);
+	if(allocs)
+		errors += failed("Unbatched send allocated");
+
+	/* Batched, a flush is forced every XPLENC_BATCH messages */
+	xplencSetBatching(TRUE);
+	messages = stats->messages;
+	syscalls = stats->syscalls;
+	alloccountStart();
+	for(i = 0; i < MESSAGES; i++)
+		xplencSendFixed(t, XPLENC_STAT, NULL, (fixpt_t) i, 1);
+	xplencFlush();
+	allocs = alloccountStop();
+	printf("Batched: %lu allocations in %u messages, %llu send calls\n", allocs, MESSAGES,
+	(unsigned long long) (stats->syscalls - syscalls));
+	if(allocs)
+		errors += failed("Batched send allocated");
+	if(stats->messages - messages != MESSAGES)
+		errors += failed("Batched message count");
+	if(stats->syscalls - syscalls < (MESSAGES + XPLENC_BATCH - 1) / XPLENC_BATCH)
+		errors += failed("Batched send call count");
+
+	xplencFree(t);
+	xplencShutdown();
+	if(!errors)
+		printf("xplenctest: PASS\n");
+	return (errors) ? 1 : 0;
+}
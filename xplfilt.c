@@ -0,0 +1,315 @@
+/*
+ * xplfilt.c
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Raw inbound xPL datagram classifier.
+ *
+ * Looks at the message type, the source and target addresses, and the
+ * schema of a raw datagram in place, and decides whether it is:
+ *
+ * XPLFILT_ACCEPT - a command for one of our instances with a class.type
+ *                  one of our services handles.
+ * XPLFILT_LIB    - housekeeping traffic xPLLib needs to see (hbeat and
+ *                  config commands for us or for everyone, and the echoes
+ *                  of our own heartbeats).
+ * XPLFILT_DROP   - everything else.
+ *
+ * A command is accepted when the instance part of its target is one of
+ * ours, whatever the vendor and device, as the message listener has always
+ * done. Housekeeping must name our vendor and device as well.
+ *
+ * Names are compared without regard to case, as xPL requires. The message
+ * listener still checks the instance, class and type exactly.
+ *
+ * The instance IDs and class.type pairs are kept in sorted arrays built
+ * at startup, so classification does not allocate anything.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "notify.h"
+#include "xplfilt.h"
+
+#define MSGTYPE_LEN 8
+
+#define MALLOC_ERROR	fatal("Out of memory in file %s, at line %d", __FILE__, __LINE__)
+
+/* A length delimited string in the set */
+typedef struct filt_entry filtEntry_t;
+
+struct filt_entry
+{
+	unsigned len;
+	String str;
+};
+
+/* A sorted set of strings */
+typedef struct filt_set filtSet_t;
+
+struct filt_set
+{
+	unsigned count;
+	unsigned alloc;
+	filtEntry_t *entries;
+};
+
+static char vendorDevicePrefix[64];
+static unsigned vendorDevicePrefixLen;
+static filtSet_t instanceSet;
+static filtSet_t schemaSet;
+static xplfiltStats_t stats;
+
+/*
+ * Compare two length delimited strings without regard to case. Shorter strings sort first.
+ */
+
+static int compareEntry(const void *a, const void *b)
+{
+	const filtEntry_t *ea = a, *eb = b;
+
+	if(ea->len != eb->len)
+		return (ea->len < eb->len) ? -1 : 1;
+	return strncasecmp(ea->str, eb->str, ea->len);
+}
+
+/*
+ * Add a string to a set
+ */
+
+static void setAdd(filtSet_t *set, String str)
+{
+	if(set->count == set->alloc){
+		set->alloc = (set->alloc) ? set->alloc * 2 : 16;
+		if(!(set->entries = realloc(set->entries, set->alloc * sizeof(filtEntry_t))))
+			MALLOC_ERROR;
+	}
+	set->entries[set->count].str = str;
+	set->entries[set->count].len = strlen(str);
+	set->count++;
+}
+
+/*
+ * Test a length delimited string for membership in a set
+ */
+
+static Bool setContains(const filtSet_t *set, const char *str, unsigned len)
+{
+	filtEntry_t key;
+
+	if(!set->count)
+		return FALSE;
+	key.str = (String) str;
+	key.len = len;
+	return bsearch(&key, set->entries, set->count, sizeof(filtEntry_t), compareEntry) ? TRUE : FALSE;
+}
+
+/*
+ * Find the end of the line starting at p. Returns NULL if there is no newline before end
+ */
+
+static const char *lineEnd(const char *p, const char *end)
+{
+	return memchr(p, '\n', end - p);
+}
+
+/*
+ * Return TRUE if a target or source address is one of ours
+ */
+
+static Bool isOurs(const char *addr, unsigned len)
+{
+	if((len <= vendorDevicePrefixLen) || strncasecmp(addr, vendorDevicePrefix, vendorDevicePrefixLen))
+		return FALSE;
+	return setContains(&instanceSet, addr + vendorDevicePrefixLen, len - vendorDevicePrefixLen);
+}
+
+/*
+ * Return TRUE if the instance part of a target address is one of ours
+ */
+
+static Bool isOurInstance(const char *addr, unsigned len)
+{
+	const char *dot;
+
+	if(!(dot = memchr(addr, '.', len)))
+		return FALSE;
+	dot++;
+	return setContains(&instanceSet, dot, len - (dot - addr));
+}
+
+/*
+ * Initialize the classifier with our vendor-device ID
+ */
+
+void xplfiltInit(const String vendorDevice)
+{
+	snprintf(vendorDevicePrefix, sizeof(vendorDevicePrefix), "%s.", vendorDevice);
+	vendorDevicePrefixLen = strlen(vendorDevicePrefix);
+}
+
+/*
+ * Add one of our instance IDs
+ */
+
+void xplfiltAddInstance(const String instanceID)
+{
+	String s;
+
+	if(!(s = strdup(instanceID)))
+		MALLOC_ERROR;
+	setAdd(&instanceSet, s);
+}
+
+/*
+ * Add a class.type pair one of our services handles
+ */
+
+void xplfiltAddSchema(const String class, const String type)
+{
+	String s;
+	unsigned len = strlen(class) + strlen(type) + 2;
+
+	if(!(s = malloc(len)))
+		MALLOC_ERROR;
+	snprintf(s, len, "%s.%s", class, type);
+	if(setContains(&schemaSet, s, len - 1)){ /* Already have it */
+		free(s);
+		return;
+	}
+	setAdd(&schemaSet, s);
+	/* Keep the set sorted so that duplicates can be found while it is built */
+	qsort(schemaSet.entries, schemaSet.count, sizeof(filtEntry_t), compareEntry);
+}
+
+/*
+ * Sort the sets. Must be called after the last add and before the first classify.
+ */
+
+void xplfiltFinalize(void)
+{
+	qsort(instanceSet.entries, instanceSet.count, sizeof(filtEntry_t), compareEntry);
+	qsort(schemaSet.entries, schemaSet.count, sizeof(filtEntry_t), compareEntry);
+	debug(DEBUG_STATUS, "xPL prefilter: %u instances, %u schemas", instanceSet.count, schemaSet.count);
+}
+
+/*
+ * Classify a raw datagram without counting it
+ */
+
+xplfiltVerdict_t xplfiltCheck(const char *buf, int len)
+{
+	const char *p, *e, *end, *eq;
+	const char *source = NULL, *target = NULL;
+	unsigned sourceLen = 0, targetLen = 0, schemaLen;
+	Bool isCommand, broadcast, hk;
+
+	if((!buf) || (len <= MSGTYPE_LEN + 1) || (buf[MSGTYPE_LEN] != '\n'))
+		goto drop;
+	end = buf + len;
+
+	/* Message type */
+	if(!strncasecmp(buf, "xpl-cmnd", MSGTYPE_LEN))
+		isCommand = TRUE;
+	else if((!strncasecmp(buf, "xpl-stat", MSGTYPE_LEN)) || (!strncasecmp(buf, "xpl-trig", MSGTYPE_LEN)))
+		isCommand = FALSE;
+	else
+		goto drop;
+
+	/* Header block */
+	p = buf + MSGTYPE_LEN + 1;
+	if((end - p < 2) || memcmp(p, "{\n", 2))
+		goto drop;
+	for(p += 2; ; p = e + 1){
+		if(!(e = lineEnd(p, end)))
+			goto drop;
+		if((e - p == 1) && (*p == '}'))
+			break;
+		if(!(eq = memchr(p, '=', e - p)))
+			goto drop;
+		if((eq - p == 6) && (!strncasecmp(p, "target", 6))){
+			target = eq + 1;
+			targetLen = e - target;
+		}
+		else if((eq - p == 6) && (!strncasecmp(p, "source", 6))){
+			source = eq + 1;
+			sourceLen = e - source;
+		}
+	}
+	if(!target || !source)
+		goto drop;
+
+	/* Schema */
+	p = e + 1;
+	if(!(e = lineEnd(p, end)))
+		goto drop;
+	schemaLen = e - p;
+
+	broadcast = ((targetLen == 1) && (*target == '*'));
+	hk = (((schemaLen > 6) && (!strncasecmp(p, "hbeat.", 6))) ||
+		((schemaLen > 7) && (!strncasecmp(p, "config.", 7))));
+
+	/* Heartbeat and config requests for us or for everyone, and the echoes of our own heartbeats */
+	if(hk && ((isCommand && (broadcast || isOurs(target, targetLen))) || isOurs(source, sourceLen)))
+		return XPLFILT_LIB;
+
+	/* Commands for our services */
+	if(isCommand && (!broadcast) && setContains(&schemaSet, p, schemaLen) && isOurInstance(target, targetLen))
+		return XPLFILT_ACCEPT;
+
+drop:
+	return XPLFILT_DROP;
+}
+
+/*
+ * Count a datagram classified with xplfiltCheck()
+ */
+
+void xplfiltCount(xplfiltVerdict_t verdict)
+{
+	stats.examined++;
+	if(verdict == XPLFILT_ACCEPT)
+		stats.accepted++;
+	else if(verdict == XPLFILT_LIB)
+		stats.lib++;
+	else
+		stats.dropped++;
+}
+
+/*
+ * Classify a raw datagram and count it
+ */
+
+xplfiltVerdict_t xplfiltClassify(const char *buf, int len)
+{
+	xplfiltVerdict_t verdict = xplfiltCheck(buf, len);
+
+	xplfiltCount(verdict);
+	return verdict;
+}
+
+/*
+ * Return the counters
+ */
+
+const xplfiltStats_t *xplfiltGetStats(void)
+{
+	return &stats;
+}
@@ -0,0 +1,39 @@
+/*
+ * xplfilt.h
+ *
+ *  Copyright (C) 2012  Stephen Rodgers
+ *
+ * Raw inbound xPL datagram classifier
+ */
+
+#ifndef XPLFILT_H
+#define XPLFILT_H
+
+#include "types.h"
+
+/* Verdicts */
+typedef enum {XPLFILT_DROP = 0, XPLFILT_LIB, XPLFILT_ACCEPT} xplfiltVerdict_t;
+
+/* Counters */
+typedef struct xplfilt_stats xplfiltStats_t;
+
+struct xplfilt_stats
+{
+	uint64_t examined;
+	uint64_t accepted;
+	uint64_t lib;
+	uint64_t dropped;
+};
+
+/* Prototypes */
+
+void xplfiltInit(const String vendorDevice);
+void xplfiltAddInstance(const String instanceID);
+void xplfiltAddSchema(const String class, const String type);
+void xplfiltFinalize(void);
+xplfiltVerdict_t xplfiltCheck(const char *buf, int len);
+void xplfiltCount(xplfiltVerdict_t verdict);
+xplfiltVerdict_t xplfiltClassify(const char *buf, int len);
+const xplfiltStats_t *xplfiltGetStats(void);
+
+#endif
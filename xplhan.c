@@ -32,40 +32,96 @@
 	#define EMAIL "hwstar@rodgers.sdcoxmail.com"
 #endif
 
+#define _GNU_SOURCE /* recvmmsg() */
+
 #include <stdio.h>
 #include <stdlib.h>
-#include <math.h>
 #include <signal.h>
+#include <errno.h>
 #include <ctype.h>
 #include <getopt.h>
 #include <limits.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <xPL.h>
 #include "types.h"
 #include "notify.h"
 #include "confread.h"
 #include "socket.h"
+#include "fixpt.h"
+#include "fmtnum.h"
+#include "xplenc.h"
+#include "xplfilt.h"
+#include "hashmap.h"
+#include "pool.h"
+#include "ring.h"
+#include "reactor.h"
+#include "timerheap.h"
+#include "uring.h"
+#include "hantrans.h"
+#include "histo.h"
+#include "metrics.h"
+#include "flight.h"
+#include "trace.h"
+#include "probes.h"
+#include "prof.h"
 
 #define MALLOC_ERROR	malloc_error(__FILE__,__LINE__)
 
-#define SHORT_OPTIONS "c:d:f:hi:l:ns:v"
+/*
+ * Counters a bus's HAN thread updates in threaded mode, and the xPL thread
+ * reads for the metrics. Each has one writer, so relaxed atomic stores and
+ * loads are enough. See statSetDouble() and statGetDouble() for the gauges.
+ */
+
+#define STAT_ADD(c, n)	__atomic_store_n(&(c), (c) + (n), __ATOMIC_RELAXED)
+#define STAT_SET(c, v)	__atomic_store_n(&(c), (v), __ATOMIC_RELAXED)
+#define STAT_GET(c)		__atomic_load_n(&(c), __ATOMIC_RELAXED)
+
+#define SHORT_OPTIONS "c:d:f:hi:l:nps:v"
 
 #define WS_SIZE 256
+#define WORKQ_CMD_SIZE 32
+#define WORKQ_POOL_MIN 64
+#define OUTBOX_DEVICE_SIZE 12
+#define OUTBOX_CURRENT_SIZE 32
+#define RESPONSE_TIMEOUT_MS 2000
+#define RECONNECT_MS 5000
+#define XPL_HUB_TICKS 60
+#define XPL_HOUSEKEEPING_MS 30000
+#define URING_ENTRIES 64
+#define UTIL_WINDOW_MS 60000
+#define HAN_CHAR_BITS 10
+#define PLAN_TOP 5
+#define PLAN_KEY_SIZE 16
+#define NODE_METRICS 7
+#define XPL_DGRAM_MAX 1500
+#define XPL_RECV_BATCH 16
 
 #define DEF_PID_FILE		"/var/run/xplhan.pid"
 #define DEF_CONFIG_FILE		"/etc/xplhan.conf"
 #define DEF_INSTANCE_ID		"test"
 #define DEF_HOST			"localhost"
 #define DEF_SERVICE			"1129"
+#define DEF_BUS_SPEED		9600
+#define DEF_TURNAROUND_MS	10
+#define DEF_FLIGHT_FILE		"/var/tmp/xplhan.flight"
+#define DEF_UTIL_BUDGET		50
+#define DEF_STALL_MS		100
 
-#define MAX_SERVICES 64
 #define MAX_CHANNEL 16
 #define MAX_UNITS_PER_COMMAND 5
 #define MAX_HAN_DEVICE 16
+#define HAN_ADDRESSES 255
 #define MAX_POLL_INTERVAL 604800
+#define MAX_PRECISION 6
 
 typedef enum {GNOP=0x00, GVLV= 0x10, GRLY= 0x11, GTMP=0x12, GOUT=0x13, GINP=0x14, GACD=0x15, GVLT=0x16, 
                GCUR=0x17,GHUM= 0x30, GWSP= 0x31, GWDR = 0x32, GRGC = 0x33} hanCommands_t;
@@ -79,55 +135,148 @@ typedef struct cloverrides {
 	unsigned interface : 1;
 } clOverride_t;
 
-/* Command keyword to code map */
+/* Command keyword to code map, with the size of the command and its response for the cost model */
 typedef struct han_command_map hanCommandMap_t;
 struct han_command_map{
 	hanCommands_t code;
 	units_t valid_units[MAX_UNITS_PER_COMMAND];
+	unsigned precision[MAX_UNITS_PER_COMMAND];
+	String sensor_type[MAX_UNITS_PER_COMMAND];
 	String keyword;
+	unsigned cmd_chars;
+	unsigned resp_params;
+	Bool by_channel;
 };
 
 /* Units to code map */
 typedef struct units_map unitsMap_t;
 struct units_map{
 	units_t code;
+	Bool in_message;
 	String keyword;
 };
 
 	
+/*
+ * Latency histograms, in microseconds.
+ * Queue wait is from queueing a command to sending it, round trip is
+ * from sending it to its response, and end to end is from the xPL
+ * request to its reply having been handed to xPL. End to end is only
+ * recorded for commands from xPL, not polls.
+ */
+
+typedef enum {LAT_QUEUE = 0, LAT_RTT, LAT_E2E, LAT_KINDS} latKind_t;
+
+typedef struct latency latency_t;
+typedef latency_t * latencyPtr_t;
+
+struct latency
+{
+	histo_t h[LAT_KINDS];
+};
+
+/*
+ * Bus time used by a node (bus address).
+ * The segment carries one transaction at a time, so a transaction is busy
+ * from sending the command until its response, or until it is given up on.
+ * The byte counts are of the ASCII protocol to the HAN server, which stand
+ * in for the frames on the segment. The rolling figures are over the last
+ * UTIL_WINDOW_MS, and are updated by the bus's scheduler.
+ */
+
+typedef struct node_cost nodeCost_t;
+typedef nodeCost_t * nodeCostPtr_t;
+
+struct node_cost
+{
+	uint64_t transactions;
+	uint64_t failures;
+	uint64_t txBytes;
+	uint64_t rxBytes;
+	uint64_t busyUs;
+	uint64_t lastTransactions;
+	uint64_t lastFailures;
+	uint64_t lastBusyUs;
+	double pollRate;
+	double pollEstimate;
+	double utilization;
+	double tps;
+	double failureRate;
+};
+
+/*
+ * Load of a node or a service, for the bus load planner
+ */
+
+typedef struct bus_load busLoad_t;
+typedef busLoad_t * busLoadPtr_t;
+
+struct bus_load
+{
+	unsigned id;
+	double rate;
+	double load;
+};
+
 typedef struct service_entry serviceEntry_t;
 typedef serviceEntry_t * serviceEntryPtr_t;
+typedef struct han_bus hanBus_t;
+typedef hanBus_t * hanBusPtr_t;
 
 /*
  * Service entry data structure.
- * There is one of these for each virtual service in this gateway
+ * There is one of these for each virtual service in this gateway.
+ * State touched on every tick or poll response lives in serviceHot_t.
  */
  
 struct service_entry
 {
 	Bool is_sensor;
-	int poll_last;
+	Bool precision_override;
 	unsigned address;
-	unsigned polling_interval;
-	unsigned poll_counter;
 	unsigned service_id;
 	unsigned channel;
+	unsigned precision;
 	units_t units;
 	char *units_keyword;
-	uint32_t iid_hash;
+	String sensor_type;
+	unsigned class_id;
+	unsigned type_id;
 	hanCommands_t cmd;
-	float poll_f_last;
+	unsigned cmd_index;
+	hanBusPtr_t bus;
 	String instance_id;
 	String class;
 	String type;
 	xPL_ServicePtr xplService;
-	serviceEntryPtr_t prev;
-	serviceEntryPtr_t next;		
+	xPL_MessagePtr msg;
+	xplencTemplatePtr_t enc;
+	latency_t lat;
+	uint64_t transactions;
+	uint64_t busyUs;
+};
+
+/*
+ * Hot service state.
+ * Parallel arrays indexed by service_id, so the scheduler and the
+ * last value checks run over packed memory instead of service entries.
+ */
+
+typedef struct service_hot serviceHot_t;
+
+struct service_hot
+{
+	unsigned count;
+	unsigned *polling_interval;
+	int *poll_last;
+	fixpt_t *poll_fx_last;
+	serviceEntryPtr_t *entry;
 };
 
 /*
  * Work Queue data structure
- * These are created by incoming xPL requests and commands
+ * These are created by incoming xPL requests and commands,
+ * and are queued in FIFO order on a ring of entry pointers
  */
 
 
@@ -138,10 +287,87 @@ typedef workQEntry_t * workQEntryPtr_t;
 struct workq_entry
 {
 	Bool is_poll;
+	uint32_t txn;
+	uint64_t queued_us;
+	uint64_t sent_us;
+	serviceEntryPtr_t sp;
+	char cmd[WORKQ_CMD_SIZE];
+};
+
+
+/*
+ * HAN bus data structure.
+ * There is one of these for each hand instance (RS-485 segment). Each bus
+ * has its own connection, work queue, scheduler and in flight command,
+ * and in threaded mode its own HAN thread and reactor.
+ */
+
+struct han_bus
+{
+	Bool cmdFail;
+	Bool overBudget;
+	Bool threadRunning;
+	Bool stopping;
+	int wakeFd;
+	int timerFd;
+	unsigned id;
+	unsigned serviceCount;
+	unsigned speed;
+	unsigned turnaround;
+	long long responseDue;
+	long long retryDue;
+	long long windowStart;
+	long long windowDue;
+	uint64_t timeouts;
+	uint64_t connects;
+	uint64_t connectFails;
+	uint64_t triggers;
+	uint64_t suppressed;
+	uint64_t busyUs;
+	uint64_t txBytes;
+	uint64_t rxBytes;
+	uint64_t lastBusyUs;
+	uint64_t lastWireBytes;
+	double utilization;
+	double wireUtilization;
+	double projected;
+	String name;
+	String host;
+	String service;
+	workQEntryPtr_t pendingResponse;
+	timerHeapPtr_t polls;
+	latencyPtr_t cmdLat;
+	latencyPtr_t *addrLat;
+	nodeCostPtr_t *nodes;
+	poolPtr_t pool;
+	ringPtr_t workQ;
+	ringPtr_t requests;
+	reactorPtr_t reactor;
+	uringPtr_t uring;
+	hanTransPtr_t trans;
+	pthread_t thread;
+};
+
+
+/*
+ * Outbox entry.
+ * In threaded mode, sensor messages are handed from the HAN thread
+ * to the xPL thread in these.
+ */
+
+typedef struct outbox_entry outboxEntry_t;
+
+struct outbox_entry
+{
 	serviceEntryPtr_t sp;
-	String cmd;
-	workQEntryPtr_t prev;
-	workQEntryPtr_t next;
+	int msgType;
+	uint32_t txn;
+	uint64_t queued_us;
+	Bool has_device;
+	Bool has_current;
+	fixpt_t value;
+	char device[OUTBOX_DEVICE_SIZE];
+	char current[OUTBOX_CURRENT_SIZE];
 };
 
 
@@ -164,18 +390,45 @@ char *progName;
 int debugLvl = 0; 
 
 static Bool noBackground = FALSE;
-static Bool cmdFail = FALSE;
-static int hanSock = -1;
+static Bool nativeEncoder = FALSE;
+static Bool threadedMode = FALSE;
+static Bool uringIO = FALSE;
+static Bool profileStages = FALSE;
+static Bool planMode = FALSE;
+static __thread Bool onHanThread = FALSE;
+static __thread uint32_t traceTxn = 0;
+static xplfiltVerdict_t rawVerdict = XPLFILT_DROP;
 static clOverride_t clOverride = {0,0,0,0};
 
-static serviceEntryPtr_t serviceEntryHead = NULL;
-static serviceEntryPtr_t serviceEntryTail = NULL;
-static workQEntryPtr_t pendingResponse = NULL;
-static workQEntryPtr_t workQHead = NULL;
-static workQEntryPtr_t workQTail = NULL;
+static serviceHot_t serviceHot = {0, NULL, NULL, NULL, NULL};
+static hanBusPtr_t *busList = NULL;
+static unsigned busCount = 0;
+static ringPtr_t xplOutbox = NULL;
+static int outboxFd = -1;
+static reactorPtr_t mainReactor = NULL;
+static uringPtr_t mainUring = NULL;
+static long long startMs = 0;
+static uint64_t xplWakeups = 0;
+static uint64_t xplRecvCalls = 0;
+static uint64_t xplHandedBack = 0;
+static uint64_t xplLibRuns = 0;
+static uint64_t xplLibReads = 0;
+static int xplReturnFd = -1;
+static struct sockaddr_storage xplReturnAddr;
+static socklen_t xplReturnAddrLen = 0;
+static uint64_t xplSent = 0;
+static String metricsWhere = NULL;
+static String traceWhere = NULL;
+static unsigned utilBudget = DEF_UTIL_BUDGET;
+static unsigned stallMs = DEF_STALL_MS;
 
 static ConfigEntryPtr_t	configEntry = NULL;
 
+static hashMapPtr_t serviceMap = NULL;
+static hashMapPtr_t busMap = NULL;
+static hashMapPtr_t internMap = NULL;
+static unsigned internCount = 0;
+
 static char configFile[WS_SIZE] = DEF_CONFIG_FILE;
 static char interface[WS_SIZE] = "";
 static char logPath[WS_SIZE] = "";
@@ -183,6 +436,7 @@ static char instanceID[WS_SIZE] = DEF_INSTANCE_ID;
 static char pidFile[WS_SIZE] = DEF_PID_FILE;
 static char host[WS_SIZE] = DEF_HOST;
 static char service[WS_SIZE] = DEF_SERVICE;
+static char flightFile[WS_SIZE] = DEF_FLIGHT_FILE;
 
 
 /* Commandline options. */
@@ -195,42 +449,49 @@ static const struct option longOptions[] = {
 	{"instance", 1, 0, 's'},	
 	{"log", 1, 0, 'l'},
 	{"no-background", 0, 0, 'n'},
+	{"plan", 0, 0, 'p'},
 	{"pid-file", 0, 0, 'f'},
 	{"version", 0, 0, 'v'},
 	{0, 0, 0, 0}
 };
 
-/* Han command map */
+/*
+ * Han command map, with the default precision and sensor type for each of the valid units,
+ * the length of the command, the number of parameters in its response, and whether
+ * the command is sent per channel
+ */
 
 static const hanCommandMap_t hanCommandMap[] = {
-	{GTMP, {FAHRENHEIT, CELSIUS, NULLUNIT}, "gtmp"},
-	{GACD, {VOLTS, HERTZ, NULLUNIT}, "gacd"},
-	{GOUT, {OUTPUT,NULLUNIT}, "gout"},
-	{GVLT, {VOLTS,NULLUNIT}, "gvlt"},
-	{GCUR, {AMPS,NULLUNIT}, "gcur"},
-	{GHUM, {PERCENTRH,NULLUNIT},"ghum"},
-	{GWSP, {MPH,KMH,NULLUNIT},"gwsp"},
-	{GWDR, {_WDIRMAP,NULLUNIT},"gwdr"},
-	{GRGC, {IN,MM,NULLUNIT},"grgc"},
-	{GNOP, {NULLUNIT}, NULL}
+	{GTMP, {FAHRENHEIT, CELSIUS, NULLUNIT}, {0, 0}, {"temp", "temp"}, "gtmp", 16, 5, TRUE},
+	{GACD, {VOLTS, HERTZ, NULLUNIT}, {1, 2}, {"volts", "frequency"}, "gacd", 14, 4, FALSE},
+	{GOUT, {OUTPUT,NULLUNIT}, {0}, {"output"}, "gout", 12, 3, TRUE},
+	{GVLT, {VOLTS,NULLUNIT}, {3}, {"volts"}, "gvlt", 22, 8, FALSE},
+	{GCUR, {AMPS,NULLUNIT}, {3}, {"amps"}, "gcur", 22, 8, FALSE},
+	{GHUM, {PERCENTRH,NULLUNIT}, {1}, {"humidity"}, "ghum", 18, 6, TRUE},
+	{GWSP, {MPH,KMH,NULLUNIT}, {1, 1}, {"windspeed", "windspeed"}, "gwsp", 18, 6, TRUE},
+	{GWDR, {_WDIRMAP,NULLUNIT}, {0}, {"winddir"}, "gwdr", 12, 3, FALSE},
+	{GRGC, {IN,MM,NULLUNIT}, {3, 3}, {"raingauge", "raingauge"}, "grgc", 24, 9, TRUE},
+	{GNOP, {NULLUNIT}, {0}, {NULL}, NULL, 0, 0, FALSE}
 };
 
-/* Units map */
+#define HAN_COMMANDS ((sizeof(hanCommandMap) / sizeof(hanCommandMap_t)) - 1)
+
+/* Units map. in_message is set if the units are sent in sensor.basic messages */
 
 static const unitsMap_t unitsMap[] = {
-	{FAHRENHEIT, "fahrenheit"},
-	{CELSIUS,"celsius"},
-	{VOLTS,"volts"},
-	{AMPS,"amps"},
-	{HERTZ,"hertz"},
-	{OUTPUT,"output"},
-	{PERCENTRH,"%rh"},
-	{MPH,"mph"},
-	{KMH,"kmh"},
-	{_WDIRMAP,"wdirmap"},
-	{IN,"in."},
-	{MM,"mm."},
-	{NULLUNIT, NULL}
+	{FAHRENHEIT, TRUE, "fahrenheit"},
+	{CELSIUS, TRUE, "celsius"},
+	{VOLTS, TRUE, "volts"},
+	{AMPS, TRUE, "amps"},
+	{HERTZ, TRUE, "hertz"},
+	{OUTPUT, FALSE, "output"},
+	{PERCENTRH, TRUE, "%rh"},
+	{MPH, TRUE, "mph"},
+	{KMH, TRUE, "kmh"},
+	{_WDIRMAP, FALSE, "wdirmap"},
+	{IN, TRUE, "in."},
+	{MM, TRUE, "mm."},
+	{NULLUNIT, FALSE, NULL}
 };
 
 static char *dirmap[16] = {
@@ -260,6 +521,27 @@ static void *mallocz(size_t size)
 	void *m = calloc(size, sizeof(uint8_t));
 	return m;
 }
+
+/*
+ * Set a gauge another thread reads
+ */
+
+static inline void statSetDouble(double *d, double v)
+{
+	__atomic_store(d, &v, __ATOMIC_RELAXED);
+}
+
+/*
+ * Read a gauge another thread sets
+ */
+
+static inline double statGetDouble(double *d)
+{
+	double v;
+
+	__atomic_load(d, &v, __ATOMIC_RELAXED);
+	return v;
+}
  
 /*
  * Malloc error handler
@@ -301,6 +583,34 @@ static Bool str2uns(String s, unsigned *num, unsigned min, unsigned max)
 }
 
 
+/*
+* Intern a string, returning a small integer ID for it.
+* The same string always gets the same ID, and IDs start at 1.
+*/
+
+static unsigned internString(const String s)
+{
+	void *id;
+	
+	if(!internMap && !(internMap = hashmapNew(16)))
+		MALLOC_ERROR;
+	if((id = hashmapFind(internMap, s)))
+		return (unsigned) (uintptr_t) id;
+	internCount++;
+	hashmapInsert(internMap, s, (void *) (uintptr_t) internCount);
+	return internCount;
+}
+
+/*
+* Return the ID of an interned string, or 0 if the string has not been interned
+*/
+
+static unsigned findInterned(const String s)
+{
+	return (unsigned) (uintptr_t) hashmapFind(internMap, s);
+}
+
+
 /*
 * Duplicate or split a string. 
 *
@@ -405,224 +715,1048 @@ static int pid_write(char *filename, pid_t pid) {
 }
 
 /*
-* When the user hits ^C, logically shutdown
-* (including telling the network the service is ending)
+* Log the percentiles of a set of latency histograms
 */
 
-static void shutdownHandler(int onSignal)
+static void logLatency(const String what, const String name, const latency_t *lat)
 {
-	serviceEntryPtr_t sp;
-	
-	for(sp = serviceEntryTail; sp; sp = sp->prev){
-		xPL_setServiceEnabled(sp->xplService, FALSE);
-		xPL_releaseService(sp->xplService);
-		xPL_shutdown();
+	static const String kindNames[LAT_KINDS] = {"queue", "round trip", "end to end"};
+	histo_t snap, *h = &snap;
+	unsigned kind;
+	
+	for(kind = 0; kind < LAT_KINDS; kind++){
+		histoSnapshot(h, &lat->h[kind]);
+		if(!h->count)
+			continue;
+		debug(DEBUG_STATUS, "Latency %s %s %s: count %llu, mean %llu, p50 %llu, p90 %llu, p99 %llu, max %llu us",
+		what, name, kindNames[kind], (unsigned long long) h->count, (unsigned long long) (h->sum / h->count),
+		(unsigned long long) histoPercentile(h, 50), (unsigned long long) histoPercentile(h, 90),
+		(unsigned long long) histoPercentile(h, 99), (unsigned long long) h->max);
 	}
-	/* Unlink the pid file if we can. */
-	(void) unlink(pidFile);
-	exit(0);
 }
 
-/* 
- * Dequeue work Queue Entry
- */
-  
-workQEntryPtr_t dequeueWorkQueueEntry()
+/*
+* Log the latencies by service, by HAN command across all buses, and by bus address
+*/
+
+static void logLatencies(void)
 {
-	workQEntryPtr_t res = NULL;
-	
-	if(workQTail){
-		res = workQTail;
-		if(workQTail->prev)
-			workQTail->prev->next = NULL;
-		else
-			workQHead = NULL;
-		workQTail = workQTail->prev;
+	latency_t total;
+	unsigned i, j, kind;
+	char ws[WS_SIZE];
+	
+	for(i = 0; i < serviceHot.count; i++)
+		logLatency("service", serviceHot.entry[i]->instance_id, &serviceHot.entry[i]->lat);
+	for(j = 0; j < HAN_COMMANDS; j++){
+		memset(&total, 0, sizeof(total));
+		for(i = 0; i < busCount; i++){
+			if(!busList[i]->cmdLat)
+				continue;
+			for(kind = 0; kind < LAT_KINDS; kind++)
+				histoMerge(&total.h[kind], &busList[i]->cmdLat[j].h[kind]);
+		}
+		logLatency("command", hanCommandMap[j].keyword, &total);
+	}
+	for(i = 0; i < busCount; i++){
+		if(!busList[i]->addrLat)
+			continue;
+		for(j = 0; j < HAN_ADDRESSES; j++){
+			if(!busList[i]->addrLat[j])
+				continue;
+			snprintf(ws, WS_SIZE, "%s/%u", busList[i]->name, j);
+			logLatency("address", ws, busList[i]->addrLat[j]);
+		}
 	}
-	return res;	
 }
 
-/* 
- * Free a work queue entry
- */
+/*
+* Estimated bus time of a transaction in seconds: the command and its
+* response on the wire at the bus speed, plus the node's turnaround.
+* Responses are RS, the address and command, two hex digits per parameter,
+* and a line ending.
+*/
 
-void freeWorkQueueEntry(workQEntryPtr_t wqe)
+static double transactionCost(hanBusPtr_t bus, unsigned cmdIndex)
 {
-	if(wqe){
-		if(wqe->cmd)
-			free(wqe->cmd);
-		free(wqe);
-	}
+	const hanCommandMap_t *cm = &hanCommandMap[cmdIndex];
+	unsigned chars = cm->cmd_chars + 6 + (cm->resp_params * 2) + 1;
+	
+	return ((chars * (double) HAN_CHAR_BITS) / bus->speed) + (bus->turnaround / 1000.0);
 }
 
-/* 
- * Add a command to the work queue
- */
- 
-void queueCommand(String cmd, serviceEntryPtr_t sp, Bool isPoll)
-{
+/*
+* Project the share of a bus the configured polling will use, from the mean
+* measured cost of a transaction on each node, or from the cost model until
+* there is one.
+*/
 
-	workQEntryPtr_t wq = NULL;
-	
-	/* Allocate work queue entry */
-	if(!(wq = mallocz(sizeof(workQEntry_t))))
-		MALLOC_ERROR;
-	debug(DEBUG_ACTION, "queueCommand()");
-	wq->cmd = cmd;
-	wq->is_poll = isPoll;
-	wq->sp = sp;
-	
-	if(!workQHead)
-		workQHead = workQTail = wq;
-	else{
-		wq->next = workQHead;
-		workQHead->prev = wq;
-		workQHead = wq;
+static double projectUtilization(hanBusPtr_t bus)
+{
+	nodeCostPtr_t nc;
+	double projected = 0;
+	unsigned i;
+	
+	for(i = 0; i < HAN_ADDRESSES; i++){
+		if(!(nc = bus->nodes[i]))
+			continue;
+		projected += (nc->transactions) ? nc->pollRate * ((nc->busyUs / 1000000.0) / nc->transactions) : nc->pollEstimate;
 	}
+	return projected;
 }
 
 /*
- * Act on the response from a GOUT command
- */
- 
-void GOUTAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
+* Return an event loop's reactor and name, the main loop first, then a
+* loop for each bus. Returns NULL for a bus which runs on the main loop.
+*/
+
+static reactorPtr_t eventLoop(unsigned i, String *name)
 {
-	int msgType = xPL_MESSAGE_STATUS;
-	char *res, dev[12];
-	xPL_MessagePtr msg = NULL;
-	serviceEntryPtr_t sp = NULL;
-	
+	if(!i){
+		*name = "main";
+		return mainReactor;
+	}
+	if((!busList[i - 1]->reactor) || (busList[i - 1]->reactor == mainReactor))
+		return NULL;
+	*name = busList[i - 1]->name;
+	return busList[i - 1]->reactor;
+}
 
+/*
+* Log the health of each event loop
+*/
 
-	if((!resp) ||(!wq) || (!wq->sp))
-		return;
-		
-	sp = wq->sp;
-	
-	/* Check for correct number of parameters */
-	
-	if(pcount != 3){
-		debug(DEBUG_UNEXPECTED, "GOUTAction(): Received an incorrect number of parameters, got %u, need 3", pcount);
-		return;
+static void logEventLoops(void)
+{
+	reactorStats_t stats, *rs = &stats;
+	reactorPtr_t r;
+	String name;
+	unsigned i;
+	
+	for(i = 0; i <= busCount; i++){
+		if(!(r = eventLoop(i, &name)))
+			continue;
+		reactorGetStats(r, rs);
+		debug(DEBUG_STATUS, "Event loop %s: %llu callbacks, longest %.3f ms in %s, %llu stalls, %llu late timers",
+		name, (unsigned long long) rs->callbacks, rs->maxCallbackUs / 1000.0, (rs->maxCallbackUs) ? rs->maxCallback : "-",
+		(unsigned long long) rs->stalls, (unsigned long long) rs->lateTimers);
+		if(rs->lateness.count)
+			debug(DEBUG_STATUS, "Event loop %s: timer lateness us p50 %llu, p90 %llu, p99 %llu, max %llu", name,
+			(unsigned long long) histoPercentile(&rs->lateness, 50), (unsigned long long) histoPercentile(&rs->lateness, 90),
+			(unsigned long long) histoPercentile(&rs->lateness, 99), (unsigned long long) rs->lateness.max);
 	}
+}
 
-	if(resp->params[1] != 2)
-		return; /* Only respond when status is requested */
-		
-	/* Conversion statements */
-	if(resp->params[2] == 1)
-		res = "high";
-	else if(resp->params[2] == 0)
-		res = "low";
-	else{
-		debug(DEBUG_UNEXPECTED,"Unexpected state received: %d", resp->params[2]);
-		return; 
-	}
-	
-	/* Format device as string */
-	snprintf(dev, 12, "%d", resp->params[0]);
+/*
+* Log the bus time used over the whole run, by bus, node and service
+*/
 
-	/* Build a message */
-	
-	if(wq->is_poll){ /* Was this the result of a poll */
-		if(resp->params[2] == sp->poll_last) /* Was there a change ? */
-			return;
-		debug(DEBUG_EXPECTED, "Sending trigger");
-		sp->poll_last = resp->params[2];
-		msgType = xPL_MESSAGE_TRIGGER;
+static void logUtilization(long long upMs)
+{
+	hanBusPtr_t bus;
+	nodeCostPtr_t nc;
+	unsigned i, j;
+	
+	for(i = 0; i < busCount; i++){
+		bus = busList[i];
+		if(!bus->nodes)
+			continue;
+		debug(DEBUG_STATUS, "Bus %s: busy %.1f%%, wire %.1f%% at %u bit/s, projected polling %.1f%%, tx %llu, rx %llu bytes",
+		bus->name, bus->busyUs / (upMs * 10.0), ((bus->txBytes + bus->rxBytes) * (double) HAN_CHAR_BITS * 100000.0) / (upMs * (double) bus->speed),
+		bus->speed, projectUtilization(bus) * 100.0, (unsigned long long) bus->txBytes, (unsigned long long) bus->rxBytes);
+		for(j = 0; j < HAN_ADDRESSES; j++){
+			if(!(nc = bus->nodes[j]) || (!nc->transactions))
+				continue;
+			debug(DEBUG_STATUS, "Node %s/%u: busy %.1f%%, %llu transactions, %.3f per second, %llu failed, tx %llu, rx %llu bytes",
+			bus->name, j, nc->busyUs / (upMs * 10.0), (unsigned long long) nc->transactions, nc->transactions * 1000.0 / upMs,
+			(unsigned long long) nc->failures, (unsigned long long) nc->txBytes, (unsigned long long) nc->rxBytes);
+		}
+	}
+	for(i = 0; i < serviceHot.count; i++){
+		if(serviceHot.entry[i]->transactions)
+			debug(DEBUG_STATUS, "Service %s: busy %.1f%%, %llu transactions", serviceHot.entry[i]->instance_id,
+			serviceHot.entry[i]->busyUs / (upMs * 10.0), (unsigned long long) serviceHot.entry[i]->transactions);
 	}
-	
-	
-	if(!(msg = xPL_createBroadcastMessage(sp->xplService, msgType)))
-		debug(DEBUG_UNEXPECTED, "GOUTaction(): Could not create status message");
-	xPL_setSchema(msg, "sensor", "basic");
-	xPL_setMessageNamedValue(msg, "device", dev);
-	xPL_setMessageNamedValue(msg, "type", "output");
-	xPL_setMessageNamedValue(msg, "current", res);
-	
-	
-	/* Send the message */
-	
-	xPL_sendMessage(msg);
-	
-	/* Release the resource */
-	
-	xPL_releaseMessage(msg);
-
 }
 
-
 /*
- * Act on the response from a GACD command
- */
- 
-void GACDAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
-{
-	char ws[12];
-	int msgType = xPL_MESSAGE_STATUS;
-	uint_least16_t voltsX10, freqX100;
-	xPL_MessagePtr msg = NULL;
-	float volts, freq;
-	serviceEntryPtr_t sp = NULL;
+* Render the metrics for a scrape of the metrics endpoint.
+* Runs on the xPL thread. In threaded mode the bus counters, gauges and
+* histograms are written by the HAN threads, and are read here with
+* relaxed atomic loads, so a scrape is not a consistent snapshot across them.
+*/
 
-	if((!resp) ||(!wq) || (!wq->sp))
-		return;
-		
-	sp = wq->sp;
-	
-	
-	/* Check for correct number of parameters */
-	
-	if(pcount != 4){
-		debug(DEBUG_UNEXPECTED, "GACDAction(): Received an incorrect number of parameters, got %u, need 4", pcount);
-		return;
+static void renderMetrics(metricsBufPtr_t mb, void *ctx)
+{
+	static const String stageNames[LAT_KINDS] = {"queue", "rtt", "e2e"};
+	static const String nodeMetrics[NODE_METRICS][3] = {
+		{"xplhan_node_busy_seconds_total", "counter", "Bus time used by transactions with a node."},
+		{"xplhan_node_transactions_total", "counter", "Transactions with a node."},
+		{"xplhan_node_failures_total", "counter", "Transactions with a node which were not answered."},
+		{"xplhan_node_bytes_total", "counter", "Command and response bytes exchanged with a node."},
+		{"xplhan_node_utilization", "gauge", "Share of the bus used by a node over the last window."},
+		{"xplhan_node_transactions_per_second", "gauge", "Transactions per second with a node over the last window."},
+		{"xplhan_node_failure_ratio", "gauge", "Share of the transactions with a node which failed over the last window."}
+	};
+	static const String stageMetrics[PROF_COUNTERS + 1][2] = {
+		{"xplhan_stage_cycles_total", "CPU cycles spent in a stage of handling a response."},
+		{"xplhan_stage_instructions_total", "Instructions retired in a stage of handling a response."},
+		{"xplhan_stage_cpu_seconds_total", "CPU time spent in a stage of handling a response."},
+		{"xplhan_stage_entries_total", "Times a stage of handling a response was entered."}
+	};
+	const xplfiltStats_t *fs = xplfiltGetStats();
+	reactorStats_t rs;
+	profCounts_t pc;
+	reactorPtr_t r;
+	String name;
+	hanBusPtr_t bus;
+	nodeCostPtr_t nc;
+	unsigned i, j, m, kind;
+	char labels[WS_SIZE];
+	
+	metricsHeader(mb, "xplhan_uptime_seconds", "gauge", "Seconds since start up.");
+	metricsPrintf(mb, "xplhan_uptime_seconds %lld\n", (reactorNowMs() - startMs) / 1000);
+	metricsHeader(mb, "xplhan_xpl_received_total", "counter", "xPL messages received.");
+	metricsPrintf(mb, "xplhan_xpl_received_total %llu\n", (unsigned long long) fs->examined);
+	metricsHeader(mb, "xplhan_xpl_receive_calls_total", "counter", "recvmmsg() calls on the xPL socket.");
+	metricsPrintf(mb, "xplhan_xpl_receive_calls_total %llu\n", (unsigned long long) xplRecvCalls);
+	metricsHeader(mb, "xplhan_xpl_dropped_total", "counter", "xPL messages dropped by the prefilter.");
+	metricsPrintf(mb, "xplhan_xpl_dropped_total %llu\n", (unsigned long long) fs->dropped);
+	metricsHeader(mb, "xplhan_xpl_sent_total", "counter", "xPL sensor messages sent.");
+	metricsPrintf(mb, "xplhan_xpl_sent_total %llu\n", (unsigned long long) xplSent);
+	
+	/* Each bus has one work queue with no priorities, so depth is reported per bus only */
+	metricsHeader(mb, "xplhan_queue_depth", "gauge", "Commands waiting in the bus work queue.");
+	for(i = 0; i < busCount; i++){
+		if(busList[i]->workQ)
+			metricsPrintf(mb, "xplhan_queue_depth{bus=\"%s\"} %u\n", busList[i]->name, ringCount(busList[i]->workQ));
 	}
-	/* Conversion statements */
-	
-	voltsX10 = (((uint_least16_t) resp->params[1]) << 8) + resp->params[0];
-	freqX100 = (((uint_least16_t) resp->params[3]) << 8) + resp->params[2];
-	volts = ((float) voltsX10)/10;
-	freq = ((float) freqX100)/100;
-	
-	debug(DEBUG_ACTION, "AC Volts = %3.1f, AC Frequency = %2.2f", volts, freq);
-	
-	/* Build a message */
-	
-	
-	if(wq->is_poll){ /* Was this the result of a poll */
-		float thisMeas = (sp->units == VOLTS) ? volts : freq;
-		if(sp->poll_f_last == thisMeas) /* Was there a change ? */
-			return;
-		debug(DEBUG_EXPECTED, "Sending trigger");
-		sp->poll_f_last = thisMeas;
-		msgType = xPL_MESSAGE_TRIGGER;
+	metricsHeader(mb, "xplhan_in_flight", "gauge", "Commands sent and waiting for a response.");
+	for(i = 0; i < busCount; i++){
+		if(busList[i]->workQ)
+			metricsPrintf(mb, "xplhan_in_flight{bus=\"%s\"} %d\n", busList[i]->name, (STAT_GET(busList[i]->pendingResponse)) ? 1 : 0);
 	}
-
-	
-	if(!(msg = xPL_createBroadcastMessage(sp->xplService, msgType)))
-		debug(DEBUG_UNEXPECTED, "gtmpaction(): Could not create status message");
-	xPL_setSchema(msg, "sensor", "basic");
-	if(sp->units == VOLTS){ /* Voltage or frequency? */
-		xPL_setMessageNamedValue(msg, "type", "volts");
-		snprintf(ws, 10, "%3.1f", volts);
-		xPL_setMessageNamedValue(msg, "current", ws);
-		xPL_setMessageNamedValue(msg, "units", "volts");
+	metricsHeader(mb, "xplhan_queue_full_total", "counter", "Commands dropped because the work queue was full.");
+	for(i = 0; i < busCount; i++){
+		if(busList[i]->pool)
+			metricsPrintf(mb, "xplhan_queue_full_total{bus=\"%s\"} %llu\n", busList[i]->name,
+			(unsigned long long) STAT_GET(poolGetStats(busList[i]->pool)->exhausted));
 	}
-	else{
-		xPL_setMessageNamedValue(msg, "type", "frequency");
-		snprintf(ws, 10, "%2.2f", freq);
-		xPL_setMessageNamedValue(msg, "current", ws);
-		xPL_setMessageNamedValue(msg, "units", "hertz");
+	metricsHeader(mb, "xplhan_responses_total", "counter", "Responses matched to a command.");
+	for(i = 0; i < busCount; i++){
+		if(!busList[i]->cmdLat)
+			continue;
+		for(j = 0; j < HAN_COMMANDS; j++)
+			metricsPrintf(mb, "xplhan_responses_total{bus=\"%s\",command=\"%s\"} %llu\n", busList[i]->name,
+			hanCommandMap[j].keyword, (unsigned long long) STAT_GET(busList[i]->cmdLat[j].h[LAT_RTT].count));
+	}
+	metricsHeader(mb, "xplhan_timeouts_total", "counter", "Commands which were never answered.");
+	for(i = 0; i < busCount; i++)
+		metricsPrintf(mb, "xplhan_timeouts_total{bus=\"%s\"} %llu\n", busList[i]->name, (unsigned long long) STAT_GET(busList[i]->timeouts));
+	metricsHeader(mb, "xplhan_connects_total", "counter", "Connections made to the HAN server.");
+	for(i = 0; i < busCount; i++)
+		metricsPrintf(mb, "xplhan_connects_total{bus=\"%s\"} %llu\n", busList[i]->name, (unsigned long long) STAT_GET(busList[i]->connects));
+	metricsHeader(mb, "xplhan_connect_failures_total", "counter", "Failed connection attempts to the HAN server.");
+	for(i = 0; i < busCount; i++)
+		metricsPrintf(mb, "xplhan_connect_failures_total{bus=\"%s\"} %llu\n", busList[i]->name, (unsigned long long) STAT_GET(busList[i]->connectFails));
+	metricsHeader(mb, "xplhan_triggers_sent_total", "counter", "Trigger messages sent for changed readings.");
+	for(i = 0; i < busCount; i++)
+		metricsPrintf(mb, "xplhan_triggers_sent_total{bus=\"%s\"} %llu\n", busList[i]->name, (unsigned long long) STAT_GET(busList[i]->triggers));
+	metricsHeader(mb, "xplhan_triggers_suppressed_total", "counter", "Polled readings not sent because they had not changed.");
+	for(i = 0; i < busCount; i++)
+		metricsPrintf(mb, "xplhan_triggers_suppressed_total{bus=\"%s\"} %llu\n", busList[i]->name, (unsigned long long) STAT_GET(busList[i]->suppressed));
+	
+	metricsHeader(mb, "xplhan_bus_utilization", "gauge", "Share of the bus busy with transactions over the last window.");
+	for(i = 0; i < busCount; i++){
+		if(busList[i]->nodes)
+			metricsPrintf(mb, "xplhan_bus_utilization{bus=\"%s\"} %.4f\n", busList[i]->name, statGetDouble(&busList[i]->utilization));
+	}
+	metricsHeader(mb, "xplhan_bus_wire_utilization", "gauge", "Share of the bus speed used by command and response bytes over the last window.");
+	for(i = 0; i < busCount; i++){
+		if(busList[i]->nodes)
+			metricsPrintf(mb, "xplhan_bus_wire_utilization{bus=\"%s\"} %.4f\n", busList[i]->name, statGetDouble(&busList[i]->wireUtilization));
+	}
+	metricsHeader(mb, "xplhan_bus_projected_utilization", "gauge", "Share of the bus the configured polling is expected to use.");
+	for(i = 0; i < busCount; i++){
+		if(busList[i]->nodes)
+			metricsPrintf(mb, "xplhan_bus_projected_utilization{bus=\"%s\"} %.4f\n", busList[i]->name, statGetDouble(&busList[i]->projected));
+	}
+	metricsHeader(mb, "xplhan_bus_busy_seconds_total", "counter", "Time the bus was busy with transactions.");
+	for(i = 0; i < busCount; i++)
+		metricsPrintf(mb, "xplhan_bus_busy_seconds_total{bus=\"%s\"} %.6f\n", busList[i]->name, STAT_GET(busList[i]->busyUs) / 1000000.0);
+	metricsHeader(mb, "xplhan_bus_bytes_total", "counter", "Command and response bytes exchanged with the HAN server.");
+	for(i = 0; i < busCount; i++){
+		metricsPrintf(mb, "xplhan_bus_bytes_total{bus=\"%s\",direction=\"tx\"} %llu\n", busList[i]->name, (unsigned long long) STAT_GET(busList[i]->txBytes));
+		metricsPrintf(mb, "xplhan_bus_bytes_total{bus=\"%s\",direction=\"rx\"} %llu\n", busList[i]->name, (unsigned long long) STAT_GET(busList[i]->rxBytes));
 	}
 	
-	/* Send the message */
-	
-	xPL_sendMessage(msg);
+	for(m = 0; m < NODE_METRICS; m++){
+		metricsHeader(mb, nodeMetrics[m][0], nodeMetrics[m][1], nodeMetrics[m][2]);
+		for(i = 0; i < busCount; i++){
+			bus = busList[i];
+			if(!bus->nodes)
+				continue;
+			for(j = 0; j < HAN_ADDRESSES; j++){
+				if(!(nc = bus->nodes[j]))
+					continue;
+				snprintf(labels, WS_SIZE, "%s{bus=\"%s\",address=\"%u\"", nodeMetrics[m][0], bus->name, j);
+				switch(m){
+					case 0:
+						metricsPrintf(mb, "%s} %.6f\n", labels, STAT_GET(nc->busyUs) / 1000000.0);
+						break;
+					case 1:
+						metricsPrintf(mb, "%s} %llu\n", labels, (unsigned long long) STAT_GET(nc->transactions));
+						break;
+					case 2:
+						metricsPrintf(mb, "%s} %llu\n", labels, (unsigned long long) STAT_GET(nc->failures));
+						break;
+					case 3:
+						metricsPrintf(mb, "%s,direction=\"tx\"} %llu\n", labels, (unsigned long long) STAT_GET(nc->txBytes));
+						metricsPrintf(mb, "%s,direction=\"rx\"} %llu\n", labels, (unsigned long long) STAT_GET(nc->rxBytes));
+						break;
+					case 4:
+						metricsPrintf(mb, "%s} %.4f\n", labels, statGetDouble(&nc->utilization));
+						break;
+					case 5:
+						metricsPrintf(mb, "%s} %.4f\n", labels, statGetDouble(&nc->tps));
+						break;
+					default:
+						metricsPrintf(mb, "%s} %.4f\n", labels, statGetDouble(&nc->failureRate));
+						break;
+				}
+			}
+		}
+	}
+	metricsHeader(mb, "xplhan_service_busy_seconds_total", "counter", "Bus time used by transactions for a service.");
+	for(i = 0; i < serviceHot.count; i++)
+		metricsPrintf(mb, "xplhan_service_busy_seconds_total{service=\"%s\"} %.6f\n", serviceHot.entry[i]->instance_id, STAT_GET(serviceHot.entry[i]->busyUs) / 1000000.0);
+	metricsHeader(mb, "xplhan_service_transactions_total", "counter", "Transactions for a service.");
+	for(i = 0; i < serviceHot.count; i++)
+		metricsPrintf(mb, "xplhan_service_transactions_total{service=\"%s\"} %llu\n", serviceHot.entry[i]->instance_id, (unsigned long long) STAT_GET(serviceHot.entry[i]->transactions));
+	
+	metricsHeader(mb, "xplhan_command_latency_seconds", "histogram", "Command latency by HAN command.");
+	for(i = 0; i < busCount; i++){
+		bus = busList[i];
+		if(!bus->cmdLat)
+			continue;
+		for(j = 0; j < HAN_COMMANDS; j++){
+			for(kind = 0; kind < LAT_KINDS; kind++){
+				if(!STAT_GET(bus->cmdLat[j].h[kind].count))
+					continue;
+				snprintf(labels, WS_SIZE, "bus=\"%s\",command=\"%s\",stage=\"%s\"", bus->name, hanCommandMap[j].keyword, stageNames[kind]);
+				metricsHisto(mb, "xplhan_command_latency_seconds", labels, &bus->cmdLat[j].h[kind]);
+			}
+		}
+	}
+	metricsHeader(mb, "xplhan_address_latency_seconds", "histogram", "Command latency by bus address.");
+	for(i = 0; i < busCount; i++){
+		bus = busList[i];
+		if(!bus->addrLat)
+			continue;
+		for(j = 0; j < HAN_ADDRESSES; j++){
+			if(!bus->addrLat[j])
+				continue;
+			for(kind = 0; kind < LAT_KINDS; kind++){
+				if(!STAT_GET(bus->addrLat[j]->h[kind].count))
+					continue;
+				snprintf(labels, WS_SIZE, "bus=\"%s\",address=\"%u\",stage=\"%s\"", bus->name, j, stageNames[kind]);
+				metricsHisto(mb, "xplhan_address_latency_seconds", labels, &bus->addrLat[j]->h[kind]);
+			}
+		}
+	}
 	
-	/* Release the resource */
+	metricsHeader(mb, "xplhan_timer_lateness_seconds", "histogram", "How long after its deadline each timer ran, by event loop.");
+	for(i = 0; i <= busCount; i++){
+		if(!(r = eventLoop(i, &name)))
+			continue;
+		snprintf(labels, WS_SIZE, "loop=\"%s\"", name);
+		reactorGetStats(r, &rs);
+		metricsHisto(mb, "xplhan_timer_lateness_seconds", labels, &rs.lateness);
+	}
+	metricsHeader(mb, "xplhan_callback_max_seconds", "gauge", "Longest time spent in one event loop callback, and the callback.");
+	for(i = 0; i <= busCount; i++){
+		if(!(r = eventLoop(i, &name)))
+			continue;
+		reactorGetStats(r, &rs);
+		if(rs.maxCallbackUs)
+			metricsPrintf(mb, "xplhan_callback_max_seconds{loop=\"%s\",callback=\"%s\"} %.6f\n", name, rs.maxCallback, rs.maxCallbackUs / 1000000.0);
+	}
+	metricsHeader(mb, "xplhan_loop_stalls_total", "counter", "Event loop callbacks which ran for longer than the stall threshold.");
+	for(i = 0; i <= busCount; i++){
+		if((r = eventLoop(i, &name))){
+			reactorGetStats(r, &rs);
+			metricsPrintf(mb, "xplhan_loop_stalls_total{loop=\"%s\"} %llu\n", name, (unsigned long long) rs.stalls);
+		}
+	}
+	metricsHeader(mb, "xplhan_late_timers_total", "counter", "Timers which ran more than the stall threshold after their deadline.");
+	for(i = 0; i <= busCount; i++){
+		if((r = eventLoop(i, &name))){
+			reactorGetStats(r, &rs);
+			metricsPrintf(mb, "xplhan_late_timers_total{loop=\"%s\"} %llu\n", name, (unsigned long long) rs.lateTimers);
+		}
+	}
 	
-	xPL_releaseMessage(msg);
-
+	if(!profEnabled)
+		return;
+	for(m = 0; m < PROF_COUNTERS + 1; m++){
+		if((m < PROF_COUNTERS) && (!profHaveCounter(m)))
+			continue;
+		metricsHeader(mb, stageMetrics[m][0], "counter", stageMetrics[m][1]);
+		for(kind = PROF_DECODE; kind < PROF_STAGES; kind++){
+			profGetCounts(kind, &pc);
+			if(m == PROF_TASK_NS)
+				metricsPrintf(mb, "%s{stage=\"%s\"} %.6f\n", stageMetrics[m][0], profStageName(kind), pc.value[m] / 1e9);
+			else
+				metricsPrintf(mb, "%s{stage=\"%s\"} %llu\n", stageMetrics[m][0], profStageName(kind),
+				(unsigned long long) ((m < PROF_COUNTERS) ? pc.value[m] : pc.entries));
+		}
+	}
+}
+
+/*
+* Log the counts for each stage of handling a response, when profiling
+*/
+
+static void logStageProfile(void)
+{
+	profCounts_t pc;
+	unsigned stage;
+	
+	if(!profEnabled)
+		return;
+	debug(DEBUG_STATUS, "Stage profile, counting %s%s, less %.1f us a mark:",
+	(profHaveCounter(PROF_CYCLES)) ? "cycles, instructions and task clock" : "task clock only",
+	(profUserOnly()) ? " in user space" : "", profMarkCost(PROF_TASK_NS) / 1000.0);
+	if(profMultiplexed())
+		debug(DEBUG_STATUS, "Counters were time shared with other events in %llu stage intervals, those counts are scaled estimates",
+		(unsigned long long) profMultiplexed());
+	for(stage = PROF_DECODE; stage < PROF_STAGES; stage++){
+		profGetCounts(stage, &pc);
+		if(!pc.entries)
+			continue;
+		if(profHaveCounter(PROF_CYCLES))
+			debug(DEBUG_STATUS, "Stage %s: %llu entries, %llu cycles and %llu instructions each, IPC %.2f, %.1f us each",
+			profStageName(stage), (unsigned long long) pc.entries, (unsigned long long) (pc.value[PROF_CYCLES] / pc.entries),
+			(unsigned long long) (pc.value[PROF_INSTRUCTIONS] / pc.entries),
+			(pc.value[PROF_CYCLES]) ? (double) pc.value[PROF_INSTRUCTIONS] / pc.value[PROF_CYCLES] : 0.0,
+			pc.value[PROF_TASK_NS] / (pc.entries * 1000.0));
+		else
+			debug(DEBUG_STATUS, "Stage %s: %llu entries, %.1f us each", profStageName(stage),
+			(unsigned long long) pc.entries, pc.value[PROF_TASK_NS] / (pc.entries * 1000.0));
+	}
+}
+
+/*
+* Log the statistics for an io_uring instance
+*/
+
+static void logUringStats(const String name, uringPtr_t u)
+{
+	const uringStats_t *us = uringGetStats(u);
+	
+	debug(DEBUG_STATUS, "io_uring %s: submits %llu, completions %llu, receives %llu, sends %llu, datagrams %llu, re-arms %llu",
+	name, (unsigned long long) us->submits, (unsigned long long) us->completions,
+	(unsigned long long) us->recvs, (unsigned long long) us->sends, (unsigned long long) us->datagrams,
+	(unsigned long long) us->rearms);
+}
+
+/*
+ * Wake a thread waiting on an eventfd
+ */
+
+static void wakeThread(int fd)
+{
+	uint64_t one = 1;
+	
+	if((write(fd, &one, sizeof(one)) < 0) && (errno != EAGAIN))
+		debug(DEBUG_UNEXPECTED, "wakeThread(): write to fd %d failed: %s", fd, strerror(errno));
+}
+
+/*
+* Threaded mode: stop the HAN threads and wait for them to exit, so that
+* nothing is running on the buses while shutdown reads their statistics
+* and releases the services. Each thread stops its own reactor when its
+* wakeup handler sees the stopping flag.
+*/
+
+static void stopHanThreads(void)
+{
+	hanBusPtr_t bus;
+	unsigned i;
+	int err;
+	
+	for(i = 0; i < busCount; i++){
+		bus = busList[i];
+		if(!bus->threadRunning)
+			continue;
+		__atomic_store_n(&bus->stopping, TRUE, __ATOMIC_RELEASE);
+		wakeThread(bus->wakeFd);
+	}
+	for(i = 0; i < busCount; i++){
+		bus = busList[i];
+		if(!bus->threadRunning)
+			continue;
+		if((err = pthread_join(bus->thread, NULL)))
+			debug(DEBUG_UNEXPECTED, "Could not join HAN thread for bus %s: %s", bus->name, strerror(err));
+		bus->threadRunning = FALSE;
+		debug(DEBUG_STATUS, "HAN I/O thread stopped for bus %s", bus->name);
+	}
+}
+
+
+/*
+* When the user hits ^C, logically shutdown
+* (including telling the network the service is ending)
+*/
+
+static void shutdownHandler(int onSignal)
+{
+	unsigned id;
+	serviceEntryPtr_t sp;
+	const xplfiltStats_t *fs = xplfiltGetStats();
+	const poolStats_t *ps;
+	const xplencStats_t *es;
+	struct rusage ru;
+	long long upMs;
+	
+	stopHanThreads();
+	upMs = reactorNowMs() - startMs;
+	if(upMs < 1)
+		upMs = 1;
+	getrusage(RUSAGE_SELF, &ru);
+	debug(DEBUG_STATUS, "Up %lld s, CPU time user %ld.%03ld s, system %ld.%03ld s", upMs / 1000,
+	(long) ru.ru_utime.tv_sec, (long) ru.ru_utime.tv_usec / 1000, (long) ru.ru_stime.tv_sec, (long) ru.ru_stime.tv_usec / 1000);
+	debug(DEBUG_STATUS, "Main loop: %llu wakeups, %.3f per second", (unsigned long long) reactorGetWakeups(mainReactor),
+	reactorGetWakeups(mainReactor) * 1000.0 / upMs);
+	if(mainUring)
+		logUringStats("main loop", mainUring);
+	logLatencies();
+	logUtilization(upMs);
+	logEventLoops();
+	logStageProfile();
+	/* Receive calls are ours, the sends which hand datagrams back, and xPLLib's reads: one a datagram, and one more to find the socket empty */
+	debug(DEBUG_STATUS, "xPL receive: %llu datagrams in %llu wakeups, %llu recvmmsg calls, %llu handed back to xPLLib, %llu read by xPLLib, %.2f receive system calls per datagram",
+	(unsigned long long) fs->examined, (unsigned long long) xplWakeups, (unsigned long long) xplRecvCalls,
+	(unsigned long long) xplHandedBack, (unsigned long long) xplLibReads,
+	(fs->examined) ? (double) (xplRecvCalls + xplHandedBack + xplLibReads + xplLibRuns) / fs->examined : 0.0);
+	if(nativeEncoder){
+		es = xplencGetStats();
+		debug(DEBUG_STATUS, "Native encoder: %llu messages in %llu send calls, %llu through io_uring",
+		(unsigned long long) es->messages, (unsigned long long) es->syscalls, (unsigned long long) es->handedOff);
+	}
+	debug(DEBUG_STATUS, "xPL prefilter: examined %llu, accepted %llu, library %llu, dropped %llu",
+	(unsigned long long) fs->examined, (unsigned long long) fs->accepted,
+	(unsigned long long) fs->lib, (unsigned long long) fs->dropped);
+	for(id = 0; id < busCount; id++){
+		if(!busList[id]->pool)
+			continue;
+		if(busList[id]->reactor != mainReactor)
+			debug(DEBUG_STATUS, "Bus %s thread: %llu wakeups, %.3f per second", busList[id]->name,
+			(unsigned long long) reactorGetWakeups(busList[id]->reactor), reactorGetWakeups(busList[id]->reactor) * 1000.0 / upMs);
+		if((busList[id]->uring) && (busList[id]->uring != mainUring))
+			logUringStats(busList[id]->name, busList[id]->uring);
+		ps = poolGetStats(busList[id]->pool);
+		debug(DEBUG_STATUS, "Bus %s work queue pool: allocs %llu, frees %llu, in use %u, peak %u, full %llu",
+		busList[id]->name, (unsigned long long) ps->allocs, (unsigned long long) ps->frees,
+		ps->in_use, ps->peak, (unsigned long long) ps->exhausted);
+	}
+	
+	for(id = serviceHot.count; id--;){
+		sp = serviceHot.entry[id];
+		if(sp->msg)
+			xPL_releaseMessage(sp->msg);
+		xplencFree(sp->enc);
+		xPL_setServiceEnabled(sp->xplService, FALSE);
+		xPL_releaseService(sp->xplService);
+		xPL_shutdown();
+	}
+	xplencShutdown();
+	traceClose();
+	/* Unlink the pid file if we can. */
+	(void) unlink(pidFile);
+	exit(0);
+}
+
+/*
+ * Write the flight recorder to its dump file
+ */
+
+static void dumpFlightRecorder(void)
+{
+	if(flightDump(flightFile))
+		debug(DEBUG_UNEXPECTED, "Flight recorder dumped to %s", flightFile);
+	else
+		debug(DEBUG_UNEXPECTED, "Could not dump flight recorder to %s: %s", flightFile, strerror(errno));
+}
+
+/*
+ * On the way out of a fatal error, dump the flight recorder and finish the trace file
+ */
+
+static void fatalHandler(void)
+{
+	dumpFlightRecorder();
+	traceClose();
+}
+
+/*
+ * Clear the count on an eventfd after a wakeup
+ */
+
+static void clearWakeup(int fd)
+{
+	uint64_t count;
+	
+	if((read(fd, &count, sizeof(count)) < 0) && (errno != EAGAIN))
+		debug(DEBUG_UNEXPECTED, "clearWakeup(): read from fd %d failed: %s", fd, strerror(errno));
+}
+
+/*
+ * Name one of a bus's sources in its reactor, for the stall warnings
+ */
+
+static void nameSource(reactorPtr_t r, int fd, const String what, hanBusPtr_t bus)
+{
+	char name[REACTOR_NAME_SIZE];
+	
+	snprintf(name, sizeof(name), "bus %s %s", bus->name, what);
+	reactorSetName(r, fd, name);
+}
+
+/*
+ * Have a bus's scheduler run as soon as its reactor gets to it
+ */
+
+static void kickBus(hanBusPtr_t bus)
+{
+	if(bus->timerFd >= 0)
+		reactorSetTimerAt(bus->reactor, bus->timerFd, 0);
+}
+
+/*
+ * Record a latency for a command's service, and for its command and address on its bus
+ */
+
+static void recordLatency(workQEntryPtr_t wq, latKind_t kind, uint64_t us)
+{
+	serviceEntryPtr_t sp = wq->sp;
+	
+	histoRecord(&sp->lat.h[kind], us);
+	histoRecord(&sp->bus->cmdLat[sp->cmd_index].h[kind], us);
+	histoRecord(&sp->bus->addrLat[sp->address]->h[kind], us);
+}
+
+/*
+ * Account for the bus time of a transaction which has ended, to its node and service
+ */
+
+static void accountTransaction(hanBusPtr_t bus, workQEntryPtr_t wq, unsigned rxBytes, Bool failed)
+{
+	serviceEntryPtr_t sp = wq->sp;
+	nodeCostPtr_t nc = bus->nodes[sp->address];
+	uint64_t busy = histoNowUs() - wq->sent_us;
+	
+	STAT_ADD(nc->transactions, 1);
+	if(failed)
+		STAT_ADD(nc->failures, 1);
+	STAT_ADD(nc->rxBytes, rxBytes);
+	STAT_ADD(nc->busyUs, busy);
+	STAT_ADD(sp->transactions, 1);
+	STAT_ADD(sp->busyUs, busy);
+	STAT_ADD(bus->busyUs, busy);
+}
+
+/*
+* Warn when the configured polling on a bus would take more of it than the budget allows
+*/
+
+static void checkUtilizationBudget(hanBusPtr_t bus)
+{
+	Bool over = (bus->projected * 100.0 > utilBudget);
+	
+	if((over) && (!bus->overBudget))
+		warn("Configured polling on bus %s would use %.1f%% of the bus, over the budget of %u%%",
+		bus->name, bus->projected * 100.0, utilBudget);
+	else if((!over) && (bus->overBudget))
+		debug(DEBUG_STATUS, "Configured polling on bus %s is back within budget at %.1f%%", bus->name, bus->projected * 100.0);
+	bus->overBudget = over;
+}
+
+/*
+* Update the rolling utilization figures of a bus and its nodes at the end of a window
+*/
+
+static void rollUtilization(hanBusPtr_t bus, long long now)
+{
+	nodeCostPtr_t nc;
+	uint64_t transactions, wireBytes = bus->txBytes + bus->rxBytes;
+	double secs = (now - bus->windowStart) / 1000.0;
+	unsigned i;
+	
+	if(secs <= 0)
+		return;
+	for(i = 0; i < HAN_ADDRESSES; i++){
+		if(!(nc = bus->nodes[i]))
+			continue;
+		transactions = nc->transactions - nc->lastTransactions;
+		statSetDouble(&nc->utilization, (nc->busyUs - nc->lastBusyUs) / (secs * 1000000.0));
+		statSetDouble(&nc->tps, transactions / secs);
+		statSetDouble(&nc->failureRate, (transactions) ? (double) (nc->failures - nc->lastFailures) / transactions : 0);
+		nc->lastTransactions = nc->transactions;
+		nc->lastFailures = nc->failures;
+		nc->lastBusyUs = nc->busyUs;
+	}
+	statSetDouble(&bus->utilization, (bus->busyUs - bus->lastBusyUs) / (secs * 1000000.0));
+	statSetDouble(&bus->wireUtilization, ((wireBytes - bus->lastWireBytes) * (double) HAN_CHAR_BITS) / (secs * bus->speed));
+	bus->lastBusyUs = bus->busyUs;
+	bus->lastWireBytes = wireBytes;
+	bus->windowStart = now;
+	bus->windowDue = now + UTIL_WINDOW_MS;
+	statSetDouble(&bus->projected, projectUtilization(bus));
+	checkUtilizationBudget(bus);
+}
+
+/*
+ * Free a work queue entry
+ */
+
+void freeWorkQueueEntry(workQEntryPtr_t wqe)
+{
+	if(wqe)
+		poolPut(wqe->sp->bus->pool, wqe);
+}
+
+/*
+ * Close the han socket after an error or EOF.
+ * It is re-opened when the next command is sent.
+ * A command in flight will not be answered, so it is dropped.
+ */
+
+static void closeHanSocket(hanBusPtr_t bus)
+{
+	hantransClose(bus->trans);
+	bus->cmdFail = TRUE;
+	flightRecord(FLIGHT_DISCONNECT, bus->id, (bus->pendingResponse) ? bus->pendingResponse->sp->service_id : FLIGHT_NONE, 0);
+	PROBE2(han_disconnect, bus->id, (bus->pendingResponse) ? bus->pendingResponse->sp->service_id : FLIGHT_NONE);
+	if(bus->pendingResponse)
+		accountTransaction(bus, bus->pendingResponse, 0, TRUE);
+	freeWorkQueueEntry(bus->pendingResponse);
+	STAT_SET(bus->pendingResponse, NULL);
+	kickBus(bus);
+}
+
+/* 
+ * Dequeue work Queue Entry
+ */
+  
+workQEntryPtr_t dequeueWorkQueueEntry(hanBusPtr_t bus)
+{
+	workQEntryPtr_t res = NULL;
+	
+	if(!ringPop(bus->workQ, &res))
+		return NULL;
+	return res;	
+}
+
+/* 
+ * Add a command to the work queue, with the time it was first queued,
+ * and its transaction ID if it is being traced.
+ * queuedUs is 0 for now.
+ */
+
+static void queueCommandAt(const String cmd, serviceEntryPtr_t sp, Bool isPoll, uint64_t queuedUs, uint32_t txn)
+{
+
+	workQEntryPtr_t wq = NULL;
+	workQEntry_t req;
+	hanBusPtr_t bus = sp->bus;
+	
+	/* In threaded mode, commands from the xPL thread are handed to the bus's HAN thread */
+	if((threadedMode) && (!onHanThread)){
+		req.is_poll = isPoll;
+		req.txn = txn;
+		req.queued_us = histoNowUs();
+		req.sp = sp;
+		confreadStringCopy(req.cmd, cmd, WORKQ_CMD_SIZE);
+		if(!ringPush(bus->requests, &req)){
+			flightRecord(FLIGHT_DROP, bus->id, sp->service_id, isPoll);
+			PROBE4(command_drop, bus->id, sp->service_id, sp->address, isPoll);
+			debug(DEBUG_UNEXPECTED, "Bus %s request queue full, dropping command: %s", bus->name, cmd);
+		}
+		else
+			wakeThread(bus->wakeFd);
+		return;
+	}
+	
+	/* Get a work queue entry from the pool, drop the command if the queue is full */
+	if(!(wq = poolGet(bus->pool))){
+		flightRecord(FLIGHT_DROP, bus->id, sp->service_id, isPoll);
+		PROBE4(command_drop, bus->id, sp->service_id, sp->address, isPoll);
+		debug(DEBUG_UNEXPECTED, "Bus %s work queue full, dropping command: %s", bus->name, cmd);
+		return;
+	}
+	debug(DEBUG_ACTION, "queueCommand()");
+	confreadStringCopy(wq->cmd, cmd, WORKQ_CMD_SIZE);
+	wq->is_poll = isPoll;
+	wq->txn = txn;
+	wq->queued_us = (queuedUs) ? queuedUs : histoNowUs();
+	wq->sp = sp;
+	
+	if(!ringPush(bus->workQ, &wq)){
+		flightRecord(FLIGHT_DROP, bus->id, sp->service_id, isPoll);
+		PROBE4(command_drop, bus->id, sp->service_id, sp->address, isPoll);
+		debug(DEBUG_UNEXPECTED, "Bus %s work queue full, dropping command: %s", bus->name, cmd);
+		freeWorkQueueEntry(wq);
+		return;
+	}
+	flightRecord(FLIGHT_ENQUEUE, bus->id, sp->service_id, isPoll);
+	PROBE4(command_queue, bus->id, sp->service_id, sp->address, isPoll);
+	if(!bus->pendingResponse)
+		kickBus(bus); /* Bus is idle, send it now */
+}
+
+/* 
+ * Add a command to the work queue.
+ * A request takes the transaction ID of the xPL message being dispatched.
+ */
+ 
+void queueCommand(const String cmd, serviceEntryPtr_t sp, Bool isPoll)
+{
+	queueCommandAt(cmd, sp, isPoll, 0, (isPoll) ? 0 : traceTxn);
+}
+
+/*
+ * Build the sensor.basic message template for a service.
+ * Everything except the message type, device and current value is fixed
+ * for the life of the service, so the message is only built once.
+ */
+
+static void buildServiceMessage(serviceEntryPtr_t sp)
+{
+	char source[WS_SIZE];
+	
+	if(!sp->is_sensor)
+		return; /* Only sensors send sensor.basic messages */
+		
+	if(nativeEncoder){ /* Use the native encoder */
+		snprintf(source, WS_SIZE, "hwstar-xplhan.%s", sp->instance_id);
+		if(!(sp->enc = xplencCreate(source, "sensor", "basic", "0", sp->sensor_type, sp->units_keyword)))
+			fatal("Could not create native message template for instance %s", sp->instance_id);
+		return;
+	}
+		
+	if(!(sp->msg = xPL_createBroadcastMessage(sp->xplService, xPL_MESSAGE_STATUS)))
+		fatal("Could not create message template for instance %s", sp->instance_id);
+	xPL_setSchema(sp->msg, "sensor", "basic");
+	xPL_setMessageNamedValue(sp->msg, "device", "0");
+	xPL_setMessageNamedValue(sp->msg, "type", sp->sensor_type);
+	xPL_setMessageNamedValue(sp->msg, "current", "");
+	if(sp->units_keyword)
+		xPL_setMessageNamedValue(sp->msg, "units", sp->units_keyword);
+}
+
+/*
+ * Send a sensor message on the xPL thread.
+ * If current is NULL, the current value is value with the service's precision.
+ */
+
+static void deliverServiceMessage(serviceEntryPtr_t sp, int msgType, String device, String current, fixpt_t value, uint32_t txn)
+{
+	uint64_t startUs = (txn) ? histoNowUs() : 0;
+	char ws[FMTNUM_SIZE];
+	
+	/*
+	 * Formatting the value and filling in the message is formatting, the encoder or xPLLib call is the send.
+	 * The native encoder formats the value straight into the datagram, so that is counted as the send.
+	 */
+	profEnter(PROF_FORMAT);
+	if(sp->enc){ /* Native encoder */
+		profEnter(PROF_XPL_SEND);
+		if(current)
+			xplencSend(sp->enc, (msgType == xPL_MESSAGE_TRIGGER) ? XPLENC_TRIG : XPLENC_STAT, device, current);
+		else
+			xplencSendFixed(sp->enc, (msgType == xPL_MESSAGE_TRIGGER) ? XPLENC_TRIG : XPLENC_STAT, device, value, sp->precision);
+		xplSent++;
+	}
+	else if(!sp->msg){
+		debug(DEBUG_UNEXPECTED, "deliverServiceMessage(): No message template for instance %s", sp->instance_id);
+		profLeave();
+		return;
+	}
+	else{
+		if(!current){
+			if(fmtnumFixed(ws, sizeof(ws), value, sp->precision) < 0){
+				debug(DEBUG_UNEXPECTED, "deliverServiceMessage(): Value too long for instance %s", sp->instance_id);
+				profLeave();
+				return;
+			}
+			current = ws;
+		}
+		xPL_setMessageType(sp->msg, msgType);
+		if(device)
+			xPL_setMessageNamedValue(sp->msg, "device", device);
+		xPL_setMessageNamedValue(sp->msg, "current", current);
+		profEnter(PROF_XPL_SEND);
+		xPL_sendMessage(sp->msg);
+		xplSent++;
+	}
+	profLeave();
+	PROBE2(xpl_send, sp->service_id, (msgType == xPL_MESSAGE_TRIGGER));
+	if(txn)
+		traceSpan(txn, "xpl send", startUs, histoNowUs(), sp->instance_id);
+}
+
+/*
+ * Send a sensor.basic message using the service's template.
+ * If device is NULL, the device in the template is left alone.
+ * If current is NULL, value is sent, formatted with the service's precision
+ * where the message is built.
+ */
+
+static void sendServiceMessage(serviceEntryPtr_t sp, int msgType, String device, String current, fixpt_t value)
+{
+	outboxEntry_t out;
+	
+	if(msgType == xPL_MESSAGE_TRIGGER)
+		STAT_ADD(sp->bus->triggers, 1);
+	flightRecord(FLIGHT_TRIGGER, sp->bus->id, sp->service_id, (msgType == xPL_MESSAGE_TRIGGER));
+	PROBE3(action_emit, sp->service_id, sp->address, (msgType == xPL_MESSAGE_TRIGGER));
+	if(onHanThread){ /* Threaded mode, the xPL thread sends the message */
+		out.sp = sp;
+		out.msgType = msgType;
+		out.txn = traceTxn;
+		out.queued_us = (traceTxn) ? histoNowUs() : 0;
+		out.has_device = (device) ? TRUE : FALSE;
+		confreadStringCopy(out.device, (device) ? device : "", OUTBOX_DEVICE_SIZE);
+		out.has_current = (current) ? TRUE : FALSE;
+		out.value = value;
+		confreadStringCopy(out.current, (current) ? current : "", OUTBOX_CURRENT_SIZE);
+		if(!ringPushMP(xplOutbox, &out)) /* Shared by all the HAN threads */
+			debug(DEBUG_UNEXPECTED, "xPL outbox full, dropping message for instance %s", sp->instance_id);
+		else
+			wakeThread(outboxFd);
+		return;
+	}
+	deliverServiceMessage(sp, msgType, device, current, value, traceTxn);
+}
+
+/*
+ * Count a polled reading which is not sent because it has not changed
+ */
+
+static void suppressReading(serviceEntryPtr_t sp)
+{
+	STAT_ADD(sp->bus->suppressed, 1);
+	PROBE2(action_suppress, sp->service_id, sp->address);
+}
+
+/*
+ * Act on the response from a GOUT command
+ */
+ 
+void GOUTAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
+{
+	int msgType = xPL_MESSAGE_STATUS;
+	char *res, dev[12];
+	serviceEntryPtr_t sp = NULL;
+	
+
+
+	if((!resp) ||(!wq) || (!wq->sp))
+		return;
+		
+	sp = wq->sp;
+	
+	/* Check for correct number of parameters */
+	
+	if(pcount != 3){
+		debug(DEBUG_UNEXPECTED, "GOUTAction(): Received an incorrect number of parameters, got %u, need 3", pcount);
+		return;
+	}
+
+	if(resp->params[1] != 2)
+		return; /* Only respond when status is requested */
+		
+	/* Conversion statements */
+	if(resp->params[2] == 1)
+		res = "high";
+	else if(resp->params[2] == 0)
+		res = "low";
+	else{
+		debug(DEBUG_UNEXPECTED,"Unexpected state received: %d", resp->params[2]);
+		return; 
+	}
+	
+	/* Format device as string */
+	snprintf(dev, 12, "%d", resp->params[0]);
+
+	/* Test for change */
+	
+	if(wq->is_poll){ /* Was this the result of a poll */
+		if(resp->params[2] == serviceHot.poll_last[sp->service_id]){ /* Was there a change ? */
+			suppressReading(sp);
+			return;
+		}
+		debug(DEBUG_EXPECTED, "Sending trigger");
+		serviceHot.poll_last[sp->service_id] = resp->params[2];
+		msgType = xPL_MESSAGE_TRIGGER;
+	}
+	
+	/* Send the message */
+	sendServiceMessage(sp, msgType, dev, res, 0);
+
+}
+
+
+/*
+ * Act on the response from a GACD command
+ */
+ 
+void GACDAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
+{
+	int msgType = xPL_MESSAGE_STATUS;
+	uint_least16_t voltsX10, freqX100;
+	fixpt_t val;
+	serviceEntryPtr_t sp = NULL;
+
+	if((!resp) ||(!wq) || (!wq->sp))
+		return;
+		
+	sp = wq->sp;
+	
+	
+	/* Check for correct number of parameters */
+	
+	if(pcount != 4){
+		debug(DEBUG_UNEXPECTED, "GACDAction(): Received an incorrect number of parameters, got %u, need 4", pcount);
+		return;
+	}
+	/* Conversion statements */
+	
+	voltsX10 = (((uint_least16_t) resp->params[1]) << 8) + resp->params[0];
+	freqX100 = (((uint_least16_t) resp->params[3]) << 8) + resp->params[2];
+	if(sp->units == VOLTS)
+		val = fixptScale(voltsX10, ((int) sp->precision) - 1);
+	else
+		val = fixptScale(freqX100, ((int) sp->precision) - 2);
+	
+	debug(DEBUG_ACTION, "AC %s = %lld x 10^-%u", (sp->units == VOLTS) ? "Volts" : "Frequency", (long long) val, sp->precision);
+	
+	/* Test for change */
+	
+	
+	if(wq->is_poll){ /* Was this the result of a poll */
+		if(serviceHot.poll_fx_last[sp->service_id] == val){ /* Was there a change ? */
+			suppressReading(sp);
+			return;
+		}
+		debug(DEBUG_EXPECTED, "Sending trigger");
+		serviceHot.poll_fx_last[sp->service_id] = val;
+		msgType = xPL_MESSAGE_TRIGGER;
+	}
+
+	/* Send the message */
+	sendServiceMessage(sp, msgType, NULL, NULL, val);
+
 }
 
 
@@ -634,12 +1768,10 @@ void GACDAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
 
 void GTMPAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
 {
-	int val = 0;
+	fixpt_t val = 0;
 	int msgType = xPL_MESSAGE_STATUS;
-	char ws[12];
 	unsigned countsPerC;
 	int_least16_t rawTemp;
-	xPL_MessagePtr msg = NULL;
 	serviceEntryPtr_t sp = NULL;
 	
 	if((!resp) ||(!wq) || (!wq->sp))
@@ -654,14 +1786,20 @@ void GTMPAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
 	countsPerC = (unsigned) resp->params[1];
 	rawTemp = (int_least16_t) ((((uint_least16_t) resp->params[4]) << 8) + resp->params[3]);
 	
-	printf("Raw temp = %d, counts per c = %d\n", rawTemp, countsPerC);
+	debug(DEBUG_ACTION, "GTMPAction(): Raw temp = %d, counts per C = %u", rawTemp, countsPerC);
 	
-	/* Do conversion per units field */
+	if(!countsPerC){
+		debug(DEBUG_UNEXPECTED, "GTMPAction(): Counts per degree C is zero");
+		return;
+	}
+	
+	/* Do conversion per units field. Truncated toward zero at the service's precision, as it always has been */
 	if(sp->units == CELSIUS){
-		val = rawTemp / countsPerC;
+		val = fixptScale(rawTemp, sp->precision) / (int64_t) countsPerC;
 	}
 	else if (sp->units == FAHRENHEIT){
-		val = (9 * ((int) rawTemp))/(5 * ((int) countsPerC)) + 32;
+		val = fixptScale(9 * ((int64_t) rawTemp), sp->precision) / (5 * ((int64_t) countsPerC)) +
+		fixptScale(32, sp->precision);
 	}
 	else{
 		debug(DEBUG_UNEXPECTED, "GTMPAction(): Invalid unit for conversion");
@@ -670,25 +1808,18 @@ void GTMPAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
 
 	
 	if(wq->is_poll){ /* Was this the result of a poll */
-		if(val == sp->poll_last) /* Was there a change ? */
+		if(val == serviceHot.poll_fx_last[sp->service_id]){ /* Was there a change ? */
+			suppressReading(sp);
 			return;
+		}
 		debug(DEBUG_EXPECTED, "Sending trigger");
-		sp->poll_last = val;
+		serviceHot.poll_fx_last[sp->service_id] = val;
 		msgType = xPL_MESSAGE_TRIGGER;
 	}
 	
 
-	
-	if(!(msg = xPL_createBroadcastMessage(sp->xplService, msgType)))
-		debug(DEBUG_UNEXPECTED, "GTMPaction(): Could not create message");
-	xPL_setSchema(msg,"sensor","basic");
-	xPL_setMessageNamedValue(msg, "device", "0"); 
-	xPL_setMessageNamedValue(msg, "type", "temp");
-	snprintf(ws, 10, "%d", val);
-	xPL_setMessageNamedValue(msg, "current", ws);
-	xPL_setMessageNamedValue(msg, "units", (sp->units == CELSIUS) ? "celsius" : "fahrenheit");
-	xPL_sendMessage(msg);
-	xPL_releaseMessage(msg);
+	/* Send the message */
+	sendServiceMessage(sp, msgType, NULL, NULL, val);
 
 }
 
@@ -700,13 +1831,11 @@ void GTMPAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
 void GVLTAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
 {
 	int msgType = xPL_MESSAGE_STATUS;
-	xPL_MessagePtr msg = NULL;
 	serviceEntryPtr_t sp = NULL;
 	uint32_t voltres;
 	int8_t voltexp;
 	uint16_t rawvolts;
-	float voltage;
-	char ws[12];
+	fixpt_t voltage;
 	
 	if((!resp) ||(!wq) || (!wq->sp))
 		return;
@@ -735,34 +1864,24 @@ void GVLTAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
 	
 	/* Scale result */
 
-	voltage = ((float) rawvolts) * ((float)voltres)*powf(10.0,voltexp);
-	debug(DEBUG_ACTION, "GVLTAction(): Voltage = %3.3f", voltage);
+	voltage = fixptScale(((int64_t) rawvolts) * ((int64_t) voltres), voltexp + (int) sp->precision);
+	debug(DEBUG_ACTION, "GVLTAction(): Voltage = %lld x 10^-%u", (long long) voltage, sp->precision);
 
 
 	/* Test for change */
 	
 	if(wq->is_poll){ /* Was this the result of a poll */
-		if(voltage == sp->poll_f_last) /* Was there a change ? */
+		if(voltage == serviceHot.poll_fx_last[sp->service_id]){ /* Was there a change ? */
+			suppressReading(sp);
 			return;
+		}
 		debug(DEBUG_EXPECTED, "Sending trigger");
-		sp->poll_f_last = voltage;
+		serviceHot.poll_fx_last[sp->service_id] = voltage;
 		msgType = xPL_MESSAGE_TRIGGER;
 	}
 	
-    /* Send message */
-    
-	if(!(msg = xPL_createBroadcastMessage(sp->xplService, msgType))){
-		debug(DEBUG_UNEXPECTED, "GVLTaction(): Could not create message");
-		return;
-	}
-	xPL_setSchema(msg,"sensor","basic");
-	xPL_setMessageNamedValue(msg, "device", "0"); 
-	xPL_setMessageNamedValue(msg, "type", "volts");
-	snprintf(ws, 10, "%3.3f", voltage);
-	xPL_setMessageNamedValue(msg, "current", ws);
-	xPL_setMessageNamedValue(msg, "units", "volts");
-	xPL_sendMessage(msg);
-	xPL_releaseMessage(msg);
+	/* Send the message */
+	sendServiceMessage(sp, msgType, NULL, NULL, voltage);
 }
 
 /*
@@ -773,13 +1892,11 @@ void GVLTAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
 void GCURAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
 {
 	int msgType = xPL_MESSAGE_STATUS;
-	xPL_MessagePtr msg = NULL;
 	serviceEntryPtr_t sp = NULL;
 	uint32_t ampsres;
 	int8_t ampsexp;
 	int16_t rawamps;
-	float amps;
-	char ws[12];
+	fixpt_t amps;
 	union {
 		int16_t amps16;
 		uint8_t amps8[2];
@@ -822,34 +1939,24 @@ void GCURAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
 	
 	/* Scale result */
 
-	amps = ((float) rawamps) * ((float)ampsres)*powf(10.0,ampsexp);
-	debug(DEBUG_ACTION, "GCURAction(): Amps = %3.3f", amps);
+	amps = fixptScale(((int64_t) rawamps) * ((int64_t) ampsres), ampsexp + (int) sp->precision);
+	debug(DEBUG_ACTION, "GCURAction(): Amps = %lld x 10^-%u", (long long) amps, sp->precision);
 
 
 	/* Test for change */
 	
 	if(wq->is_poll){ /* Was this the result of a poll */
-		if(amps == sp->poll_f_last) /* Was there a change ? */
+		if(amps == serviceHot.poll_fx_last[sp->service_id]){ /* Was there a change ? */
+			suppressReading(sp);
 			return;
+		}
 		debug(DEBUG_EXPECTED, "Sending trigger");
-		sp->poll_f_last = amps;
+		serviceHot.poll_fx_last[sp->service_id] = amps;
 		msgType = xPL_MESSAGE_TRIGGER;
 	}
 	
-    /* Send message */
-    
-	if(!(msg = xPL_createBroadcastMessage(sp->xplService, msgType))){
-		debug(DEBUG_UNEXPECTED, "GCURaction(): Could not create message");
-		return;
-	}
-	xPL_setSchema(msg,"sensor","basic");
-	xPL_setMessageNamedValue(msg, "device", "0"); 
-	xPL_setMessageNamedValue(msg, "type", "amps");
-	snprintf(ws, 10, "%3.3f", amps);
-	xPL_setMessageNamedValue(msg, "current", ws);
-	xPL_setMessageNamedValue(msg, "units", "amps");
-	xPL_sendMessage(msg);
-	xPL_releaseMessage(msg);
+	/* Send the message */
+	sendServiceMessage(sp, msgType, NULL, NULL, amps);
 }
 
 /*
@@ -858,12 +1965,10 @@ void GCURAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
 
 void GHUMAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
 {
-	float val = 0;
+	fixpt_t val = 0;
 	int msgType = xPL_MESSAGE_STATUS;
-	char ws[12];
 	unsigned countsPerRHP;
 	int_least16_t rawHum;
-	xPL_MessagePtr msg = NULL;
 	serviceEntryPtr_t sp = NULL;
 	
 	if((!resp) ||(!wq) || (!wq->sp))
@@ -885,8 +1990,13 @@ void GHUMAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
 	
 	/* Do conversion per units field */
 
+	if(!countsPerRHP){
+		debug(DEBUG_UNEXPECTED, "GHUMAction(): Counts per percent RH is zero");
+		return;
+	}
+
 	if (sp->units == PERCENTRH){
-		val = ((float) rawHum)/((int) countsPerRHP);
+		val = fixptScaleDiv(rawHum, sp->precision, countsPerRHP);
 	}
 	else{
 		debug(DEBUG_UNEXPECTED, "GHUMAction(): Invalid unit for conversion");
@@ -895,25 +2005,18 @@ void GHUMAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
 
 	
 	if(wq->is_poll){ /* Was this the result of a poll */
-		if(val == sp->poll_f_last) /* Was there a change ? */
+		if(val == serviceHot.poll_fx_last[sp->service_id]){ /* Was there a change ? */
+			suppressReading(sp);
 			return;
+		}
 		debug(DEBUG_EXPECTED, "Sending trigger");
-		sp->poll_f_last = val;
+		serviceHot.poll_fx_last[sp->service_id] = val;
 		msgType = xPL_MESSAGE_TRIGGER;
 	}
 	
 
-	
-	if(!(msg = xPL_createBroadcastMessage(sp->xplService, msgType)))
-		debug(DEBUG_UNEXPECTED, "GHUMaction(): Could not create message");
-	xPL_setSchema(msg,"sensor","basic");
-	xPL_setMessageNamedValue(msg, "device", "0"); 
-	xPL_setMessageNamedValue(msg, "type", "humidity");
-	snprintf(ws, 10, "%2.1f", val);
-	xPL_setMessageNamedValue(msg, "current", ws);
-	xPL_setMessageNamedValue(msg, "units", "%rh");
-	xPL_sendMessage(msg);
-	xPL_releaseMessage(msg);
+	/* Send the message */
+	sendServiceMessage(sp, msgType, NULL, NULL, val);
 
 }
 
@@ -923,13 +2026,11 @@ void GHUMAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
 
 void GWSPAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
 {
-	float val;
+	fixpt_t val;
 	int msgType = xPL_MESSAGE_STATUS;
-	char ws[12];
 	uint_least32_t counts;
 	uint_least16_t mantissa;
 	int_least8_t exponent;
-	xPL_MessagePtr msg = NULL;
 	serviceEntryPtr_t sp = NULL;
 	
 	if((!resp) ||(!wq) || (!wq->sp))
@@ -945,45 +2046,41 @@ void GWSPAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
 	mantissa =  ((((uint_least16_t) resp->params[3]) << 8) + resp->params[2]);
 	counts =  ((((uint_least32_t) resp->params[5]) << 8) + resp->params[4]);
 	
-	printf("Raw counts  = %u", counts);
-	
-	/* Calculate result */
-	val =  ((float)mantissa)*powf(10.0,exponent) / (float) counts;
-	debug(DEBUG_ACTION, "GWSPAction(): Windspeed = %3.1f kmh", val);
-	
+	debug(DEBUG_ACTION, "GWSPAction(): Raw counts = %u", counts);
 	
+	if(!counts){
+		debug(DEBUG_UNEXPECTED, "GWSPAction(): Count is zero");
+		return;
+	}
 	
-	/* Do conversion per units field */
+	/* Calculate result and do conversion per units field */
+	/* MPH = KMH * 0.621371, folded into the divisor so there is only one rounding step */
 
-	if (sp->units == KMH);
+	if (sp->units == KMH)
+		val = fixptScaleDiv(mantissa, exponent + (int) sp->precision, counts);
 	else if(sp->units == MPH)
-		val *= 0.621371;
+		val = fixptScaleDiv(((int64_t) mantissa) * 621371, exponent + (int) sp->precision, ((int64_t) counts) * 1000000);
 	else{
+		val = 0;
 		debug(DEBUG_UNEXPECTED, "GWSPAction(): Invalid unit for conversion");
 	}
+	debug(DEBUG_ACTION, "GWSPAction(): Windspeed = %lld x 10^-%u %s", (long long) val, sp->precision, (sp->units == KMH)? "kmh":"mph");
 
 
 	
 	if(wq->is_poll){ /* Was this the result of a poll */
-		if(val == sp->poll_f_last) /* Was there a change ? */
+		if(val == serviceHot.poll_fx_last[sp->service_id]){ /* Was there a change ? */
+			suppressReading(sp);
 			return;
+		}
 		debug(DEBUG_EXPECTED, "Sending trigger");
-		sp->poll_f_last = val;
+		serviceHot.poll_fx_last[sp->service_id] = val;
 		msgType = xPL_MESSAGE_TRIGGER;
 	}
 	
 
-	
-	if(!(msg = xPL_createBroadcastMessage(sp->xplService, msgType)))
-		debug(DEBUG_UNEXPECTED, "GWSPaction(): Could not create message");
-	xPL_setSchema(msg,"sensor","basic");
-	xPL_setMessageNamedValue(msg, "device", "0"); 
-	xPL_setMessageNamedValue(msg, "type", "windspeed");
-	snprintf(ws, 10, "%3.1f", val);
-	xPL_setMessageNamedValue(msg, "current", ws);
-	xPL_setMessageNamedValue(msg, "units", (sp->units == KMH)? "kmh":"mph");
-	xPL_sendMessage(msg);
-	xPL_releaseMessage(msg);
+	/* Send the message */
+	sendServiceMessage(sp, msgType, NULL, NULL, val);
 
 }
 
@@ -997,7 +2094,6 @@ void GWDRAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
 	int msgType = xPL_MESSAGE_STATUS;
 	char *wd;
 	unsigned char dircode;
-	xPL_MessagePtr msg = NULL;
 	serviceEntryPtr_t sp = NULL;
 
 	
@@ -1038,23 +2134,18 @@ void GWDRAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
 	debug(DEBUG_EXPECTED, "wd = %s", wd);
 	
 	if(wq->is_poll){ /* Was this the result of a poll */
-		if(dircode == sp->poll_last) /* Was there a change ? */
+		if(dircode == serviceHot.poll_last[sp->service_id]){ /* Was there a change ? */
+			suppressReading(sp);
 			return;
+		}
 		debug(DEBUG_EXPECTED, "Sending trigger");
-		sp->poll_last = dircode;
+		serviceHot.poll_last[sp->service_id] = dircode;
 		msgType = xPL_MESSAGE_TRIGGER;
 	}
 	
 
-	
-	if(!(msg = xPL_createBroadcastMessage(sp->xplService, msgType)))
-		debug(DEBUG_UNEXPECTED, "GWDRaction(): Could not create message");
-	xPL_setSchema(msg,"sensor","basic");
-	xPL_setMessageNamedValue(msg, "device", "0"); 
-	xPL_setMessageNamedValue(msg, "type", "winddir");
-	xPL_setMessageNamedValue(msg, "current", wd);
-	xPL_sendMessage(msg);
-	xPL_releaseMessage(msg);
+	/* Send the message */
+	sendServiceMessage(sp, msgType, NULL, wd, 0);
 
 }
 
@@ -1064,13 +2155,11 @@ void GWDRAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
 
 void GRGCAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
 {
-	float val;
+	fixpt_t val;
 	int msgType = xPL_MESSAGE_STATUS;
-	char ws[12];
 	uint_least32_t counts;
 	uint_least16_t mantissa;
 	int_least8_t exponent;
-	xPL_MessagePtr msg = NULL;
 	serviceEntryPtr_t sp = NULL;
 	
 	if((!resp) ||(!wq) || (!wq->sp))
@@ -1089,45 +2178,36 @@ void GRGCAction(unsigned char pcount, responsePtr_t resp, workQEntryPtr_t wq)
 			  (((uint32_t) resp->params[7]) * 65536) +
 			  (((uint32_t) resp->params[8]) * 16777216);
 
-	printf("Raw counts  = %u", counts);
-	
-	/* Calculate result */
-	val =  ((float)mantissa)*powf(10.0,exponent) * (float) counts;
-	debug(DEBUG_ACTION, "GRGCAction(): Raingauge = %6.3f mm", val);
-	
+	debug(DEBUG_ACTION, "GRGCAction(): Raw counts = %u", counts);
 	
-	
-	/* Do conversion per units field */
+	/* Calculate result and do conversion per units field */
+	/* Inches = MM / 25.4, folded into the divisor so there is only one rounding step */
 
-	if (sp->units == MM);
+	if (sp->units == MM)
+		val = fixptScale(((int64_t) mantissa) * ((int64_t) counts), exponent + (int) sp->precision);
 	else if(sp->units == IN)
-		val /= 25.4;
+		val = fixptScaleDiv(((int64_t) mantissa) * ((int64_t) counts) * 10, exponent + (int) sp->precision, 254);
 	else{
+		val = 0;
 		debug(DEBUG_UNEXPECTED, "GRGCAction(): Invalid unit for conversion");
 	}
+	debug(DEBUG_ACTION, "GRGCAction(): Raingauge = %lld x 10^-%u %s", (long long) val, sp->precision, (sp->units == MM) ? "mm" : "in");
 
 
 	
 	if(wq->is_poll){ /* Was this the result of a poll */
-		if(val == sp->poll_f_last) /* Was there a change ? */
+		if(val == serviceHot.poll_fx_last[sp->service_id]){ /* Was there a change ? */
+			suppressReading(sp);
 			return;
+		}
 		debug(DEBUG_EXPECTED, "Sending trigger");
-		sp->poll_f_last = val;
+		serviceHot.poll_fx_last[sp->service_id] = val;
 		msgType = xPL_MESSAGE_TRIGGER;
 	}
 	
 
-	
-	if(!(msg = xPL_createBroadcastMessage(sp->xplService, msgType)))
-		debug(DEBUG_UNEXPECTED, "GRGCaction(): Could not create message");
-	xPL_setSchema(msg,"sensor","basic");
-	xPL_setMessageNamedValue(msg, "device", "0"); 
-	xPL_setMessageNamedValue(msg, "type", "raingauge");
-	snprintf(ws, 10, "%6.3f", val);
-	xPL_setMessageNamedValue(msg, "current", ws);
-	xPL_setMessageNamedValue(msg, "units", (sp->units == KMH)? "mm.":"in.");
-	xPL_sendMessage(msg);
-	xPL_releaseMessage(msg);
+	/* Send the message */
+	sendServiceMessage(sp, msgType, NULL, NULL, val);
 
 }
 
@@ -1157,12 +2237,20 @@ uint_least8_t hex2(String s)
  * Decode the response, and figure out what to do with it
  */
  
-static void decodeResponse(String r)
+static void decodeResponse(hanBusPtr_t bus, String r)
 {
+	workQEntryPtr_t pendingResponse = bus->pendingResponse;
 	int i, pcount;
+	unsigned rxBytes = strlen(r) + 1;
+	uint64_t rxUs = histoNowUs();
+	Bool matched = FALSE;
 	response_t response;
 	
+	profEnter(PROF_DECODE);
 	debug(DEBUG_ACTION, "Line received: %s", r);
+	STAT_ADD(bus->rxBytes, rxBytes);
+	flightRecord(FLIGHT_RECEIVE, bus->id, (pendingResponse) ? pendingResponse->sp->service_id : FLIGHT_NONE, rxBytes);
+	PROBE2(response_receive, bus->id, rxBytes);
 	if(!strncmp(r, "RS", 2)){
 		response.address = hex2(r + 2);
 		response.command = hex2(r + 4);
@@ -1173,6 +2261,15 @@ static void decodeResponse(String r)
 		debug_hexdump(DEBUG_ACTION, &response, pcount + 2, "Binary response dump: ");
 		if((pendingResponse) && (pendingResponse->sp) && 
 		(pendingResponse->sp->address == (unsigned) response.address)){
+			recordLatency(pendingResponse, LAT_RTT, rxUs - pendingResponse->sent_us);
+			flightRecord(FLIGHT_DECODE, bus->id, pendingResponse->sp->service_id, rxUs - pendingResponse->sent_us);
+			PROBE4(response_decode, bus->id, pendingResponse->sp->service_id, response.address, rxUs - pendingResponse->sent_us);
+			accountTransaction(bus, pendingResponse, rxBytes, FALSE);
+			matched = TRUE;
+			/* Messages sent by the action belong to the command's transaction */
+			if((traceTxn = pendingResponse->txn))
+				traceSpan(traceTxn, "response wait", pendingResponse->sent_us, rxUs, pendingResponse->sp->instance_id);
+			profEnter(PROF_CONVERT);
 			switch((hanCommands_t) response.command){
 				case GTMP: /* Temperature */
 					GTMPAction(pcount, &response, pendingResponse);
@@ -1214,46 +2311,43 @@ static void decodeResponse(String r)
 					debug(DEBUG_UNEXPECTED, "Unknown response received");
 					break;
 			}
+			if(!pendingResponse->is_poll)
+				recordLatency(pendingResponse, LAT_E2E, histoNowUs() - pendingResponse->queued_us);
+			if(traceTxn){
+				traceSpan(traceTxn, "decode", rxUs, histoNowUs(), pendingResponse->sp->instance_id);
+				traceTxn = 0;
+			}
 		}
-		if(pendingResponse){ /* Free the work queue entry if it exists */
+		if(!matched){
+			flightRecord(FLIGHT_DECODE, bus->id, FLIGHT_NONE, response.address);
+			PROBE2(response_unmatched, bus->id, response.address);
+		}
+		if(pendingResponse){ /* Free the work queue entry if it exists, and send the next command */
+			if(!matched)
+				accountTransaction(bus, pendingResponse, rxBytes, TRUE);
 			freeWorkQueueEntry(pendingResponse);
-			pendingResponse = NULL;
+			STAT_SET(bus->pendingResponse, NULL);
+			kickBus(bus);
 		}
 	}
+	profLeave();
 }
 	
 
 /*
- * Handler for han socket events
+ * A line was received from a bus's han server, or NULL at EOF or on an error
  */
 
-static void hanHandler(int fd, int revents, int userValue)
+static void hanLine(const String line, void *ctx)
 {
-	static unsigned pos = 0;
-	static char response[WS_SIZE];
-	int res;
-	
-
-	debug(DEBUG_ACTION,"revents = %08X", revents);
-	
+	hanBusPtr_t bus = ctx;
 	
-	res = socketReadLineNonBlocking(fd, &pos, response, WS_SIZE);
-	if(res == -1)
-		debug(DEBUG_UNEXPECTED, "Socket read returned error");
-	else if (res == 1){
-		if(!response[0]){
-			/* EOF. We must close the socket and re-open it later */
-			xPL_removeIODevice(hanSock);
-			close(hanSock);
-			hanSock = -1;
-			cmdFail = TRUE;
-			return;
-		}
-		decodeResponse(response);
+	if(!line){
+		/* We must close the socket and re-open it later */
+		closeHanSocket(bus);
+		return;
 	}
-	
-	
-		
+	decodeResponse(bus, line);
 }
 
 /* 
@@ -1262,13 +2356,10 @@ static void hanHandler(int fd, int revents, int userValue)
  
 static void qHanGOUT(unsigned subcommand, serviceEntryPtr_t sp, Bool isPoll)
 {
-	String cmd;
+	char cmd[WORKQ_CMD_SIZE];
 	
-	/* Allocate buffer for command */
-	if(!(cmd = mallocz(WS_SIZE)))
-		MALLOC_ERROR;
 	/* Format command */
-	snprintf(cmd, WS_SIZE, "CA%02X%02X%02X%02X00",sp->address, (unsigned ) sp->cmd, sp->channel, subcommand );
+	snprintf(cmd, WORKQ_CMD_SIZE, "CA%02X%02X%02X%02X00",sp->address, (unsigned ) sp->cmd, sp->channel, subcommand );
 	queueCommand(cmd, sp, isPoll);
 }
 
@@ -1341,692 +2432,1220 @@ static void doHanGOUT(xPL_MessagePtr theMessage, serviceEntryPtr_t sp)
 			debug(DEBUG_UNEXPECTED,"current must be one of: high, low");
 			return;
 		}
-		qHanGOUT(outputState, sp, FALSE);
-		
+		qHanGOUT(outputState, sp, FALSE);
+		
+	}
+	
+}
+
+/*
+ * Queue han GACD command
+ */
+ 
+static void qHanGACD(serviceEntryPtr_t sp, Bool isPoll)
+{
+	char cmd[WORKQ_CMD_SIZE];
+	
+	/* Format command */
+	snprintf(cmd, WORKQ_CMD_SIZE, "CA%02X%02X00000000",sp->address, (unsigned ) sp->cmd);
+
+	queueCommand(cmd, sp, isPoll);
+	
+}
+
+
+
+/*
+ * do HAN GACD command 
+ */
+ 
+static void doHanGACD(xPL_MessagePtr theMessage, serviceEntryPtr_t sp)
+{
+
+	const String request =  xPL_getMessageNamedValue(theMessage, "request");
+	
+	if(!request){
+		debug(DEBUG_UNEXPECTED, "doHanGACD(): no request specified");
+		return;
+	}
+	if(strcmp(request, "current")){ /* Only the current command is supported  */
+		debug(DEBUG_UNEXPECTED, "doHanGACD(): only the current request is supported");
+		return;
+	}
+	debug(DEBUG_ACTION, "doHanGACD()");	
+	
+	
+	qHanGACD(sp, FALSE);
+	
+}
+
+/*
+ * Queue a HAN GTMP command
+ */
+
+static void qHanGTMP(serviceEntryPtr_t sp, Bool isPoll)
+{
+	char cmd[WORKQ_CMD_SIZE];
+	
+	if(!sp)
+		return;
+		
+	/* Format command */
+	snprintf(cmd, WORKQ_CMD_SIZE, "CA%02X%02X%02X00000000",sp->address, (unsigned ) sp->cmd, sp->channel);
+
+	queueCommand(cmd, sp, isPoll);
+}
+
+
+/*
+ * Do HAN temperature command 
+ */
+ 
+
+
+static void doHanGTMP(xPL_MessagePtr theMessage, serviceEntryPtr_t sp)
+{
+	const String request =  xPL_getMessageNamedValue(theMessage, "request");
+	const String device =  xPL_getMessageNamedValue(theMessage, "device");
+
+	
+	if(!request){
+		debug(DEBUG_UNEXPECTED, "doHanGTMP(): no request specified");
+		return;
+	}
+		
+	if(!device){
+		debug(DEBUG_UNEXPECTED, "doHanGTMP(): no device specified, device is required");
+
+	}
+	else{
+		unsigned dev;
+		if(!str2uns(device, &dev, 0, 0)){
+			debug(DEBUG_UNEXPECTED, "doHanGTMP(): device=0 is required");
+			return;
+		}
+	}
+	
+	if(strcmp(request, "current")){ 
+		debug(DEBUG_UNEXPECTED, "doHanGTMP(): only the 'current' request is supported");
+		return;
+	}
+
+		
+	debug(DEBUG_ACTION, "doHanGTMP()");	
+
+	qHanGTMP(sp, FALSE);
+}
+
+/*
+ * Queue han GVLT command
+ */
+ 
+static void qHanGVLT(serviceEntryPtr_t sp, Bool isPoll)
+{
+	char cmd[WORKQ_CMD_SIZE];
+	
+	/* Format command */
+	snprintf(cmd, WORKQ_CMD_SIZE, "CA%02X%02X0000000000000000",sp->address, (unsigned ) sp->cmd);
+
+	queueCommand(cmd, sp, isPoll);
+	
+}
+
+
+
+/*
+ * do HAN GVLT command 
+ */
+ 
+static void doHanGVLT(xPL_MessagePtr theMessage, serviceEntryPtr_t sp)
+{
+
+	const String request =  xPL_getMessageNamedValue(theMessage, "request");
+	const String device =  xPL_getMessageNamedValue(theMessage, "device");
+	
+	if(!request){
+		debug(DEBUG_UNEXPECTED, "doHanGVLT(): no request specified");
+		return;
+	}
+	if(!device){
+		debug(DEBUG_UNEXPECTED, "doHanGVLT(): no device specified, device is required");
+
+	}
+	else{
+		unsigned dev;
+		if(!str2uns(device, &dev, 0, 0)){
+			debug(DEBUG_UNEXPECTED, "doHanGVLT(): device=0 is required");
+			return;
+		}
+	}
+	
+	if(strcmp(request, "current")){ /* Only the current command is supported  */
+		debug(DEBUG_UNEXPECTED, "doHanGVLT(): only the current request is supported");
+		return;
+	}
+	debug(DEBUG_ACTION, "doHanGVLT()");	
+	
+	
+	qHanGVLT(sp, FALSE);
+	
+}
+
+/*
+ * Queue han GCUR command
+ */
+ 
+static void qHanGCUR(serviceEntryPtr_t sp, Bool isPoll)
+{
+	char cmd[WORKQ_CMD_SIZE];
+	
+	/* Format command */
+	snprintf(cmd, WORKQ_CMD_SIZE, "CA%02X%02X0000000000000000",sp->address, (unsigned ) sp->cmd);
+
+	queueCommand(cmd, sp, isPoll);
+	
+}
+
+
+
+/*
+ * do HAN GCUR command 
+ */
+ 
+static void doHanGCUR(xPL_MessagePtr theMessage, serviceEntryPtr_t sp)
+{
+
+	const String request =  xPL_getMessageNamedValue(theMessage, "request");
+	const String device =  xPL_getMessageNamedValue(theMessage, "device");
+	
+	if(!request){
+		debug(DEBUG_UNEXPECTED, "doHanGCUR(): no request specified");
+		return;
+	}
+	if(!device){
+		debug(DEBUG_UNEXPECTED, "doHanGCUR(): no device specified, device is required");
+
+	}
+	else{
+		unsigned dev;
+		if(!str2uns(device, &dev, 0, 0)){
+			debug(DEBUG_UNEXPECTED, "doHanGCUR(): device=0 is required");
+			return;
+		}
+	}
+	
+	if(strcmp(request, "current")){ /* Only the current command is supported  */
+		debug(DEBUG_UNEXPECTED, "doHanGCUR(): only the current request is supported");
+		return;
+	}
+	debug(DEBUG_ACTION, "doHanGCUR()");	
+	
+	
+	qHanGCUR(sp, FALSE);
+	
+}
+
+/*
+ * Queue a HAN GHUM command
+ */
+
+static void qHanGHUM(serviceEntryPtr_t sp, Bool isPoll)
+{
+	char cmd[WORKQ_CMD_SIZE];
+	
+	if(!sp)
+		return;
+		
+	/* Format command */
+	snprintf(cmd, WORKQ_CMD_SIZE, "CA%02X%02X%02X0000000000",sp->address, (unsigned ) sp->cmd, sp->channel);
+
+	queueCommand(cmd, sp, isPoll);
+}
+
+
+/*
+ * Do HAN humidity command 
+ */
+ 
+
+
+static void doHanGHUM(xPL_MessagePtr theMessage, serviceEntryPtr_t sp)
+{
+	const String request =  xPL_getMessageNamedValue(theMessage, "request");
+	const String device =  xPL_getMessageNamedValue(theMessage, "device");
+
+	
+	if(!request){
+		debug(DEBUG_UNEXPECTED, "doHanGHUM(): no request specified");
+		return;
+	}
+		
+	if(!device){
+		debug(DEBUG_UNEXPECTED, "doHanGHUM(): no device specified, device is required");
+
+	}
+	else{
+		unsigned dev;
+		if(!str2uns(device, &dev, 0, 0)){
+			debug(DEBUG_UNEXPECTED, "doHanGHUM(): device=0 is required");
+			return;
+		}
 	}
 	
+	if(strcmp(request, "current")){ 
+		debug(DEBUG_UNEXPECTED, "doHanGHUM(): only the 'current' request is supported");
+		return;
+	}
+
+		
+	debug(DEBUG_ACTION, "doHanGHUM()");	
+
+	qHanGHUM(sp, FALSE);
 }
 
 /*
- * Queue han GACD command
+ * Queue a HAN GWSP command
  */
- 
-static void qHanGACD(serviceEntryPtr_t sp, Bool isPoll)
+
+static void qHanGWSP(serviceEntryPtr_t sp, Bool isPoll)
 {
-	String cmd;
+	char cmd[WORKQ_CMD_SIZE];
 	
-	/* Allocate buffer for command */
-	if(!(cmd = mallocz(WS_SIZE)))
-		MALLOC_ERROR;
-			
+	if(!sp)
+		return;
+		
 	/* Format command */
-	snprintf(cmd, WS_SIZE, "CA%02X%02X00000000",sp->address, (unsigned ) sp->cmd);
+	snprintf(cmd, WORKQ_CMD_SIZE, "CA%02X%02X%02x0000000000",sp->address, (unsigned ) sp->cmd, sp->channel);
 
 	queueCommand(cmd, sp, isPoll);
-	
 }
 
 
-
 /*
- * do HAN GACD command 
+ * Do HAN wind speed command
  */
  
-static void doHanGACD(xPL_MessagePtr theMessage, serviceEntryPtr_t sp)
-{
 
+
+static void doHanGWSP(xPL_MessagePtr theMessage, serviceEntryPtr_t sp)
+{
 	const String request =  xPL_getMessageNamedValue(theMessage, "request");
+	const String device =  xPL_getMessageNamedValue(theMessage, "device");
+
 	
 	if(!request){
-		debug(DEBUG_UNEXPECTED, "doHanGACD(): no request specified");
+		debug(DEBUG_UNEXPECTED, "doHanGWSP(): no request specified");
 		return;
 	}
-	if(strcmp(request, "current")){ /* Only the current command is supported  */
-		debug(DEBUG_UNEXPECTED, "doHanGACD(): only the current request is supported");
-		return;
+		
+	if(!device){
+		debug(DEBUG_UNEXPECTED, "doHanGWSP(): no device specified, device is required");
+
+	}
+	else{
+		unsigned dev;
+		if(!str2uns(device, &dev, 0, 0)){
+			debug(DEBUG_UNEXPECTED, "doHanGWSP(): device=0 is required");
+			return;
+		}
 	}
-	debug(DEBUG_ACTION, "doHanGACD()");	
-	
-	
-	qHanGACD(sp, FALSE);
 	
+	if(strcmp(request, "current")){ 
+		debug(DEBUG_UNEXPECTED, "doHanGWSP(): only the 'current' request is supported");
+		return;
+	}
+
+		
+	debug(DEBUG_ACTION, "doHanGWSP()");	
+
+	qHanGWSP(sp, FALSE);
 }
 
+
 /*
- * Queue a HAN GTMP command
+ * Queue a HAN Wind direction command
  */
 
-static void qHanGTMP(serviceEntryPtr_t sp, Bool isPoll)
+static void qHanGWDR(serviceEntryPtr_t sp, Bool isPoll)
 {
-	String cmd;
+	char cmd[WORKQ_CMD_SIZE];
 	
 	if(!sp)
 		return;
 		
-	/* Allocate buffer for command */
-	if(!(cmd = mallocz(WS_SIZE)))
-		MALLOC_ERROR;
-	
-			
 	/* Format command */
-	snprintf(cmd, WS_SIZE, "CA%02X%02X%02X00000000",sp->address, (unsigned ) sp->cmd, sp->channel);
+	snprintf(cmd, WORKQ_CMD_SIZE, "CA%02X%02X000000",sp->address, (unsigned ) sp->cmd);
 
 	queueCommand(cmd, sp, isPoll);
 }
 
 
 /*
- * Do HAN temperature command 
+ * Do HAN wind direction command 
  */
  
 
 
-static void doHanGTMP(xPL_MessagePtr theMessage, serviceEntryPtr_t sp)
+static void doHanGWDR(xPL_MessagePtr theMessage, serviceEntryPtr_t sp)
 {
 	const String request =  xPL_getMessageNamedValue(theMessage, "request");
 	const String device =  xPL_getMessageNamedValue(theMessage, "device");
 
 	
 	if(!request){
-		debug(DEBUG_UNEXPECTED, "doHanGTMP(): no request specified");
+		debug(DEBUG_UNEXPECTED, "doHanGWDR(): no request specified");
 		return;
 	}
 		
 	if(!device){
-		debug(DEBUG_UNEXPECTED, "doHanGTMP(): no device specified, device is required");
+		debug(DEBUG_UNEXPECTED, "doHanGWDR(): no device specified, device is required");
 
 	}
 	else{
 		unsigned dev;
 		if(!str2uns(device, &dev, 0, 0)){
-			debug(DEBUG_UNEXPECTED, "doHanGTMP(): device=0 is required");
+			debug(DEBUG_UNEXPECTED, "doHanGWDR(): device=0 is required");
 			return;
 		}
 	}
 	
 	if(strcmp(request, "current")){ 
-		debug(DEBUG_UNEXPECTED, "doHanGTMP(): only the 'current' request is supported");
+		debug(DEBUG_UNEXPECTED, "doHanGWDR(): only the 'current' request is supported");
 		return;
 	}
 
 		
-	debug(DEBUG_ACTION, "doHanGTMP()");	
+	debug(DEBUG_ACTION, "doHanGWDR()");	
 
-	qHanGTMP(sp, FALSE);
+	qHanGWDR(sp, FALSE);
 }
 
+
 /*
- * Queue han GVLT command
+ * Queue a HAN rain gauge command
  */
- 
-static void qHanGVLT(serviceEntryPtr_t sp, Bool isPoll)
+
+static void qHanGRGC(serviceEntryPtr_t sp, Bool isPoll)
 {
-	String cmd;
+	char cmd[WORKQ_CMD_SIZE];
 	
-	/* Allocate buffer for command */
-	if(!(cmd = mallocz(WS_SIZE)))
-		MALLOC_ERROR;
-			
+	if(!sp)
+		return;
+		
 	/* Format command */
-	snprintf(cmd, WS_SIZE, "CA%02X%02X0000000000000000",sp->address, (unsigned ) sp->cmd);
+	snprintf(cmd, WORKQ_CMD_SIZE, "CA%02X%02X00000000%02X00000000",sp->address, (unsigned ) sp->cmd, sp->channel);
 
 	queueCommand(cmd, sp, isPoll);
-	
 }
 
 
-
 /*
- * do HAN GVLT command 
+ * Do rain gauge command
  */
  
-static void doHanGVLT(xPL_MessagePtr theMessage, serviceEntryPtr_t sp)
-{
 
+
+static void doHanGRGC(xPL_MessagePtr theMessage, serviceEntryPtr_t sp)
+{
 	const String request =  xPL_getMessageNamedValue(theMessage, "request");
 	const String device =  xPL_getMessageNamedValue(theMessage, "device");
+
 	
 	if(!request){
-		debug(DEBUG_UNEXPECTED, "doHanGVLT(): no request specified");
+		debug(DEBUG_UNEXPECTED, "doHanGRGC(): no request specified");
 		return;
 	}
+		
 	if(!device){
-		debug(DEBUG_UNEXPECTED, "doHanGVLT(): no device specified, device is required");
+		debug(DEBUG_UNEXPECTED, "doHanGRGC(): no device specified, device is required");
 
 	}
 	else{
 		unsigned dev;
 		if(!str2uns(device, &dev, 0, 0)){
-			debug(DEBUG_UNEXPECTED, "doHanGVLT(): device=0 is required");
+			debug(DEBUG_UNEXPECTED, "doHanGRGC(): device=0 is required");
 			return;
 		}
 	}
 	
-	if(strcmp(request, "current")){ /* Only the current command is supported  */
-		debug(DEBUG_UNEXPECTED, "doHanGVLT(): only the current request is supported");
+	if(strcmp(request, "current")){ 
+		debug(DEBUG_UNEXPECTED, "doHanGRGC(): only the 'current' request is supported");
 		return;
 	}
-	debug(DEBUG_ACTION, "doHanGVLT()");	
-	
-	
-	qHanGVLT(sp, FALSE);
-	
+
+		
+	debug(DEBUG_ACTION, "doHanGRGC()");	
+
+	qHanGRGC(sp, FALSE);
 }
 
+
 /*
- * Queue han GCUR command
- */
- 
-static void qHanGCUR(serviceEntryPtr_t sp, Bool isPoll)
+ * Poll dispatcher
+ */ 
+
+static void dispatchPollCommand(serviceEntryPtr_t sp)
 {
-	String cmd;
-	
-	/* Allocate buffer for command */
-	if(!(cmd = mallocz(WS_SIZE)))
-		MALLOC_ERROR;
+	if(!sp)
+		return;
+	switch(sp->cmd){
+		case GTMP:
+			qHanGTMP(sp, TRUE);
+			break;
 			
-	/* Format command */
-	snprintf(cmd, WS_SIZE, "CA%02X%02X0000000000000000",sp->address, (unsigned ) sp->cmd);
+		case GACD:
+			qHanGACD(sp, TRUE);
+			break;
+			
+		case GOUT:
+			qHanGOUT(2, sp, TRUE);
+			break;
+			
+		case GVLT:
+			qHanGVLT(sp, TRUE);
+			break;
+		
+		case GCUR:
+			qHanGCUR(sp, TRUE);
+			break;
+			
+		case GHUM:
+			qHanGHUM(sp, TRUE);
+			break;
+			
+		case GWSP:
+			qHanGWSP(sp, TRUE);
+			break;
+			
+		case GWDR:
+			qHanGWDR(sp, TRUE);
+			break;
+		
+	    case GRGC:
+			qHanGRGC(sp, TRUE);
+			break;
+		
+		
+		default:
+			debug(DEBUG_UNEXPECTED, "Got unrecognized poll request %u", (unsigned) sp->cmd);
+			break;
+	}	
+}
 
-	queueCommand(cmd, sp, isPoll);
+
+
+/* 
+ * HAN Command dispatcher
+ */
+
+static void dispatchHanCommand(xPL_MessagePtr theMessage, serviceEntryPtr_t sp)
+{
+	if((!theMessage) || (!sp))
+		return;
+		
+	debug(DEBUG_ACTION, "dispatchHanCommand()");
 	
+	switch(sp->cmd){
+		case GTMP:
+			doHanGTMP(theMessage, sp);
+			break;
+		
+		case GACD:
+			doHanGACD(theMessage, sp);
+			break;
+			
+		case GOUT:
+			doHanGOUT(theMessage, sp);
+			break;
+			
+		case GVLT:
+			doHanGVLT(theMessage, sp);
+			break;
+			
+		case GCUR:
+			doHanGCUR(theMessage, sp);
+			break;
+			
+	    case GHUM:
+			doHanGHUM(theMessage, sp);
+			break;
+			
+		case GWSP:
+			doHanGWSP(theMessage, sp);
+			break;
+			
+		case GWDR:
+			doHanGWDR(theMessage, sp);
+			break;
+			
+		case GRGC:
+			doHanGRGC(theMessage, sp);
+			break;
+					
+		default:
+			debug(DEBUG_UNEXPECTED,"Invalid han command received: %02X", (unsigned) sp->cmd);
+			break; 
+	}
 }
 
 
+/*
+* Our raw listener.
+* xPLLib calls this with each datagram before it parses it. Classify the datagram
+* so that the message listener can throw away traffic which is not for us
+* without looking at the parsed message. The datagrams xPLHandler() hands back
+* to xPLLib are counted here, when xPLLib reads them.
+*/
+
+static void xPLRawListener(String theData, int len, xPL_ObjectPtr userValue)
+{
+	xplLibReads++;
+	rawVerdict = xplfiltClassify(theData, len);
+}
 
 /*
- * do HAN GCUR command 
- */
- 
-static void doHanGCUR(xPL_MessagePtr theMessage, serviceEntryPtr_t sp)
+* Our Listener 
+*/
+
+static void xPLListener(xPL_MessagePtr theMessage, xPL_ObjectPtr userValue)
 {
+	serviceEntryPtr_t sp;
+	xplfiltVerdict_t verdict = rawVerdict;
+	uint64_t startUs = 0;
 
-	const String request =  xPL_getMessageNamedValue(theMessage, "request");
-	const String device =  xPL_getMessageNamedValue(theMessage, "device");
-	
-	if(!request){
-		debug(DEBUG_UNEXPECTED, "doHanGCUR(): no request specified");
+	rawVerdict = XPLFILT_DROP; /* A verdict applies to one message only */
+	if(verdict != XPLFILT_ACCEPT)
 		return;
-	}
-	if(!device){
-		debug(DEBUG_UNEXPECTED, "doHanGCUR(): no device specified, device is required");
-
-	}
-	else{
-		unsigned dev;
-		if(!str2uns(device, &dev, 0, 0)){
-			debug(DEBUG_UNEXPECTED, "doHanGCUR(): device=0 is required");
-			return;
-		}
-	}
 	
-	if(strcmp(request, "current")){ /* Only the current command is supported  */
-		debug(DEBUG_UNEXPECTED, "doHanGCUR(): only the current request is supported");
-		return;
+	if(!xPL_isBroadcastMessage(theMessage)){ /* If not a broadcast message */
+		if(xPL_MESSAGE_COMMAND == xPL_getMessageType(theMessage)){ /* If the message is a command */
+			const String type = xPL_getSchemaType(theMessage);
+			const String class = xPL_getSchemaClass(theMessage);
+			const String instanceID = xPL_getTargetInstanceID(theMessage);
+			debug(DEBUG_ACTION, "Received message from: %s-%s.%s,\n instance id: %s, class: %s, type: %s",
+			xPL_getSourceVendor(theMessage), xPL_getSourceDeviceID(theMessage),
+			xPL_getSourceInstanceID(theMessage), instanceID, class, type);
+			
+			/* Look up the service by instance ID, and check the class and type IDs */
+			sp = hashmapFind(serviceMap, instanceID);
+			if((sp) && (findInterned(class) == sp->class_id) && (findInterned(type) == sp->type_id)){
+				if(traceEnabled){ /* Start a transaction, the commands queued by the dispatch carry its ID */
+					startUs = histoNowUs();
+					traceTxn = traceNewId();
+				}
+				dispatchHanCommand(theMessage, sp);
+				if(traceTxn){
+					traceSpan(traceTxn, "xpl receive", startUs, histoNowUs(), sp->instance_id);
+					traceTxn = 0;
+				}
+			}
+			
+		}
 	}
-	debug(DEBUG_ACTION, "doHanGCUR()");	
-	
-	
-	qHanGCUR(sp, FALSE);
-	
 }
 
+
+
 /*
- * Queue a HAN GHUM command
- */
+* Send the next command on a bus, connecting to its HAN server first if need be.
+* If the server can't be reached, the queued commands are dropped, and
+* the connection is retried after RECONNECT_MS.
+*/
 
-static void qHanGHUM(serviceEntryPtr_t sp, Bool isPoll)
+static void sendNextCommand(hanBusPtr_t bus, long long now)
 {
-	String cmd;
-	
-	if(!sp)
+	workQEntryPtr_t wq;
+	unsigned len;
+	uint64_t txUs;
+	
+	if(!hantransIsOpen(bus->trans)){ /* Not connected. This could have been due to an EOF detected previously */
+		if(!hantransConnect(bus->trans)){
+			debug(DEBUG_UNEXPECTED, "Could not open socket to han server for bus %s, retrying in %d seconds", bus->name, RECONNECT_MS / 1000);
+			while((wq = dequeueWorkQueueEntry(bus))) /* Can't process commands */
+				freeWorkQueueEntry(wq);
+			flightRecord(FLIGHT_CONNECT_FAIL, bus->id, FLIGHT_NONE, errno);
+			PROBE2(han_connect_fail, bus->id, errno);
+			bus->cmdFail = TRUE;
+			STAT_ADD(bus->connectFails, 1);
+			bus->retryDue = now + RECONNECT_MS;
+			/* FIXME: Need to find some way to notify the originator the command could not be completed */
+			return;
+		}
+		bus->cmdFail = FALSE;
+		STAT_ADD(bus->connects, 1);
+		flightRecord(FLIGHT_CONNECT, bus->id, FLIGHT_NONE, 0);
+		PROBE1(han_connect, bus->id);
+		nameSource(bus->reactor, hantransGetFD(bus->trans), "han socket", bus);
+	}
+	if(!(wq = dequeueWorkQueueEntry(bus)))
 		return;
-		
-	/* Allocate buffer for command */
-	if(!(cmd = mallocz(WS_SIZE)))
-		MALLOC_ERROR;
-	
-			
-	/* Format command */
-	snprintf(cmd, WS_SIZE, "CA%02X%02X%02X0000000000",sp->address, (unsigned ) sp->cmd, sp->channel);
-
-	queueCommand(cmd, sp, isPoll);
+	debug(DEBUG_ACTION, "Sending command: %s", wq->cmd);
+	len = strlen(wq->cmd);
+	txUs = (wq->txn) ? histoNowUs() : 0;
+	/* An io_uring send goes out when the reactor flushes at the end of this iteration */
+	if(!hantransSend(bus->trans, wq->cmd, len)){ /* Send the command */
+		debug(DEBUG_UNEXPECTED, "Command TX failed on bus %s", bus->name);
+		freeWorkQueueEntry(wq);
+		closeHanSocket(bus);
+		return;
+	}
+	STAT_SET(bus->pendingResponse, wq);
+	bus->responseDue = now + RESPONSE_TIMEOUT_MS;
+	STAT_ADD(bus->txBytes, len);
+	STAT_ADD(bus->nodes[wq->sp->address]->txBytes, len);
+	wq->sent_us = histoNowUs();
+	recordLatency(wq, LAT_QUEUE, wq->sent_us - wq->queued_us);
+	flightRecord(FLIGHT_SEND, bus->id, wq->sp->service_id, wq->sent_us - wq->queued_us);
+	PROBE4(command_send, bus->id, wq->sp->service_id, wq->sp->address, wq->sent_us - wq->queued_us);
+	if(wq->txn){
+		traceSpan(wq->txn, "queue wait", wq->queued_us, txUs, wq->sp->instance_id);
+		traceSpan(wq->txn, "han send", txUs, wq->sent_us, wq->sp->instance_id);
+	}
 }
 
 
 /*
- * Do HAN humidity command 
- */
- 
-
+* Run the scheduler for one bus.
+* Queues the polls which are due, times out an unanswered command,
+* sends the next command if the bus is idle, and then arms the bus's
+* timer for the earliest of the next poll, the response timeout and the
+* reconnect time. Nothing runs between deadlines.
+*/
 
-static void doHanGHUM(xPL_MessagePtr theMessage, serviceEntryPtr_t sp)
+static void busRun(hanBusPtr_t bus)
 {
-	const String request =  xPL_getMessageNamedValue(theMessage, "request");
-	const String device =  xPL_getMessageNamedValue(theMessage, "device");
-
+	const timerHeapEntry_t *next;
+	long long now = reactorNowMs();
+	long long due, interval;
+	uint32_t waitedMs;
+	
+	/* End of a utilization window */
+	if(now >= bus->windowDue)
+		rollUtilization(bus, now);
+	
+	/* Queue the polls which are due */
+	while((next = timerheapTop(bus->polls)) && (next->due <= now)){
+		interval = serviceHot.polling_interval[next->id] * 1000LL;
+		/* Stay in phase unless a whole interval was missed */
+		if((due = next->due + interval) <= now)
+			due = now + interval;
+		dispatchPollCommand(serviceHot.entry[next->id]);
+		timerheapReschedule(bus->polls, due);
+	}
 	
-	if(!request){
-		debug(DEBUG_UNEXPECTED, "doHanGHUM(): no request specified");
-		return;
+	/* Give up on a command which was never answered */
+	if((bus->pendingResponse) && (now >= bus->responseDue)){
+		debug(DEBUG_UNEXPECTED, "No response on bus %s to command: %s", bus->name, bus->pendingResponse->cmd);
+		STAT_ADD(bus->timeouts, 1);
+		waitedMs = (histoNowUs() - bus->pendingResponse->sent_us) / 1000;
+		flightRecord(FLIGHT_TIMEOUT, bus->id, bus->pendingResponse->sp->service_id, waitedMs);
+		PROBE4(command_timeout, bus->id, bus->pendingResponse->sp->service_id, bus->pendingResponse->sp->address, waitedMs);
+		accountTransaction(bus, bus->pendingResponse, 0, TRUE);
+		freeWorkQueueEntry(bus->pendingResponse);
+		STAT_SET(bus->pendingResponse, NULL);
 	}
+	
+	/* One command in flight at a time */
+	if((!bus->pendingResponse) && (now >= bus->retryDue) && (ringCount(bus->workQ)))
+		sendNextCommand(bus, now);
 		
-	if(!device){
-		debug(DEBUG_UNEXPECTED, "doHanGHUM(): no device specified, device is required");
-
-	}
-	else{
-		unsigned dev;
-		if(!str2uns(device, &dev, 0, 0)){
-			debug(DEBUG_UNEXPECTED, "doHanGHUM(): device=0 is required");
-			return;
-		}
+	/* Sleep until the next deadline, or until something is queued */
+	due = (next = timerheapTop(bus->polls)) ? next->due : -1;
+	if(bus->pendingResponse){
+		if((due < 0) || (bus->responseDue < due))
+			due = bus->responseDue;
 	}
-	
-	if(strcmp(request, "current")){ 
-		debug(DEBUG_UNEXPECTED, "doHanGHUM(): only the 'current' request is supported");
-		return;
+	else if(ringCount(bus->workQ)){
+		if((due < 0) || (bus->retryDue < due))
+			due = bus->retryDue;
 	}
+	if((due < 0) || (bus->windowDue < due))
+		due = bus->windowDue;
+	reactorSetTimerAt(bus->reactor, bus->timerFd, due);
+}
 
-		
-	debug(DEBUG_ACTION, "doHanGHUM()");	
 
-	qHanGHUM(sp, FALSE);
+/*
+* Bus timer expired
+*/
+
+static void busTimerHandler(int fd, void *ctx)
+{
+	busRun(ctx);
 }
 
+
 /*
- * Queue a HAN GWSP command
- */
+* xPLLib housekeeping tick.
+* xPLLib sends its heartbeats from xPL_processMessages(). It needs this
+* often until it has found the hub, after that heartbeats are minutes
+* apart and the tick is slowed down.
+*/
 
-static void qHanGWSP(serviceEntryPtr_t sp, Bool isPoll)
+static void housekeepingHandler(int fd, void *ctx)
 {
-	String cmd;
-	
-	if(!sp)
-		return;
-		
-	/* Allocate buffer for command */
-	if(!(cmd = mallocz(WS_SIZE)))
-		MALLOC_ERROR;
+	static unsigned ticks;
 	
-			
-	/* Format command */
-	snprintf(cmd, WS_SIZE, "CA%02X%02X%02x0000000000",sp->address, (unsigned ) sp->cmd, sp->channel);
-
-	queueCommand(cmd, sp, isPoll);
+	xPL_processMessages(0);
+	if(++ticks == XPL_HUB_TICKS)
+		reactorSetTimer(mainReactor, fd, XPL_HOUSEKEEPING_MS, XPL_HOUSEKEEPING_MS);
 }
 
 
 /*
- * Do HAN wind speed command
- */
- 
-
+* Open the socket which hands datagrams back to xPLLib, and find where to send them:
+* xPLLib's own socket, over loopback if it is bound to every address
+*/
 
-static void doHanGWSP(xPL_MessagePtr theMessage, serviceEntryPtr_t sp)
+static void openXPLReturn(int fd)
 {
-	const String request =  xPL_getMessageNamedValue(theMessage, "request");
-	const String device =  xPL_getMessageNamedValue(theMessage, "device");
+	struct sockaddr_in *sin = (struct sockaddr_in *) &xplReturnAddr;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &xplReturnAddr;
+	
+	xplReturnAddrLen = sizeof(xplReturnAddr);
+	if(getsockname(fd, (struct sockaddr *) &xplReturnAddr, &xplReturnAddrLen) < 0)
+		fatal_with_reason(errno, "Could not get the xPL socket address");
+	if((xplReturnAddr.ss_family == AF_INET) && (sin->sin_addr.s_addr == htonl(INADDR_ANY)))
+		sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	else if((xplReturnAddr.ss_family == AF_INET6) && (IN6_IS_ADDR_UNSPECIFIED(&sin6->sin6_addr)))
+		sin6->sin6_addr = in6addr_loopback;
+	if((xplReturnFd = socket(xplReturnAddr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+		fatal_with_reason(errno, "Could not create the xPL return socket");
+}
 
-	
-	if(!request){
-		debug(DEBUG_UNEXPECTED, "doHanGWSP(): no request specified");
-		return;
-	}
-		
-	if(!device){
-		debug(DEBUG_UNEXPECTED, "doHanGWSP(): no device specified, device is required");
+/*
+* xPL socket is readable.
+* Drain the socket with recvmmsg() into a fixed batch, and classify each datagram
+* before xPLLib sees it. Datagrams the prefilter drops end here, and are never
+* parsed. xPLLib has no call to parse a datagram it did not read itself, so the
+* ones it needs are handed back to it once the socket is empty: they are sent to
+* its own socket over loopback, then xPLLib is run and reads them.
+* xPLRawListener() classifies everything xPLLib reads.
+*
+* The datagrams to hand back are kept at the front of the batch, and the rest of
+* the batch is filled again until the socket is empty or the batch is all kept
+* datagrams. Handing them back sooner would have the drain read them again.
+*/
 
+static void xPLHandler(int fd, uint32_t events, void *ctx)
+{
+	static struct mmsghdr msgs[XPL_RECV_BATCH];
+	static struct iovec iov[XPL_RECV_BATCH];
+	static char bufs[XPL_RECV_BATCH][XPL_DGRAM_MAX];
+	unsigned lens[XPL_RECV_BATCH];
+	xplfiltVerdict_t verdict;
+	int i, n, first, kept = 0;
+
+	xplWakeups++;
+	for(i = 0; i < XPL_RECV_BATCH; i++){
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len = XPL_DGRAM_MAX;
+		memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
 	}
-	else{
-		unsigned dev;
-		if(!str2uns(device, &dev, 0, 0)){
-			debug(DEBUG_UNEXPECTED, "doHanGWSP(): device=0 is required");
-			return;
+	for(;;){
+		first = kept;
+		xplRecvCalls++;
+		if((n = recvmmsg(fd, msgs + first, XPL_RECV_BATCH - first, MSG_DONTWAIT, NULL)) < 0){
+			if(errno == EINTR)
+				continue;
+			if((errno != EAGAIN) && (errno != EWOULDBLOCK))
+				debug(DEBUG_UNEXPECTED, "xPL receive failed: %s", strerror(errno));
+			break;
+		}
+		for(i = first; i < first + n; i++){
+			if((verdict = xplfiltCheck(bufs[i], (int) msgs[i].msg_len)) == XPLFILT_DROP){
+				xplfiltCount(verdict);
+				continue;
+			}
+			/* xPLLib needs this one, keep it */
+			if(i != kept)
+				memcpy(bufs[kept], bufs[i], msgs[i].msg_len);
+			lens[kept++] = msgs[i].msg_len;
 		}
+		if((n < XPL_RECV_BATCH - first) || (kept == XPL_RECV_BATCH))
+			break; /* Empty, or no room left */
 	}
-	
-	if(strcmp(request, "current")){ 
-		debug(DEBUG_UNEXPECTED, "doHanGWSP(): only the 'current' request is supported");
+	if(!kept)
 		return;
+	for(i = 0; i < kept; i++){
+		xplHandedBack++;
+		if(sendto(xplReturnFd, bufs[i], lens[i], 0, (struct sockaddr *) &xplReturnAddr, xplReturnAddrLen) < 0)
+			debug(DEBUG_UNEXPECTED, "Could not hand an xPL datagram back to xPLLib: %s", strerror(errno));
 	}
-
-		
-	debug(DEBUG_ACTION, "doHanGWSP()");	
-
-	qHanGWSP(sp, FALSE);
+	xplLibRuns++;
+	xPL_processMessages(0);
 }
 
 
 /*
- * Queue a HAN Wind direction command
- */
+* Signal handler. Signals arrive through the reactor's signalfd, so this
+* runs in normal context and may do anything.
+*/
 
-static void qHanGWDR(serviceEntryPtr_t sp, Bool isPoll)
+static void signalHandler(int signo, void *ctx)
 {
-	String cmd;
-	
-	if(!sp)
+	if(signo == SIGUSR2){
+		dumpFlightRecorder();
 		return;
-		
-	/* Allocate buffer for command */
-	if(!(cmd = mallocz(WS_SIZE)))
-		MALLOC_ERROR;
-	
-			
-	/* Format command */
-	snprintf(cmd, WS_SIZE, "CA%02X%02X000000",sp->address, (unsigned ) sp->cmd);
-
-	queueCommand(cmd, sp, isPoll);
+	}
+	if(signo == SIGUSR1){
+		logStageProfile();
+		return;
+	}
+	if(signo == SIGHUP){
+		/* Re-open the log file, for log rotation */
+		if((!noBackground) && (debugLvl) && (logPath[0]) && (!threadedMode)){
+			notify_logpath(logPath);
+			debug(DEBUG_STATUS, "Log file re-opened");
+		}
+		return;
+	}
+	shutdownHandler(signo);
 }
 
 
 /*
- * Do HAN wind direction command 
- */
- 
-
+* Threaded mode: move commands from the xPL thread to the bus's work queue
+*/
 
-static void doHanGWDR(xPL_MessagePtr theMessage, serviceEntryPtr_t sp)
+static void hanWakeHandler(int fd, uint32_t events, void *ctx)
 {
-	const String request =  xPL_getMessageNamedValue(theMessage, "request");
-	const String device =  xPL_getMessageNamedValue(theMessage, "device");
-
-	
-	if(!request){
-		debug(DEBUG_UNEXPECTED, "doHanGWDR(): no request specified");
-		return;
-	}
-		
-	if(!device){
-		debug(DEBUG_UNEXPECTED, "doHanGWDR(): no device specified, device is required");
-
-	}
-	else{
-		unsigned dev;
-		if(!str2uns(device, &dev, 0, 0)){
-			debug(DEBUG_UNEXPECTED, "doHanGWDR(): device=0 is required");
-			return;
-		}
-	}
+	hanBusPtr_t bus = ctx;
+	workQEntry_t req;
 	
-	if(strcmp(request, "current")){ 
-		debug(DEBUG_UNEXPECTED, "doHanGWDR(): only the 'current' request is supported");
+	clearWakeup(fd);
+	if(__atomic_load_n(&bus->stopping, __ATOMIC_ACQUIRE)){
+		reactorStop(bus->reactor);
 		return;
 	}
-
-		
-	debug(DEBUG_ACTION, "doHanGWDR()");	
-
-	qHanGWDR(sp, FALSE);
+	while(ringPop(bus->requests, &req))
+		queueCommandAt(req.cmd, req.sp, req.is_poll, req.queued_us, req.txn);
 }
 
 
 /*
- * Queue a HAN rain gauge command
- */
+* Threaded mode: HAN I/O thread, one per bus.
+* Owns the bus's han socket, work queue, poll scheduler and the response
+* decoders. Commands arrive from the xPL thread on the bus's request ring,
+* and sensor messages go back to it on the shared outbox ring.
+*/
 
-static void qHanGRGC(serviceEntryPtr_t sp, Bool isPoll)
+static void *hanThreadMain(void *arg)
 {
-	String cmd;
-	
-	if(!sp)
-		return;
-		
-	/* Allocate buffer for command */
-	if(!(cmd = mallocz(WS_SIZE)))
-		MALLOC_ERROR;
+	hanBusPtr_t bus = arg;
 	
-			
-	/* Format command */
-	snprintf(cmd, WS_SIZE, "CA%02X%02X00000000%02X00000000",sp->address, (unsigned ) sp->cmd, sp->channel);
-
-	queueCommand(cmd, sp, isPoll);
+	onHanThread = TRUE;
+	reactorRun(bus->reactor);
+	return NULL;
 }
 
 
 /*
- * Do rain gauge command
- */
- 
-
+* Threaded mode: send the sensor messages the HAN thread left in the outbox
+*/
 
-static void doHanGRGC(xPL_MessagePtr theMessage, serviceEntryPtr_t sp)
+static void outboxHandler(int fd, uint32_t events, void *ctx)
 {
-	const String request =  xPL_getMessageNamedValue(theMessage, "request");
-	const String device =  xPL_getMessageNamedValue(theMessage, "device");
-
-	
-	if(!request){
-		debug(DEBUG_UNEXPECTED, "doHanGRGC(): no request specified");
-		return;
+	outboxEntry_t out;
+	
+	clearWakeup(fd);
+	while(ringPop(xplOutbox, &out)){
+		if(out.txn)
+			traceSpan(out.txn, "outbox wait", out.queued_us, histoNowUs(), out.sp->instance_id);
+		deliverServiceMessage(out.sp, out.msgType, (out.has_device) ? out.device : NULL,
+		(out.has_current) ? out.current : NULL, out.value, out.txn);
 	}
-		
-	if(!device){
-		debug(DEBUG_UNEXPECTED, "doHanGRGC(): no device specified, device is required");
+}
 
-	}
-	else{
-		unsigned dev;
-		if(!str2uns(device, &dev, 0, 0)){
-			debug(DEBUG_UNEXPECTED, "doHanGRGC(): device=0 is required");
-			return;
-		}
-	}
-	
-	if(strcmp(request, "current")){ 
-		debug(DEBUG_UNEXPECTED, "doHanGRGC(): only the 'current' request is supported");
-		return;
-	}
 
-		
-	debug(DEBUG_ACTION, "doHanGRGC()");	
+/*
+* io_uring completions are ready
+*/
+
+static void uringHandler(int fd, uint32_t events, void *ctx)
+{
+	uringProcess(ctx);
+}
 
-	qHanGRGC(sp, FALSE);
+
+/*
+* Submit the io_uring operations queued in this reactor iteration
+*/
+
+static void uringFlushHandler(void *ctx)
+{
+	uringFlush(ctx);
 }
 
 
 /*
- * Poll dispatcher
- */ 
+* Main loop: send what was queued in this reactor iteration
+*/
 
-static void dispatchPollCommand(serviceEntryPtr_t sp)
+static void mainFlushHandler(void *ctx)
 {
-	if(!sp)
-		return;
-	switch(sp->cmd){
-		case GTMP:
-			qHanGTMP(sp, TRUE);
-			break;
-			
-		case GACD:
-			qHanGACD(sp, TRUE);
-			break;
-			
-		case GOUT:
-			qHanGOUT(2, sp, TRUE);
-			break;
-			
-		case GVLT:
-			qHanGVLT(sp, TRUE);
-			break;
-		
-		case GCUR:
-			qHanGCUR(sp, TRUE);
-			break;
-			
-		case GHUM:
-			qHanGHUM(sp, TRUE);
-			break;
-			
-		case GWSP:
-			qHanGWSP(sp, TRUE);
-			break;
-			
-		case GWDR:
-			qHanGWDR(sp, TRUE);
-			break;
-		
-	    case GRGC:
-			qHanGRGC(sp, TRUE);
-			break;
-		
-		
-		default:
-			debug(DEBUG_UNEXPECTED, "Got unrecognized poll request %u", (unsigned) sp->cmd);
-			break;
-	}	
+	if(nativeEncoder){
+		profContinue(PROF_XPL_SEND); /* Batched sends, queued on the io_uring if there is one */
+		xplencFlush();
+		profLeave();
+	}
+	if(mainUring)
+		uringFlush(mainUring);
 }
 
 
+/*
+* Native encoder send handler: queue the datagram on the main loop's io_uring
+*/
 
-/* 
- * HAN Command dispatcher
- */
+static Bool uringDatagram(int fd, const char *data, unsigned len, const struct sockaddr *addr, socklen_t addrLen, void *ctx)
+{
+	return uringSendTo(ctx, fd, data, len, addr, addrLen);
+}
 
-static void dispatchHanCommand(xPL_MessagePtr theMessage, serviceEntryPtr_t sp)
+
+/*
+* Set up an io_uring instance for the buses run by a reactor.
+* If io_uring can't be had (not built in, or refused by the kernel), the
+* buses fall back to the socket transport, and NULL is returned.
+*/
+
+static uringPtr_t startUring(reactorPtr_t r)
 {
-	if((!theMessage) || (!sp))
-		return;
-		
-	debug(DEBUG_ACTION, "dispatchHanCommand()");
+	uringPtr_t u;
 	
-	switch(sp->cmd){
-		case GTMP:
-			doHanGTMP(theMessage, sp);
-			break;
-		
-		case GACD:
-			doHanGACD(theMessage, sp);
-			break;
-			
-		case GOUT:
-			doHanGOUT(theMessage, sp);
-			break;
-			
-		case GVLT:
-			doHanGVLT(theMessage, sp);
-			break;
-			
-		case GCUR:
-			doHanGCUR(theMessage, sp);
-			break;
-			
-	    case GHUM:
-			doHanGHUM(theMessage, sp);
-			break;
-			
-		case GWSP:
-			doHanGWSP(theMessage, sp);
-			break;
-			
-		case GWDR:
-			doHanGWDR(theMessage, sp);
-			break;
-			
-		case GRGC:
-			doHanGRGC(theMessage, sp);
-			break;
-					
-		default:
-			debug(DEBUG_UNEXPECTED,"Invalid han command received: %02X", (unsigned) sp->cmd);
-			break; 
+	if(!(u = uringNew(URING_ENTRIES))){
+		warn("io_uring is not available (%s), using sockets for HAN I/O", strerror(errno));
+		uringIO = FALSE;
+		return NULL;
 	}
+	if(!reactorAddFd(r, uringGetFD(u), EPOLLIN, uringHandler, u))
+		fatal("Could not register io_uring fd");
+	reactorSetName(r, uringGetFD(u), "io_uring completions");
+	reactorSetFlush(r, uringFlushHandler, u);
+	return u;
 }
 
 
 /*
-* Our Listener 
+* Create a bus's timer, and run its scheduler for the first time
 */
 
-static void xPLListener(xPL_MessagePtr theMessage, xPL_ObjectPtr userValue)
+static void startBus(hanBusPtr_t bus)
 {
-	uint32_t iid_hash;
-	serviceEntryPtr_t sp;
+	if((bus->timerFd = reactorAddTimer(bus->reactor, busTimerHandler, bus)) < 0)
+		fatal_with_reason(errno, "Could not create timer for bus %s", bus->name);
+	nameSource(bus->reactor, bus->timerFd, "timer", bus);
+	if(!(bus->trans = hantransNew(bus->host, bus->service, bus->reactor, bus->uring, hanLine, bus)))
+		MALLOC_ERROR;
+	debug(DEBUG_STATUS, "Bus %s uses %s for HAN I/O", bus->name, hantransName(bus->trans));
+	kickBus(bus);
+}
 
+
+/*
+* Threaded mode: create the rings and wakeup fds and start a HAN thread
+* for each bus which has services
+*/
+
+static void startHanThreads(unsigned outboxSize)
+{
+	hanBusPtr_t bus;
+	unsigned i;
+	int err;
 	
-	if(!xPL_isBroadcastMessage(theMessage)){ /* If not a broadcast message */
-		if(xPL_MESSAGE_COMMAND == xPL_getMessageType(theMessage)){ /* If the message is a command */
-			const String type = xPL_getSchemaType(theMessage);
-			const String class = xPL_getSchemaClass(theMessage);
-			const String instanceID = xPL_getTargetInstanceID(theMessage);
-			debug(DEBUG_ACTION, "Received message from: %s-%s.%s,\n instance id: %s, class: %s, type: %s",
-			xPL_getSourceVendor(theMessage), xPL_getSourceDeviceID(theMessage),
-			xPL_getSourceInstanceID(theMessage), instanceID, class, type);
-			
-			/* Hash the incoming instance ID */
-			iid_hash = confreadHash(instanceID);
-			
-			/* Traverse the service list looking for an instance ID which matches */
-			for(sp = serviceEntryHead; sp; sp = sp->next){
-				if((iid_hash == sp->iid_hash) && (!strcmp(instanceID, sp->instance_id)))
-					break;
-	
-			}
-			if((sp) && (!strcmp(class, sp->class)) && (!strcmp(type, sp->type)))
-				dispatchHanCommand(theMessage, sp);	
-			
-		}
+	if(!(xplOutbox = ringNew(sizeof(outboxEntry_t), outboxSize)))
+		MALLOC_ERROR;
+	if((outboxFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		fatal_with_reason(errno, "eventfd");
+	if(!reactorAddFd(mainReactor, outboxFd, EPOLLIN, outboxHandler, NULL))
+		fatal("Could not register outbox fd");
+	reactorSetName(mainReactor, outboxFd, "xPL outbox");
+		
+	/* The shutdown signals are already blocked, and the threads inherit the mask */
+	for(i = 0; i < busCount; i++){
+		bus = busList[i];
+		if(!bus->serviceCount)
+			continue;
+		if(!(bus->requests = ringNew(sizeof(workQEntry_t), (bus->serviceCount * 2) + WORKQ_POOL_MIN)))
+			MALLOC_ERROR;
+		if(!(bus->reactor = reactorNew()))
+			fatal_with_reason(errno, "Could not create reactor for bus %s", bus->name);
+		reactorSetStallThreshold(bus->reactor, stallMs * 1000ULL);
+		if((bus->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+			fatal_with_reason(errno, "eventfd");
+		if(!reactorAddFd(bus->reactor, bus->wakeFd, EPOLLIN, hanWakeHandler, bus))
+			fatal("Could not register wakeup fd for bus %s", bus->name);
+		nameSource(bus->reactor, bus->wakeFd, "wakeup", bus);
+		if(uringIO)
+			bus->uring = startUring(bus->reactor);
+		startBus(bus);
+		if((err = pthread_create(&bus->thread, NULL, hanThreadMain, bus)))
+			fatal_with_reason(err, "creating HAN thread for bus %s", bus->name);
+		bus->threadRunning = TRUE;
+		debug(DEBUG_STATUS, "HAN I/O thread started for bus %s", bus->name);
 	}
 }
 
 
-
 /*
-* Our tick handler. 
-* This is used check for commands to send to the HAN server.
-* If one is present, it is sent, and then dequeued and freed.
+* Add a bus
 */
 
-static void tickHandler(int userVal, xPL_ObjectPtr obj)
+static hanBusPtr_t addBus(const String name, const String host, const String service)
 {
-	serviceEntryPtr_t se;
+	hanBusPtr_t bus;
 	
-	/* debug(DEBUG_ACTION,"TICK"); */
+	if(!(bus = mallocz(sizeof(hanBus_t))))
+		MALLOC_ERROR;
+	if(!(bus->name = strdup(name)) || !(bus->host = strdup(host)) || !(bus->service = strdup(service)))
+		MALLOC_ERROR;
+	if(hashmapInsert(busMap, bus->name, bus))
+		fatal("Bus %s is already defined", name);
+	bus->wakeFd = -1;
+	bus->timerFd = -1;
+	bus->speed = DEF_BUS_SPEED;
+	bus->turnaround = DEF_TURNAROUND_MS;
+	bus->id = busCount;
+	if(!(busList = realloc(busList, (busCount + 1) * sizeof(hanBusPtr_t))))
+		MALLOC_ERROR;
+	busList[busCount++] = bus;
+	return bus;
+}
+
+
+/*
+* Sort bus loads, heaviest first
+*/
+
+static int cmpBusLoad(const void *a, const void *b)
+{
+	const busLoad_t *la = a;
+	const busLoad_t *lb = b;
 	
-	/* Traverse the service list looking for expired poll counters */
+	return (la->load < lb->load) - (la->load > lb->load);
+}
+
+/*
+* Print the expected load of the configured polling on each bus, and whether it fits.
+* Uses the cost model of each service's command, at the bus speed and turnaround.
+* Polls of the same command and channel on a node by several services are counted
+* as sent, and again as if they were coalesced into the one at the shortest interval.
+* Returns the exit status: 0 if every bus fits its budget, 1 otherwise.
+*/
+
+static int planLoad(void)
+{
+	hashMapPtr_t groups;
+	hanBusPtr_t bus;
+	serviceEntryPtr_t sp, leader;
+	busLoadPtr_t svc = NULL, nodes = NULL, nl;
+	double *groupRate = NULL, rate, cost, tps, occupancy, ctps, coccupancy, burst, growth;
+	char (*keys)[PLAN_KEY_SIZE] = NULL;
+	unsigned b, i, n, polled, nodeCount, queueSize;
+	int status = 0;
+	
+	if(!(svc = mallocz(serviceHot.count * sizeof(busLoad_t))) ||
+	!(nodes = mallocz(HAN_ADDRESSES * sizeof(busLoad_t))) ||
+	!(groupRate = mallocz(serviceHot.count * sizeof(double))) ||
+	!(keys = mallocz(serviceHot.count * PLAN_KEY_SIZE)))
+		MALLOC_ERROR;
 	
-	for(se = serviceEntryHead; se; se = se->next){
-		if(se->polling_interval){
-			if(!se->poll_counter){
-				se->poll_counter = se->polling_interval;
-				dispatchPollCommand(se);
+	for(b = 0; b < busCount; b++){
+		bus = busList[b];
+		if(!bus->serviceCount)
+			continue;
+		if(!(groups = hashmapNew(bus->serviceCount)))
+			MALLOC_ERROR;
+		memset(nodes, 0, HAN_ADDRESSES * sizeof(busLoad_t));
+		tps = occupancy = burst = 0;
+		for(i = 0, n = 0; i < serviceHot.count; i++){
+			sp = serviceHot.entry[i];
+			if((sp->bus != bus) || (!serviceHot.polling_interval[i]))
+				continue;
+			rate = 1.0 / serviceHot.polling_interval[i];
+			cost = transactionCost(bus, sp->cmd_index);
+			svc[n].id = i;
+			svc[n].rate = rate;
+			svc[n++].load = rate * cost;
+			nodes[sp->address].id = sp->address;
+			nodes[sp->address].rate += rate;
+			nodes[sp->address].load += rate * cost;
+			tps += rate;
+			occupancy += rate * cost;
+			burst += cost;
+			/* Group the polls which send the same command */
+			snprintf(keys[i], PLAN_KEY_SIZE, "%02X%02X%02X", sp->address, (unsigned) sp->cmd,
+			(hanCommandMap[sp->cmd_index].by_channel) ? sp->channel : 0);
+			if(!(leader = hashmapInsert(groups, keys[i], sp)))
+				leader = sp;
+			if(rate > groupRate[leader->service_id])
+				groupRate[leader->service_id] = rate;
+		}
+		polled = n;
+		ctps = coccupancy = 0;
+		for(i = 0; i < serviceHot.count; i++){
+			if(groupRate[i] > 0){
+				ctps += groupRate[i];
+				coccupancy += groupRate[i] * transactionCost(bus, serviceHot.entry[i]->cmd_index);
+				groupRate[i] = 0;
 			}
+		}
+		hashmapFree(groups);
+		queueSize = (bus->serviceCount * 2) + WORKQ_POOL_MIN;
+		
+		printf("Bus %s: %u bit/s, turnaround %u ms, %u services, %u polled\n", bus->name, bus->speed,
+		bus->turnaround, bus->serviceCount, polled);
+		printf("  Transactions: %.3f per second, %.3f if duplicate polls were coalesced\n", tps, ctps);
+		printf("  Occupancy: %.1f%%, %.1f%% if duplicate polls were coalesced, budget %u%%\n",
+		occupancy * 100.0, coccupancy * 100.0, utilBudget);
+		printf("  Work queue: %u entries, the start up burst of %u polls takes %.2f s\n", queueSize, polled, burst);
+		if(occupancy >= 1.0){
+			/* Polls arrive faster than the bus can carry them */
+			growth = tps - (tps / occupancy);
+			if(growth <= 0) /* Exactly saturated */
+				printf("  Result: overloaded, the bus is busy all the time and the work queue never drains\n");
 			else
-				se->poll_counter--;
+				printf("  Result: overloaded, the work queue fills in about %.0f s and polls are dropped\n", queueSize / growth);
+			status = 1;
 		}
-	}
+		else if(occupancy * 100.0 > utilBudget){
+			printf("  Result: over budget\n");
+			status = 1;
+		}
+		else
+			printf("  Result: fits\n");
 			
-
-	
-	if(workQTail){
-		if(hanSock == -1){ /* Socket not connected. This could have been due to an EOF detected previously */
-			if((hanSock = socketConnectIP(host, service, PF_UNSPEC, SOCK_STREAM)) < 0){
-				debug(DEBUG_UNEXPECTED, "Could not open socket to han server (post fork)");
-				freeWorkQueueEntry(dequeueWorkQueueEntry()); /* Can't process command */
-				cmdFail = TRUE;
-				/* FIXME: Need to find some way to notify the originator the command could not be completed */
-				return;
-			}
-			cmdFail = FALSE;
-			/* Add han socket to the xPL polling list */
-			if(xPL_addIODevice(hanHandler, 1234, hanSock, TRUE, FALSE, FALSE) == FALSE)
-				fatal("Could not register han socket fd with xPL");
+		/* Heaviest nodes */
+		for(i = 0, nodeCount = 0; i < HAN_ADDRESSES; i++){
+			if(nodes[i].rate > 0)
+				nodes[nodeCount++] = nodes[i];
 		}
-		debug(DEBUG_ACTION, "Sending command: %s", workQTail->cmd);
-		if(socketPrintf(hanSock, "%s", workQTail->cmd) < 0){ /* Send the command */
-			debug(DEBUG_UNEXPECTED, "Command TX failed");
-			xPL_removeIODevice(hanSock);
-			close(hanSock);
-			hanSock = -1;
-			cmdFail = TRUE;
+		qsort(nodes, nodeCount, sizeof(busLoad_t), cmpBusLoad);
+		printf("  Heaviest nodes:\n");
+		for(i = 0; (i < nodeCount) && (i < PLAN_TOP); i++){
+			nl = &nodes[i];
+			printf("    address %-3u %8.3f per second %6.1f%%\n", nl->id, nl->rate, nl->load * 100.0);
+		}
+		
+		/* Heaviest services */
+		qsort(svc, polled, sizeof(busLoad_t), cmpBusLoad);
+		printf("  Heaviest services:\n");
+		for(i = 0; (i < polled) && (i < PLAN_TOP); i++){
+			sp = serviceHot.entry[svc[i].id];
+			printf("    %-20s %8.3f per second %6.1f%%  %s address %u\n", sp->instance_id, svc[i].rate, svc[i].load * 100.0,
+			hanCommandMap[sp->cmd_index].keyword, sp->address);
 		}
-		pendingResponse = workQTail;
-		dequeueWorkQueueEntry(); /* Remove command from queue */
 	}
+	free(keys);
+	free(groupRate);
+	free(nodes);
+	free(svc);
+	return status;
 }
 
-
 /*
 * Show help
 */
@@ -2047,6 +3666,7 @@ void showHelp(void)
 	printf("  -i, --interface NAME    Set the broadcast interface (e.g. eth0)\n");
 	printf("  -l, --log  PATH         Path name to debug log file when daemonized\n");
 	printf("  -n, --no-background     Do not fork into the background (useful for debugging)\n");
+	printf("  -p, --plan              Print the expected bus load of the config file and exit\n");
 	printf("  -s, --instance ID       Set instance id. Default is %s", instanceID);
 	printf("  -v, --version           Display program version\n");
 	printf("\n");
@@ -2067,10 +3687,16 @@ int main(int argc, char *argv[])
 	int optchar;
 	int i,j;
 	int serviceCount;
-	String p;
-	SectionEntryPtr_t se;
+	int busDefs;
+	int tickFd, sigFd, sock;
+	unsigned id;
+	sigset_t sigs;
+	String p, q;
+	SectionEntryPtr_t se, bse;
 	serviceEntryPtr_t sp;
-	String slist[MAX_SERVICES];
+	hanBusPtr_t bus;
+	String *slist, *flightBusNames;
+	hashMapPtr_t serviceNameMap;
 
 		
 
@@ -2142,6 +3768,11 @@ int main(int argc, char *argv[])
 				/* Mark that we shouldn't background. */
 				noBackground = TRUE;
 				break;
+				
+				/* Was it a request to plan the bus load? */
+			case 'p':
+				planMode = TRUE;
+				break;
 	
 						
 				/* Was it an instance ID ? */
@@ -2206,11 +3837,118 @@ int main(int argc, char *argv[])
 	/* log path */
 	if((!clOverride.log_path) && (p = confreadValueBySectEntKey(se, "log-path")))
 		confreadStringCopy(logPath, p, sizeof(logPath));
+		
+	/* xPL encoder for sensor messages */
+	if((p = confreadValueBySectEntKey(se, "xpl-encoder"))){
+		if(!strcmp(p, "native"))
+			nativeEncoder = TRUE;
+		else if(strcmp(p, "xpllib"))
+			fatal("Error in config file: xpl-encoder must be one of: native, xpllib");
+	}
+	
+	/* Run HAN I/O on its own thread */
+	if((p = confreadValueBySectEntKey(se, "threaded"))){
+		if(!strcmp(p, "yes"))
+			threadedMode = TRUE;
+		else if(strcmp(p, "no"))
+			fatal("Error in config file: threaded must be one of: yes, no");
+	}
+	
+	/* Count cycles and instructions in each stage of handling a response */
+	if((p = confreadValueBySectEntKey(se, "profile-stages"))){
+		if(!strcmp(p, "yes"))
+			profileStages = TRUE;
+		else if(strcmp(p, "no"))
+			fatal("Error in config file: profile-stages must be one of: yes, no");
+	}
+	
+	/* Metrics endpoint, unix:/path, host:port or port */
+	if((p = confreadValueBySectEntKey(se, "metrics"))){
+		if(!(metricsWhere = strdup(p)))
+			MALLOC_ERROR;
+	}
+	
+	/* Percentage of a bus which configured polling may use before a warning */
+	if((p = confreadValueBySectEntKey(se, "utilization-budget"))){
+		if(!str2uns(p, &utilBudget, 1, 100))
+			fatal("Error in config file: utilization-budget must be between 1 and 100");
+	}
+	
+	/* Longest a callback may block the event loop, or a timer run late, before a warning */
+	if((p = confreadValueBySectEntKey(se, "stall-threshold"))){
+		if(!str2uns(p, &stallMs, 0, 60000))
+			fatal("Error in config file: stall-threshold must be between 0 and 60000");
+	}
+	
+	/* Transaction trace file, in Chrome trace event format */
+	if((p = confreadValueBySectEntKey(se, "trace-file"))){
+		if(!(traceWhere = strdup(p)))
+			MALLOC_ERROR;
+	}
+	
+	/* Flight recorder dump file */
+	if((p = confreadValueBySectEntKey(se, "flight-file")))
+		confreadStringCopy(flightFile, p, sizeof(flightFile));
+	
+	/* HAN socket I/O backend */
+	if((p = confreadValueBySectEntKey(se, "han-io"))){
+		if(!strcmp(p, "uring"))
+			uringIO = TRUE;
+		else if(strcmp(p, "socket"))
+			fatal("Error in config file: han-io must be one of: socket, uring");
+	}
+	
+	/* Build the bus list. The host and port in the general stanza are the default bus */
+	if(!(busMap = hashmapNew(0)))
+		MALLOC_ERROR;
+	bus = addBus("default", host, service);
+	if((p = confreadValueBySectEntKey(se, "bus-speed")) && (!str2uns(p, &bus->speed, 300, 1000000)))
+		fatal("Error in config file: bus-speed must be between 300 and 1000000");
+	if((p = confreadValueBySectEntKey(se, "turnaround")) && (!str2uns(p, &bus->turnaround, 0, RESPONSE_TIMEOUT_MS)))
+		fatal("Error in config file: turnaround must be between 0 and %u", RESPONSE_TIMEOUT_MS);
+	if((p = confreadValueBySectEntKey(se, "buses"))){
+		for(busDefs = 1, q = p; (q = strchr(q, ',')); q++)
+			busDefs++;
+		if(!(slist = mallocz(busDefs * sizeof(String))))
+			MALLOC_ERROR;
+		busDefs = dupOrSplitString(p, slist, ',', busDefs);
+		for(i = 0; i < busDefs; i++){
+			if(!(bse = confreadFindSection(configEntry, slist[i])))
+				fatal("Stanza for bus %s does not exist", slist[i]);
+			if(!(p = confreadValueBySectEntKey(bse, "host")))
+				fatal("host missing in stanza: %s", slist[i]);
+			if(!(q = confreadValueBySectEntKey(bse, "port")))
+				q = DEF_SERVICE;
+			bus = addBus(slist[i], p, q);
+			if((p = confreadValueBySectEntKey(bse, "bus-speed")) && (!str2uns(p, &bus->speed, 300, 1000000)))
+				fatal("In stanza %s, bus-speed must be between 300 and 1000000", slist[i]);
+			if((p = confreadValueBySectEntKey(bse, "turnaround")) && (!str2uns(p, &bus->turnaround, 0, RESPONSE_TIMEOUT_MS)))
+				fatal("In stanza %s, turnaround must be between 0 and %u", slist[i], RESPONSE_TIMEOUT_MS);
+		}
+		free(slist[0]);
+		free(slist);
+	}
 			
 	/* Build the instance list */
 	if(!(p = confreadValueBySectEntKey(se, "services")))
 		fatal("At least one service must be defined in the general section");
-	serviceCount = dupOrSplitString(p, slist, ',', MAX_SERVICES);
+	/* Size the service list from the number of separators */
+	for(serviceCount = 1, q = p; (q = strchr(q, ',')); q++)
+		serviceCount++;
+	if(!(slist = mallocz(serviceCount * sizeof(String))))
+		MALLOC_ERROR;
+	serviceCount = dupOrSplitString(p, slist, ',', serviceCount);
+	
+	/* Service names and instance IDs are checked for duplicates as they are added */
+	if(!(serviceNameMap = hashmapNew(serviceCount)) || !(serviceMap = hashmapNew(serviceCount)))
+		MALLOC_ERROR;
+	
+	/* Allocate the hot state arrays */
+	if(!(serviceHot.polling_interval = mallocz(serviceCount * sizeof(unsigned))) ||
+	!(serviceHot.poll_last = mallocz(serviceCount * sizeof(int))) ||
+	!(serviceHot.poll_fx_last = mallocz(serviceCount * sizeof(fixpt_t))) ||
+	!(serviceHot.entry = mallocz(serviceCount * sizeof(serviceEntryPtr_t))))
+		MALLOC_ERROR;
 	
 	for(i = 0; i < serviceCount; i++){
 	
@@ -2219,16 +3957,9 @@ int main(int argc, char *argv[])
 		if(!(p = confreadValueBySectEntKey(se, "instance")))
 			fatal("Instance for service %s does not exist", slist[i]);
 		
-		/* Check for duplicate service name  or duplicate instance id */
-		for(j = 0, sp = serviceEntryHead; j < i ; j++){
-				if(!strcmp(slist[i], slist[j]))
-					fatal("Service name %s is already defined", slist[j]);
-				if(sp){	
-					if(!strcmp(p, sp->instance_id))
-						fatal("Instance id %s is already defined", p);
-					sp= sp->next;
-				}
-		}
+		/* Check for duplicate service name */
+		if(hashmapInsert(serviceNameMap, slist[i], se))
+			fatal("Service name %s is already defined", slist[i]);
 						
 		/* Allocate a data structure */
 		if(!(sp = mallocz(sizeof(serviceEntry_t))))
@@ -2237,8 +3968,10 @@ int main(int argc, char *argv[])
 		/* Save instance ID */	
 		if(!(sp->instance_id = strdup(p))) 
 			MALLOC_ERROR;
-		/* Hash  instance ID */
-		sp->iid_hash = confreadHash(sp->instance_id);
+			
+		/* Check for duplicate instance ID, and add the service to the registry */
+		if(hashmapInsert(serviceMap, sp->instance_id, sp))
+			fatal("Instance id %s is already defined", p);
 			
 		/* Get Address */
 		if(!(p = confreadValueBySectEntKey(se, "address")))
@@ -2262,6 +3995,15 @@ int main(int argc, char *argv[])
 		if(!(sp->type = strdup(p)))
 			MALLOC_ERROR;
 			
+		/* Get the bus, if not specified the default bus is used */
+		if((p = confreadValueBySectEntKey(se, "bus"))){
+			if(!(sp->bus = hashmapFind(busMap, p)))
+				fatal("In stanza %s, bus %s is not defined", slist[i], p);
+		}
+		else
+			sp->bus = busList[0];
+		sp->bus->serviceCount++;
+			
 		/* Map han command */
 		if(!(p = confreadValueBySectEntKey(se, "han-command")))
 			fatal("han-command missing in stanza: %s", slist[i]);		
@@ -2271,6 +4013,7 @@ int main(int argc, char *argv[])
 		}
 		if(!(sp->cmd = hanCommandMap[j].code))
 			fatal("Unrecognized han-command: %s in stanza: %s", p, slist[i]);
+		sp->cmd_index = j;
 			
 		/* Map units, if class is 'sensor' */
 		if(sp->is_sensor){
@@ -2284,17 +4027,30 @@ int main(int argc, char *argv[])
 		}
 		if(!(sp->units = unitsMap[j].code)) //??????????
 				fatal("Unrecognized units: %s in stanza: %s", p, slist[i]);		
+		if(unitsMap[j].in_message)
+			sp->units_keyword = unitsMap[j].keyword;
 			
 		/* Check poll-interval if present and class is sensor */
 		
 		if((p = confreadValueBySectEntKey(se, "polling-interval"))){
 			if(!sp->is_sensor)
 				fatal("In stanza %s, a polling-interval is specified for non-sensor service", slist[i]);
-			if(!str2uns(p, &sp->polling_interval, 0,  MAX_POLL_INTERVAL))
+			if(!str2uns(p, &serviceHot.polling_interval[i], 0,  MAX_POLL_INTERVAL))
 				fatal("In stanza %s, polling-interval must be between 0 and %u", slist[i], MAX_POLL_INTERVAL);
 		}
 		
 		
+		/* Check precision if present and class is sensor */
+		
+		if((p = confreadValueBySectEntKey(se, "precision"))){
+			if(!sp->is_sensor)
+				fatal("In stanza %s, a precision is specified for non-sensor service", slist[i]);
+			if(!str2uns(p, &sp->precision, 0, MAX_PRECISION))
+				fatal("In stanza %s, precision must be between 0 and %u", slist[i], MAX_PRECISION);
+			sp->precision_override = TRUE;
+		}
+		
+		
 		/* Check channel if present */
 		
 		if((p = confreadValueBySectEntKey(se, "channel"))){
@@ -2302,25 +4058,68 @@ int main(int argc, char *argv[])
 				fatal("In stanza %s, channel must be between 0 and %u", slist[i], MAX_CHANNEL);
 		}
 			
-		/* Add the service ID */
+		/* Add the service ID, and insert the entry into the service table */
 		sp->service_id = i;	
-		
-		/* Insert entry into service list */
-		if(!serviceEntryHead)
-			serviceEntryHead = serviceEntryTail = sp;
-		else{
-			serviceEntryTail->next = sp;
-			sp->prev = serviceEntryTail;
-			serviceEntryTail = sp;
-		}	
+		serviceHot.entry[i] = sp;
+		serviceHot.count = i + 1;
 	}
+	hashmapFree(serviceNameMap);
 	free(slist[0]); /* Free service list */
+	free(slist);
+	
+	/*
+	 * Give each bus the poll deadlines of its services for its scheduler, and its work queue.
+	 * Work queue entries come from a fixed pool, so queueing a command never calls malloc()
+	 */
+	 
+	for(id = 0; id < busCount; id++){
+		bus = busList[id];
+		if(!bus->serviceCount)
+			continue;
+		if(!(bus->polls = timerheapNew(bus->serviceCount)))
+			MALLOC_ERROR;
+		if(!(bus->cmdLat = mallocz(HAN_COMMANDS * sizeof(latency_t))) ||
+		!(bus->addrLat = mallocz(HAN_ADDRESSES * sizeof(latencyPtr_t))) ||
+		!(bus->nodes = mallocz(HAN_ADDRESSES * sizeof(nodeCostPtr_t))))
+			MALLOC_ERROR;
+		if(!(bus->pool = poolNew(sizeof(workQEntry_t), (bus->serviceCount * 2) + WORKQ_POOL_MIN)))
+			MALLOC_ERROR;
+		if(!(bus->workQ = ringNew(sizeof(workQEntryPtr_t), (bus->serviceCount * 2) + WORKQ_POOL_MIN)))
+			MALLOC_ERROR;
+	}
+	/* First polls are a second after start up */
+	startMs = reactorNowMs();
+	for(id = 0; id < serviceHot.count; id++){
+		sp = serviceHot.entry[id];
+		if((!sp->bus->addrLat[sp->address]) && (!(sp->bus->addrLat[sp->address] = mallocz(sizeof(latency_t)))))
+			MALLOC_ERROR;
+		if((!sp->bus->nodes[sp->address]) && (!(sp->bus->nodes[sp->address] = mallocz(sizeof(nodeCost_t)))))
+			MALLOC_ERROR;
+		if(serviceHot.polling_interval[id]){
+			timerheapPush(serviceHot.entry[id]->bus->polls, startMs + 1000, id);
+			sp->bus->nodes[sp->address]->pollRate += 1.0 / serviceHot.polling_interval[id];
+			sp->bus->nodes[sp->address]->pollEstimate += transactionCost(sp->bus, sp->cmd_index) / serviceHot.polling_interval[id];
+		}
+	}
+	/* Check the configured polling against the budget before there are any measurements */
+	for(id = 0; id < busCount; id++){
+		bus = busList[id];
+		if(!bus->serviceCount)
+			continue;
+		bus->windowStart = startMs;
+		bus->windowDue = startMs + UTIL_WINDOW_MS;
+		statSetDouble(&bus->projected, projectUtilization(bus));
+		if(!planMode)
+			checkUtilizationBudget(bus);
+	}
 	
 	/*
-	 * Sanity check the command to units mapping if class is 'sensor'
+	 * Sanity check the command to units mapping if class is 'sensor',
+	 * and set the reading precision and sensor type
 	 */
 	 
-	 for(sp = serviceEntryHead; sp; sp = sp->next){
+	 for(id = 0; id < serviceHot.count; id++){
+		 sp = serviceHot.entry[id];
 		 if(sp->is_sensor){
 			for(i = 0; hanCommandMap[i].code; i++){
 				if(hanCommandMap[i].code == sp->cmd){
@@ -2332,19 +4131,51 @@ int main(int argc, char *argv[])
 					if(!hanCommandMap[i].valid_units[j]){
 						fatal("Instance %s fails sanity check of han command to units", sp->instance_id);
 					}
+					/* Use the default precision for the units unless one was specified */
+					if(!sp->precision_override)
+						sp->precision = hanCommandMap[i].precision[j];
+					sp->sensor_type = hanCommandMap[i].sensor_type[j];
 				}
 			}
 		}		
 	}
 	
 	/*
-	 * Do a test connect to the han server
+	 * Intern the class and type strings
+	 */
+	
+	for(id = 0; id < serviceHot.count; id++){
+		sp = serviceHot.entry[id];
+		sp->class_id = internString(sp->class);
+		sp->type_id = internString(sp->type);
+	}
+	
+	/* Plan the bus load of the configuration without connecting to anything */
+	if(planMode)
+		exit(planLoad());
+		
+	/* Name the services and buses in flight recorder dumps, and dump on the way out of a fatal error */
+	if(!(slist = mallocz(serviceHot.count * sizeof(String))) || !(flightBusNames = mallocz(busCount * sizeof(String))))
+		MALLOC_ERROR;
+	for(id = 0; id < serviceHot.count; id++)
+		slist[id] = serviceHot.entry[id]->instance_id;
+	for(id = 0; id < busCount; id++)
+		flightBusNames[id] = busList[id]->name;
+	flightSetNames(slist, serviceHot.count, flightBusNames, busCount);
+	notify_on_fatal(fatalHandler);
+		
+	/*
+	 * Do a test connect to the han server of each bus in use
 	 */
  
-	if((hanSock = socketConnectIP(host, service, PF_UNSPEC, SOCK_STREAM)) < 0)
-		fatal("Could not connect to han server");
-	close(hanSock);
-	hanSock = -1;
+	for(id = 0; id < busCount; id++){
+		bus = busList[id];
+		if(!bus->serviceCount)
+			continue;
+		if((sock = socketConnectIP(bus->host, bus->service, PF_UNSPEC, SOCK_STREAM)) < 0)
+			fatal("Could not connect to han server for bus %s", bus->name);
+		close(sock);
+	}
 
 
 	/* Turn on library debugging for level 5 */
@@ -2430,30 +4261,104 @@ int main(int argc, char *argv[])
 		fatal("Unable to start xPL lib");
 	}
 
+	/* Start the native encoder if requested */
+	if((nativeEncoder) && (!xplencInit(interface)))
+		fatal("Unable to start native xPL encoder");
+
 	/* Initialize xplrcs service */
 
 	/* Create virtual services and set our application version */
-	for(sp = serviceEntryHead; sp; sp = sp->next){
+	for(id = 0; id < serviceHot.count; id++){
+		sp = serviceHot.entry[id];
 		debug(DEBUG_EXPECTED, "Creating xplhan service with class: %s type: %s with instance ID: %s", sp->class, sp->type, sp->instance_id);
 		sp->xplService = xPL_createService("hwstar", "xplhan", sp->instance_id);
 		xPL_setServiceVersion(sp->xplService, VERSION);
+		buildServiceMessage(sp);
 	}
 
 
-  	/* Install signal traps for proper shutdown */
- 	signal(SIGTERM, shutdownHandler);
- 	signal(SIGINT, shutdownHandler);
+	/* Create the main reactor, which replaces xPLLib's main loop */
+	if(!(mainReactor = reactorNew()))
+		fatal_with_reason(errno, "Could not create reactor");
+	reactorSetStallThreshold(mainReactor, stallMs * 1000ULL);
+	
+	/* Opt in stage profiling. The HAN threads open their own counters */
+	if((profileStages) && (!profInit()))
+		fatal_with_reason(errno, "Could not open performance counters for profile-stages");
+		
+  	/* Shutdown signals are delivered through the reactor, this must be done before starting any threads */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGHUP);
+	sigaddset(&sigs, SIGUSR2);
+	sigaddset(&sigs, SIGUSR1);
+	if((sigFd = reactorAddSignals(mainReactor, &sigs, signalHandler, NULL)) < 0)
+		fatal_with_reason(errno, "Could not set up signal handling");
+	reactorSetName(mainReactor, sigFd, "signals");
+	/* A han server going away shows up as a send error, not a signal */
+	signal(SIGPIPE, SIG_IGN);
+		
+	/* xPLLib's socket, which it processes when it is readable */
+	openXPLReturn(xPL_getFD());
+	if(!reactorAddFd(mainReactor, xPL_getFD(), EPOLLIN, xPLHandler, NULL))
+		fatal("Could not register xPL socket");
+	reactorSetName(mainReactor, xPL_getFD(), "xPL socket");
  
-	/* Add 1 second tick service */
-	xPL_addTimeoutHandler(tickHandler, 1, NULL);
+	/* Opt in transaction tracing */
+	if((traceWhere) && (!traceOpen(traceWhere)))
+		fatal_with_reason(errno, "Could not open trace file %s", traceWhere);
+		
+	/* Metrics are served from the main loop */
+	if((metricsWhere) && (!metricsListen(mainReactor, metricsWhere, renderMetrics, NULL)))
+		fatal_with_reason(errno, "Could not open metrics endpoint %s", metricsWhere);
+		
+	/* xPLLib housekeeping, the buses schedule themselves */
+	if(((tickFd = reactorAddTimer(mainReactor, housekeepingHandler, NULL)) < 0) || (!reactorSetTimer(mainReactor, tickFd, 1000, 1000)))
+		fatal_with_reason(errno, "Could not create housekeeping timer");
+	reactorSetName(mainReactor, tickFd, "xPL housekeeping timer");
+		
+	/* The buses either run from the main reactor, or get their own threads */
+	if(threadedMode)
+		startHanThreads((serviceCount * 2) + WORKQ_POOL_MIN);
+	else{
+		if(uringIO)
+			mainUring = startUring(mainReactor);
+		for(id = 0; id < busCount; id++){
+			bus = busList[id];
+			bus->reactor = mainReactor;
+			bus->uring = mainUring;
+			if(bus->serviceCount)
+				startBus(bus);
+		}
+	}
+	
+	/* The native encoder's sends, and the main loop's io_uring submissions, go out once per iteration */
+	if((nativeEncoder) || (mainUring)){
+		if(nativeEncoder)
+			xplencSetBatching(TRUE);
+		if((nativeEncoder) && (mainUring))
+			xplencSetSendHandler(uringDatagram, mainUring);
+		reactorSetFlush(mainReactor, mainFlushHandler, NULL);
+	}
+
+	/* Build the prefilter, and classify raw messages before xPLLib parses them */
+	xplfiltInit("hwstar-xplhan");
+	for(id = 0; id < serviceHot.count; id++){
+		sp = serviceHot.entry[id];
+		xplfiltAddInstance(sp->instance_id);
+		xplfiltAddSchema(sp->class, sp->type);
+	}
+	xplfiltFinalize();
+	xPL_addRawListener(xPLRawListener, NULL);
 
   	/* And a listener for all xPL messages */
   	xPL_addMessageListener(xPLListener, NULL);
 
 
  	/* Enable the service */
- 	for(sp = serviceEntryHead; sp; sp = sp->next){
-		xPL_setServiceEnabled(sp->xplService, TRUE);
+ 	for(id = 0; id < serviceHot.count; id++){
+		xPL_setServiceEnabled(serviceHot.entry[id]->xplService, TRUE);
 	}
 
 	if(pid_write(pidFile, getpid()) != 0) {
@@ -2465,10 +4370,7 @@ int main(int argc, char *argv[])
 
  	/** Main Loop **/
 
-	for (;;) {
-		/* Let XPL run forever */
-		xPL_processMessages(-1);
-  	}
+	reactorRun(mainReactor);
 
 	exit(1);
 	return 1;